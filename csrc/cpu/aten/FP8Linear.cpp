@@ -1,3 +1,4 @@
+#include "FP8Linear.h"
 #include "csrc/utils/CustomOperatorRegistration.h"
 #include "fp8_utils.h"
 #include "ideep/IDeepConversions.h"
@@ -6,6 +7,33 @@ namespace torch_ipex {
 namespace cpu {
 
 using namespace torch_ipex::cpu;
+
+dnnl::matmul::primitive_desc fp8_matmul_primitive_desc(
+    const ideep::tensor::desc& src_desc,
+    const ideep::tensor::desc& weights_desc,
+    const ideep::tensor::desc& bias_desc,
+    const ideep::tensor::desc& dst_desc) {
+  auto op_attr = ideep::attr_t();
+  op_attr.set_scales_mask(DNNL_ARG_SRC, 0);
+  op_attr.set_scales_mask(DNNL_ARG_WEIGHTS, 0);
+  op_attr.set_scratchpad_mode(dnnl::scratchpad_mode::user);
+  auto engine = ideep::engine::cpu_engine();
+  // TODO: Remove this try/catch when oneDNN provides API to notify
+  // framework whether current platform can run FP8 primitives.
+  try {
+    return bias_desc.is_zero()
+        ? dnnl::matmul::primitive_desc(
+              engine, src_desc, weights_desc, dst_desc, op_attr)
+        : dnnl::matmul::primitive_desc(
+              engine, src_desc, weights_desc, bias_desc, dst_desc, op_attr);
+  } catch (dnnl::error& e) {
+    if (e.status == dnnl_unimplemented)
+      throw std::runtime_error("Running FP8 on not supported platform.");
+    // on any other error just re-throw
+    throw;
+  }
+}
+
 at::Tensor fp8_linear_impl(
     at::Tensor inp_fp8,
     at::Tensor scale_invA,
@@ -77,31 +105,8 @@ at::Tensor fp8_linear_impl(
                                    get_mkldnn_dtype(bias.scalar_type()),
                                    ideep::format_tag::any)
                              : ideep::tensor::desc();
-  auto op_attr = ideep::attr_t();
-  if (input_scale != 1.0f) {
-    op_attr.set_scales_mask(DNNL_ARG_SRC, 0);
-  }
-  if (input_scale != 1.0f) {
-    op_attr.set_scales_mask(DNNL_ARG_WEIGHTS, 0);
-  }
-
-  op_attr.set_scratchpad_mode(dnnl::scratchpad_mode::user);
-  auto engine = ideep::engine::cpu_engine();
-  // TODO: Remove this try/catch when oneDNN provides API to notify
-  // framework whether current platform can run FP8 primitives.
-  dnnl::matmul::primitive_desc primitive_desc;
-  try {
-    primitive_desc = with_bias
-        ? dnnl::matmul::primitive_desc(
-              engine, src_desc, weights_desc, bias_desc, dst_desc, op_attr)
-        : dnnl::matmul::primitive_desc(
-              engine, src_desc, weights_desc, dst_desc, op_attr);
-  } catch (dnnl::error& e) {
-    if (e.status == dnnl_unimplemented)
-      throw std::runtime_error("Running FP8 on not supported platform.");
-    // on any other error just re-throw
-    throw;
-  }
+  auto primitive_desc =
+      fp8_matmul_primitive_desc(src_desc, weights_desc, bias_desc, dst_desc);
   auto primitive = dnnl::matmul(primitive_desc);
 
   // Prepare args and execute primitive
@@ -117,9 +122,7 @@ at::Tensor fp8_linear_impl(
   ideep::tensor src_scales_t = ideep::tensor(ideep::scale_t(1, input_scale));
   ideep::tensor wei_scales_t = ideep::tensor(ideep::scale_t(1, weight_scale));
 
-  if (input_scale != 1.0f) {
-    args.insert({DNNL_ARG_ATTR_SCALES | DNNL_ARG_SRC, src_scales_t});
-  }
+  args.insert({DNNL_ARG_ATTR_SCALES | DNNL_ARG_SRC, src_scales_t});
   args.insert({DNNL_ARG_ATTR_SCALES | DNNL_ARG_WEIGHTS, wei_scales_t});
 
   primitive.execute(ideep::stream::default_stream(), args);
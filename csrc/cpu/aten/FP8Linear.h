@@ -0,0 +1,20 @@
+#pragma once
+
+#include <ATen/ATen.h>
+
+#include <ideep.hpp>
+
+namespace torch_ipex {
+namespace cpu {
+
+// Matmul of the fp8 src and weights into the dst, with per tensor src and
+// weights scales given at execution and a user scratchpad. An empty
+// bias_desc means no bias. Throws if the platform can't run FP8 primitives.
+dnnl::matmul::primitive_desc fp8_matmul_primitive_desc(
+    const ideep::tensor::desc& src_desc,
+    const ideep::tensor::desc& weights_desc,
+    const ideep::tensor::desc& bias_desc,
+    const ideep::tensor::desc& dst_desc);
+
+} // namespace cpu
+} // namespace torch_ipex
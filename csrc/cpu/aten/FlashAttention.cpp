@@ -1,4 +1,5 @@
 #include "FlashAttention.h"
+#include <ATen/CPUGeneratorImpl.h>
 #include <torch/all.h>
 #include <torch/csrc/autograd/function.h>
 
@@ -6,6 +7,23 @@ namespace torch_ipex {
 namespace cpu {
 
 IPEX_DEFINE_DISPATCH(flash_attention_kernel_stub);
+IPEX_DEFINE_DISPATCH(flash_attention_backward_kernel_stub);
+
+/*
+ *Seed of the dropout mask. If not given, it is drawn from the default CPU
+ *generator so that torch.manual_seed makes the mask reproducible.
+ */
+static int64_t flash_attention_philox_seed(
+    double dropout_p,
+    c10::optional<int64_t> philox_seed = c10::nullopt) {
+  if (philox_seed.has_value() || dropout_p == 0) {
+    return philox_seed.value_or(0);
+  }
+  auto gen = at::get_generator_or_default<at::CPUGeneratorImpl>(
+      c10::nullopt, at::detail::getDefaultCPUGenerator());
+  std::lock_guard<std::mutex> lock(gen->mutex_);
+  return static_cast<int64_t>(gen->random64());
+}
 
 /*
  *Caculate the flash attention SDPA with attention mask.
@@ -18,8 +36,278 @@ std::tuple<at::Tensor, at::Tensor> flash_attention_forward_cpu(
     bool is_causal,
     const c10::optional<at::Tensor>& attention_mask,
     c10::optional<double> scale) {
+  // The aten backward has no way to get the seed of the forward, so dropout
+  // is rejected here as well rather than only failing in the backward
+  TORCH_CHECK(
+      dropout_p == 0.0,
+      "IPEX flash_attention: The dropout mask of the aten op can not be regenerated in the backward, use torch.ops.torch_ipex.flash_attention for dropout");
+  return flash_attention_kernel_stub(
+      kCPU,
+      query,
+      key,
+      value,
+      dropout_p,
+      is_causal,
+      attention_mask,
+      -1,
+      -1,
+      c10::nullopt,
+      scale,
+      0,
+      0);
+}
+
+/*
+ *Caculate the gradients of the flash attention SDPA. The attention weights
+ *are recomputed from the logsumexp returned by the forward.
+ */
+std::tuple<at::Tensor, at::Tensor, at::Tensor> flash_attention_backward_cpu(
+    const at::Tensor& grad_out,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& out,
+    const at::Tensor& logsumexp,
+    double dropout_p,
+    bool is_causal,
+    const c10::optional<at::Tensor>& attention_mask,
+    c10::optional<double> scale) {
+  TORCH_CHECK(
+      dropout_p == 0.0,
+      "IPEX flash_attention_backward: The dropout mask of the aten op can not be regenerated, use torch.ops.torch_ipex.flash_attention for training with dropout");
+  return flash_attention_backward_kernel_stub(
+      kCPU,
+      grad_out,
+      query,
+      key,
+      value,
+      out,
+      logsumexp,
+      dropout_p,
+      is_causal,
+      attention_mask,
+      -1,
+      -1,
+      c10::nullopt,
+      scale,
+      0,
+      0);
+}
+
+std::tuple<at::Tensor, at::Tensor> flash_attention_ipex_forward_cpu(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    double dropout_p,
+    bool is_causal,
+    const c10::optional<at::Tensor>& attention_mask,
+    c10::optional<double> scale,
+    int64_t window_size_left,
+    int64_t window_size_right,
+    const c10::optional<at::Tensor>& alibi_slopes,
+    c10::optional<int64_t> philox_seed,
+    int64_t philox_offset) {
   return flash_attention_kernel_stub(
-      kCPU, query, key, value, dropout_p, is_causal, attention_mask, scale);
+      kCPU,
+      query,
+      key,
+      value,
+      dropout_p,
+      is_causal,
+      attention_mask,
+      window_size_left,
+      window_size_right,
+      alibi_slopes,
+      scale,
+      flash_attention_philox_seed(dropout_p, philox_seed),
+      philox_offset);
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor>
+flash_attention_ipex_backward_cpu(
+    const at::Tensor& grad_out,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& out,
+    const at::Tensor& logsumexp,
+    double dropout_p,
+    bool is_causal,
+    const c10::optional<at::Tensor>& attention_mask,
+    c10::optional<double> scale,
+    int64_t window_size_left,
+    int64_t window_size_right,
+    const c10::optional<at::Tensor>& alibi_slopes,
+    int64_t philox_seed,
+    int64_t philox_offset) {
+  return flash_attention_backward_kernel_stub(
+      kCPU,
+      grad_out,
+      query,
+      key,
+      value,
+      out,
+      logsumexp,
+      dropout_p,
+      is_causal,
+      attention_mask,
+      window_size_left,
+      window_size_right,
+      alibi_slopes,
+      scale,
+      philox_seed,
+      philox_offset);
+}
+
+torch::autograd::variable_list IPEXFlashAttentionOp::forward(
+    torch::autograd::AutogradContext* ctx,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    double dropout_p,
+    bool is_causal,
+    const at::Tensor& attention_mask,
+    int64_t window_size_left,
+    int64_t window_size_right,
+    const at::Tensor& alibi_slopes,
+    c10::optional<double> scale,
+    int64_t philox_seed,
+    int64_t philox_offset) {
+  RECORD_FUNCTION(
+      "IPEXFlashAttentionOp::forward", c10::ArrayRef<c10::IValue>({}));
+  at::AutoDispatchBelowADInplaceOrView g;
+
+  c10::optional<at::Tensor> mask = attention_mask.defined()
+      ? c10::optional<at::Tensor>(attention_mask)
+      : c10::nullopt;
+  c10::optional<at::Tensor> slopes = alibi_slopes.defined()
+      ? c10::optional<at::Tensor>(alibi_slopes)
+      : c10::nullopt;
+  auto outputs = flash_attention_kernel_stub(
+      kCPU,
+      query,
+      key,
+      value,
+      dropout_p,
+      is_causal,
+      mask,
+      window_size_left,
+      window_size_right,
+      slopes,
+      scale,
+      philox_seed,
+      philox_offset);
+  auto output = std::get<0>(outputs);
+  auto logsumexp = std::get<1>(outputs);
+
+  ctx->saved_data["dropout_p"] = dropout_p;
+  ctx->saved_data["is_causal"] = is_causal;
+  ctx->saved_data["window_size_left"] = window_size_left;
+  ctx->saved_data["window_size_right"] = window_size_right;
+  ctx->saved_data["scale"] = scale;
+  ctx->saved_data["philox_seed"] = philox_seed;
+  ctx->saved_data["philox_offset"] = philox_offset;
+  ctx->save_for_backward(
+      {query, key, value, attention_mask, output, logsumexp, alibi_slopes});
+  ctx->mark_non_differentiable({logsumexp});
+  return {output, logsumexp};
+}
+
+torch::autograd::variable_list IPEXFlashAttentionOp::backward(
+    torch::autograd::AutogradContext* ctx,
+    torch::autograd::variable_list grad_outputs) {
+  RECORD_FUNCTION(
+      "IPEXFlashAttentionOp::backward", c10::ArrayRef<c10::IValue>({}));
+
+  auto dropout_p = ctx->saved_data["dropout_p"].toDouble();
+  auto is_causal = ctx->saved_data["is_causal"].toBool();
+  auto window_size_left = ctx->saved_data["window_size_left"].toInt();
+  auto window_size_right = ctx->saved_data["window_size_right"].toInt();
+  auto scale = ctx->saved_data["scale"].toOptional<double>();
+  auto philox_seed = ctx->saved_data["philox_seed"].toInt();
+  auto philox_offset = ctx->saved_data["philox_offset"].toInt();
+  auto saved = ctx->get_saved_variables();
+  c10::optional<at::Tensor> mask =
+      saved[3].defined() ? c10::optional<at::Tensor>(saved[3]) : c10::nullopt;
+  c10::optional<at::Tensor> slopes =
+      saved[6].defined() ? c10::optional<at::Tensor>(saved[6]) : c10::nullopt;
+
+  auto grads = flash_attention_backward_kernel_stub(
+      kCPU,
+      grad_outputs[0],
+      saved[0],
+      saved[1],
+      saved[2],
+      saved[4],
+      saved[5],
+      dropout_p,
+      is_causal,
+      mask,
+      window_size_left,
+      window_size_right,
+      slopes,
+      scale,
+      philox_seed,
+      philox_offset);
+  return {
+      std::get<0>(grads),
+      std::get<1>(grads),
+      std::get<2>(grads),
+      at::Tensor(),
+      at::Tensor(),
+      at::Tensor(),
+      at::Tensor(),
+      at::Tensor(),
+      at::Tensor(),
+      at::Tensor(),
+      at::Tensor(),
+      at::Tensor()};
+}
+
+std::tuple<at::Tensor, at::Tensor> flash_attention_ipex_forward(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    double dropout_p,
+    bool is_causal,
+    const c10::optional<at::Tensor>& attention_mask,
+    c10::optional<double> scale,
+    int64_t window_size_left,
+    int64_t window_size_right,
+    const c10::optional<at::Tensor>& alibi_slopes,
+    c10::optional<int64_t> philox_seed,
+    int64_t philox_offset) {
+  if (at::GradMode::is_enabled() &&
+      (query.requires_grad() || key.requires_grad() ||
+       value.requires_grad())) {
+    auto outputs = IPEXFlashAttentionOp::apply(
+        query,
+        key,
+        value,
+        dropout_p,
+        is_causal,
+        attention_mask.has_value() ? attention_mask.value() : at::Tensor(),
+        window_size_left,
+        window_size_right,
+        alibi_slopes.has_value() ? alibi_slopes.value() : at::Tensor(),
+        scale,
+        flash_attention_philox_seed(dropout_p, philox_seed),
+        philox_offset);
+    return std::make_tuple(outputs[0], outputs[1]);
+  }
+  return flash_attention_ipex_forward_cpu(
+      query,
+      key,
+      value,
+      dropout_p,
+      is_causal,
+      attention_mask,
+      window_size_left,
+      window_size_right,
+      alibi_slopes,
+      scale,
+      philox_seed,
+      philox_offset);
 }
 
 /*
@@ -31,18 +319,43 @@ TORCH_LIBRARY_IMPL(aten, CPU, m) {
   m.impl(
       TORCH_SELECTIVE_NAME("aten::_scaled_dot_product_flash_attention_for_cpu"),
       TORCH_FN((&torch_ipex::cpu::flash_attention_forward_cpu)));
+  // Autograd of the op above calls this one, so training gets the
+  // recompute-based backward too.
+  m.impl(
+      TORCH_SELECTIVE_NAME(
+          "aten::_scaled_dot_product_flash_attention_for_cpu_backward"),
+      TORCH_FN((&torch_ipex::cpu::flash_attention_backward_cpu)));
 }
 
 TORCH_LIBRARY_FRAGMENT(torch_ipex, m) {
   m.def(
       "flash_attention(Tensor query, Tensor key, Tensor value, \
        float dropout_p=0.0, bool is_causal=False, \
-       *, Tensor? attention_mask=None, float? scale=None) -> \
+       *, Tensor? attention_mask=None, float? scale=None, \
+       int window_size_left=-1, int window_size_right=-1, \
+       Tensor? alibi_slopes=None, int? philox_seed=None, \
+       int philox_offset=0) -> \
        (Tensor, Tensor)");
   m.impl(
       "flash_attention",
       c10::DispatchKey::CPU,
-      torch_ipex::cpu::flash_attention_forward_cpu);
+      torch_ipex::cpu::flash_attention_ipex_forward_cpu);
+  m.impl(
+      "flash_attention",
+      c10::DispatchKey::AutogradCPU,
+      torch_ipex::cpu::flash_attention_ipex_forward);
+  m.def(
+      "flash_attention_backward(Tensor grad_out, Tensor query, Tensor key, \
+       Tensor value, Tensor out, Tensor logsumexp, float dropout_p=0.0, \
+       bool is_causal=False, *, Tensor? attention_mask=None, \
+       float? scale=None, int window_size_left=-1, \
+       int window_size_right=-1, Tensor? alibi_slopes=None, \
+       int philox_seed=0, int philox_offset=0) -> \
+       (Tensor, Tensor, Tensor)");
+  m.impl(
+      "flash_attention_backward",
+      c10::DispatchKey::CPU,
+      torch_ipex::cpu::flash_attention_ipex_backward_cpu);
 }
 
 } // namespace cpu
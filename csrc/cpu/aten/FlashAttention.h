@@ -2,6 +2,7 @@
 
 #include <ATen/ATen.h>
 #include <dyndisp/DispatchStub.h>
+#include <torch/all.h>
 
 namespace torch_ipex {
 namespace cpu {
@@ -15,9 +16,56 @@ std::tuple<at::Tensor, at::Tensor> flash_attention(
     double dropout_p,
     bool is_causal,
     c10::optional<at::Tensor> attention_mask,
-    c10::optional<double> scale);
+    int64_t window_size_left,
+    int64_t window_size_right,
+    c10::optional<at::Tensor> alibi_slopes,
+    c10::optional<double> scale,
+    int64_t philox_seed,
+    int64_t philox_offset);
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor> flash_attention_backward(
+    const at::Tensor& grad_out,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& out,
+    const at::Tensor& logsumexp,
+    double dropout_p,
+    bool is_causal,
+    c10::optional<at::Tensor> attention_mask,
+    int64_t window_size_left,
+    int64_t window_size_right,
+    c10::optional<at::Tensor> alibi_slopes,
+    c10::optional<double> scale,
+    int64_t philox_seed,
+    int64_t philox_offset);
 } // namespace
 
+// Flash attention with autograd. The dropout mask is regenerated by the
+// backward from philox_seed/philox_offset instead of being saved.
+class IPEXFlashAttentionOp
+    : public torch::autograd::Function<IPEXFlashAttentionOp> {
+ public:
+  static torch::autograd::variable_list forward(
+      torch::autograd::AutogradContext* ctx,
+      const at::Tensor& query,
+      const at::Tensor& key,
+      const at::Tensor& value,
+      double dropout_p,
+      bool is_causal,
+      const at::Tensor& attention_mask,
+      int64_t window_size_left,
+      int64_t window_size_right,
+      const at::Tensor& alibi_slopes,
+      c10::optional<double> scale,
+      int64_t philox_seed,
+      int64_t philox_offset);
+
+  static torch::autograd::variable_list backward(
+      torch::autograd::AutogradContext* ctx,
+      torch::autograd::variable_list grad_outputs);
+};
+
 using flash_attention_kernel_fn = std::tuple<at::Tensor, at::Tensor> (*)(
     const at::Tensor& query,
     const at::Tensor& key,
@@ -25,9 +73,35 @@ using flash_attention_kernel_fn = std::tuple<at::Tensor, at::Tensor> (*)(
     double dropout_p,
     bool is_causal,
     c10::optional<at::Tensor> attention_mask,
-    c10::optional<double> scale);
+    int64_t window_size_left,
+    int64_t window_size_right,
+    c10::optional<at::Tensor> alibi_slopes,
+    c10::optional<double> scale,
+    int64_t philox_seed,
+    int64_t philox_offset);
+
+using flash_attention_backward_kernel_fn =
+    std::tuple<at::Tensor, at::Tensor, at::Tensor> (*)(
+        const at::Tensor& grad_out,
+        const at::Tensor& query,
+        const at::Tensor& key,
+        const at::Tensor& value,
+        const at::Tensor& out,
+        const at::Tensor& logsumexp,
+        double dropout_p,
+        bool is_causal,
+        c10::optional<at::Tensor> attention_mask,
+        int64_t window_size_left,
+        int64_t window_size_right,
+        c10::optional<at::Tensor> alibi_slopes,
+        c10::optional<double> scale,
+        int64_t philox_seed,
+        int64_t philox_offset);
 
 IPEX_DECLARE_DISPATCH(flash_attention_kernel_fn, flash_attention_kernel_stub);
+IPEX_DECLARE_DISPATCH(
+    flash_attention_backward_kernel_fn,
+    flash_attention_backward_kernel_stub);
 
 } // namespace cpu
 } // namespace torch_ipex
@@ -376,11 +376,11 @@ at::Tensor woq_linear_pack_weight(
       block_k /= 2;
     }
     assert(block_k > 0);
+    if (block_k % 4 && lowp_mode == 3) {
+      // This case is not supported by kernel
+      return weight;
+    }
     if (is_int4) {
-      if (block_k % 4 && lowp_mode == 3) {
-        // This case is not supported by kernel
-        return weight;
-      }
       // Create a new non-quantized tensor in data type uint8 (Byte)
       // One uint8 holds two int4 values. Compressed along K.
       // N is padded to the nearest multiple of block_n.
@@ -8,6 +8,8 @@ namespace cpu {
 IPEX_DEFINE_DISPATCH(mixtral_moe_tpp_kernel_stub);
 IPEX_DEFINE_DISPATCH(mixtral_moe_woq_kernel_stub);
 IPEX_DEFINE_DISPATCH(mixtral_moe_kernel_stub);
+IPEX_DEFINE_DISPATCH(fused_moe_tpp_kernel_stub);
+IPEX_DEFINE_DISPATCH(moe_router_kernel_stub);
 
 at::Tensor mixtral_moe_tpp(
     const at::Tensor& hidden_states,
@@ -92,6 +94,67 @@ at::Tensor mixtral_moe_woq(
       routing_weights,
       output);
 }
+
+/*
+ * Computes all the experts of a Mixtral style MoE layer in one call.
+ * @param hidden_states [num_tokens, hidden_size] or [bs, seq_len, hidden_size]
+ * @param topk_ids [num_tokens, top_k] the experts selected by every token
+ * @param topk_weights [num_tokens, top_k] the routing weights of topk_ids
+ * @param gate_wei/up_wei/down_wei the (prepacked) weights of every expert
+ * @param tpp_fallback whether the weights are plain 2D weights
+ * @return the weighted sum of the selected experts of every token
+ */
+at::Tensor fused_moe_tpp(
+    const at::Tensor& hidden_states,
+    const at::Tensor& topk_ids,
+    const at::Tensor& topk_weights,
+    const std::vector<at::Tensor>& gate_wei,
+    const std::vector<at::Tensor>& up_wei,
+    const std::vector<at::Tensor>& down_wei,
+    bool tpp_fallback) {
+  RECORD_FUNCTION("ipex::fused_moe_tpp", c10::ArrayRef<c10::IValue>({}));
+
+  TORCH_CHECK(
+      gate_wei.size() > 0 && gate_wei.size() == up_wei.size() &&
+          gate_wei.size() == down_wei.size(),
+      "fused_moe_tpp: expect the same number of gate, up and down weights");
+  TORCH_CHECK(
+      topk_ids.sizes() == topk_weights.sizes(),
+      "fused_moe_tpp: topk_ids and topk_weights should have the same shape");
+  return fused_moe_tpp_kernel_stub(
+      kCPU,
+      hidden_states,
+      topk_ids,
+      topk_weights,
+      gate_wei,
+      up_wei,
+      down_wei,
+      tpp_fallback);
+}
+
+/*
+ * Routes every token to its top_k experts.
+ * @param router_logits [num_tokens, num_experts] the output of the gate
+ * @param top_k the number of experts selected by every token
+ * @param renormalize whether the top_k weights are normalized to sum to 1
+ * @return (topk_weights, topk_ids, expert_counts, sorted_token_ids,
+ * sorted_topk_idx): topk_weights and topk_ids are [num_tokens, top_k],
+ * expert_counts is [num_experts]; sorted_token_ids and sorted_topk_idx are the
+ * (token, k) pairs grouped by expert, so the slice of expert e is the top_x
+ * and idx of the mixtral_moe* ops.
+ */
+std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor, at::Tensor>
+moe_router(const at::Tensor& router_logits, int64_t top_k, bool renormalize) {
+  RECORD_FUNCTION("ipex::moe_router", c10::ArrayRef<c10::IValue>({}));
+
+  TORCH_CHECK(
+      router_logits.dim() == 2,
+      "moe_router: expect router_logits to be [num_tokens, num_experts]");
+  TORCH_CHECK(
+      top_k > 0 && top_k <= router_logits.size(1),
+      "moe_router: top_k should be in [1, num_experts]");
+  return moe_router_kernel_stub(kCPU, router_logits, top_k, renormalize);
+}
 } // namespace cpu
 } // namespace torch_ipex
 
@@ -118,5 +181,17 @@ TORCH_LIBRARY_FRAGMENT(torch_ipex, m) {
       "mixtral_moe_woq",
       c10::DispatchKey::CPU,
       torch_ipex::cpu::mixtral_moe_woq);
+  m.def(
+      "fused_moe_tpp(Tensor hidden_states, Tensor topk_ids, Tensor topk_weights, \
+      Tensor[] gate_wei, Tensor[] up_wei, Tensor[] down_wei, bool tpp_fallback) \
+      -> Tensor");
+  m.impl(
+      "fused_moe_tpp",
+      c10::DispatchKey::CPU,
+      torch_ipex::cpu::fused_moe_tpp);
+  m.def(
+      "moe_router(Tensor router_logits, int top_k, bool renormalize) -> (Tensor, \
+      Tensor, Tensor, Tensor, Tensor)");
+  m.impl("moe_router", c10::DispatchKey::CPU, torch_ipex::cpu::moe_router);
 }
 } // namespace
\ No newline at end of file
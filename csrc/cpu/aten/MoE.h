@@ -37,6 +37,16 @@ at::Tensor mixtral_moe(
     bool,
     const at::Tensor&,
     at::Tensor&);
+at::Tensor fused_moe_tpp(
+    const at::Tensor&,
+    const at::Tensor&,
+    const at::Tensor&,
+    const std::vector<at::Tensor>&,
+    const std::vector<at::Tensor>&,
+    const std::vector<at::Tensor>&,
+    bool);
+std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor, at::Tensor>
+moe_router(const at::Tensor&, int64_t, bool);
 using mixtral_moe_tpp_kernel_fn = at::Tensor (*)(
     const at::Tensor& hidden_states,
     const at::Tensor& top_x,
@@ -69,8 +79,23 @@ using mixtral_moe_kernel_fn = at::Tensor (*)(
     bool use_dnnl,
     const at::Tensor& routing_weights,
     at::Tensor& output);
+using fused_moe_tpp_kernel_fn = at::Tensor (*)(
+    const at::Tensor& hidden_states,
+    const at::Tensor& topk_ids,
+    const at::Tensor& topk_weights,
+    const std::vector<at::Tensor>& gate_wei,
+    const std::vector<at::Tensor>& up_wei,
+    const std::vector<at::Tensor>& down_wei,
+    bool tpp_fallback);
+using moe_router_kernel_fn =
+    std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor, at::Tensor> (*)(
+        const at::Tensor& router_logits,
+        int64_t top_k,
+        bool renormalize);
 IPEX_DECLARE_DISPATCH(mixtral_moe_tpp_kernel_fn, mixtral_moe_tpp_kernel_stub);
 IPEX_DECLARE_DISPATCH(mixtral_moe_woq_kernel_fn, mixtral_moe_woq_kernel_stub);
 IPEX_DECLARE_DISPATCH(mixtral_moe_kernel_fn, mixtral_moe_kernel_stub);
+IPEX_DECLARE_DISPATCH(fused_moe_tpp_kernel_fn, fused_moe_tpp_kernel_stub);
+IPEX_DECLARE_DISPATCH(moe_router_kernel_fn, moe_router_kernel_stub);
 } // namespace cpu
 } // namespace torch_ipex
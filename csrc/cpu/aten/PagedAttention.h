@@ -19,7 +19,23 @@ void single_query_cached_kv_attention(
     at::Tensor& context_lens, // [num_seqs]
     int64_t block_size,
     int64_t max_context_len,
-    const c10::optional<at::Tensor>& alibi_slopes);
+    const c10::optional<at::Tensor>& alibi_slopes,
+    const c10::optional<at::Tensor>& k_scale,
+    const c10::optional<at::Tensor>& v_scale);
+
+void paged_attention_varlen(
+    at::Tensor& out, // [num_tokens, num_heads, head_size]
+    at::Tensor& query, // [num_tokens, num_heads, head_size]
+    at::Tensor& key_cache, // [num_blocks, block_size, kv_heads, head_size]
+    at::Tensor& value_cache, // [num_blocks, block_size, kv_heads, head_size]
+    at::Tensor& query_start_loc, // [num_seqs + 1]
+    at::Tensor& seq_lens, // [num_seqs]
+    at::Tensor& block_tables, // [num_seqs, max_num_blocks_per_seq]
+    const double scale,
+    bool is_causal,
+    const c10::optional<at::Tensor>& alibi_slopes,
+    const c10::optional<at::Tensor>& k_scale,
+    const c10::optional<at::Tensor>& v_scale);
 }
 
 void reshape_and_cache(
@@ -27,7 +43,19 @@ void reshape_and_cache(
     at::Tensor& value,
     at::Tensor& key_cache,
     at::Tensor& value_cache,
-    at::Tensor& slot_mapping);
+    at::Tensor& slot_mapping,
+    const c10::optional<at::Tensor>& k_scale,
+    const c10::optional<at::Tensor>& v_scale);
+
+void copy_blocks(
+    const std::vector<at::Tensor>& key_caches,
+    const std::vector<at::Tensor>& value_caches,
+    const at::Tensor& block_mapping);
+
+void swap_blocks(
+    const at::Tensor& src,
+    at::Tensor& dst,
+    const at::Tensor& block_mapping);
 
 using single_query_cached_kv_attention_fn = void (*)(
     at::Tensor& out, // [num_seqs, num_heads, head_size]
@@ -40,19 +68,52 @@ using single_query_cached_kv_attention_fn = void (*)(
     at::Tensor& context_lens, // [num_seqs]
     int64_t block_size,
     int64_t max_context_len,
-    const c10::optional<at::Tensor>& alibi_slopes);
+    const c10::optional<at::Tensor>& alibi_slopes,
+    const c10::optional<at::Tensor>& k_scale,
+    const c10::optional<at::Tensor>& v_scale);
+
+using paged_attention_varlen_fn = void (*)(
+    at::Tensor& out, // [num_tokens, num_heads, head_size]
+    at::Tensor& query, // [num_tokens, num_heads, head_size]
+    at::Tensor& key_cache, // [num_blocks, block_size, kv_heads, head_size]
+    at::Tensor& value_cache, // [num_blocks, block_size, kv_heads, head_size]
+    at::Tensor& query_start_loc, // [num_seqs + 1]
+    at::Tensor& seq_lens, // [num_seqs]
+    at::Tensor& block_tables, // [num_seqs, max_num_blocks_per_seq]
+    const double scale,
+    bool is_causal,
+    const c10::optional<at::Tensor>& alibi_slopes,
+    const c10::optional<at::Tensor>& k_scale,
+    const c10::optional<at::Tensor>& v_scale);
 
 using reshape_and_cache_fn = void (*)(
     at::Tensor& key,
     at::Tensor& value,
     at::Tensor& key_cache,
     at::Tensor& value_cache,
-    at::Tensor& slot_mapping);
+    at::Tensor& slot_mapping,
+    const c10::optional<at::Tensor>& k_scale,
+    const c10::optional<at::Tensor>& v_scale);
+
+using copy_blocks_fn = void (*)(
+    const std::vector<at::Tensor>& key_caches,
+    const std::vector<at::Tensor>& value_caches,
+    const at::Tensor& block_mapping);
+
+using swap_blocks_fn = void (*)(
+    const at::Tensor& src,
+    at::Tensor& dst,
+    const at::Tensor& block_mapping);
 
 IPEX_DECLARE_DISPATCH(
     single_query_cached_kv_attention_fn,
     single_query_cached_kv_attention_kernel_stub);
+IPEX_DECLARE_DISPATCH(
+    paged_attention_varlen_fn,
+    paged_attention_varlen_kernel_stub);
 IPEX_DECLARE_DISPATCH(reshape_and_cache_fn, reshape_and_cache_kernel_stub);
+IPEX_DECLARE_DISPATCH(copy_blocks_fn, copy_blocks_kernel_stub);
+IPEX_DECLARE_DISPATCH(swap_blocks_fn, swap_blocks_kernel_stub);
 
 } // namespace cpu
 } // namespace torch_ipex
@@ -11,6 +11,7 @@ namespace torch_ipex {
 namespace cpu {
 
 IPEX_DEFINE_DISPATCH(rotary_position_embedding_kernel_stub);
+IPEX_DEFINE_DISPATCH(rotary_position_embedding_with_kv_cache_kernel_stub);
 
 std::tuple<at::Tensor, at::Tensor, at::Tensor>
 rotary_position_embedding_forward_cpu(
@@ -27,6 +28,39 @@ rotary_position_embedding_forward_cpu(
       kCPU, t_in, t_emb_pos, t_pos, N, H, offset, rotary_ndims);
 }
 
+// Same as rotary_position_embedding on the fused qkv, but the key and value
+// are written into the kv cache instead of new tensors. Only the query is
+// returned.
+at::Tensor rotary_position_embedding_with_kv_cache_forward_cpu(
+    at::Tensor& t_in,
+    at::Tensor& t_emb_pos,
+    at::Tensor& t_pos,
+    int64_t N, // N: number of head, H: head size
+    int64_t H,
+    int64_t offset,
+    int64_t rotary_ndims,
+    at::Tensor& key_cache,
+    at::Tensor& value_cache,
+    const c10::optional<at::Tensor>& slot_mapping,
+    int64_t cache_offset) {
+  RECORD_FUNCTION(
+      "ipex::rotary_position_embedding_with_kv_cache",
+      c10::ArrayRef<c10::IValue>({}));
+  return rotary_position_embedding_with_kv_cache_kernel_stub(
+      kCPU,
+      t_in,
+      t_emb_pos,
+      t_pos,
+      N,
+      H,
+      offset,
+      rotary_ndims,
+      key_cache,
+      value_cache,
+      slot_mapping,
+      cache_offset);
+}
+
 } // namespace cpu
 } // namespace torch_ipex
 
@@ -39,5 +73,11 @@ TORCH_LIBRARY_FRAGMENT(torch_ipex, m) {
       "rotary_position_embedding",
       c10::DispatchKey::CPU,
       torch_ipex::cpu::rotary_position_embedding_forward_cpu);
+  m.def(
+      "rotary_position_embedding_with_kv_cache(Tensor t_in, Tensor t_emb_pos, Tensor t_pos, int N, int H, int offset, int rotary_ndims, Tensor(a!) key_cache, Tensor(b!) value_cache, Tensor? slot_mapping=None, int cache_offset=0)-> Tensor");
+  m.impl(
+      "rotary_position_embedding_with_kv_cache",
+      c10::DispatchKey::CPU,
+      torch_ipex::cpu::rotary_position_embedding_with_kv_cache_forward_cpu);
 }
 } // namespace
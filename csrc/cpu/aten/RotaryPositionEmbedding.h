@@ -17,6 +17,19 @@ rotary_position_embedding_kernel_impl(
     int64_t H,
     int64_t offset,
     int64_t rotary_ndims);
+
+at::Tensor rotary_position_embedding_with_kv_cache_kernel_impl(
+    at::Tensor& t_in,
+    at::Tensor& t_emb_pos,
+    at::Tensor& t_pos,
+    int64_t N, // N: number of head, H: head size
+    int64_t H,
+    int64_t offset,
+    int64_t rotary_ndims,
+    at::Tensor& key_cache,
+    at::Tensor& value_cache,
+    const c10::optional<at::Tensor>& slot_mapping,
+    int64_t cache_offset);
 }
 
 using rotary_position_embedding_kernel_fn =
@@ -33,5 +46,22 @@ IPEX_DECLARE_DISPATCH(
     rotary_position_embedding_kernel_fn,
     rotary_position_embedding_kernel_stub);
 
+using rotary_position_embedding_with_kv_cache_kernel_fn = at::Tensor (*)(
+    at::Tensor& t_in,
+    at::Tensor& t_emb_pos,
+    at::Tensor& t_pos,
+    int64_t N, // N: number of head, H: head size
+    int64_t H,
+    int64_t offset,
+    int64_t rotary_ndims,
+    at::Tensor& key_cache,
+    at::Tensor& value_cache,
+    const c10::optional<at::Tensor>& slot_mapping,
+    int64_t cache_offset);
+
+IPEX_DECLARE_DISPATCH(
+    rotary_position_embedding_with_kv_cache_kernel_fn,
+    rotary_position_embedding_with_kv_cache_kernel_stub);
+
 } // namespace cpu
 } // namespace torch_ipex
@@ -2,6 +2,7 @@
 #include "TPPGEMM.h"
 #include <torch/all.h>
 #include <torch/csrc/autograd/function.h>
+#include "tpp/timing.h"
 #include "tpp/xsmm_functors.h"
 namespace torch_ipex {
 namespace cpu {
@@ -97,6 +98,10 @@ at::Tensor tpp_linear_add_add_forward_cpu(
       kCPU, t_in, t_in1, t_in2, t_wt, t_bias, scale);
 }
 
+void tpp_set_profiling(bool enabled) {
+  torch_ipex::tpp::set_profiling_enabled(enabled);
+}
+
 } // namespace cpu
 } // namespace torch_ipex
 
@@ -183,5 +188,12 @@ TORCH_LIBRARY_FRAGMENT(torch_ipex, m) {
       torch_ipex::cpu::tpp_linear_mul_forward_cpu);
 }
 
+TORCH_LIBRARY_FRAGMENT(torch_ipex, m) {
+  // Takes no tensor, so it is registered as a catch-all kernel
+  m.def(
+      "tpp_set_profiling(bool enabled) -> ()",
+      torch_ipex::cpu::tpp_set_profiling);
+}
+
 } // namespace
 #endif
\ No newline at end of file
@@ -67,6 +67,9 @@ at::Tensor tpp_linear_add_add_forward_cpu(
     double scale,
     c10::optional<int64_t> out_features);
 
+// Turn the runtime TPP profiling on or off, see tpp/timing.h
+void tpp_set_profiling(bool enabled);
+
 using tpp_linear_nobias_impl_fn =
     at::Tensor (*)(const at::Tensor&, const at::Tensor&);
 
@@ -1,6 +1,7 @@
 #include <ATen/ATen.h>
 #include <ATen/Dispatch.h>
 #include <ATen/Parallel.h>
+#include <ATen/core/PhiloxRNGEngine.h>
 #include <ATen/cpu/vec/functional.h>
 #include <ATen/cpu/vec/vec.h>
 #include <ATen/native/CPUBlas.h>
@@ -11,99 +12,17 @@
 #include <torch/all.h>
 #include <torch/csrc/autograd/function.h>
 #include <limits>
+#include <sstream>
+#include <vector>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 #include "../cpu/utils/isa_utils.h"
+#include "csrc/cpu/aten/utils/mkl_gemm.h"
+#include "csrc/cpu/aten/utils/shape_tuner.h"
 #include "csrc/cpu/tpp/woq/tla.h"
-#include "mkl.h"
 #include "vec/vec.h"
 
-inline void _mkl_gemm(
-    const CBLAS_LAYOUT layout,
-    const CBLAS_TRANSPOSE transa,
-    const CBLAS_TRANSPOSE transb,
-    const int& m,
-    const int& n,
-    const int& k,
-    const float& alpha,
-    const float* a,
-    const int& lda,
-    const float* b,
-    const int& ldb,
-    const float& beta,
-    float* c,
-    const int& ldc) {
-  cblas_sgemm(
-      layout, transa, transb, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc);
-}
-
-inline void _mkl_gemm(
-    const CBLAS_LAYOUT layout,
-    const CBLAS_TRANSPOSE transa,
-    const CBLAS_TRANSPOSE transb,
-    const int& m,
-    const int& n,
-    const int& k,
-    const double& alpha,
-    const double* a,
-    const int& lda,
-    const double* b,
-    const int& ldb,
-    const double& beta,
-    double* c,
-    const int& ldc) {
-  cblas_dgemm(
-      layout, transa, transb, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc);
-}
-
-inline void _mkl_gemm(
-    const CBLAS_LAYOUT layout,
-    const CBLAS_TRANSPOSE transa,
-    const CBLAS_TRANSPOSE transb,
-    const int& m,
-    const int& n,
-    const int& k,
-    const float& alpha,
-    const at::BFloat16* a,
-    const int& lda,
-    const at::BFloat16* b,
-    const int& ldb,
-    const float& beta,
-    float* c,
-    const int& ldc) {
-  cblas_gemm_bf16bf16f32(
-      layout,
-      transa,
-      transb,
-      m,
-      n,
-      k,
-      alpha,
-      (const MKL_BF16*)(a),
-      lda,
-      (const MKL_BF16*)(b),
-      ldb,
-      beta,
-      c,
-      ldc);
-}
-
-inline void _mkl_gemm(
-    const CBLAS_LAYOUT layout,
-    const CBLAS_TRANSPOSE transa,
-    const CBLAS_TRANSPOSE transb,
-    const int& m,
-    const int& n,
-    const int& k,
-    const float& alpha,
-    const at::Half* a,
-    const int& lda,
-    const at::Half* b,
-    const int& ldb,
-    const float& beta,
-    float* c,
-    const int& ldc) {
-  TORCH_CHECK(false, "_mkl_gemm does not support FP16 yet");
-}
-
 namespace torch_ipex {
 using namespace tpp;
 namespace cpu {
@@ -351,11 +270,113 @@ inline void _mul_reduce_max_fusion_kernel(
           vec_tmp_max));
 }
 
+// Dropout of one attention row: out = keep ? out * keep_scale : 0.
+// The keep mask is drawn from Philox with subsequence row_id and counter
+// offset + col / 4, so it only depends on the seed/offset and the position of
+// the element, not on the tiling, and the backward can regenerate it instead
+// of storing it. col must be a multiple of 4.
+template <typename scalar_t>
+inline void _dropout_row(
+    scalar_t* out,
+    int64_t size,
+    float dropout_p,
+    scalar_t keep_scale,
+    uint64_t seed,
+    uint64_t offset,
+    uint64_t row_id,
+    int64_t col) {
+  at::Philox4_32 engine(seed, row_id, offset + col / 4);
+  for (int64_t c = 0; c < size; c++) {
+    // 24 random bits to a float in [0, 1)
+    float u = (engine() >> 8) * (1.0f / 16777216.0f);
+    out[c] = u < dropout_p ? scalar_t(0) : out[c] * keep_scale;
+  }
+}
+
+// Keys [kv_start, kv_end) visible to the queries [m, m + qBlockSize) with a
+// sliding window of window_left keys before and window_right keys after the
+// query position. A negative window size leaves that side unbounded.
+inline void _window_kv_range(
+    int64_t m,
+    int64_t qBlockSize,
+    int64_t kvSize,
+    int64_t window_left,
+    int64_t window_right,
+    int64_t& kv_start,
+    int64_t& kv_end) {
+  kv_start = window_left >= 0 ? std::max<int64_t>(m - window_left, 0) : 0;
+  kv_end = window_right >= 0
+      ? std::min<int64_t>(m + qBlockSize + window_right, kvSize)
+      : kvSize;
+}
+
+// Whether some key of the [m, m + qBlockSize) x [n, n + kvBlockSize) block
+// is outside the sliding window of its query.
+inline bool _window_block_is_masked(
+    int64_t m,
+    int64_t qBlockSize,
+    int64_t n,
+    int64_t kvBlockSize,
+    int64_t window_left,
+    int64_t window_right) {
+  return (window_left >= 0 && n < m + qBlockSize - 1 - window_left) ||
+      (window_right >= 0 && n + kvBlockSize - 1 > m + window_right);
+}
+
+// Fill the keys of one qk row that are outside the sliding window of query
+// q_pos with val. n is the position of the first key of the row.
+template <typename accum_t>
+inline void _window_mask_row(
+    accum_t* qk,
+    int64_t kvBlockSize,
+    int64_t q_pos,
+    int64_t n,
+    int64_t window_left,
+    int64_t window_right,
+    accum_t val) {
+  int64_t first = 0, last = kvBlockSize;
+  if (window_left >= 0) {
+    first = std::max<int64_t>(q_pos - window_left - n, 0);
+    first = std::min(first, kvBlockSize);
+  }
+  if (window_right >= 0) {
+    last = std::min<int64_t>(q_pos + window_right - n + 1, kvBlockSize);
+    last = std::max(last, first);
+  }
+  torch_ipex::cpu::kernel::fill_stub(qk, val, first);
+  torch_ipex::cpu::kernel::fill_stub(qk + last, val, kvBlockSize - last);
+}
+
+// qk <- qk * scale - slope * |q_pos - k_pos|, the ALiBi bias computed on the
+// fly for one row. n is the position of the first key of the row.
+template <typename accum_t>
+inline void _alibi_bias_row(
+    accum_t* qk,
+    int64_t kvBlockSize,
+    int64_t q_pos,
+    int64_t n,
+    accum_t scale,
+    accum_t slope) {
+  using Vec = at::vec::Vectorized<accum_t>;
+  auto vec_scale = Vec(scale);
+  auto vec_slope = Vec(slope);
+  auto vec_offset = Vec::arange(0, 1);
+  int64_t c = 0;
+  for (; c < kvBlockSize - (kvBlockSize % Vec::size()); c += Vec::size()) {
+    auto distance =
+        (Vec(static_cast<accum_t>(q_pos - n - c)) - vec_offset).abs();
+    auto x = Vec::loadu(qk + c);
+    (x * vec_scale - vec_slope * distance).store(qk + c);
+  }
+  for (; c < kvBlockSize; c++) {
+    auto distance = static_cast<accum_t>(std::abs(q_pos - n - c));
+    qk[c] = qk[c] * scale - slope * distance;
+  }
+}
+
 /*
  *Caculate the flash attention SDPA.
  *@template scalar_t: q/k/v data type
- *@template q_split_size: q block size
- *@template kv_split_size: kv block size
  *@param output: output result
  *@param logsumexp: logsumexp for backward
  *@param q: query
@@ -364,9 +385,18 @@ inline void _mul_reduce_max_fusion_kernel(
  *@param dropout_p: dropout probability
  *@param is_causal: assume causal attention masking if true
  *@param attention_mask: attention mask
+ *@param window_size_left: number of keys before the query in the sliding
+ *window, -1 for unbounded
+ *@param window_size_right: number of keys after the query in the sliding
+ *window, -1 for unbounded
+ *@param alibi_slopes: ALiBi slopes of shape (Num_heads) or (Batch x Num_heads)
  *@param scale: scaling factor applied prior to softmax
+ *@param philox_seed: seed of the dropout mask
+ *@param philox_offset: offset of the dropout mask
+ *@param q_split_size: q block size
+ *@param kv_split_size: kv block size
  */
-template <typename scalar_t, int64_t q_split_size, int64_t kv_split_size>
+template <typename scalar_t>
 inline typename std::enable_if_t<!is_reduced_floating_point_v<scalar_t>, void>
 cpu_flash_attention(
     const at::Tensor& output,
@@ -377,7 +407,14 @@ cpu_flash_attention(
     double dropout_p,
     bool is_causal,
     c10::optional<at::Tensor> attention_mask,
-    c10::optional<double> scale) {
+    int64_t window_size_left,
+    int64_t window_size_right,
+    c10::optional<at::Tensor> alibi_slopes,
+    c10::optional<double> scale,
+    int64_t philox_seed,
+    int64_t philox_offset,
+    int64_t q_split_size,
+    int64_t kv_split_size) {
   // Query (Batch x Num_heads  x Q_seq_len  x Dim_per_head)
   //    -> (Batch x Q_seq_len  x Num_heads  x Dim_per_head)
   // Key   (Batch x Num_heads  x KV_seq_len x Dim_per_head)
@@ -393,6 +430,12 @@ cpu_flash_attention(
   using accum_t = at::opmath_type<scalar_t>;
   using Vec = at::vec::Vectorized<accum_t>;
   accum_t scaling_factor = calculate_scale(query, scale).as_float_unchecked();
+  // With ALiBi the scaling factor is applied together with the bias
+  accum_t qk_scale = alibi_slopes.has_value() ? 1 : scaling_factor;
+  // Causal attention is a sliding window without keys on the right
+  if (is_causal) {
+    window_size_right = 0;
+  }
   if (attention_mask.has_value() && is_bool_mask) {
     attention_mask.value() = attention_mask.value().to(at::kFloat);
   }
@@ -420,6 +463,9 @@ cpu_flash_attention(
   int64_t oStrideB = output.stride(0);
   int64_t oStrideM = output.stride(1);
   int64_t oStrideH = output.stride(2);
+  int64_t lStrideB = logsumexp.stride(0);
+  int64_t lStrideM = logsumexp.stride(1);
+  int64_t lStrideH = logsumexp.stride(2);
   int64_t mStrideB =
       (attention_mask.has_value() && attention_mask.value().size(0) > 1)
       ? attention_mask.value().stride(0)
@@ -430,6 +476,15 @@ cpu_flash_attention(
       : 0;
   int64_t mStrideM =
       attention_mask.has_value() ? attention_mask.value().stride(2) : 0;
+  // ALiBi slopes (Batch x Num_heads) or (Num_heads)
+  int64_t aStrideB = 0;
+  if (alibi_slopes.has_value()) {
+    alibi_slopes.value() = alibi_slopes.value()
+                               .to(at::toOpMathType(query.scalar_type()))
+                               .contiguous();
+    aStrideB =
+        alibi_slopes.value().dim() == 2 ? alibi_slopes.value().stride(0) : 0;
+  }
 
   int64_t qSplitSize = q_split_size > qSize ? qSize : q_split_size;
   int64_t kvSplitSize = kv_split_size > kvSize ? kvSize : kv_split_size;
@@ -458,7 +513,11 @@ cpu_flash_attention(
   accum_t* mask_data = attention_mask.has_value()
       ? attention_mask.value().data_ptr<accum_t>()
       : nullptr;
+  accum_t* alibi_data = alibi_slopes.has_value()
+      ? alibi_slopes.value().data_ptr<accum_t>()
+      : nullptr;
   scalar_t* out_data = output.data_ptr<scalar_t>();
+  accum_t* lse_data = logsumexp.data_ptr<accum_t>();
   accum_t* buf_data = buf.data_ptr<accum_t>();
 
   at::parallel_for(
@@ -484,9 +543,24 @@ cpu_flash_attention(
               qBlockSize);
           torch_ipex::cpu::kernel::fill_stub(
               qk_sum_data, static_cast<accum_t>(0), qBlockSize);
-          int64_t num_keys =
-              is_causal ? std::min(m + qBlockSize, kvSize) : kvSize;
-          for (int64_t n = 0; n < num_keys; n += kvSplitSize) {
+          int64_t kv_start = 0, kv_end = kvSize;
+          _window_kv_range(
+              m,
+              qBlockSize,
+              kvSize,
+              window_size_left,
+              window_size_right,
+              kv_start,
+              kv_end);
+          // Start at the first kv block inside the sliding window
+          int64_t n_start = kv_start / kvSplitSize * kvSplitSize;
+          if (n_start >= kv_end) {
+            torch_ipex::cpu::kernel::fill_stub(
+                dst_data, static_cast<accum_t>(0), qBlockSize * headSize);
+          }
+          accum_t alibi_slope =
+              alibi_data != nullptr ? alibi_data[i * aStrideB + j] : 0;
+          for (int64_t n = n_start; n < kv_end; n += kvSplitSize) {
             int64_t kvBlockSize = std::min(kvSplitSize, kvSize - n);
             // Calculate scale * q @ k.T
             _mkl_gemm(
@@ -504,15 +578,35 @@ cpu_flash_attention(
                 static_cast<accum_t>(0),
                 qk_data,
                 kvBlockSize);
-            // Apply causal mask, fill unused with -inf
-            if (is_causal && num_keys - n <= kvSplitSize) {
+            // Apply sliding window and causal mask, fill unused with -inf
+            if (_window_block_is_masked(
+                    m,
+                    qBlockSize,
+                    n,
+                    kvBlockSize,
+                    window_size_left,
+                    window_size_right)) {
               for (const auto row : c10::irange(qBlockSize)) {
-                int64_t last_col = m + row - n;
-                accum_t* row_ptr = qk_data + row * kvBlockSize;
-                torch_ipex::cpu::kernel::fill_stub(
-                    row_ptr + last_col + 1,
-                    -std::numeric_limits<accum_t>::infinity(),
-                    kvBlockSize - last_col - 1);
+                _window_mask_row(
+                    qk_data + row * kvBlockSize,
+                    kvBlockSize,
+                    m + row,
+                    n,
+                    window_size_left,
+                    window_size_right,
+                    -std::numeric_limits<accum_t>::infinity());
+              }
+            }
+            // Add ALiBi bias and apply scaling factor
+            if (alibi_data != nullptr) {
+              for (const auto row : c10::irange(qBlockSize)) {
+                _alibi_bias_row(
+                    qk_data + row * kvBlockSize,
+                    kvBlockSize,
+                    m + row,
+                    n,
+                    scaling_factor,
+                    alibi_slope);
               }
             }
             // Update attention weights with attention mask
@@ -523,9 +617,8 @@ cpu_flash_attention(
                   // qk <- attn_mask ? qk : -inf
                   auto neg_inf = -std::numeric_limits<accum_t>::infinity();
                   at::vec::map2<accum_t>(
-                      [neg_inf, scaling_factor](Vec x, Vec m) {
-                        return Vec::blendv(
-                            Vec(neg_inf), x * Vec(scaling_factor), m);
+                      [neg_inf, qk_scale](Vec x, Vec m) {
+                        return Vec::blendv(Vec(neg_inf), x * Vec(qk_scale), m);
                       },
                       qk_data + row * kvBlockSize,
                       qk_data + row * kvBlockSize,
@@ -535,8 +628,8 @@ cpu_flash_attention(
                 } else {
                   // qk <- qk + attn_mask
                   at::vec::map2<accum_t>(
-                      [scaling_factor](Vec x, Vec y) {
-                        return x * Vec(scaling_factor) + y;
+                      [qk_scale](Vec x, Vec y) {
+                        return x * Vec(qk_scale) + y;
                       },
                       qk_data + row * kvBlockSize,
                       qk_data + row * kvBlockSize,
@@ -550,7 +643,7 @@ cpu_flash_attention(
             accum_t tmp_max = 0, tmp_sum = 0, sum_old = 0, exp_tmp = 0;
             for (int64_t row = 0; row < qBlockSize; ++row) {
               sum_old = qk_sum_data[row];
-              if (attention_mask.has_value()) {
+              if (attention_mask.has_value() || alibi_data != nullptr) {
                 // max per row
                 tmp_max = at::vec::reduce_all<accum_t>(
                     [](Vec& x, Vec& y) { return at::vec::maximum(x, y); },
@@ -566,6 +659,14 @@ cpu_flash_attention(
                     tmp_max);
               }
               tmp_max = qk_max_data[row] > tmp_max ? qk_max_data[row] : tmp_max;
+              if (tmp_max == -std::numeric_limits<accum_t>::infinity()) {
+                // No visible key for the row yet, it adds nothing to dst
+                torch_ipex::cpu::kernel::fill_stub(
+                    qk_data + row * kvBlockSize,
+                    static_cast<accum_t>(0),
+                    kvBlockSize);
+                continue;
+              }
               // qk <- exp(qk - max) and sum per row
               tmp_sum = tmp_max;
               _exp_reduce_sum_fusion_kernel(
@@ -573,6 +674,18 @@ cpu_flash_attention(
                   kvBlockSize,
                   qk_data + row * kvBlockSize,
                   tmp_sum);
+              // Drop after the row sum, softmax is normalized before dropout
+              if (dropout_p > 0) {
+                _dropout_row(
+                    qk_data + row * kvBlockSize,
+                    kvBlockSize,
+                    dropout_p,
+                    static_cast<accum_t>(1),
+                    philox_seed,
+                    philox_offset,
+                    (i * num_head + j) * qSize + m + row,
+                    n);
+              }
               // exp_tmp <- exp(max[row] - max)
               exp_tmp = std::exp(qk_max_data[row] - tmp_max);
               // sum[row] <- sum + exp_tmp * sum[row]
@@ -580,7 +693,7 @@ cpu_flash_attention(
               // max[row] <- max
               qk_max_data[row] = tmp_max;
               // dst <- dst * exp_tmp
-              if (n > 0) {
+              if (n > n_start) {
                 at::vec::map<accum_t>(
                     [exp_tmp](Vec x) { return x * Vec(exp_tmp); },
                     dst_data + row * headSize,
@@ -601,20 +714,31 @@ cpu_flash_attention(
                 vStrideN,
                 qk_data,
                 kvBlockSize,
-                n == 0 ? static_cast<accum_t>(0) : static_cast<accum_t>(1),
+                n == n_start ? static_cast<accum_t>(0)
+                             : static_cast<accum_t>(1),
                 dst_data,
                 headSize);
           }
-          // dst <- dst / sum[row]
+          // dst <- dst / sum[row] / (1 - dropout_p)
           // reorder MHA output with strides
           for (int64_t row = 0; row < qBlockSize; ++row) {
-            accum_t sum_reciprocal = 1 / qk_sum_data[row];
+            // A row without any visible key outputs 0, its logsumexp is +inf
+            // so that the backward recomputes exp(qk - logsumexp) as 0
+            accum_t sum_reciprocal = 0;
+            accum_t lse = std::numeric_limits<accum_t>::infinity();
+            if (qk_sum_data[row] != 0) {
+              sum_reciprocal =
+                  1 / (qk_sum_data[row] * static_cast<accum_t>(1 - dropout_p));
+              // logsumexp <- max[row] + log(sum[row])
+              lse = qk_max_data[row] + std::log(qk_sum_data[row]);
+            }
             at::vec::map<scalar_t>(
                 [sum_reciprocal](Vec x) { return x * Vec(sum_reciprocal); },
                 out_data + i * oStrideB + j * oStrideH + m * oStrideM +
                     row * oStrideM,
                 dst_data + row * headSize,
                 headSize);
+            lse_data[i * lStrideB + j * lStrideH + (m + row) * lStrideM] = lse;
           }
           // Move to the next query
           at::native::data_index_step(i, batchSize, j, num_head, k, qSlice);
@@ -623,7 +747,7 @@ cpu_flash_attention(
 }
 
 // Half/BFloat16
-template <typename scalar_t, int64_t q_split_size, int64_t kv_split_size>
+template <typename scalar_t>
 inline typename std::enable_if_t<is_reduced_floating_point_v<scalar_t>, void>
 cpu_flash_attention(
     const at::Tensor& output,
@@ -634,7 +758,14 @@ cpu_flash_attention(
     double dropout_p,
     bool is_causal,
     c10::optional<at::Tensor> attention_mask,
-    c10::optional<double> scale) {
+    int64_t window_size_left,
+    int64_t window_size_right,
+    c10::optional<at::Tensor> alibi_slopes,
+    c10::optional<double> scale,
+    int64_t philox_seed,
+    int64_t philox_offset,
+    int64_t q_split_size,
+    int64_t kv_split_size) {
   // Query (Batch x Num_heads  x Q_seq_len  x Dim_per_head)
   //    -> (Batch x Q_seq_len  x Num_heads  x Dim_per_head)
   // Key   (Batch x Num_heads  x KV_seq_len x Dim_per_head)
@@ -657,6 +788,12 @@ cpu_flash_attention(
   using accum_t = at::opmath_type<scalar_t>;
   using Vec = at::vec::Vectorized<accum_t>;
   accum_t scaling_factor = calculate_scale(query, scale).as_float_unchecked();
+  // With ALiBi the scaling factor is applied together with the bias
+  accum_t qk_scale = alibi_slopes.has_value() ? 1 : scaling_factor;
+  // Causal attention is a sliding window without keys on the right
+  if (is_causal) {
+    window_size_right = 0;
+  }
   if (attention_mask.has_value()) {
     attention_mask.value() = attention_mask.value().to(at::kFloat);
   }
@@ -684,6 +821,9 @@ cpu_flash_attention(
   int64_t oStrideB = output.stride(0);
   int64_t oStrideM = output.stride(1);
   int64_t oStrideH = output.stride(2);
+  int64_t lStrideB = logsumexp.stride(0);
+  int64_t lStrideM = logsumexp.stride(1);
+  int64_t lStrideH = logsumexp.stride(2);
   int64_t mStrideB =
       (attention_mask.has_value() && attention_mask.value().size(0) > 1)
       ? attention_mask.value().stride(0)
@@ -694,6 +834,14 @@ cpu_flash_attention(
       : 0;
   int64_t mStrideM =
       attention_mask.has_value() ? attention_mask.value().stride(2) : 0;
+  // ALiBi slopes (Batch x Num_heads) or (Num_heads)
+  int64_t aStrideB = 0;
+  if (alibi_slopes.has_value()) {
+    alibi_slopes.value() =
+        alibi_slopes.value().to(accumulate_dtype).contiguous();
+    aStrideB =
+        alibi_slopes.value().dim() == 2 ? alibi_slopes.value().stride(0) : 0;
+  }
 
   int64_t qSplitSize = q_split_size > qSize ? qSize : q_split_size;
   int64_t kvSplitSize = kv_split_size > kvSize ? kvSize : kv_split_size;
@@ -724,7 +872,11 @@ cpu_flash_attention(
   accum_t* mask_data = attention_mask.has_value()
       ? attention_mask.value().data_ptr<accum_t>()
       : nullptr;
+  accum_t* alibi_data = alibi_slopes.has_value()
+      ? alibi_slopes.value().data_ptr<accum_t>()
+      : nullptr;
   scalar_t* out_data = output.data_ptr<scalar_t>();
+  accum_t* lse_data = logsumexp.data_ptr<accum_t>();
   accum_t* buf_data = buf.data_ptr<accum_t>();
   scalar_t* buf_reduced_data = buf_reduced.data_ptr<scalar_t>();
 
@@ -1063,8 +1215,23 @@ cpu_flash_attention(
               qBlockSize);
           torch_ipex::cpu::kernel::fill_stub(
               qk_sum_data, static_cast<accum_t>(0), qBlockSize);
-          int64_t num_keys =
-              is_causal ? std::min(m + qBlockSize, kvSize) : kvSize;
+          int64_t kv_start = 0, kv_end = kvSize;
+          _window_kv_range(
+              m,
+              qBlockSize,
+              kvSize,
+              window_size_left,
+              window_size_right,
+              kv_start,
+              kv_end);
+          // Start at the first kv block inside the sliding window
+          int64_t n_start = kv_start / kvSplitSize * kvSplitSize;
+          if (n_start >= kv_end) {
+            torch_ipex::cpu::kernel::fill_stub(
+                dst_data, static_cast<accum_t>(0), qBlockSize * headSize);
+          }
+          accum_t alibi_slope =
+              alibi_data != nullptr ? alibi_data[i * aStrideB + j] : 0;
           if (is_fp16 && !headSize_even) {
             // pad query if headSize is not even for fp16
             // [qBlockSize, headSize] -> [qBlockSize, headSize + 1]
@@ -1075,7 +1242,7 @@ cpu_flash_attention(
                 headSize + 1,
                 qStrideM);
           }
-          for (int64_t n = 0; n < num_keys; n += kvSplitSize) {
+          for (int64_t n = n_start; n < kv_end; n += kvSplitSize) {
             int64_t kvBlockSize = std::min(kvSplitSize, kvSize - n);
             // Calculate scale * q @ k.T
             if ((!is_fp16 && headSize_even) || is_fp16) {
@@ -1142,15 +1309,35 @@ cpu_flash_attention(
                   qk_data,
                   kvBlockSize);
             }
-            // Apply causal mask, fill unused with -inf
-            if (is_causal && num_keys - n <= kvSplitSize) {
+            // Apply sliding window and causal mask, fill unused with -inf
+            if (_window_block_is_masked(
+                    m,
+                    qBlockSize,
+                    n,
+                    kvBlockSize,
+                    window_size_left,
+                    window_size_right)) {
               for (const auto row : c10::irange(qBlockSize)) {
-                int64_t last_col = m + row - n;
-                accum_t* row_ptr = qk_data + row * kvBlockSize;
-                torch_ipex::cpu::kernel::fill_stub(
-                    row_ptr + last_col + 1,
-                    -std::numeric_limits<accum_t>::infinity(),
-                    kvBlockSize - last_col - 1);
+                _window_mask_row(
+                    qk_data + row * kvBlockSize,
+                    kvBlockSize,
+                    m + row,
+                    n,
+                    window_size_left,
+                    window_size_right,
+                    -std::numeric_limits<accum_t>::infinity());
+              }
+            }
+            // Add ALiBi bias and apply scaling factor
+            if (alibi_data != nullptr) {
+              for (const auto row : c10::irange(qBlockSize)) {
+                _alibi_bias_row(
+                    qk_data + row * kvBlockSize,
+                    kvBlockSize,
+                    m + row,
+                    n,
+                    scaling_factor,
+                    alibi_slope);
               }
             }
             // Update attention weights with attention mask
@@ -1161,9 +1348,8 @@ cpu_flash_attention(
                   // qk <- attn_mask ? qk : -inf
                   auto neg_inf = -std::numeric_limits<accum_t>::infinity();
                   at::vec::map2<accum_t>(
-                      [neg_inf, scaling_factor](Vec x, Vec m) {
-                        return Vec::blendv(
-                            Vec(neg_inf), x * Vec(scaling_factor), m);
+                      [neg_inf, qk_scale](Vec x, Vec m) {
+                        return Vec::blendv(Vec(neg_inf), x * Vec(qk_scale), m);
                       },
                       qk_data + row * kvBlockSize,
                       qk_data + row * kvBlockSize,
@@ -1173,8 +1359,8 @@ cpu_flash_attention(
                 } else {
                   // qk <- qk + attn_mask
                   at::vec::map2<accum_t>(
-                      [scaling_factor](Vec x, Vec y) {
-                        return x * Vec(scaling_factor) + y;
+                      [qk_scale](Vec x, Vec y) {
+                        return x * Vec(qk_scale) + y;
                       },
                       qk_data + row * kvBlockSize,
                       qk_data + row * kvBlockSize,
@@ -1188,7 +1374,7 @@ cpu_flash_attention(
             accum_t tmp_max = 0, tmp_sum = 0, sum_old = 0, exp_tmp = 0;
             for (int64_t row = 0; row < qBlockSize; ++row) {
               sum_old = qk_sum_data[row];
-              if (attention_mask.has_value()) {
+              if (attention_mask.has_value() || alibi_data != nullptr) {
                 // max per row
                 tmp_max = at::vec::reduce_all<accum_t>(
                     [](Vec& x, Vec& y) { return at::vec::maximum(x, y); },
@@ -1204,6 +1390,17 @@ cpu_flash_attention(
                     tmp_max);
               }
               tmp_max = qk_max_data[row] > tmp_max ? qk_max_data[row] : tmp_max;
+              if (tmp_max == -std::numeric_limits<accum_t>::infinity()) {
+                // No visible key for the row yet, it adds nothing to dst
+                torch_ipex::cpu::kernel::fill_stub(
+                    qk_reduced_data +
+                        row *
+                            ((kvBlockSize % 2) != 0 ? 1 + kvBlockSize
+                                                    : kvBlockSize),
+                    scalar_t(0),
+                    kvBlockSize % 2 == 0 ? kvBlockSize : kvBlockSize + 1);
+                continue;
+              }
               // qk <- exp(qk - max) and sum per row
               tmp_sum = tmp_max;
               _exp_reduce_sum_fusion_kernel(
@@ -1214,6 +1411,21 @@ cpu_flash_attention(
                           ((kvBlockSize % 2) != 0 ? 1 + kvBlockSize
                                                   : kvBlockSize),
                   tmp_sum);
+              // Drop after the row sum, softmax is normalized before dropout
+              if (dropout_p > 0) {
+                _dropout_row(
+                    qk_reduced_data +
+                        row *
+                            ((kvBlockSize % 2) != 0 ? 1 + kvBlockSize
+                                                    : kvBlockSize),
+                    kvBlockSize,
+                    dropout_p,
+                    scalar_t(1),
+                    philox_seed,
+                    philox_offset,
+                    (i * num_head + j) * qSize + m + row,
+                    n);
+              }
               // exp_tmp <- exp(max[row] - max)
               exp_tmp = std::exp(qk_max_data[row] - tmp_max);
               // sum[row] <- sum + exp_tmp * sum[row]
@@ -1221,7 +1433,7 @@ cpu_flash_attention(
               // max[row] <- max
               qk_max_data[row] = tmp_max;
               // dst <- dst * exp_tmp
-              if (n > 0) {
+              if (n > n_start) {
                 at::vec::map<accum_t>(
                     [exp_tmp](Vec x) { return x * Vec(exp_tmp); },
                     dst_data + row * headSize,
@@ -1242,7 +1454,7 @@ cpu_flash_attention(
               int64_t psize = n / kvSplitSize * av_gemm_K;
               if (n + kvSplitSize < kvSize) {
                 // main
-                if (n == 0) {
+                if (n == n_start) {
                   av_gemm(
                       qk_reduced_data,
                       value_reorder_ptr +
@@ -1262,7 +1474,7 @@ cpu_flash_attention(
                 }
               } else if (n + kvSplitSize >= kvSize) {
                 // tail
-                if (n == 0) {
+                if (n == n_start) {
                   av_gemm_tail(
                       qk_reduced_data,
                       value_reorder_ptr +
@@ -1294,21 +1506,32 @@ cpu_flash_attention(
                   vStrideN,
                   qk_reduced_data,
                   kvBlockSize % 2 == 0 ? kvBlockSize : kvBlockSize + 1,
-                  n == 0 ? static_cast<accum_t>(0) : static_cast<accum_t>(1),
+                  n == n_start ? static_cast<accum_t>(0)
+                               : static_cast<accum_t>(1),
                   dst_data,
                   headSize);
             }
           }
-          // dst <- dst / sum[row]
+          // dst <- dst / sum[row] / (1 - dropout_p)
           // reorder MHA output with strides
           for (int64_t row = 0; row < qBlockSize; ++row) {
-            accum_t sum_reciprocal = 1 / qk_sum_data[row];
+            // A row without any visible key outputs 0, its logsumexp is +inf
+            // so that the backward recomputes exp(qk - logsumexp) as 0
+            accum_t sum_reciprocal = 0;
+            accum_t lse = std::numeric_limits<accum_t>::infinity();
+            if (qk_sum_data[row] != 0) {
+              sum_reciprocal =
+                  1 / (qk_sum_data[row] * static_cast<accum_t>(1 - dropout_p));
+              // logsumexp <- max[row] + log(sum[row])
+              lse = qk_max_data[row] + std::log(qk_sum_data[row]);
+            }
             at::vec::map<scalar_t>(
                 [sum_reciprocal](Vec x) { return x * Vec(sum_reciprocal); },
                 out_data + i * oStrideB + j * oStrideH + m * oStrideM +
                     row * oStrideM,
                 dst_data + row * headSize,
                 headSize);
+            lse_data[i * lStrideB + j * lStrideH + (m + row) * lStrideM] = lse;
           }
           // Move to the next query
           at::native::data_index_step(i, batchSize, j, num_head, k, qSlice);
@@ -1316,6 +1539,565 @@ cpu_flash_attention(
       });
 }
 
+/*
+ *Caculate the gradients of the flash attention SDPA.
+ *The attention weights are recomputed block by block from q, k and the
+ *logsumexp saved by the forward, so memory stays linear in the sequence
+ *length.
+ *@template scalar_t: q/k/v data type
+ *@param grad_q: gradient of query
+ *@param grad_k: gradient of key
+ *@param grad_v: gradient of value
+ *@param grad_out: gradient of output
+ *@param q: query
+ *@param k: key
+ *@param v: value
+ *@param out: output of the forward
+ *@param logsumexp: logsumexp saved by the forward
+ *@param dropout_p: dropout probability
+ *@param is_causal: assume causal attention masking if true
+ *@param attention_mask: additive attention mask
+ *@param window_size_left: sliding window size before the query, -1 for none
+ *@param window_size_right: sliding window size after the query, -1 for none
+ *@param alibi_slopes: ALiBi slopes of shape (Num_heads) or (Batch x Num_heads)
+ *@param scale: scaling factor applied prior to softmax
+ *@param philox_seed: seed of the dropout mask used by the forward
+ *@param philox_offset: offset of the dropout mask used by the forward
+ *@param q_split_size: q block size
+ *@param kv_split_size: kv block size
+ */
+template <typename scalar_t>
+void cpu_flash_attention_backward(
+    const at::Tensor& grad_q,
+    const at::Tensor& grad_k,
+    const at::Tensor& grad_v,
+    const at::Tensor& grad_out,
+    const at::Tensor& q,
+    const at::Tensor& k,
+    const at::Tensor& v,
+    const at::Tensor& out,
+    const at::Tensor& logsumexp,
+    double dropout_p,
+    bool is_causal,
+    c10::optional<at::Tensor> attention_mask,
+    int64_t window_size_left,
+    int64_t window_size_right,
+    c10::optional<at::Tensor> alibi_slopes,
+    c10::optional<double> scale,
+    int64_t philox_seed,
+    int64_t philox_offset,
+    int64_t q_split_size,
+    int64_t kv_split_size) {
+  // Query (Batch x Num_heads  x Q_seq_len  x Dim_per_head)
+  //    -> (Batch x Q_seq_len  x Num_heads  x Dim_per_head)
+  // Key   (Batch x Num_heads  x KV_seq_len x Dim_per_head)
+  //    -> (Batch x KV_seq_len x Num_heads  x Dim_per_head)
+  // Value (Batch x Num_heads  x KV_seq_len x Dim_per_head)
+  //    -> (Batch x KV_seq_len x Num_heads  x Dim_per_head)
+  // grad_q/grad_k/grad_v are already (Batch x Seq_len x Num_heads x Dim)
+  at::Tensor query = q.transpose(1, 2);
+  at::Tensor key = k.transpose(1, 2);
+  at::Tensor value = v.transpose(1, 2);
+  at::Tensor grad_output = grad_out.transpose(1, 2);
+  at::Tensor output = out.transpose(1, 2);
+
+  using accum_t = at::opmath_type<scalar_t>;
+  using Vec = at::vec::Vectorized<accum_t>;
+  accum_t scaling_factor = calculate_scale(query, scale).as_float_unchecked();
+  accum_t keep_scale = 1 / static_cast<accum_t>(1 - dropout_p);
+  const auto accumulate_dtype = at::toOpMathType(query.scalar_type());
+  if (attention_mask.has_value()) {
+    attention_mask.value() = attention_mask.value().to(accumulate_dtype);
+  }
+  // Causal attention is a sliding window without keys on the right
+  if (is_causal) {
+    window_size_right = 0;
+  }
+
+  // Sizes
+  int64_t batchSize = query.size(0);
+  int64_t qSize = query.size(1);
+  int64_t kvSize = value.size(1);
+  int64_t num_head = query.size(2);
+  int64_t headSize = query.size(3);
+
+  // Strides
+  int64_t qStrideB = query.stride(0);
+  int64_t qStrideM = query.stride(1);
+  int64_t qStrideH = query.stride(2);
+  int64_t kStrideB = key.stride(0);
+  int64_t kStrideN = key.stride(1);
+  int64_t kStrideH = key.stride(2);
+  int64_t vStrideB = value.stride(0);
+  int64_t vStrideN = value.stride(1);
+  int64_t vStrideH = value.stride(2);
+  int64_t oStrideB = output.stride(0);
+  int64_t oStrideM = output.stride(1);
+  int64_t oStrideH = output.stride(2);
+  int64_t goStrideB = grad_output.stride(0);
+  int64_t goStrideM = grad_output.stride(1);
+  int64_t goStrideH = grad_output.stride(2);
+  int64_t gqStrideB = grad_q.stride(0);
+  int64_t gqStrideM = grad_q.stride(1);
+  int64_t gqStrideH = grad_q.stride(2);
+  int64_t gkStrideB = grad_k.stride(0);
+  int64_t gkStrideN = grad_k.stride(1);
+  int64_t gkStrideH = grad_k.stride(2);
+  int64_t gvStrideB = grad_v.stride(0);
+  int64_t gvStrideN = grad_v.stride(1);
+  int64_t gvStrideH = grad_v.stride(2);
+  // logsumexp (Batch x Num_heads x Q_seq_len)
+  int64_t lStrideB = logsumexp.stride(0);
+  int64_t lStrideH = logsumexp.stride(1);
+  int64_t lStrideM = logsumexp.stride(2);
+  int64_t mStrideB =
+      (attention_mask.has_value() && attention_mask.value().size(0) > 1)
+      ? attention_mask.value().stride(0)
+      : 0;
+  int64_t mStrideH =
+      (attention_mask.has_value() && attention_mask.value().size(1) > 1)
+      ? attention_mask.value().stride(1)
+      : 0;
+  int64_t mStrideM =
+      attention_mask.has_value() ? attention_mask.value().stride(2) : 0;
+  // ALiBi slopes (Batch x Num_heads) or (Num_heads)
+  int64_t aStrideB = 0;
+  if (alibi_slopes.has_value()) {
+    alibi_slopes.value() =
+        alibi_slopes.value().to(accumulate_dtype).contiguous();
+    aStrideB =
+        alibi_slopes.value().dim() == 2 ? alibi_slopes.value().stride(0) : 0;
+  }
+
+  int64_t qSplitSize = q_split_size > qSize ? qSize : q_split_size;
+  int64_t kvSplitSize = kv_split_size > kvSize ? kvSize : kv_split_size;
+  int64_t num_thread = at::get_num_threads();
+
+  // allocate per thread temp buf (accumulate type)
+  int64_t size_per_thread =
+      /* attn      */ qSplitSize * kvSplitSize +
+      /* grad_attn */ qSplitSize * kvSplitSize +
+      /* grad_q    */ qSplitSize * headSize +
+      /* dsum      */ qSplitSize +
+      /* grad_k    */ kvSize * headSize +
+      /* grad_v    */ kvSize * headSize;
+
+  at::Tensor buf = at::empty(
+      {num_thread, size_per_thread}, query.options().dtype(accumulate_dtype));
+  // attn and grad_attn are converted back to BF16 before the gemms with
+  // BF16 operands
+  constexpr bool is_reduced_type = is_reduced_floating_point_v<scalar_t>;
+  at::Tensor buf_reduced = at::empty(
+      {num_thread, is_reduced_type ? 2 * qSplitSize * kvSplitSize : 0},
+      query.options());
+  // Data ptrs
+  scalar_t* q_data = query.data_ptr<scalar_t>();
+  scalar_t* k_data = key.data_ptr<scalar_t>();
+  scalar_t* v_data = value.data_ptr<scalar_t>();
+  scalar_t* out_data = output.data_ptr<scalar_t>();
+  scalar_t* grad_out_data = grad_output.data_ptr<scalar_t>();
+  scalar_t* grad_q_data = grad_q.data_ptr<scalar_t>();
+  scalar_t* grad_k_data = grad_k.data_ptr<scalar_t>();
+  scalar_t* grad_v_data = grad_v.data_ptr<scalar_t>();
+  accum_t* lse_data = logsumexp.data_ptr<accum_t>();
+  accum_t* mask_data = attention_mask.has_value()
+      ? attention_mask.value().data_ptr<accum_t>()
+      : nullptr;
+  accum_t* alibi_data = alibi_slopes.has_value()
+      ? alibi_slopes.value().data_ptr<accum_t>()
+      : nullptr;
+  accum_t* buf_data = buf.data_ptr<accum_t>();
+  scalar_t* buf_reduced_data =
+      is_reduced_type ? buf_reduced.data_ptr<scalar_t>() : nullptr;
+
+  at::parallel_for(
+      0, batchSize * num_head, 1, [&](int64_t begin, int64_t end) {
+        int64_t i = 0, j = 0;
+        at::native::data_index_init(begin, i, batchSize, j, num_head);
+        int ompIdx = at::get_thread_num();
+        accum_t* buf_ptr = buf_data + ompIdx * size_per_thread;
+        accum_t* attn_data = buf_ptr;
+        accum_t* grad_attn_data = attn_data + qSplitSize * kvSplitSize;
+        accum_t* grad_q_acc = grad_attn_data + qSplitSize * kvSplitSize;
+        accum_t* dsum_data = grad_q_acc + qSplitSize * headSize;
+        accum_t* grad_k_acc = dsum_data + qSplitSize;
+        accum_t* grad_v_acc = grad_k_acc + kvSize * headSize;
+        scalar_t* attn_reduced_data = is_reduced_type
+            ? buf_reduced_data + ompIdx * 2 * qSplitSize * kvSplitSize
+            : nullptr;
+        scalar_t* grad_attn_reduced_data = is_reduced_type
+            ? attn_reduced_data + qSplitSize * kvSplitSize
+            : nullptr;
+
+        for (const auto z : c10::irange(begin, end)) {
+          (void)z; // Suppress unused variable
+          scalar_t* q_ptr = q_data + i * qStrideB + j * qStrideH;
+          scalar_t* k_ptr = k_data + i * kStrideB + j * kStrideH;
+          scalar_t* v_ptr = v_data + i * vStrideB + j * vStrideH;
+          scalar_t* out_ptr = out_data + i * oStrideB + j * oStrideH;
+          scalar_t* grad_out_ptr =
+              grad_out_data + i * goStrideB + j * goStrideH;
+          accum_t* lse_ptr = lse_data + i * lStrideB + j * lStrideH;
+          accum_t alibi_slope =
+              alibi_data != nullptr ? alibi_data[i * aStrideB + j] : 0;
+          torch_ipex::cpu::kernel::fill_stub(
+              grad_k_acc, static_cast<accum_t>(0), kvSize * headSize);
+          torch_ipex::cpu::kernel::fill_stub(
+              grad_v_acc, static_cast<accum_t>(0), kvSize * headSize);
+
+          for (int64_t m = 0; m < qSize; m += qSplitSize) {
+            int64_t qBlockSize = std::min(qSplitSize, qSize - m);
+            // dsum <- sum(grad_out * out) per row
+            for (int64_t row = 0; row < qBlockSize; ++row) {
+              dsum_data[row] = at::vec::map2_reduce_all<scalar_t>(
+                  [](Vec x, Vec y) { return x * y; },
+                  [](Vec x, Vec y) { return x + y; },
+                  grad_out_ptr + (m + row) * goStrideM,
+                  out_ptr + (m + row) * oStrideM,
+                  headSize);
+            }
+            int64_t kv_start = 0, kv_end = kvSize;
+            _window_kv_range(
+                m,
+                qBlockSize,
+                kvSize,
+                window_size_left,
+                window_size_right,
+                kv_start,
+                kv_end);
+            // Start at the first kv block inside the sliding window
+            int64_t n_start = kv_start / kvSplitSize * kvSplitSize;
+            if (n_start >= kv_end) {
+              torch_ipex::cpu::kernel::fill_stub(
+                  grad_q_acc, static_cast<accum_t>(0), qBlockSize * headSize);
+            }
+            for (int64_t n = n_start; n < kv_end; n += kvSplitSize) {
+              int64_t kvBlockSize = std::min(kvSplitSize, kvSize - n);
+              bool window_masked = _window_block_is_masked(
+                  m,
+                  qBlockSize,
+                  n,
+                  kvBlockSize,
+                  window_size_left,
+                  window_size_right);
+              // Recompute q @ k.T
+              _mkl_gemm(
+                  CblasRowMajor,
+                  CblasNoTrans,
+                  CblasTrans,
+                  qBlockSize,
+                  kvBlockSize,
+                  headSize,
+                  static_cast<accum_t>(1),
+                  q_ptr + m * qStrideM,
+                  qStrideM,
+                  k_ptr + n * kStrideN,
+                  kStrideN,
+                  static_cast<accum_t>(0),
+                  attn_data,
+                  kvBlockSize);
+              // attn <- exp(scale * qk + alibi + mask - logsumexp)
+              for (int64_t row = 0; row < qBlockSize; ++row) {
+                accum_t* row_ptr = attn_data + row * kvBlockSize;
+                accum_t lse = lse_ptr[(m + row) * lStrideM];
+                accum_t qk_scale = scaling_factor;
+                if (alibi_data != nullptr) {
+                  _alibi_bias_row(
+                      row_ptr,
+                      kvBlockSize,
+                      m + row,
+                      n,
+                      scaling_factor,
+                      alibi_slope);
+                  qk_scale = 1;
+                }
+                if (attention_mask.has_value()) {
+                  at::vec::map2<accum_t>(
+                      [qk_scale, lse](Vec x, Vec y) {
+                        return exp_u20(x * Vec(qk_scale) + y - Vec(lse));
+                      },
+                      row_ptr,
+                      row_ptr,
+                      mask_data + i * mStrideB + j * mStrideH +
+                          (m + row) * mStrideM + n,
+                      kvBlockSize);
+                } else {
+                  at::vec::map<accum_t>(
+                      [qk_scale, lse](Vec x) {
+                        return exp_u20(x * Vec(qk_scale) - Vec(lse));
+                      },
+                      row_ptr,
+                      row_ptr,
+                      kvBlockSize);
+                }
+                // Apply sliding window and causal mask, fill unused with 0
+                if (window_masked) {
+                  _window_mask_row(
+                      row_ptr,
+                      kvBlockSize,
+                      m + row,
+                      n,
+                      window_size_left,
+                      window_size_right,
+                      static_cast<accum_t>(0));
+                }
+              }
+              // grad_attn <- grad_out @ v.T
+              _mkl_gemm(
+                  CblasRowMajor,
+                  CblasNoTrans,
+                  CblasTrans,
+                  qBlockSize,
+                  kvBlockSize,
+                  headSize,
+                  static_cast<accum_t>(1),
+                  grad_out_ptr + m * goStrideM,
+                  goStrideM,
+                  v_ptr + n * vStrideN,
+                  vStrideN,
+                  static_cast<accum_t>(0),
+                  grad_attn_data,
+                  kvBlockSize);
+              for (int64_t row = 0; row < qBlockSize; ++row) {
+                accum_t* attn_row = attn_data + row * kvBlockSize;
+                accum_t* grad_attn_row = grad_attn_data + row * kvBlockSize;
+                uint64_t row_id = (i * num_head + j) * qSize + m + row;
+                // grad_attn <- dropout(grad_attn) with the forward's mask
+                if (dropout_p > 0) {
+                  _dropout_row(
+                      grad_attn_row,
+                      kvBlockSize,
+                      dropout_p,
+                      keep_scale,
+                      philox_seed,
+                      philox_offset,
+                      row_id,
+                      n);
+                }
+                // grad_attn <- attn * (grad_attn - dsum), the softmax backward
+                accum_t dsum = dsum_data[row];
+                at::vec::map2<accum_t>(
+                    [dsum](Vec x, Vec y) { return y * (x - Vec(dsum)); },
+                    grad_attn_row,
+                    grad_attn_row,
+                    attn_row,
+                    kvBlockSize);
+                // attn <- dropout(attn), as multiplied with v by the forward
+                if (dropout_p > 0) {
+                  _dropout_row(
+                      attn_row,
+                      kvBlockSize,
+                      dropout_p,
+                      keep_scale,
+                      philox_seed,
+                      philox_offset,
+                      row_id,
+                      n);
+                }
+              }
+              if constexpr (is_reduced_type) {
+                at::vec::map<scalar_t>(
+                    [](Vec x) { return x; },
+                    attn_reduced_data,
+                    attn_data,
+                    qBlockSize * kvBlockSize);
+                at::vec::map<scalar_t>(
+                    [](Vec x) { return x; },
+                    grad_attn_reduced_data,
+                    grad_attn_data,
+                    qBlockSize * kvBlockSize);
+              }
+              // grad_v <- grad_v + attn.T @ grad_out
+              _mkl_gemm(
+                  CblasRowMajor,
+                  CblasTrans,
+                  CblasNoTrans,
+                  kvBlockSize,
+                  headSize,
+                  qBlockSize,
+                  static_cast<accum_t>(1),
+                  conditional_data_ptr(attn_data, attn_reduced_data),
+                  kvBlockSize,
+                  grad_out_ptr + m * goStrideM,
+                  goStrideM,
+                  static_cast<accum_t>(1),
+                  grad_v_acc + n * headSize,
+                  headSize);
+              // grad_q <- grad_q + scale * grad_attn @ k
+              _mkl_gemm(
+                  CblasRowMajor,
+                  CblasNoTrans,
+                  CblasNoTrans,
+                  qBlockSize,
+                  headSize,
+                  kvBlockSize,
+                  scaling_factor,
+                  conditional_data_ptr(grad_attn_data, grad_attn_reduced_data),
+                  kvBlockSize,
+                  k_ptr + n * kStrideN,
+                  kStrideN,
+                  n == n_start ? static_cast<accum_t>(0)
+                               : static_cast<accum_t>(1),
+                  grad_q_acc,
+                  headSize);
+              // grad_k <- grad_k + scale * grad_attn.T @ q
+              _mkl_gemm(
+                  CblasRowMajor,
+                  CblasTrans,
+                  CblasNoTrans,
+                  kvBlockSize,
+                  headSize,
+                  qBlockSize,
+                  scaling_factor,
+                  conditional_data_ptr(grad_attn_data, grad_attn_reduced_data),
+                  kvBlockSize,
+                  q_ptr + m * qStrideM,
+                  qStrideM,
+                  static_cast<accum_t>(1),
+                  grad_k_acc + n * headSize,
+                  headSize);
+            }
+            // reorder grad_q with strides
+            for (int64_t row = 0; row < qBlockSize; ++row) {
+              at::vec::map<scalar_t>(
+                  [](Vec x) { return x; },
+                  grad_q_data + i * gqStrideB + j * gqStrideH +
+                      (m + row) * gqStrideM,
+                  grad_q_acc + row * headSize,
+                  headSize);
+            }
+          }
+          // reorder grad_k and grad_v with strides
+          for (int64_t row = 0; row < kvSize; ++row) {
+            at::vec::map<scalar_t>(
+                [](Vec x) { return x; },
+                grad_k_data + i * gkStrideB + j * gkStrideH + row * gkStrideN,
+                grad_k_acc + row * headSize,
+                headSize);
+            at::vec::map<scalar_t>(
+                [](Vec x) { return x; },
+                grad_v_data + i * gvStrideB + j * gvStrideH + row * gvStrideN,
+                grad_v_acc + row * headSize,
+                headSize);
+          }
+          // Move to the next head
+          at::native::data_index_step(i, batchSize, j, num_head);
+        }
+      });
+}
+
+// q/kv block sizes used by the flash attention kernels
+struct FlashAttentionTiles {
+  int64_t q_split_size;
+  int64_t kv_split_size;
+};
+
+// L2 cache size of one core in bytes, the tuned tiles depend on it
+static int64_t flash_attention_l2_size() {
+  static int64_t l2_size = [] {
+    long size = 0;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    return size > 0 ? static_cast<int64_t>(size) : int64_t(1) << 20;
+  }();
+  return l2_size;
+}
+
+/*
+ *Default block sizes, the tiers that used to be hard-coded in the dispatch.
+ */
+static FlashAttentionTiles flash_attention_default_tiles(int64_t qSize) {
+  int64_t q_split = qSize >= 768 ? 256 : (qSize >= 192 ? 64 : 32);
+  return {q_split, 512};
+}
+
+static std::vector<FlashAttentionTiles> flash_attention_tile_candidates(
+    int64_t qSize,
+    int64_t kvSize) {
+  std::vector<FlashAttentionTiles> candidates;
+  for (int64_t q_split : {32, 64, 128, 256}) {
+    for (int64_t kv_split : {128, 256, 512, 1024}) {
+      // Skip blocks that are clamped to the same size as a smaller one
+      if ((q_split > 32 && q_split / 2 >= qSize) ||
+          (kv_split > 128 && kv_split / 2 >= kvSize)) {
+        continue;
+      }
+      candidates.push_back({q_split, kv_split});
+    }
+  }
+  return candidates;
+}
+
+static std::ostream& operator<<(
+    std::ostream& out,
+    const FlashAttentionTiles& tiles) {
+  return out << tiles.q_split_size << " " << tiles.kv_split_size;
+}
+
+static std::istream& operator>>(std::istream& in, FlashAttentionTiles& tiles) {
+  return in >> tiles.q_split_size >> tiles.kv_split_size;
+}
+
+/*
+ *Tile table filled by timing the candidates when FLASH_ATTENTION_AUTOTUNE is
+ *set. The table is kept in FLASH_ATTENTION_TUNE_CACHE so that later runs skip
+ *the tuning.
+ */
+static ShapeTuner<FlashAttentionTiles>& flash_attention_tuner() {
+  static ShapeTuner<FlashAttentionTiles> tuner(
+      env2int("FLASH_ATTENTION_AUTOTUNE", 0) != 0,
+      getenv("FLASH_ATTENTION_TUNE_CACHE"));
+  return tuner;
+}
+
+/*
+ *Runs the kernel with the block sizes of the tile table, tuning them first
+ *if the shape is not in the table yet.
+ *@param is_backward: whether run is the backward kernel
+ *@param query: query (Batch x Num_heads x Q_seq_len x Dim_per_head)
+ *@param key: key (Batch x Num_heads x KV_seq_len x Dim_per_head)
+ *@param run: runs the kernel with the given block sizes
+ */
+template <typename F>
+void flash_attention_run_tuned(
+    bool is_backward,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const F& run) {
+  int64_t qSize = query.size(2);
+  int64_t kvSize = key.size(2);
+  int64_t headSize = query.size(3);
+  auto tiles = flash_attention_default_tiles(qSize);
+  auto& tuner = flash_attention_tuner();
+  if (!tuner.active()) {
+    run(tiles);
+    return;
+  }
+
+  // Sequence lengths are bucketed to the next power of 2 so that prompts of
+  // similar length share a tuning result
+  auto bucket = [](int64_t size) {
+    int64_t size_bucket = 32;
+    while (size_bucket < size) {
+      size_bucket *= 2;
+    }
+    return size_bucket;
+  };
+  std::ostringstream table_key;
+  table_key << (is_backward ? "bwd" : "fwd") << "_" << query.scalar_type()
+            << "_" << bucket(qSize) << "_" << bucket(kvSize) << "_"
+            << headSize << "_" << at::get_num_threads() << "_"
+            << flash_attention_l2_size() / 1024;
+  // Every run overwrites all the outputs, so the candidates run in place
+  tiles = tuner.get(
+      table_key.str(),
+      tiles,
+      [&]() { return flash_attention_tile_candidates(qSize, kvSize); },
+      run);
+  run(tiles);
+}
+
 void flash_attention_kernel_impl(
     const at::Tensor& output,
     const at::Tensor& logsumexp,
@@ -1325,24 +2107,16 @@ void flash_attention_kernel_impl(
     double dropout_p,
     bool is_causal,
     c10::optional<at::Tensor> attention_mask,
-    c10::optional<double> scale) {
-  auto q_seq_len = query.size(2);
-
+    int64_t window_size_left,
+    int64_t window_size_right,
+    c10::optional<at::Tensor> alibi_slopes,
+    c10::optional<double> scale,
+    int64_t philox_seed,
+    int64_t philox_offset) {
   AT_DISPATCH_FLOATING_TYPES_AND2(
       kBFloat16, kHalf, query.scalar_type(), "flash_attention", [&] {
-        if (q_seq_len >= 768) {
-          cpu_flash_attention<scalar_t, 256, 512>(
-              output,
-              logsumexp,
-              query,
-              key,
-              value,
-              dropout_p,
-              is_causal,
-              attention_mask,
-              scale);
-        } else if (q_seq_len >= 192) {
-          cpu_flash_attention<scalar_t, 64, 512>(
+        auto run = [&](const FlashAttentionTiles& tiles) {
+          cpu_flash_attention<scalar_t>(
               output,
               logsumexp,
               query,
@@ -1351,19 +2125,16 @@ void flash_attention_kernel_impl(
               dropout_p,
               is_causal,
               attention_mask,
-              scale);
-        } else {
-          cpu_flash_attention<scalar_t, 32, 512>(
-              output,
-              logsumexp,
-              query,
-              key,
-              value,
-              dropout_p,
-              is_causal,
-              attention_mask,
-              scale);
-        }
+              window_size_left,
+              window_size_right,
+              alibi_slopes,
+              scale,
+              philox_seed,
+              philox_offset,
+              tiles.q_split_size,
+              tiles.kv_split_size);
+        };
+        flash_attention_run_tuned(/* is_backward */ false, query, key, run);
       });
 }
 
@@ -1374,7 +2145,12 @@ std::tuple<at::Tensor, at::Tensor> flash_attention_kernel(
     double dropout_p,
     bool is_causal,
     c10::optional<at::Tensor> attention_mask,
-    c10::optional<double> scale) {
+    int64_t window_size_left,
+    int64_t window_size_right,
+    c10::optional<at::Tensor> alibi_slopes,
+    c10::optional<double> scale,
+    int64_t philox_seed,
+    int64_t philox_offset) {
   RECORD_FUNCTION(
       "torch_ipex::flash_attention_kernel", c10::ArrayRef<c10::IValue>({}));
 
@@ -1401,8 +2177,19 @@ std::tuple<at::Tensor, at::Tensor> flash_attention_kernel(
       query.dim() == 4 && key.dim() == 4 && value.dim() == 4,
       "IPEX flash_attention: Accept only 4 dims inputs shape of {B, H, T, K}");
   TORCH_CHECK(
-      dropout_p == 0.0,
-      "IPEX flash_attention: Currently do not support dropout > 0");
+      dropout_p >= 0.0 && dropout_p < 1.0,
+      "IPEX flash_attention: Dropout probability should be in [0, 1)");
+  TORCH_CHECK(
+      window_size_left >= -1 && window_size_right >= -1,
+      "IPEX flash_attention: Window sizes should be non-negative or -1 for unbounded");
+  TORCH_CHECK(
+      !alibi_slopes.has_value() ||
+          (c10::isFloatingType(alibi_slopes.value().scalar_type()) &&
+           alibi_slopes.value().size(-1) == query.size(1) &&
+           (alibi_slopes.value().dim() == 1 ||
+            (alibi_slopes.value().dim() == 2 &&
+             alibi_slopes.value().size(0) == query.size(0)))),
+      "IPEX flash_attention: ALiBi slopes should be floating point of shape {H} or {B, H}");
   TORCH_CHECK(
       (query.size(3) == value.size(3)) && (key.size(3) == value.size(3)),
       "IPEX flash_attention: Q/K/V should have the same head size");
@@ -1428,16 +2215,233 @@ std::tuple<at::Tensor, at::Tensor> flash_attention_kernel(
       dropout_p,
       is_causal,
       attention_mask,
-      scale);
+      window_size_left,
+      window_size_right,
+      alibi_slopes,
+      scale,
+      philox_seed,
+      philox_offset);
 
   output = output.transpose(1, 2);
   logsumexp = logsumexp.transpose(1, 2);
 
   return std::make_tuple(std::move(output), std::move(logsumexp));
 }
+
+void flash_attention_backward_kernel_impl(
+    const at::Tensor& grad_q,
+    const at::Tensor& grad_k,
+    const at::Tensor& grad_v,
+    const at::Tensor& grad_out,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& out,
+    const at::Tensor& logsumexp,
+    double dropout_p,
+    bool is_causal,
+    c10::optional<at::Tensor> attention_mask,
+    int64_t window_size_left,
+    int64_t window_size_right,
+    c10::optional<at::Tensor> alibi_slopes,
+    c10::optional<double> scale,
+    int64_t philox_seed,
+    int64_t philox_offset) {
+  AT_DISPATCH_FLOATING_TYPES_AND(
+      kBFloat16, query.scalar_type(), "flash_attention_backward", [&] {
+        auto run = [&](const FlashAttentionTiles& tiles) {
+          cpu_flash_attention_backward<scalar_t>(
+              grad_q,
+              grad_k,
+              grad_v,
+              grad_out,
+              query,
+              key,
+              value,
+              out,
+              logsumexp,
+              dropout_p,
+              is_causal,
+              attention_mask,
+              window_size_left,
+              window_size_right,
+              alibi_slopes,
+              scale,
+              philox_seed,
+              philox_offset,
+              tiles.q_split_size,
+              tiles.kv_split_size);
+        };
+        flash_attention_run_tuned(/* is_backward */ true, query, key, run);
+      });
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor> flash_attention_backward_kernel(
+    const at::Tensor& grad_out,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& out,
+    const at::Tensor& logsumexp,
+    double dropout_p,
+    bool is_causal,
+    c10::optional<at::Tensor> attention_mask,
+    int64_t window_size_left,
+    int64_t window_size_right,
+    c10::optional<at::Tensor> alibi_slopes,
+    c10::optional<double> scale,
+    int64_t philox_seed,
+    int64_t philox_offset) {
+  RECORD_FUNCTION(
+      "torch_ipex::flash_attention_backward_kernel",
+      c10::ArrayRef<c10::IValue>({}));
+
+  if (!grad_out.defined()) {
+    return std::make_tuple(at::Tensor(), at::Tensor(), at::Tensor());
+  }
+  // grad_out may be expanded, e.g. from out.sum().backward()
+  if (grad_out.stride(-1) != 1) {
+    return flash_attention_backward_kernel(
+        grad_out.contiguous(),
+        query,
+        key,
+        value,
+        out,
+        logsumexp,
+        dropout_p,
+        is_causal,
+        attention_mask,
+        window_size_left,
+        window_size_right,
+        alibi_slopes,
+        scale,
+        philox_seed,
+        philox_offset);
+  }
+  const auto dtype = query.scalar_type();
+  TORCH_CHECK(
+      c10::isFloatingType(dtype),
+      "IPEX flash_attention_backward: Expected data type in FP32, FP64, BF16, FP16, but got ",
+      dtype,
+      " instead.");
+  TORCH_CHECK(
+      dtype == key.scalar_type() && dtype == value.scalar_type() &&
+          dtype == out.scalar_type() && dtype == grad_out.scalar_type(),
+      "IPEX flash_attention_backward: Q/K/V/Out/Grad_out should have the same data type");
+  TORCH_CHECK(
+      logsumexp.scalar_type() == at::toOpMathType(dtype),
+      "IPEX flash_attention_backward: Logsumexp should be in the accumulate type of Q/K/V");
+  TORCH_CHECK(
+      query.dim() == 4 && key.dim() == 4 && value.dim() == 4 &&
+          out.dim() == 4 && grad_out.dim() == 4,
+      "IPEX flash_attention_backward: Accept only 4 dims inputs shape of {B, H, T, K}");
+  TORCH_CHECK(
+      dropout_p >= 0.0 && dropout_p < 1.0,
+      "IPEX flash_attention_backward: Dropout probability should be in [0, 1)");
+  TORCH_CHECK(
+      window_size_left >= -1 && window_size_right >= -1,
+      "IPEX flash_attention_backward: Window sizes should be non-negative or -1 for unbounded");
+  TORCH_CHECK(
+      !alibi_slopes.has_value() ||
+          (c10::isFloatingType(alibi_slopes.value().scalar_type()) &&
+           alibi_slopes.value().size(-1) == query.size(1) &&
+           (alibi_slopes.value().dim() == 1 ||
+            (alibi_slopes.value().dim() == 2 &&
+             alibi_slopes.value().size(0) == query.size(0)))),
+      "IPEX flash_attention_backward: ALiBi slopes should be floating point of shape {H} or {B, H}");
+  TORCH_CHECK(
+      (query.size(3) == value.size(3)) && (key.size(3) == value.size(3)),
+      "IPEX flash_attention_backward: Q/K/V should have the same head size");
+  TORCH_CHECK(
+      (query.stride(-1) == 1) && (key.stride(-1) == 1) &&
+          (value.stride(-1) == 1) && (out.stride(-1) == 1) &&
+          (!attention_mask.has_value() ||
+           attention_mask.value().stride(-1) == 1),
+      "IPEX flash_attention_backward: Q/K/V/Out/Mask should be continuous on the last dim");
+
+  // The gemms are done by MKL, which has no FP16 gemm, so FP16 is computed
+  // in FP32. The extra copies are linear in the sequence length.
+  if (dtype == at::kHalf) {
+    auto attention_mask_fp32 = attention_mask;
+    if (attention_mask.has_value() &&
+        attention_mask.value().scalar_type() != ScalarType::Bool) {
+      attention_mask_fp32 = attention_mask.value().to(at::kFloat);
+    }
+    auto grads = flash_attention_backward_kernel(
+        grad_out.to(at::kFloat),
+        query.to(at::kFloat),
+        key.to(at::kFloat),
+        value.to(at::kFloat),
+        out.to(at::kFloat),
+        logsumexp,
+        dropout_p,
+        is_causal,
+        attention_mask_fp32,
+        window_size_left,
+        window_size_right,
+        alibi_slopes,
+        scale,
+        philox_seed,
+        philox_offset);
+    return std::make_tuple(
+        std::get<0>(grads).to(dtype),
+        std::get<1>(grads).to(dtype),
+        std::get<2>(grads).to(dtype));
+  }
+
+  // qk <- attn_mask ? qk : -inf, expressed as an additive mask
+  if (attention_mask.has_value() &&
+      attention_mask.value().scalar_type() == ScalarType::Bool) {
+    attention_mask = at::zeros_like(
+                         attention_mask.value(),
+                         attention_mask.value().options().dtype(
+                             at::toOpMathType(dtype)))
+                         .masked_fill_(
+                             attention_mask.value().logical_not(),
+                             -std::numeric_limits<double>::infinity());
+  }
+
+  int64_t batchSize = query.size(0);
+  int64_t qSize = query.size(2);
+  int64_t kvSize = key.size(2);
+  int64_t num_head = query.size(1);
+  int64_t headSize = query.size(3);
+  at::Tensor grad_q =
+      at::empty({batchSize, qSize, num_head, headSize}, query.options());
+  at::Tensor grad_k =
+      at::empty({batchSize, kvSize, num_head, headSize}, key.options());
+  at::Tensor grad_v =
+      at::empty({batchSize, kvSize, num_head, headSize}, value.options());
+
+  flash_attention_backward_kernel_impl(
+      grad_q,
+      grad_k,
+      grad_v,
+      grad_out,
+      query,
+      key,
+      value,
+      out,
+      logsumexp,
+      dropout_p,
+      is_causal,
+      attention_mask,
+      window_size_left,
+      window_size_right,
+      alibi_slopes,
+      scale,
+      philox_seed,
+      philox_offset);
+
+  return std::make_tuple(
+      grad_q.transpose(1, 2), grad_k.transpose(1, 2), grad_v.transpose(1, 2));
+}
 } // anonymous namespace
 
 IPEX_REGISTER_DISPATCH(flash_attention_kernel_stub, &flash_attention_kernel);
+IPEX_REGISTER_DISPATCH(
+    flash_attention_backward_kernel_stub,
+    &flash_attention_backward_kernel);
 
 } // namespace cpu
 } // namespace torch_ipex
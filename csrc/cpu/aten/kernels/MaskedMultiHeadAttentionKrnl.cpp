@@ -4,7 +4,18 @@
 #include <torch/all.h>
 #include <torch/csrc/autograd/function.h>
 #include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "csrc/cpu/aten/utils/kv_split.h"
+#include "csrc/cpu/aten/utils/mkl_gemm.h"
+#include "csrc/cpu/tpp/utils.h"
 #include "vec/vec.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 namespace torch_ipex {
 namespace cpu {
@@ -470,25 +481,188 @@ void copy_key_value(
   auto key_ptr = key.data_ptr<T>();
   auto value_cache_ptr = value_cache.data_ptr<T>();
   auto value_ptr = value.data_ptr<T>();
-  auto token_stride = beam_batch * hidden_size;
   auto beam_size = beam_batch / bs;
-#pragma omp parallel for collapse(2)
+#pragma omp parallel for collapse(3)
   for (auto si = 0; si < seq_len; si++) {
     for (auto bi = 0; bi < bs; bi++) {
-      auto cache_stride = si * token_stride + bi * beam_size * hidden_size;
-      auto state_stride = (bi * seq_len + si) * hidden_size;
-      auto key_cache_start = key_cache_ptr + cache_stride;
-      auto key_ptr_start = key_ptr + state_stride;
-      torch_ipex::cpu::kernel::move_ker<T, T>(
-          key_cache_start, key_ptr_start, hidden_size);
-      auto value_cache_ptr_start = value_cache_ptr + cache_stride;
-      auto value_ptr_start = value_ptr + state_stride;
-      torch_ipex::cpu::kernel::move_ker<T, T>(
-          value_cache_ptr_start, value_ptr_start, hidden_size);
+      for (auto hi = 0; hi < head_num; hi++) {
+        auto state_stride = (bi * seq_len + si) * hidden_size + hi * head_size;
+        auto key_cache_start = key_cache_ptr + si * key_cache.stride(0) +
+            bi * beam_size * key_cache.stride(1) + hi * key_cache.stride(2);
+        auto key_ptr_start = key_ptr + state_stride;
+        torch_ipex::cpu::kernel::move_ker<T, T>(
+            key_cache_start, key_ptr_start, head_size);
+        auto value_cache_ptr_start = value_cache_ptr +
+            si * value_cache.stride(0) +
+            bi * beam_size * value_cache.stride(1) +
+            hi * value_cache.stride(2);
+        auto value_ptr_start = value_ptr + state_stride;
+        torch_ipex::cpu::kernel::move_ker<T, T>(
+            value_cache_ptr_start, value_ptr_start, head_size);
+      }
     }
   }
 }
 
+/*
+ *The beam every past token of every beam comes from, resolved from the beam
+ *history of the indirect access kv cache. The table is laid out as
+ *[offset, beam_batch] int32 and is shared by all the layers of a decode step.
+ */
+struct BeamOriginTable {
+  int64_t offset = 0;
+  int64_t beam_batch = 0;
+  // version of beam_idx the table was resolved with
+  int64_t version = 0;
+  // beam_idx[offset - 1] the table was resolved with
+  std::vector<int64_t> last_beams;
+  std::vector<int32_t> origins;
+  // whether every beam only attends to its own past tokens, e.g. under
+  // greedy search
+  bool identity = false;
+
+  const int32_t* token(int64_t ti) const {
+    return origins.data() + ti * beam_batch;
+  }
+};
+
+/*
+ *The beam origin tables of the beam_idx tensors in use, one per model or
+ *stream. A table is keyed by the storage of its beam_idx and is dropped once
+ *that storage is freed. The weak reference also keeps the address of a freed
+ *storage from being reused by a new beam_idx while the table is kept.
+ */
+class BeamOriginCache {
+ public:
+  static BeamOriginCache& instance() {
+    static BeamOriginCache cache;
+    return cache;
+  }
+
+  std::shared_ptr<const BeamOriginTable> find(const at::Tensor& beam_idx) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(key_of(beam_idx));
+    if (it == entries.end() || it->second.storage.expired()) {
+      return nullptr;
+    }
+    return it->second.table;
+  }
+
+  void insert(
+      const at::Tensor& beam_idx,
+      std::shared_ptr<const BeamOriginTable> table) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = entries.begin(); it != entries.end();) {
+      if (it->second.storage.expired()) {
+        it = entries.erase(it);
+      } else {
+        it++;
+      }
+    }
+    entries[key_of(beam_idx)] = Entry{
+        c10::weak_intrusive_ptr<c10::StorageImpl>(
+            beam_idx.storage().getIntrusivePtr()),
+        std::move(table)};
+  }
+
+  // Inference tensors have no version counter, only the rows are compared
+  static int64_t version_of(const at::Tensor& t) {
+    return t.is_inference() ? 0 : t._version();
+  }
+
+ private:
+  using Key = std::pair<const c10::StorageImpl*, int64_t>;
+  struct Entry {
+    c10::weak_intrusive_ptr<c10::StorageImpl> storage;
+    std::shared_ptr<const BeamOriginTable> table;
+  };
+
+  static Key key_of(const at::Tensor& t) {
+    return {t.storage().unsafeGetStorageImpl(), t.storage_offset()};
+  }
+
+  std::mutex mutex;
+  std::map<Key, Entry> entries;
+};
+
+/*
+ *Get the beam origins of the first offset tokens. The first layer of a decode
+ *step extends the table of the previous step by one token, the other layers
+ *reuse it. Only an unknown history is resolved by walking all of it.
+ */
+std::shared_ptr<const BeamOriginTable> resolve_beam_origins(
+    const at::Tensor& beam_idx,
+    int64_t offset) {
+  auto beam_batch = beam_idx.size(1);
+  auto row_stride = beam_idx.stride(0);
+  auto b_ptr = beam_idx.data_ptr<long>();
+  auto version = BeamOriginCache::version_of(beam_idx);
+  auto row_matches = [&](const BeamOriginTable& table, int64_t ti) {
+    return std::equal(
+        table.last_beams.begin(),
+        table.last_beams.end(),
+        b_ptr + ti * row_stride);
+  };
+  auto& cache = BeamOriginCache::instance();
+  auto cached = cache.find(beam_idx);
+  if (cached && cached->beam_batch == beam_batch) {
+    if (cached->offset == offset && cached->version == version &&
+        row_matches(*cached, offset - 1)) {
+      return cached;
+    }
+  } else {
+    cached.reset();
+  }
+  auto table = std::make_shared<BeamOriginTable>();
+  table->offset = offset;
+  table->beam_batch = beam_batch;
+  table->version = version;
+  table->last_beams.assign(
+      b_ptr + (offset - 1) * row_stride,
+      b_ptr + (offset - 1) * row_stride + beam_batch);
+  table->origins.resize(offset * beam_batch);
+  auto last = table->origins.data() + (offset - 1) * beam_batch;
+  bool identity = true;
+  for (int64_t i = 0; i < beam_batch; i++) {
+    last[i] = table->last_beams[i];
+    identity = identity && last[i] == i;
+  }
+  if (cached && cached->offset == offset - 1 && offset > 1 &&
+      row_matches(*cached, offset - 2)) {
+    // the beam i of this step continues the beam last[i] of the previous one
+    at::parallel_for(0, offset - 1, 64, [&](int64_t begin, int64_t end) {
+      for (int64_t ti = begin; ti < end; ti++) {
+        auto src = cached->token(ti);
+        auto dst = table->origins.data() + ti * beam_batch;
+        for (int64_t i = 0; i < beam_batch; i++) {
+          dst[i] = src[last[i]];
+        }
+      }
+    });
+    identity = identity && cached->identity;
+  } else {
+    // according to the last decoded token to get the target beam for the past
+    // token
+    for (int64_t ti = offset - 2; ti >= 0; ti--) {
+      auto next = table->origins.data() + (ti + 1) * beam_batch;
+      auto dst = table->origins.data() + ti * beam_batch;
+      for (int64_t i = 0; i < beam_batch; i++) {
+        dst[i] = b_ptr[ti * row_stride + next[i]];
+        identity = identity && dst[i] == i;
+      }
+    }
+  }
+  table->identity = identity;
+  cache.insert(beam_idx, table);
+  return table;
+}
+
+// Whether the past tokens in T are multiplied with _mkl_gemm
+template <typename T>
+constexpr bool past_tokens_use_gemm() {
+  return std::is_same<T, float>::value || std::is_same<T, at::BFloat16>::value;
+}
+
 /*
  *The scale-dot product for indirect access kv chache and fuse
  *matmul+div+add+softmax to improve data reuse
@@ -533,7 +707,13 @@ scale_dot_product_for_indirect_access_kv_cache(
   auto group_size = head_num / kv_head;
   auto head_size = query.size(3);
   auto seq_len = offset + cur_len;
-  auto kc_token_stride = beam_batch * kv_head * head_size;
+  // the caches may be token major or head major, see empty_growable_kv_cache
+  auto kc_token_stride = key_cache.stride(0);
+  auto kc_beam_stride = key_cache.stride(1);
+  auto kc_head_stride = key_cache.stride(2);
+  auto vc_token_stride = value_cache.stride(0);
+  auto vc_beam_stride = value_cache.stride(1);
+  auto vc_head_stride = value_cache.stride(2);
   auto attn_weights = at::empty({bs, head_num, cur_len, seq_len}, at::kFloat);
   query = query.contiguous();
   key = key.contiguous();
@@ -553,24 +733,43 @@ scale_dot_product_for_indirect_access_kv_cache(
   auto attn_out_ptr = attn_outs.data_ptr<VT>();
   // torch_ipex::cpu::kernel::zero_ker(attn_out_ptr, attn_outs.numel());
   auto attn_w_ptr = attn_weights.data_ptr<float>();
-  long new_beam_idx[beam_batch][offset + query.size(1) + 1];
-  auto b_ptr = beam_idx.data_ptr<long>();
-  if (offset > 0) {
-    // according to the last decoded token to get the target beam for the past
-    // token
-    for (int i = 0; i < bs; i++) {
-      new_beam_idx[i][offset - 1] = b_ptr[(offset - 1) * bs + i];
-      for (int j = offset - 2; j >= 0;
-           j--) { // for the token of input, the target beam is alwarys 0
-        new_beam_idx[i][j] = b_ptr[j * bs + new_beam_idx[i][j + 1]];
-      }
-    }
-  }
+  auto beam_origins = resolve_beam_origins(beam_idx, offset);
+  // When every beam attends to its own past tokens, the past tokens of a
+  // head are one [offset, head_size] matrix with the token stride of the
+  // cache, which is dense for the head-major layout
+  bool past_gemm = cur_len == 1 && offset > 0 && beam_origins->identity;
+  bool qk_gemm = past_gemm && past_tokens_use_gemm<QT>();
+  bool av_gemm = past_gemm && past_tokens_use_gemm<VT>();
   {
     RECORD_FUNCTION(
         "ipex::iakv_sdp::matmul(query, key)", c10::ArrayRef<c10::IValue>({}));
+    if (qk_gemm) {
+      // the query heads sharing a key head are one [group_size, head_size]
+      // matrix
+#pragma omp parallel for collapse(2)
+      for (auto bi = 0; bi < bs; bi++) {
+        for (auto kv_hi = 0; kv_hi < kv_head; kv_hi++) {
+          auto hi = kv_hi * group_size;
+          _mkl_gemm(
+              CblasRowMajor,
+              CblasNoTrans,
+              CblasTrans,
+              group_size,
+              offset,
+              head_size,
+              1.f,
+              q_ptr + (bi * head_num + hi) * head_size,
+              head_size,
+              k_cache_ptr + bi * kc_beam_stride + kv_hi * kc_head_stride,
+              kc_token_stride,
+              0.f,
+              attn_w_ptr + (bi * head_num + hi) * seq_len,
+              seq_len);
+        }
+      }
+    }
 #pragma omp parallel for collapse(3)
-    for (auto ti = 0; ti < seq_len; ti++) {
+    for (auto ti = qk_gemm ? offset : 0; ti < seq_len; ti++) {
       for (auto bi = 0; bi < bs; bi++) {
         for (auto hi = 0; hi < head_num; hi++) {
           for (auto query_ti = 0; query_ti < cur_len; query_ti++) {
@@ -595,12 +794,12 @@ scale_dot_product_for_indirect_access_kv_cache(
                 auto beam_size = beam_batch / bs;
                 // need to store key accross beam
                 kc_t_beam_start =
-                    kc_t_beam_start + bi * beam_size * kv_head * head_size;
+                    kc_t_beam_start + bi * beam_size * kc_beam_stride;
               } else {
-                kc_t_beam_start = kc_t_beam_start + bi * kv_head * head_size;
+                kc_t_beam_start = kc_t_beam_start + bi * kc_beam_stride;
               }
               auto kc_head_start =
-                  k_cache_ptr + kc_t_beam_start + kv_hi * head_size;
+                  k_cache_ptr + kc_t_beam_start + kv_hi * kc_head_stride;
               auto k_ptr_start = k_ptr +
                   (bi * cur_len + ti - offset) * kv_head * head_size +
                   kv_hi * head_size;
@@ -625,14 +824,14 @@ scale_dot_product_for_indirect_access_kv_cache(
                     nullptr);
               } else {
                 kc_t_beam_start = kc_t_beam_start +
-                    new_beam_idx[bi][ti] * kv_head * head_size;
+                    beam_origins->token(ti)[bi] * kc_beam_stride;
                 if (cur_len > 1) {
                   auto beam_size = beam_batch / bs;
                   kc_t_beam_start =
-                      kc_t_beam_start + bi * beam_size * kv_head * head_size;
+                      kc_t_beam_start + bi * beam_size * kc_beam_stride;
                 }
                 auto kc_head_start =
-                    k_cache_ptr + kc_t_beam_start + kv_hi * head_size;
+                    k_cache_ptr + kc_t_beam_start + kv_hi * kc_head_stride;
                 reduce_head<QT>(
                     q_ptr_start,
                     kc_head_start,
@@ -705,67 +904,82 @@ scale_dot_product_for_indirect_access_kv_cache(
       }
     }
   }
-  auto thread_numbers = omp_get_max_threads();
-  auto private_attn_outs =
-      at::empty({thread_numbers, bs, head_num, cur_len, head_size}, at::kFloat);
-  auto private_attn_out_flag =
-      at::zeros({thread_numbers, bs, head_num}, at::kByte);
-  auto flag_access = private_attn_out_flag.accessor<uint8_t, 3>();
-  auto private_attn_out_ptr = private_attn_outs.data_ptr<float>();
-  // private_attn_outs.numel());
-  auto attn_outs_stride_priv = bs * head_num * cur_len * head_size;
+  // the partial results are sized by the chunks instead of the threads
+  auto split = split_kv_partitions(bs * head_num, seq_len);
+  auto num_chunks = split.num_partitions;
+  auto chunk_size = split.partition_size;
+  auto partial_attn_outs =
+      at::empty({num_chunks, bs, head_num, cur_len, head_size}, at::kFloat);
+  auto partial_attn_out_ptr = partial_attn_outs.data_ptr<float>();
+  auto attn_outs_stride_chunk = bs * head_num * cur_len * head_size;
+  // attention weights of a chunk in VT for the gemm, one row per thread
+  auto av_gemm_weights = av_gemm
+      ? at::empty({omp_get_max_threads(), chunk_size}, value.options())
+      : at::Tensor();
   {
     RECORD_FUNCTION(
         "ipex::iakv_sdp::matmul(attn_w, value)",
         c10::ArrayRef<c10::IValue>({}));
 #pragma omp parallel for collapse(3)
-    for (auto vi = 0; vi < seq_len; vi++) {
-      for (auto bi = 0; bi < bs; bi++) {
-        for (auto hi = 0; hi < head_num; hi++) {
-          auto thread_id = omp_get_thread_num();
+    for (auto bi = 0; bi < bs; bi++) {
+      for (auto hi = 0; hi < head_num; hi++) {
+        for (auto ci = 0; ci < num_chunks; ci++) {
+          auto kv_hi = hi / group_size; // maping the query head to key/value
+                                        // head to support MGA/MQA
+          auto vi_begin = ci * chunk_size;
+          auto vi_end = std::min<int64_t>(vi_begin + chunk_size, seq_len);
           for (auto query_ti = 0; query_ti < cur_len; query_ti++) {
-            auto kv_hi = hi / group_size; // maping the query head to key/value
-                                          // head to support MGA/MQA
             auto attn_w_stride = (bi * head_num + hi) * cur_len * seq_len;
             auto attn_w_query_start =
                 attn_w_ptr + attn_w_stride + query_ti * seq_len;
-            // calculate weighted value and store the result to attn_outs[bs,
-            // head_num, cur_len, head_size]
-            auto attn_out_head_stride = thread_id * attn_outs_stride_priv +
+            // calculate weighted value of the chunk and store the result to
+            // partial_attn_outs[ci, bs, head_num, cur_len, head_size]
+            auto attn_out_head_stride = ci * attn_outs_stride_chunk +
                 (bi * head_num + hi) * cur_len * head_size;
-            auto attn_out_start = private_attn_out_ptr + attn_out_head_stride +
+            auto attn_out_start = partial_attn_out_ptr + attn_out_head_stride +
                 query_ti * head_size;
-
-            auto vc_token_start = vi * kc_token_stride;
-            if (vi == query_ti + offset) { // caculate the attention values
-                                           // for the current token
-              auto vc_t_beam_start = vc_token_start;
-              if (cur_len > 1) { // this may occur for processing the promt
-                auto beam_size = beam_batch / bs;
-                // removed the redundant computation, need to store key accross
-                // beam
-                vc_t_beam_start =
-                    vc_t_beam_start + bi * beam_size * kv_head * head_size;
-              } else {
-                vc_t_beam_start = vc_t_beam_start + bi * kv_head * head_size;
-              }
-              auto v_cache_head_start =
-                  v_cache_ptr + vc_t_beam_start + kv_hi * head_size;
-              auto v_ptr_start = v_ptr +
-                  (bi * cur_len + vi - offset) * kv_head * head_size +
-                  kv_hi * head_size;
-              mul_attenion_weights_and_value_of_head<VT, float>(
-                  attn_w_query_start[vi],
-                  v_ptr_start,
-                  attn_out_start,
+            bool accumulate = false;
+            auto vi_start = vi_begin;
+            if (av_gemm && vi_begin < offset) {
+              vi_start = std::min<int64_t>(vi_end, offset);
+              auto w_ptr = av_gemm_weights.data_ptr<VT>() +
+                  omp_get_thread_num() * chunk_size;
+              torch_ipex::cpu::kernel::move_ker<VT, float>(
+                  w_ptr, attn_w_query_start + vi_begin, vi_start - vi_begin);
+              _mkl_gemm(
+                  CblasRowMajor,
+                  CblasNoTrans,
+                  CblasNoTrans,
+                  1,
                   head_size,
-                  true,
-                  v_cache_head_start,
-                  flag_access[thread_id][bi][hi]);
-            } else if (vi < query_ti + offset) { // caculate attention
-                                                 // values for the past
-                                                 // token
-              if (vi >= offset) {
+                  vi_start - vi_begin,
+                  1.f,
+                  w_ptr,
+                  vi_start - vi_begin,
+                  v_cache_ptr + vi_begin * vc_token_stride +
+                      bi * vc_beam_stride + kv_hi * vc_head_stride,
+                  vc_token_stride,
+                  0.f,
+                  attn_out_start,
+                  head_size);
+              accumulate = true;
+            }
+            for (auto vi = vi_start; vi < vi_end; vi++) {
+              auto vc_token_start = vi * vc_token_stride;
+              if (vi == query_ti + offset) { // caculate the attention values
+                                             // for the current token
+                auto vc_t_beam_start = vc_token_start;
+                if (cur_len > 1) { // this may occur for processing the promt
+                  auto beam_size = beam_batch / bs;
+                  // removed the redundant computation, need to store key
+                  // accross beam
+                  vc_t_beam_start =
+                      vc_t_beam_start + bi * beam_size * vc_beam_stride;
+                } else {
+                  vc_t_beam_start = vc_t_beam_start + bi * vc_beam_stride;
+                }
+                auto v_cache_head_start =
+                    v_cache_ptr + vc_t_beam_start + kv_hi * vc_head_stride;
                 auto v_ptr_start = v_ptr +
                     (bi * cur_len + vi - offset) * kv_head * head_size +
                     kv_hi * head_size;
@@ -774,64 +988,76 @@ scale_dot_product_for_indirect_access_kv_cache(
                     v_ptr_start,
                     attn_out_start,
                     head_size,
-                    false,
-                    nullptr,
-                    flag_access[thread_id][bi][hi]);
-              } else {
-                auto vc_t_beam_start =
-                    vc_token_start + new_beam_idx[bi][vi] * kv_head * head_size;
-                if (cur_len > 1) {
-                  auto beam_size = beam_batch / bs;
-                  vc_t_beam_start =
-                      vc_t_beam_start + bi * beam_size * kv_head * head_size;
-                }
-                auto v_cache_head_start =
-                    v_cache_ptr + vc_t_beam_start + kv_hi * head_size;
-                mul_attenion_weights_and_value_of_head<VT, float>(
-                    attn_w_query_start[vi],
+                    true,
                     v_cache_head_start,
-                    attn_out_start,
-                    head_size,
-                    false,
-                    nullptr,
-                    flag_access[thread_id][bi][hi]);
+                    accumulate);
+              } else if (vi < query_ti + offset) { // caculate attention
+                                                   // values for the past
+                                                   // token
+                if (vi >= offset) {
+                  auto v_ptr_start = v_ptr +
+                      (bi * cur_len + vi - offset) * kv_head * head_size +
+                      kv_hi * head_size;
+                  mul_attenion_weights_and_value_of_head<VT, float>(
+                      attn_w_query_start[vi],
+                      v_ptr_start,
+                      attn_out_start,
+                      head_size,
+                      false,
+                      nullptr,
+                      accumulate);
+                } else {
+                  auto vc_t_beam_start = vc_token_start +
+                      beam_origins->token(vi)[bi] * vc_beam_stride;
+                  if (cur_len > 1) {
+                    auto beam_size = beam_batch / bs;
+                    vc_t_beam_start =
+                        vc_t_beam_start + bi * beam_size * vc_beam_stride;
+                  }
+                  auto v_cache_head_start =
+                      v_cache_ptr + vc_t_beam_start + kv_hi * vc_head_stride;
+                  mul_attenion_weights_and_value_of_head<VT, float>(
+                      attn_w_query_start[vi],
+                      v_cache_head_start,
+                      attn_out_start,
+                      head_size,
+                      false,
+                      nullptr,
+                      accumulate);
+                }
+              } else {
+                continue;
               }
+              accumulate = true;
+            }
+            if (!accumulate) { // no token of the chunk is visible to the query
+              torch_ipex::cpu::kernel::zero_ker(attn_out_start, head_size);
             }
           }
-          if (flag_access[thread_id][bi][hi] == 0)
-            flag_access[thread_id][bi][hi] = 1;
         }
       }
     }
   }
   {
     RECORD_FUNCTION(
-        "ipex::iakv_sdp::reduction_private_result",
+        "ipex::iakv_sdp::reduction_chunk_result",
         c10::ArrayRef<c10::IValue>({}));
 #pragma omp parallel for collapse(3)
     for (auto bi = 0; bi < bs; bi++) {
       for (auto hi = 0; hi < head_num; hi++) {
         for (auto qi = 0; qi < cur_len; qi++) {
-          auto thr0_head_start = private_attn_out_ptr +
+          auto chunk0_head_start = partial_attn_out_ptr +
               (bi * head_num + hi) * cur_len * head_size + qi * head_size;
-          if (flag_access[0][bi][hi] == 0) {
-            torch_ipex::cpu::kernel::zero_ker(thr0_head_start, head_size);
-          }
-          for (auto thread_id = 1; thread_id < thread_numbers; thread_id++) {
-            if (flag_access[thread_id][bi][hi] == 0) {
-              continue;
-            }
-            auto attn_out_head_stride = thread_id * attn_outs_stride_priv +
-                (bi * head_num + hi) * cur_len * head_size;
-            auto private_attn_out_start =
-                private_attn_out_ptr + attn_out_head_stride + qi * head_size;
+          for (auto ci = 1; ci < num_chunks; ci++) {
             torch_ipex::cpu::kernel::add_ker<float, float>(
-                thr0_head_start, private_attn_out_start, head_size);
+                chunk0_head_start,
+                chunk0_head_start + ci * attn_outs_stride_chunk,
+                head_size);
           }
           auto attn_outs_start = attn_out_ptr +
               (bi * head_num + hi) * cur_len * head_size + qi * head_size;
           torch_ipex::cpu::kernel::move_ker<VT, float>(
-              attn_outs_start, thr0_head_start, head_size);
+              attn_outs_start, chunk0_head_start, head_size);
         }
       }
     }
@@ -864,7 +1090,13 @@ scale_dot_product_for_indirect_access_kv_cache_half(
   auto group_size = head_num / kv_head;
   auto head_size = query.size(3);
   auto seq_len = offset + cur_len;
-  auto kc_token_stride = beam_batch * kv_head * head_size;
+  // the caches may be token major or head major, see empty_growable_kv_cache
+  auto kc_token_stride = key_cache.stride(0);
+  auto kc_beam_stride = key_cache.stride(1);
+  auto kc_head_stride = key_cache.stride(2);
+  auto vc_token_stride = value_cache.stride(0);
+  auto vc_beam_stride = value_cache.stride(1);
+  auto vc_head_stride = value_cache.stride(2);
   auto attn_weights =
       at::empty({bs, head_num, cur_len, seq_len}, key.options());
   query = query.contiguous();
@@ -885,19 +1117,7 @@ scale_dot_product_for_indirect_access_kv_cache_half(
   auto attn_out_ptr = attn_outs.data_ptr<at::Half>();
   // torch_ipex::cpu::kernel::zero_ker(attn_out_ptr, attn_outs.numel());
   auto attn_w_ptr = attn_weights.data_ptr<at::Half>();
-  long new_beam_idx[beam_batch][offset + query.size(1) + 1];
-  auto b_ptr = beam_idx.data_ptr<long>();
-  if (offset > 0) {
-    // according to the last decoded token to get the target beam for the past
-    // token
-    for (int i = 0; i < bs; i++) {
-      new_beam_idx[i][offset - 1] = b_ptr[(offset - 1) * bs + i];
-      for (int j = offset - 2; j >= 0;
-           j--) { // for the token of input, the target beam is alwarys 0
-        new_beam_idx[i][j] = b_ptr[j * bs + new_beam_idx[i][j + 1]];
-      }
-    }
-  }
+  auto beam_origins = resolve_beam_origins(beam_idx, offset);
   {
     RECORD_FUNCTION(
         "ipex::iakv_sdp::matmul(query, key)", c10::ArrayRef<c10::IValue>({}));
@@ -927,12 +1147,12 @@ scale_dot_product_for_indirect_access_kv_cache_half(
                 auto beam_size = beam_batch / bs;
                 // need to store key accross beam
                 kc_t_beam_start =
-                    kc_t_beam_start + bi * beam_size * kv_head * head_size;
+                    kc_t_beam_start + bi * beam_size * kc_beam_stride;
               } else {
-                kc_t_beam_start = kc_t_beam_start + bi * kv_head * head_size;
+                kc_t_beam_start = kc_t_beam_start + bi * kc_beam_stride;
               }
               auto kc_head_start =
-                  k_cache_ptr + kc_t_beam_start + kv_hi * head_size;
+                  k_cache_ptr + kc_t_beam_start + kv_hi * kc_head_stride;
               auto k_ptr_start = k_ptr +
                   (bi * cur_len + ti - offset) * kv_head * head_size +
                   kv_hi * head_size;
@@ -957,14 +1177,14 @@ scale_dot_product_for_indirect_access_kv_cache_half(
                     nullptr);
               } else {
                 kc_t_beam_start = kc_t_beam_start +
-                    new_beam_idx[bi][ti] * kv_head * head_size;
+                    beam_origins->token(ti)[bi] * kc_beam_stride;
                 if (cur_len > 1) {
                   auto beam_size = beam_batch / bs;
                   kc_t_beam_start =
-                      kc_t_beam_start + bi * beam_size * kv_head * head_size;
+                      kc_t_beam_start + bi * beam_size * kc_beam_stride;
                 }
                 auto kc_head_start =
-                    k_cache_ptr + kc_t_beam_start + kv_hi * head_size;
+                    k_cache_ptr + kc_t_beam_start + kv_hi * kc_head_stride;
                 reduce_head_half(
                     q_ptr_start,
                     kc_head_start,
@@ -1011,67 +1231,53 @@ scale_dot_product_for_indirect_access_kv_cache_half(
       }
     }
   }
-  auto thread_numbers = omp_get_max_threads();
-  auto private_attn_outs = at::zeros(
-      {thread_numbers, bs, head_num, cur_len, head_size}, key.options());
-  auto private_attn_out_flag =
-      at::zeros({thread_numbers, bs, head_num}, at::kByte);
-  auto flag_access = private_attn_out_flag.accessor<uint8_t, 3>();
-  auto private_attn_out_ptr = private_attn_outs.data_ptr<at::Half>();
-  // private_attn_outs.numel());
-  auto attn_outs_stride_priv = bs * head_num * cur_len * head_size;
+  // the partial results are sized by the chunks instead of the threads
+  auto split = split_kv_partitions(bs * head_num, seq_len);
+  auto num_chunks = split.num_partitions;
+  auto chunk_size = split.partition_size;
+  auto partial_attn_outs =
+      at::empty({num_chunks, bs, head_num, cur_len, head_size}, key.options());
+  auto partial_attn_out_ptr = partial_attn_outs.data_ptr<at::Half>();
+  auto attn_outs_stride_chunk = bs * head_num * cur_len * head_size;
   {
     RECORD_FUNCTION(
         "ipex::iakv_sdp::matmul(attn_w, value)",
         c10::ArrayRef<c10::IValue>({}));
 #pragma omp parallel for collapse(3)
-    for (auto vi = 0; vi < seq_len; vi++) {
-      for (auto bi = 0; bi < bs; bi++) {
-        for (auto hi = 0; hi < head_num; hi++) {
-          auto thread_id = omp_get_thread_num();
+    for (auto bi = 0; bi < bs; bi++) {
+      for (auto hi = 0; hi < head_num; hi++) {
+        for (auto ci = 0; ci < num_chunks; ci++) {
+          auto kv_hi = hi / group_size; // maping the query head to key/value
+                                        // head to support MGA/MQA
+          auto vi_begin = ci * chunk_size;
+          auto vi_end = std::min<int64_t>(vi_begin + chunk_size, seq_len);
           for (auto query_ti = 0; query_ti < cur_len; query_ti++) {
-            auto kv_hi = hi / group_size; // maping the query head to key/value
-                                          // head to support MGA/MQA
             auto attn_w_stride = (bi * head_num + hi) * cur_len * seq_len;
             auto attn_w_query_start =
                 attn_w_ptr + attn_w_stride + query_ti * seq_len;
-            // calculate weighted value and store the result to attn_outs[bs,
-            // head_num, cur_len, head_size]
-            auto attn_out_head_stride = thread_id * attn_outs_stride_priv +
+            // calculate weighted value of the chunk and store the result to
+            // partial_attn_outs[ci, bs, head_num, cur_len, head_size]
+            auto attn_out_head_stride = ci * attn_outs_stride_chunk +
                 (bi * head_num + hi) * cur_len * head_size;
-            auto attn_out_start = private_attn_out_ptr + attn_out_head_stride +
+            auto attn_out_start = partial_attn_out_ptr + attn_out_head_stride +
                 query_ti * head_size;
-
-            auto vc_token_start = vi * kc_token_stride;
-            if (vi == query_ti + offset) { // caculate the attention values
-                                           // for the current token
-              auto vc_t_beam_start = vc_token_start;
-              if (cur_len > 1) { // this may occur for processing the promt
-                auto beam_size = beam_batch / bs;
-                // removed the redundant computation, need to store key accross
-                // beam
-                vc_t_beam_start =
-                    vc_t_beam_start + bi * beam_size * kv_head * head_size;
-              } else {
-                vc_t_beam_start = vc_t_beam_start + bi * kv_head * head_size;
-              }
-              auto v_cache_head_start =
-                  v_cache_ptr + vc_t_beam_start + kv_hi * head_size;
-              auto v_ptr_start = v_ptr +
-                  (bi * cur_len + vi - offset) * kv_head * head_size +
-                  kv_hi * head_size;
-              mul_attenion_weights_and_value_of_head_half(
-                  attn_w_query_start[vi],
-                  v_ptr_start,
-                  attn_out_start,
-                  head_size,
-                  true,
-                  v_cache_head_start,
-                  flag_access[thread_id][bi][hi]);
-            } else if (vi < query_ti + offset) { // caculate attention
-                                                 // values for the past
-                                                 // token
-              if (vi >= offset) {
+            bool accumulate = false;
+            for (auto vi = vi_begin; vi < vi_end; vi++) {
+              auto vc_token_start = vi * vc_token_stride;
+              if (vi == query_ti + offset) { // caculate the attention values
+                                             // for the current token
+                auto vc_t_beam_start = vc_token_start;
+                if (cur_len > 1) { // this may occur for processing the promt
+                  auto beam_size = beam_batch / bs;
+                  // removed the redundant computation, need to store key
+                  // accross beam
+                  vc_t_beam_start =
+                      vc_t_beam_start + bi * beam_size * vc_beam_stride;
+                } else {
+                  vc_t_beam_start = vc_t_beam_start + bi * vc_beam_stride;
+                }
+                auto v_cache_head_start =
+                    v_cache_ptr + vc_t_beam_start + kv_hi * vc_head_stride;
                 auto v_ptr_start = v_ptr +
                     (bi * cur_len + vi - offset) * kv_head * head_size +
                     kv_hi * head_size;
@@ -1080,31 +1286,51 @@ scale_dot_product_for_indirect_access_kv_cache_half(
                     v_ptr_start,
                     attn_out_start,
                     head_size,
-                    false,
-                    nullptr,
-                    flag_access[thread_id][bi][hi]);
-              } else {
-                auto vc_t_beam_start =
-                    vc_token_start + new_beam_idx[bi][vi] * kv_head * head_size;
-                if (cur_len > 1) {
-                  auto beam_size = beam_batch / bs;
-                  vc_t_beam_start =
-                      vc_t_beam_start + bi * beam_size * kv_head * head_size;
-                }
-                auto v_cache_head_start =
-                    v_cache_ptr + vc_t_beam_start + kv_hi * head_size;
-                mul_attenion_weights_and_value_of_head_half(
-                    attn_w_query_start[vi],
+                    true,
                     v_cache_head_start,
-                    attn_out_start,
-                    head_size,
-                    false,
-                    nullptr,
-                    flag_access[thread_id][bi][hi]);
+                    accumulate);
+              } else if (vi < query_ti + offset) { // caculate attention
+                                                   // values for the past
+                                                   // token
+                if (vi >= offset) {
+                  auto v_ptr_start = v_ptr +
+                      (bi * cur_len + vi - offset) * kv_head * head_size +
+                      kv_hi * head_size;
+                  mul_attenion_weights_and_value_of_head_half(
+                      attn_w_query_start[vi],
+                      v_ptr_start,
+                      attn_out_start,
+                      head_size,
+                      false,
+                      nullptr,
+                      accumulate);
+                } else {
+                  auto vc_t_beam_start = vc_token_start +
+                      beam_origins->token(vi)[bi] * vc_beam_stride;
+                  if (cur_len > 1) {
+                    auto beam_size = beam_batch / bs;
+                    vc_t_beam_start =
+                        vc_t_beam_start + bi * beam_size * vc_beam_stride;
+                  }
+                  auto v_cache_head_start =
+                      v_cache_ptr + vc_t_beam_start + kv_hi * vc_head_stride;
+                  mul_attenion_weights_and_value_of_head_half(
+                      attn_w_query_start[vi],
+                      v_cache_head_start,
+                      attn_out_start,
+                      head_size,
+                      false,
+                      nullptr,
+                      accumulate);
+                }
+              } else {
+                continue;
               }
+              accumulate = true;
+            }
+            if (!accumulate) { // no token of the chunk is visible to the query
+              torch_ipex::cpu::kernel::zero_ker(attn_out_start, head_size);
             }
-            if (flag_access[thread_id][bi][hi] == 0)
-              flag_access[thread_id][bi][hi] = 1;
           }
         }
       }
@@ -1112,24 +1338,20 @@ scale_dot_product_for_indirect_access_kv_cache_half(
   }
   {
     RECORD_FUNCTION(
-        "ipex::iakv_sdp::reduction_private_result",
+        "ipex::iakv_sdp::reduction_chunk_result",
         c10::ArrayRef<c10::IValue>({}));
 #pragma omp parallel for collapse(3)
     for (auto bi = 0; bi < bs; bi++) {
       for (auto hi = 0; hi < head_num; hi++) {
         for (auto qi = 0; qi < cur_len; qi++) {
-          for (auto thread_id = 0; thread_id < thread_numbers; thread_id++) {
-            if (flag_access[thread_id][bi][hi] == 0) {
-              continue;
-            }
-            auto attn_out_head_stride = thread_id * attn_outs_stride_priv +
-                (bi * head_num + hi) * cur_len * head_size;
-            auto private_attn_out_start =
-                private_attn_out_ptr + attn_out_head_stride + qi * head_size;
-            auto attn_outs_start = attn_out_ptr +
+          auto attn_outs_start = attn_out_ptr +
+              (bi * head_num + hi) * cur_len * head_size + qi * head_size;
+          for (auto ci = 0; ci < num_chunks; ci++) {
+            auto partial_attn_out_start = partial_attn_out_ptr +
+                ci * attn_outs_stride_chunk +
                 (bi * head_num + hi) * cur_len * head_size + qi * head_size;
             torch_ipex::cpu::kernel::add_ker<at::Half, at::Half>(
-                attn_outs_start, private_attn_out_start, head_size);
+                attn_outs_start, partial_attn_out_start, head_size);
           }
         }
       }
@@ -1319,7 +1541,12 @@ first_token_masked_mha(
         /* dropout */ 0.0,
         /* is_causal*/ false,
         attention_mask,
-        1. / scale_attn));
+        /* window_size_left */ -1,
+        /* window_size_right */ -1,
+        /* alibi_slopes */ c10::nullopt,
+        1. / scale_attn,
+        /* philox_seed */ 0,
+        /* philox_offset */ 0));
   } else {
     key = key.permute({0, 2, 1, 3});
     query = query.permute({0, 2, 1, 3});
@@ -1342,6 +1569,131 @@ first_token_masked_mha(
   return std::make_tuple(
       attn_outputs, attn_weights, key_cache, value_cache, beam_idx);
 }
+// A KV cache reserves address space for kv_cache_reserve_factor times the
+// tokens it is created with, and pages are committed segment by segment as it
+// grows. Growing it in place never copies the cached tokens. The storage only
+// spans the committed pages, so that whole-storage accesses (serialization,
+// share_memory_, storage copies) never touch the reserved ones.
+constexpr int64_t kv_cache_reserve_factor = 16;
+
+/*
+ *Whether the KV caches are allocated head major, i.e. stored as [beam_batch,
+ *head_num, tokens, head_size] so that the past tokens of one head are
+ *contiguous. The caches keep the logical shape [tokens, beam_batch, head_num,
+ *head_size] either way. Enabled by MASKED_MHA_HEAD_MAJOR_KV_CACHE=1.
+ */
+bool kv_cache_head_major() {
+  static bool enabled =
+      tpp::env2int("MASKED_MHA_HEAD_MAJOR_KV_CACHE", 0) != 0;
+  return enabled;
+}
+
+#ifndef _WIN32
+struct ReservedKVCache {
+  void* base;
+  size_t reserved_bytes;
+};
+
+void release_reserved_kv_cache(void* ctx) {
+  auto cache = static_cast<ReservedKVCache*>(ctx);
+  munmap(cache->base, cache->reserved_bytes);
+  delete cache;
+}
+
+size_t kv_cache_page_align(size_t bytes) {
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+  return (bytes + page_size - 1) / page_size * page_size;
+}
+
+// Commits the pages backing the first bytes of a reservation
+bool commit_kv_cache(void* base, size_t bytes) {
+  return mprotect(
+             base, kv_cache_page_align(bytes), PROT_READ | PROT_WRITE) == 0;
+}
+#endif
+
+/*
+ *Allocate a KV cache of shape [tokens, beam_batch, head_num, head_size] which
+ *can grow in place up to reserve_tokens. Fall back to a plain tensor if the
+ *address space can not be reserved. Head major caches are permuted views and
+ *are reallocated on growth.
+ */
+at::Tensor empty_growable_kv_cache(
+    int64_t tokens,
+    int64_t reserve_tokens,
+    int64_t beam_batch,
+    int64_t head_num,
+    int64_t head_size,
+    const at::TensorOptions& options) {
+  if (kv_cache_head_major()) {
+    return at::empty({beam_batch, head_num, tokens, head_size}, options)
+        .permute({2, 0, 1, 3});
+  }
+  std::vector<int64_t> sizes = {tokens, beam_batch, head_num, head_size};
+#ifndef _WIN32
+  std::vector<int64_t> strides = {
+      beam_batch * head_num * head_size, head_num * head_size, head_size, 1};
+  size_t token_bytes = strides[0] * options.dtype().itemsize();
+  size_t reserved_bytes = kv_cache_page_align(reserve_tokens * token_bytes);
+  void* base = mmap(
+      nullptr,
+      reserved_bytes,
+      PROT_NONE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+      -1,
+      0);
+  if (base != MAP_FAILED) {
+    if (commit_kv_cache(base, tokens * token_bytes)) {
+      c10::Storage storage(
+          c10::Storage::use_byte_size_t(),
+          tokens * token_bytes,
+          at::DataPtr(
+              base,
+              new ReservedKVCache{base, reserved_bytes},
+              &release_reserved_kv_cache,
+              at::kCPU),
+          /*allocator*/ nullptr,
+          /*resizable*/ false);
+      return at::empty({0}, options).set_(storage, 0, sizes, strides);
+    }
+    munmap(base, reserved_bytes);
+  }
+#endif
+  return at::empty(sizes, options);
+}
+
+/*
+ *Grow the KV cache to tokens by committing the next segment of its
+ *reservation and extending its storage over it. The returned cache shares
+ *the storage of the input one.
+ *@return false if the cache is not reserved or the reservation is too small,
+ *the cache has to be reallocated then.
+ */
+bool grow_kv_cache_in_place(at::Tensor& cache, int64_t tokens) {
+#ifndef _WIN32
+  auto storage = cache.storage();
+  if (storage.data_ptr().get_deleter() != &release_reserved_kv_cache ||
+      cache.storage_offset() != 0 || !cache.is_contiguous()) {
+    return false;
+  }
+  auto reserved =
+      static_cast<ReservedKVCache*>(storage.data_ptr().get_context());
+  size_t bytes = tokens * cache.stride(0) * cache.element_size();
+  if (bytes > reserved->reserved_bytes ||
+      !commit_kv_cache(storage.data_ptr().get(), bytes)) {
+    return false;
+  }
+  storage.set_nbytes(bytes);
+  auto sizes = cache.sizes().vec();
+  auto strides = cache.strides().vec();
+  sizes[0] = tokens;
+  cache = at::empty({0}, cache.options()).set_(storage, 0, sizes, strides);
+  return true;
+#else
+  return false;
+#endif
+}
+
 std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor, at::Tensor>
 masked_multihead_self_attention_kernel_impl(
     at::Tensor& query,
@@ -1383,10 +1735,19 @@ masked_multihead_self_attention_kernel_impl(
   if (offset == 0) {
     max_positions =
         max_positions > cur_len ? max_positions : max_positions + cur_len;
-    key_cache = at::empty(
-        {max_positions, beam_batch, key.size(2), key.size(3)}, key.options());
-    value_cache = at::empty(
-        {max_positions, beam_batch, value.size(2), value.size(3)},
+    key_cache = empty_growable_kv_cache(
+        max_positions,
+        max_positions * kv_cache_reserve_factor,
+        beam_batch,
+        key.size(2),
+        key.size(3),
+        key.options());
+    value_cache = empty_growable_kv_cache(
+        max_positions,
+        max_positions * kv_cache_reserve_factor,
+        beam_batch,
+        value.size(2),
+        value.size(3),
         value.options());
     beam_idx = at::empty({max_positions, beam_batch}, beam_idx.options());
     auto beam_idx_access = beam_idx.accessor<long, 2>();
@@ -1402,15 +1763,27 @@ masked_multihead_self_attention_kernel_impl(
     }
   } else if (offset > 0 && offset + cur_len > cache_size) {
     auto new_cache_size = cache_size * 2;
-    auto new_key_cache = at::empty(
-        {new_cache_size, beam_batch, key.size(2), key.size(3)}, key.options());
-    auto new_value_cache = at::empty(
-        {new_cache_size, beam_batch, value.size(2), value.size(3)},
-        value.options());
+    while (new_cache_size < offset + cur_len) {
+      new_cache_size *= 2;
+    }
+    // Only caches that were not allocated here, or outgrew their reservation,
+    // are copied
+    for (auto cache : {&key_cache, &value_cache}) {
+      if (!grow_kv_cache_in_place(*cache, new_cache_size)) {
+        auto new_cache = empty_growable_kv_cache(
+            new_cache_size,
+            new_cache_size * kv_cache_reserve_factor,
+            beam_batch,
+            cache->size(2),
+            cache->size(3),
+            cache->options());
+        new_cache.slice(0, 0, cache_size).copy_(*cache);
+        *cache = new_cache;
+      }
+    }
+    // beam_idx only holds one index per token and beam, copying it is cheap
     auto new_beam_idx =
         at::empty({new_cache_size, beam_batch}, beam_idx.options());
-    new_key_cache.slice(0, 0, cache_size).copy_(key_cache);
-    new_value_cache.slice(0, 0, cache_size).copy_(value_cache);
     new_beam_idx.slice(0, 0, cache_size).copy_(beam_idx);
     auto new_beam_idx_access = new_beam_idx.accessor<long, 2>();
     auto beam_idx_access = beam_idx.accessor<long, 2>();
@@ -1419,11 +1792,16 @@ masked_multihead_self_attention_kernel_impl(
         new_beam_idx_access[i][j] = beam_idx_access[0][j];
       }
     }
-    key_cache = new_key_cache;
-    value_cache = new_value_cache;
     beam_idx = new_beam_idx;
   }
   if (offset > 0) {
+    // the kernels follow the strides of the caches except for head_size
+    if (key_cache.stride(3) != 1) {
+      key_cache = key_cache.contiguous();
+    }
+    if (value_cache.stride(3) != 1) {
+      value_cache = value_cache.contiguous();
+    }
     return zero_copy_kv_cache_masked_multihead_self_attention_kernel_impl(
         query,
         key,
@@ -8,7 +8,10 @@
 #include <immintrin.h>
 #include <torch/csrc/autograd/function.h>
 #include <algorithm>
+#include <cstring>
+#include <limits>
 #include "tpp/kernels/TPPGEMMKrnl.h"
+#include "vec/vec.h"
 
 namespace torch_ipex {
 namespace cpu {
@@ -124,6 +127,289 @@ at::Tensor mixtral_moe_woq_kernl_impl(
 
   return output;
 }
+// Sorts the (token, k) pairs of topk_ids by expert with a counting sort.
+// offsets[e]..offsets[e + 1] are the rows of expert e in the sorted order,
+// sorted_pair_ids holds the pair t * top_k + k of every sorted row and
+// token_pos[t * top_k + k] is the sorted row of the pair (t, k).
+void moe_sort_tokens_by_expert(
+    const at::Tensor& topk_ids,
+    int64_t num_experts,
+    std::vector<int64_t>& offsets,
+    std::vector<int64_t>& sorted_pair_ids,
+    std::vector<int64_t>& token_pos) {
+  auto total = topk_ids.numel();
+  auto ids = topk_ids.data_ptr<int64_t>();
+
+  offsets.assign(num_experts + 1, 0);
+  for (int64_t i = 0; i < total; i++) {
+    TORCH_CHECK(
+        ids[i] >= 0 && ids[i] < num_experts,
+        "MoE: expert id ",
+        ids[i],
+        " is out of range [0, ",
+        num_experts,
+        ")");
+    offsets[ids[i] + 1]++;
+  }
+  for (int64_t e = 0; e < num_experts; e++) {
+    offsets[e + 1] += offsets[e];
+  }
+  std::vector<int64_t> next(offsets.begin(), offsets.end() - 1);
+  sorted_pair_ids.resize(total);
+  token_pos.resize(total);
+  for (int64_t i = 0; i < total; i++) {
+    auto pos = next[ids[i]]++;
+    sorted_pair_ids[pos] = i;
+    token_pos[i] = pos;
+  }
+}
+
+template <typename T>
+at::Tensor fused_moe_tpp_kernl_impl_(
+    const at::Tensor& hidden_states,
+    const at::Tensor& topk_ids,
+    const at::Tensor& topk_weights,
+    const std::vector<at::Tensor>& gate_wei,
+    const std::vector<at::Tensor>& up_wei,
+    const std::vector<at::Tensor>& down_wei,
+    bool tpp_fallback) {
+  int64_t num_experts = gate_wei.size();
+  auto C = hidden_states.size(-1);
+  auto hidden = hidden_states.reshape({-1, C}).contiguous();
+  auto num_tokens = hidden.size(0);
+  auto out_sizes = hidden_states.sizes().vec();
+  if (num_tokens == 0) {
+    // Nothing to route, there is no expert output to concatenate
+    out_sizes.back() = tpp_fallback ? down_wei[0].size(0)
+                                    : down_wei[0].size(0) * down_wei[0].size(3);
+    return hidden_states.new_empty(out_sizes);
+  }
+  auto ids = topk_ids.reshape({num_tokens, -1}).to(at::kLong).contiguous();
+  auto weights =
+      topk_weights.reshape({num_tokens, -1}).to(at::kFloat).contiguous();
+  auto top_k = ids.size(1);
+
+  std::vector<int64_t> offsets, sorted_pair_ids, token_pos;
+  moe_sort_tokens_by_expert(
+      ids, num_experts, offsets, sorted_pair_ids, token_pos);
+  auto total = num_tokens * top_k;
+
+  // Gather the tokens into an expert grouped buffer
+  auto sorted_hidden = hidden.new_empty({total, C});
+  auto hidden_ptr = hidden.data_ptr<T>();
+  auto sorted_hidden_ptr = sorted_hidden.data_ptr<T>();
+  at::parallel_for(0, total, 0, [&](int64_t begin, int64_t end) {
+    for (int64_t i = begin; i < end; i++) {
+      std::memcpy(
+          sorted_hidden_ptr + i * C,
+          hidden_ptr + sorted_pair_ids[i] / top_k * C,
+          C * sizeof(T));
+    }
+  });
+
+  at::Tensor expert_out;
+  if (tpp_fallback) {
+    std::vector<at::Tensor> outs;
+    for (int64_t e = 0; e < num_experts; e++) {
+      if (offsets[e + 1] == offsets[e])
+        continue;
+      auto x = sorted_hidden.narrow(0, offsets[e], offsets[e + 1] - offsets[e]);
+      outs.push_back(at::linear(
+          at::silu(at::linear(x, gate_wei[e])) * at::linear(x, up_wei[e]),
+          down_wei[e]));
+    }
+    expert_out = at::cat(outs).to(hidden.scalar_type()).contiguous();
+  } else {
+    auto down_sizes = down_wei[0].sizes();
+    expert_out = hidden.new_empty({total, down_sizes[0] * down_sizes[3]});
+    torch_ipex::tpp::tpp_fused_moe<T>(
+        sorted_hidden, gate_wei, up_wei, down_wei, offsets, expert_out);
+  }
+
+  // Every token reduces its own top_k rows, so the result does not depend on
+  // the thread scheduling as with index_add_
+  auto H = expert_out.size(1);
+  auto output = hidden.new_empty({num_tokens, H});
+  auto expert_out_ptr = expert_out.data_ptr<T>();
+  auto output_ptr = output.data_ptr<T>();
+  auto weights_ptr = weights.data_ptr<float>();
+  at::parallel_for(0, num_tokens, 0, [&](int64_t begin, int64_t end) {
+    std::vector<float> acc(H);
+    for (int64_t t = begin; t < end; t++) {
+      std::fill(acc.begin(), acc.end(), 0.f);
+      for (int64_t k = 0; k < top_k; k++) {
+        auto w = weights_ptr[t * top_k + k];
+        auto src = expert_out_ptr + token_pos[t * top_k + k] * H;
+        for (int64_t h = 0; h < H; h++) {
+          acc[h] += w * static_cast<float>(src[h]);
+        }
+      }
+      for (int64_t h = 0; h < H; h++) {
+        output_ptr[t * H + h] = static_cast<T>(acc[h]);
+      }
+    }
+  });
+
+  out_sizes.back() = H;
+  return output.view(out_sizes);
+}
+
+at::Tensor fused_moe_tpp_kernl_impl(
+    const at::Tensor& hidden_states,
+    const at::Tensor& topk_ids,
+    const at::Tensor& topk_weights,
+    const std::vector<at::Tensor>& gate_wei,
+    const std::vector<at::Tensor>& up_wei,
+    const std::vector<at::Tensor>& down_wei,
+    bool tpp_fallback) {
+  if (hidden_states.scalar_type() == at::kFloat) {
+    return fused_moe_tpp_kernl_impl_<float>(
+        hidden_states,
+        topk_ids,
+        topk_weights,
+        gate_wei,
+        up_wei,
+        down_wei,
+        tpp_fallback);
+  } else if (hidden_states.scalar_type() == at::kBFloat16) {
+    return fused_moe_tpp_kernl_impl_<at::BFloat16>(
+        hidden_states,
+        topk_ids,
+        topk_weights,
+        gate_wei,
+        up_wei,
+        down_wei,
+        tpp_fallback);
+  } else {
+    TORCH_CHECK(
+        false,
+        "fused_moe_tpp: unsupported data type ",
+        hidden_states.scalar_type());
+  }
+}
+// Loads a row of router logits as float into out and returns its max
+template <typename T>
+inline float moe_router_load_max(const T* logits, int64_t size, float* out) {
+  int64_t i = 0;
+  float max = -std::numeric_limits<float>::infinity();
+#if defined(CPU_CAPABILITY_AVX512)
+  auto vec_max = _mm512_set1_ps(max);
+  for (; i <= size - 16; i += 16) {
+    auto vec_out = _loadu(logits + i);
+    vec_max = _mm512_max_ps(vec_max, vec_out);
+    _mm512_storeu_ps(out + i, vec_out);
+  }
+  if (i < size) {
+    __mmask16 mask = (1 << (size - i)) - 1;
+    auto vec_out = _maskz_loadu(logits + i, mask);
+    vec_max = _mm512_mask_max_ps(vec_max, mask, vec_out, vec_max);
+    _mm512_mask_storeu_ps(out + i, mask, vec_out);
+    i = size;
+  }
+  max = _mm512_reduce_max_ps(vec_max);
+#endif
+  for (; i < size; i++) {
+    out[i] = static_cast<float>(logits[i]);
+    max = std::max(max, out[i]);
+  }
+  return max;
+}
+
+template <typename T>
+std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor, at::Tensor>
+moe_router_kernl_impl_(
+    const at::Tensor& router_logits,
+    int64_t top_k,
+    bool renormalize) {
+  auto logits = router_logits.contiguous();
+  auto num_tokens = logits.size(0);
+  auto num_experts = logits.size(1);
+  auto topk_weights = at::empty({num_tokens, top_k}, at::kFloat);
+  auto topk_ids = at::empty({num_tokens, top_k}, at::kLong);
+  auto logits_ptr = logits.data_ptr<T>();
+  auto weights_ptr = topk_weights.data_ptr<float>();
+  auto ids_ptr = topk_ids.data_ptr<int64_t>();
+
+  at::parallel_for(0, num_tokens, 0, [&](int64_t begin, int64_t end) {
+    std::vector<float> probs(num_experts);
+    for (int64_t t = begin; t < end; t++) {
+      auto max = moe_router_load_max(
+          logits_ptr + t * num_experts, num_experts, probs.data());
+      // softmax keeps the order of the logits, so the top_k experts are
+      // selected on the logits and only the normalizer needs the full row
+      auto w = weights_ptr + t * top_k;
+      auto ids = ids_ptr + t * top_k;
+      int64_t n = 0;
+      for (int64_t e = 0; e < num_experts; e++) {
+        if (n == top_k && probs[e] <= w[top_k - 1])
+          continue;
+        auto j = std::min(n, top_k - 1);
+        for (; j > 0 && w[j - 1] < probs[e]; j--) {
+          w[j] = w[j - 1];
+          ids[j] = ids[j - 1];
+        }
+        w[j] = probs[e];
+        ids[j] = e;
+        n = std::min(n + 1, top_k);
+      }
+      float sum = 0.f;
+      for (int64_t k = 0; k < top_k; k++) {
+        w[k] = std::exp(w[k] - max);
+        sum += w[k];
+      }
+      if (!renormalize) {
+#if defined(CPU_CAPABILITY_AVX512)
+        torch_ipex::cpu::kernel::_dil_exp_reduce_sum_fusion_kernel(
+            probs.data(), num_experts, probs.data(), max);
+        sum = max;
+#else
+        sum = 0.f;
+        for (int64_t e = 0; e < num_experts; e++) {
+          sum += std::exp(probs[e] - max);
+        }
+#endif
+      }
+      for (int64_t k = 0; k < top_k; k++) {
+        w[k] /= sum;
+      }
+    }
+  });
+
+  std::vector<int64_t> offsets, sorted_pair_ids, token_pos;
+  moe_sort_tokens_by_expert(
+      topk_ids, num_experts, offsets, sorted_pair_ids, token_pos);
+  auto expert_counts = at::empty({num_experts}, at::kLong);
+  auto sorted_token_ids = at::empty({num_tokens * top_k}, at::kLong);
+  auto sorted_topk_idx = at::empty({num_tokens * top_k}, at::kLong);
+  auto counts_ptr = expert_counts.data_ptr<int64_t>();
+  auto sorted_token_ids_ptr = sorted_token_ids.data_ptr<int64_t>();
+  auto sorted_topk_idx_ptr = sorted_topk_idx.data_ptr<int64_t>();
+  for (int64_t e = 0; e < num_experts; e++) {
+    counts_ptr[e] = offsets[e + 1] - offsets[e];
+  }
+  for (int64_t i = 0; i < num_tokens * top_k; i++) {
+    sorted_token_ids_ptr[i] = sorted_pair_ids[i] / top_k;
+    sorted_topk_idx_ptr[i] = sorted_pair_ids[i] % top_k;
+  }
+  return std::make_tuple(
+      topk_weights, topk_ids, expert_counts, sorted_token_ids, sorted_topk_idx);
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor, at::Tensor>
+moe_router_kernl_impl(
+    const at::Tensor& router_logits,
+    int64_t top_k,
+    bool renormalize) {
+  if (router_logits.scalar_type() == at::kFloat) {
+    return moe_router_kernl_impl_<float>(router_logits, top_k, renormalize);
+  } else if (router_logits.scalar_type() == at::kBFloat16) {
+    return moe_router_kernl_impl_<at::BFloat16>(
+        router_logits, top_k, renormalize);
+  } else {
+    return moe_router_kernl_impl_<float>(
+        router_logits.to(at::kFloat), top_k, renormalize);
+  }
+}
 } // anonymous namespace
 
 IPEX_REGISTER_DISPATCH(
@@ -133,6 +419,8 @@ IPEX_REGISTER_DISPATCH(
     mixtral_moe_woq_kernel_stub,
     &mixtral_moe_woq_kernl_impl);
 IPEX_REGISTER_DISPATCH(mixtral_moe_kernel_stub, &mixtral_moe_kernl_impl);
+IPEX_REGISTER_DISPATCH(fused_moe_tpp_kernel_stub, &fused_moe_tpp_kernl_impl);
+IPEX_REGISTER_DISPATCH(moe_router_kernel_stub, &moe_router_kernl_impl);
 
 } // namespace cpu
 } // namespace torch_ipex
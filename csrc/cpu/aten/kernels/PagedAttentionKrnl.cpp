@@ -2,7 +2,10 @@
 #include <aten/PagedAttention.h>
 #include <torch/all.h>
 #include <torch/csrc/autograd/function.h>
+#include <algorithm>
+#include <cstring>
 #include <limits>
+#include "csrc/cpu/aten/utils/kv_split.h"
 #include "vec/vec.h"
 
 namespace torch_ipex {
@@ -18,7 +21,7 @@ void reduce_head(
     int64_t head_size) {
   attn_w_pos[0] = 0;
 #if defined(CPU_CAPABILITY_AVX512)
-  torch_ipex::cpu::kernel::_reduce_head<QT, KT, KT>(
+  torch_ipex::cpu::kernel::_reduce_head<QT, KT, float>(
       q_ptr_start, k_cache_start, attn_w_pos, head_size, false, nullptr);
 #else
   for (auto hsi = 0; hsi < head_size; hsi++) {
@@ -37,7 +40,7 @@ inline void mul_attenion_weights_and_value_of_head(
   auto vec_size = 16; // 512/32
   auto hsi = 0;
 #if defined(CPU_CAPABILITY_AVX512)
-  torch_ipex::cpu::kernel::_mul_and_accumulate<CT, OT, CT>(
+  torch_ipex::cpu::kernel::_mul_and_accumulate<CT, OT, float>(
       attn_w,
       v_cache_start,
       attn_out_start,
@@ -56,15 +59,126 @@ inline void mul_attenion_weights_and_value_of_head(
 #endif
 }
 
+// The KV cache could be stored as int8 or fp8 with a scale (x = q * scale).
+template <typename T>
+constexpr bool is_quantized_kv_cache_v = std::is_same_v<T, int8_t> ||
+    std::is_same_v<T, at::Float8_e5m2> || std::is_same_v<T, at::Float8_e4m3fn>;
+
+/**
+ * Checks the scale of a quantized KV cache and returns its stride over the
+ * cache blocks. The scale is either per kv head [num_kv_heads] or per block and
+ * kv head [num_blocks, num_kv_heads].
+ */
+inline int64_t kv_cache_scale_block_stride(
+    const c10::optional<at::Tensor>& kv_scale,
+    const at::Tensor& kv_cache) {
+  if (!kv_scale.has_value()) {
+    TORCH_CHECK(
+        kv_cache.scalar_type() != at::kChar,
+        "the scale is required for the int8 KV cache");
+    return 0;
+  }
+  auto& scale = kv_scale.value();
+  TORCH_CHECK(
+      scale.scalar_type() == at::kFloat && scale.is_contiguous(),
+      "the scale of KV cache should be a contiguous float tensor");
+  auto num_kv_heads = kv_cache.size(2);
+  if (scale.dim() == 1) {
+    TORCH_CHECK(
+        scale.size(0) == num_kv_heads,
+        "the per head scale of KV cache should have num_kv_heads elements");
+    return 0;
+  }
+  TORCH_CHECK(
+      scale.dim() == 2 && scale.size(0) == kv_cache.size(0) &&
+          scale.size(1) == num_kv_heads,
+      "the per block scale of KV cache should be [num_blocks, num_kv_heads]");
+  return scale.stride(0);
+}
+
+inline const float* kv_cache_scale_ptr(
+    const c10::optional<at::Tensor>& kv_scale) {
+  return kv_scale.has_value() ? kv_scale.value().data_ptr<float>() : nullptr;
+}
+
+template <typename DST_T, typename SRC_T>
+inline void quantize_and_move_ker(
+    DST_T* out,
+    const SRC_T* in,
+    float scale,
+    int64_t len) {
+  auto inv_scale = 1.0f / scale;
+  auto max_val = static_cast<float>(std::numeric_limits<DST_T>::max());
+  auto min_val = static_cast<float>(std::numeric_limits<DST_T>::lowest());
+  for (auto i = 0; i < len; i++) {
+    auto val = std::min(
+        std::max(static_cast<float>(in[i]) * inv_scale, min_val), max_val);
+    if constexpr (std::is_same_v<DST_T, int8_t>) {
+      out[i] = static_cast<int8_t>(std::nearbyint(val));
+    } else {
+      out[i] = static_cast<DST_T>(val);
+    }
+  }
+}
+
+/**
+ * Calls `fn` with a null pointer of the KV cache element type, which is either
+ * the type of the activation or one of the int8/fp8 quantized types.
+ */
+template <typename scalar_t, typename F>
+inline void dispatch_kv_cache_type(at::ScalarType cache_type, const F& fn) {
+  if (cache_type == c10::CppTypeToScalarType<scalar_t>::value) {
+    fn(static_cast<scalar_t*>(nullptr));
+  } else if (cache_type == at::kChar) {
+    fn(static_cast<int8_t*>(nullptr));
+  } else if (cache_type == at::kFloat8_e5m2) {
+    fn(static_cast<at::Float8_e5m2*>(nullptr));
+  } else if (cache_type == at::kFloat8_e4m3fn) {
+    fn(static_cast<at::Float8_e4m3fn*>(nullptr));
+  } else {
+    TORCH_CHECK(false, "Unsupported data type of the paged KV cache");
+  }
+}
+
+/**
+ * Computes the scores of one query head against one KV cache block, applies the
+ * scale and the alibi bias and returns the max score of the block.
+ */
+template <typename scalar_t, typename cache_t>
+inline float compute_block_scores(
+    const scalar_t* q_ptr_start,
+    const cache_t* k_block_start,
+    float* scores,
+    int64_t num_tokens,
+    int64_t token_stride,
+    int64_t head_size,
+    float scale,
+    float alibi_slope,
+    int64_t first_token_id,
+    int64_t context_len) {
+  auto max_val = -std::numeric_limits<float>::infinity();
+  for (auto ti = 0; ti < num_tokens; ti++) {
+    reduce_head<scalar_t, cache_t>(
+        q_ptr_start, k_block_start + ti * token_stride, scores + ti, head_size);
+    scores[ti] = scores[ti] * scale +
+        alibi_slope * (first_token_id + ti + 1 - context_len);
+    max_val = std::max(max_val, scores[ti]);
+  }
+  return max_val;
+}
+
 /**
  * Performs scale-dot-product for the next token based on cached key-value
  * attention.
  *
- * This function computes the attention weights and applies the attention
- * mechanism to obtain the final output. It takes in tensors representing the
- * query, key cache, value cache, head mapping, scale, block tables, context
- * lengths, block size, max context length, and optional alibi slopes. The
- * output tensor is updated with the computed attention values.
+ * The kernel walks the blocks of every sequence once and keeps a running
+ * max/sum (online softmax) together with an fp32 accumulator of the value
+ * rows, so neither a [num_seqs, num_heads, max_context_len] score buffer nor a
+ * per-thread output copy is needed. When there are fewer (seq, head) pairs
+ * than threads, the context is split into partitions of whole blocks
+ * (flash-decoding) and the partial results are merged by a light reduction.
+ * An int8/fp8 KV cache is dequantized on the fly by folding its scale into the
+ * attention score and the attention weight.
  *
  * @param out           Output tensor [num_seqs, num_heads, head_size].
  * @param query         Query tensor [num_seqs, num_heads, head_size].
@@ -84,8 +198,10 @@ inline void mul_attenion_weights_and_value_of_head(
  * @param max_context_len Maximum context length.
  * @param alibi_slopes  Optional tensor of alibi slopes with the shape of
  * (num_heads).
+ * @param k_scale       Optional scale of the quantized key cache.
+ * @param v_scale       Optional scale of the quantized value cache.
  */
-template <typename scalar_t>
+template <typename scalar_t, typename cache_t>
 void single_query_cached_kv_attention_kernel(
     at::Tensor& out,
     at::Tensor& query,
@@ -97,11 +213,17 @@ void single_query_cached_kv_attention_kernel(
     at::Tensor& context_lens,
     int64_t block_size,
     int64_t max_context_len,
-    const c10::optional<at::Tensor>& alibi_slopes) {
+    const c10::optional<at::Tensor>& alibi_slopes,
+    const c10::optional<at::Tensor>& k_scale,
+    const c10::optional<at::Tensor>& v_scale) {
   auto out_ptr = out.data_ptr<scalar_t>();
   auto query_ptr = query.data_ptr<scalar_t>();
-  auto key_cache_ptr = key_cache.data_ptr<scalar_t>();
-  auto value_cache_ptr = value_cache.data_ptr<scalar_t>();
+  auto key_cache_ptr = key_cache.data_ptr<cache_t>();
+  auto value_cache_ptr = value_cache.data_ptr<cache_t>();
+  auto k_scale_ptr = kv_cache_scale_ptr(k_scale);
+  auto v_scale_ptr = kv_cache_scale_ptr(v_scale);
+  auto k_scale_stride = kv_cache_scale_block_stride(k_scale, key_cache);
+  auto v_scale_stride = kv_cache_scale_block_stride(v_scale, value_cache);
   auto head_mapping_ptr = head_mapping.data_ptr<int>();
   auto block_tables_ptr = block_tables.data_ptr<int>();
   auto context_lens_ptr = context_lens.data_ptr<int>();
@@ -113,13 +235,12 @@ void single_query_cached_kv_attention_kernel(
   auto head_size = query.size(2);
   auto num_kv_heads = key_cache.size(2);
   auto max_num_blocks_per_seq = block_tables.size(1);
-  auto attn_weights = at::empty(
-      {num_seqs, num_heads, max_context_len},
-      query.options().dtype(at::ScalarType::Float));
-  auto attn_weights_ptr = attn_weights.data_ptr<float>();
   auto kv_block_stride = key_cache.stride(0);
+  auto kv_token_stride = key_cache.stride(1);
   auto q_stride = query.stride(0);
-  auto attn_weights_stride = attn_weights.stride(0);
+  auto q_head_stride = query.stride(1);
+  auto out_stride = out.stride(0);
+  auto out_head_stride = out.stride(1);
 
   if (alibi_slopes.has_value()) {
     auto alibi_slopes_size = alibi_slopes.value().size(0);
@@ -128,163 +249,425 @@ void single_query_cached_kv_attention_kernel(
         "alibi_slopes size is not equal to num_heads");
   }
 
+  // Split the context of each sequence into partitions of whole blocks
+  auto max_num_blocks = (max_context_len + block_size - 1) / block_size;
+  auto split =
+      split_kv_partitions(num_seqs * num_heads, max_num_blocks, block_size);
+  auto num_partitions = split.num_partitions;
+  auto partition_blocks = split.partition_size;
+
+  // Per partition result: [acc(head_size), max, sum]. Only needed when a
+  // sequence is split, otherwise the result goes to `out` directly.
+  auto partial_stride = head_size + 2;
+  at::Tensor partial_results;
+  float* partial_ptr = nullptr;
+  if (num_partitions > 1) {
+    partial_results = at::empty(
+        {num_seqs, num_heads, num_partitions, partial_stride}, at::kFloat);
+    partial_ptr = partial_results.data_ptr<float>();
+  }
+  // Per thread scratch: [scores(block_size), acc(head_size)]
+  auto thread_numbers = omp_get_max_threads();
+  auto scratch_stride = block_size + head_size;
+  auto scratch = at::empty({thread_numbers, scratch_stride}, at::kFloat);
+  auto scratch_ptr = scratch.data_ptr<float>();
+
 #pragma omp parallel for collapse(3)
   for (auto seq_id = 0; seq_id < num_seqs; seq_id++) {
     for (auto head_id = 0; head_id < num_heads; head_id++) {
-      for (auto token_id = 0; token_id < max_context_len; token_id++) {
+      for (auto partition_id = 0; partition_id < num_partitions;
+           partition_id++) {
         auto context_len = context_lens_ptr[seq_id];
-        if (token_id >= context_len)
+        if (context_len == 0) {
+          // Nothing to attend, the output of the head is zeros
+          if (partition_id == 0) {
+            torch_ipex::cpu::kernel::zero_ker(
+                out_ptr + seq_id * out_stride + head_id * out_head_stride,
+                head_size);
+          }
           continue;
-        auto attn_w_pos = attn_weights_ptr + seq_id * attn_weights_stride +
-            head_id * max_context_len + token_id;
-        auto q_ptr_start = query_ptr + seq_id * q_stride + head_id * head_size;
-        auto block_id = block_tables_ptr
-            [seq_id * max_num_blocks_per_seq + token_id / block_size];
-        auto block_offset = token_id % block_size;
-        auto k_cache_start = key_cache_ptr + block_id * kv_block_stride +
-            block_offset * num_kv_heads * head_size +
-            head_mapping_ptr[head_id] * head_size;
-        reduce_head<scalar_t, scalar_t>(
-            q_ptr_start, k_cache_start, attn_w_pos, head_size);
-      }
-    }
-  }
+        }
+        auto num_blocks = (context_len + block_size - 1) / block_size;
+        auto block_begin = partition_id * partition_blocks;
+        auto block_end = std::min(block_begin + partition_blocks, num_blocks);
+        auto partial_start = partial_ptr +
+            ((seq_id * num_heads + head_id) * num_partitions + partition_id) *
+                partial_stride;
+        if (block_begin >= block_end) {
+          // Nothing to attend in this partition for a short sequence
+          if (partial_ptr != nullptr) {
+            partial_start[head_size] = -std::numeric_limits<float>::infinity();
+            partial_start[head_size + 1] = 0.f;
+          }
+          continue;
+        }
+        auto thread_id = omp_get_thread_num();
+        auto scores = scratch_ptr + thread_id * scratch_stride;
+        auto acc = partial_ptr != nullptr ? partial_start : scores + block_size;
+        auto q_ptr_start =
+            query_ptr + seq_id * q_stride + head_id * q_head_stride;
+        auto kv_head_id = head_mapping_ptr[head_id];
+        auto kv_head_offset = kv_head_id * head_size;
+        auto alibi_slope =
+            alibi_slopes_ptr != nullptr ? alibi_slopes_ptr[head_id] : 0.f;
+        auto running_max = -std::numeric_limits<float>::infinity();
+        auto running_sum = 0.f;
+        torch_ipex::cpu::kernel::zero_ker(acc, head_size);
 
-// div+add+softmax
-#pragma omp parallel for collapse(2)
-  for (auto seq_id = 0; seq_id < num_seqs; seq_id++) {
-    for (auto head_id = 0; head_id < num_heads; head_id++) {
-      auto max_val = -10000.0f;
-      float sum = 0.0f;
-      auto context_len = context_lens_ptr[seq_id];
-      auto attn_w_start = attn_weights_ptr + seq_id * attn_weights_stride +
-          head_id * max_context_len;
+        for (auto block_id = block_begin; block_id < block_end; block_id++) {
+          auto physical_block_id =
+              block_tables_ptr[seq_id * max_num_blocks_per_seq + block_id];
+          auto first_token_id = block_id * block_size;
+          auto num_tokens =
+              std::min<int64_t>(block_size, context_len - first_token_id);
+          auto k_block_start = key_cache_ptr +
+              physical_block_id * kv_block_stride + kv_head_offset;
+          auto v_block_start = value_cache_ptr +
+              physical_block_id * kv_block_stride + kv_head_offset;
+          auto k_dequant_scale = k_scale_ptr != nullptr
+              ? k_scale_ptr[physical_block_id * k_scale_stride + kv_head_id]
+              : 1.f;
+          auto v_dequant_scale = v_scale_ptr != nullptr
+              ? v_scale_ptr[physical_block_id * v_scale_stride + kv_head_id]
+              : 1.f;
+          auto block_max = compute_block_scores<scalar_t, cache_t>(
+              q_ptr_start,
+              k_block_start,
+              scores,
+              num_tokens,
+              kv_token_stride,
+              head_size,
+              scale * k_dequant_scale,
+              alibi_slope,
+              first_token_id,
+              context_len);
+          // Rescale the accumulated result if the running max grows
+          if (block_max > running_max) {
+            if (running_sum > 0.f) {
+              auto correction = std::exp(running_max - block_max);
+              running_sum *= correction;
+              for (auto hsi = 0; hsi < head_size; hsi++) {
+                acc[hsi] *= correction;
+              }
+            }
+            running_max = block_max;
+          }
+          // exp(score - max) and sum
+          auto block_sum = running_max;
 #if defined(CPU_CAPABILITY_AVX512)
-      if (alibi_slopes_ptr != nullptr) {
-        auto alibi_slope = alibi_slopes_ptr[head_id];
-        torch_ipex::cpu::kernel::
-            _dil_div_add_alibi_and_reduce_max_fusion_kernel<float>(
-                attn_w_start,
-                scale,
-                context_len,
-                attn_w_start,
-                max_val,
-                alibi_slope,
+          torch_ipex::cpu::kernel::_dil_exp_reduce_sum_fusion_kernel(
+              scores, num_tokens, scores, block_sum);
+#else
+          block_sum = 0.f;
+          for (auto ti = 0; ti < num_tokens; ti++) {
+            scores[ti] = std::exp(scores[ti] - running_max);
+            block_sum += scores[ti];
+          }
+#endif
+          running_sum += block_sum;
+          // acc += exp(score - max) * value
+          for (auto ti = 0; ti < num_tokens; ti++) {
+            mul_attenion_weights_and_value_of_head<float, cache_t>(
+                scores[ti] * v_dequant_scale,
+                v_block_start + ti * kv_token_stride,
+                acc,
+                head_size,
                 true);
-      } else {
-        torch_ipex::cpu::kernel::
-            _dil_div_add_alibi_and_reduce_max_fusion_kernel<float>(
-                attn_w_start,
-                scale,
-                context_len,
-                attn_w_start,
-                max_val,
-                1,
-                false);
-      }
-      torch_ipex::cpu::kernel::_dil_exp_reduce_sum_fusion_kernel(
-          attn_w_start, context_len, attn_w_start, max_val);
-      torch_ipex::cpu::kernel::_dil_normalization_kernel<float>(
-          attn_w_start, max_val, context_len, attn_w_start);
+          }
+        } // for block_id
 
+        if (partial_ptr != nullptr) {
+          partial_start[head_size] = running_max;
+          partial_start[head_size + 1] = running_sum;
+        } else {
+          auto out_start =
+              out_ptr + seq_id * out_stride + head_id * out_head_stride;
+#if defined(CPU_CAPABILITY_AVX512)
+          torch_ipex::cpu::kernel::_dil_normalization_kernel<scalar_t>(
+              acc, running_sum, head_size, out_start);
 #else
-      // div+add+softmax
-      for (auto token_id = 0; token_id < context_lens_ptr[seq_id]; token_id++) {
-        attn_w_start[token_id] = attn_w_start[token_id] * scale;
-        if (alibi_slopes_ptr != nullptr) {
-          auto alibi_slope = alibi_slopes_ptr[head_id];
-          auto alibi_slopes_val =
-              alibi_slope * (token_id + 1 - context_lens_ptr[seq_id]);
-          attn_w_start[token_id] = attn_w_start[token_id] + alibi_slopes_val;
-        }
-        if (attn_w_start[token_id] > max_val) {
-          max_val = attn_w_start[token_id];
-        }
-      }
-      // exp and sum
-      for (auto token_id = 0; token_id < context_lens_ptr[seq_id]; token_id++) {
-        attn_w_start[token_id] = exp(attn_w_start[token_id] - max_val);
-        sum += attn_w_start[token_id];
-      }
-      // normalize
-      for (auto token_id = 0; token_id < context_lens_ptr[seq_id]; token_id++) {
-        attn_w_start[token_id] = attn_w_start[token_id] / sum;
-      }
+          for (auto hsi = 0; hsi < head_size; hsi++) {
+            out_start[hsi] = acc[hsi] / running_sum;
+          }
 #endif
-    }
-  }
-
-  auto thread_numbers = omp_get_max_threads();
-  auto private_attn_outs =
-      at::empty({thread_numbers, num_seqs, num_heads, head_size}, at::kFloat);
-  auto private_attn_out_flag =
-      at::zeros({thread_numbers, num_seqs, num_heads}, at::kByte);
-  auto flag_access = private_attn_out_flag.accessor<uint8_t, 3>();
-  auto private_attn_out_ptr = private_attn_outs.data_ptr<float>();
-  auto private_attn_out_stride = private_attn_outs.stride(0);
-// mul and accumulate
-#pragma omp parallel for collapse(3)
-  for (auto seq_id = 0; seq_id < num_seqs; seq_id++) {
-    for (auto head_id = 0; head_id < num_heads; head_id++) {
-      for (auto token_id = 0; token_id < max_context_len; token_id++) {
-        auto context_len = context_lens_ptr[seq_id];
-        auto thread_id = omp_get_thread_num();
-        if (token_id >= context_len)
-          continue;
-        auto attn_w = attn_weights_ptr
-            [seq_id * attn_weights_stride + head_id * max_context_len +
-             token_id];
-        auto block_id = block_tables_ptr
-            [seq_id * max_num_blocks_per_seq + token_id / block_size];
-        auto block_offset = token_id % block_size;
-        auto v_cache_start = value_cache_ptr + block_id * kv_block_stride +
-            block_offset * num_kv_heads * head_size +
-            head_mapping_ptr[head_id] * head_size;
-        auto attn_out_start = private_attn_out_ptr +
-            thread_id * private_attn_out_stride + seq_id * q_stride +
-            head_id * head_size;
-        mul_attenion_weights_and_value_of_head<float, scalar_t>(
-            attn_w,
-            v_cache_start,
-            attn_out_start,
-            head_size,
-            flag_access[thread_id][seq_id][head_id]);
-        flag_access[thread_id][seq_id][head_id] = 1;
-      } // for token_id
+        }
+      } // for partition_id
     } // for head_id
   } // for seq_id
+
+  if (num_partitions == 1) {
+    return;
+  }
   {
     RECORD_FUNCTION(
-        "ipex::single_query_cached_kv_attention::reduction_private_result",
+        "ipex::single_query_cached_kv_attention::reduction_partition_result",
         c10::ArrayRef<c10::IValue>({}));
 #pragma omp parallel for collapse(2)
     for (auto seq_id = 0; seq_id < num_seqs; seq_id++) {
-      for (auto hi = 0; hi < num_heads; hi++) {
-        auto thr0_head_start =
-            private_attn_out_ptr + (seq_id * num_heads + hi) * head_size;
-        if (flag_access[0][seq_id][hi] == 0) {
-          torch_ipex::cpu::kernel::zero_ker(thr0_head_start, head_size);
+      for (auto head_id = 0; head_id < num_heads; head_id++) {
+        if (context_lens_ptr[seq_id] == 0) {
+          continue;
+        }
+        auto partial_head_start = partial_ptr +
+            (seq_id * num_heads + head_id) * num_partitions * partial_stride;
+        auto global_max = -std::numeric_limits<float>::infinity();
+        for (auto pi = 0; pi < num_partitions; pi++) {
+          global_max = std::max(
+              global_max, partial_head_start[pi * partial_stride + head_size]);
         }
-        for (auto thread_id = 1; thread_id < thread_numbers; thread_id++) {
-          if (flag_access[thread_id][seq_id][hi] == 0) {
+        // Merge into the first partition
+        auto acc = partial_head_start;
+        auto global_sum = 0.f;
+        for (auto pi = 0; pi < num_partitions; pi++) {
+          auto partial_start = partial_head_start + pi * partial_stride;
+          auto partial_sum = partial_start[head_size + 1];
+          if (partial_sum == 0.f) {
             continue;
           }
-          auto attn_out_head_stride = thread_id * private_attn_out_stride +
-              (seq_id * num_heads + hi) * head_size;
-          auto private_attn_out_start =
-              private_attn_out_ptr + attn_out_head_stride;
-          torch_ipex::cpu::kernel::add_ker<float, float>(
-              thr0_head_start, private_attn_out_start, head_size);
+          auto correction = std::exp(partial_start[head_size] - global_max);
+          global_sum += partial_sum * correction;
+          if (pi == 0) {
+            for (auto hsi = 0; hsi < head_size; hsi++) {
+              acc[hsi] *= correction;
+            }
+          } else {
+            mul_attenion_weights_and_value_of_head<float, float>(
+                correction, partial_start, acc, head_size, true);
+          }
+        }
+        auto out_start =
+            out_ptr + seq_id * out_stride + head_id * out_head_stride;
+#if defined(CPU_CAPABILITY_AVX512)
+        torch_ipex::cpu::kernel::_dil_normalization_kernel<scalar_t>(
+            acc, global_sum, head_size, out_start);
+#else
+        for (auto hsi = 0; hsi < head_size; hsi++) {
+          out_start[hsi] = acc[hsi] / global_sum;
         }
-        auto out_start = out_ptr + (seq_id * num_heads + hi) * head_size;
-        torch_ipex::cpu::kernel::move_ker<scalar_t, float>(
-            out_start, thr0_head_start, head_size);
+#endif
       }
     }
   }
-
 } // single_query_cached_kv_attention_kernel
 
+// The number of query tokens of one sequence processed together against a KV
+// cache block in the varlen kernel.
+constexpr int64_t VARLEN_QUERY_TILE = 16;
+
+/**
+ * Performs scale-dot-product over the paged KV cache for a batch mixing
+ * prefill chunks and decode tokens. The queries of all sequences are packed
+ * along the first dimension and located by `query_start_loc`. The KV cache
+ * is expected to already contain the keys/values of the new tokens (written by
+ * reshape_and_cache), so the last `query_len` positions of every sequence are
+ * the ones of its queries.
+ *
+ * @param out           Output tensor [num_tokens, num_heads, head_size].
+ * @param query         Query tensor [num_tokens, num_heads, head_size].
+ * @param key_cache     The key cache [num_blocks, block_size, num_kv_heads,
+ * head_size].
+ * @param value_cache   The value cache [num_blocks, block_size, num_kv_heads,
+ * head_size].
+ * @param query_start_loc The start offset of each sequence in `query`. The
+ * shape should be [num_seqs + 1].
+ * @param seq_lens      The number of cached tokens (context + new tokens) of
+ * each sequence. The shape should be [num_seqs].
+ * @param block_tables  Block tables tensor [num_seqs, max_num_blocks_per_seq].
+ * @param scale         Scaling factor for attention weights.
+ * @param is_causal     Whether a query only attends to the cached tokens up to
+ * and including its own position.
+ * @param alibi_slopes  Optional tensor of alibi slopes with the shape of
+ * (num_heads).
+ * @param k_scale       Optional scale of the quantized key cache.
+ * @param v_scale       Optional scale of the quantized value cache.
+ */
+template <typename scalar_t, typename cache_t>
+void paged_attention_varlen_kernel(
+    at::Tensor& out,
+    at::Tensor& query,
+    at::Tensor& key_cache,
+    at::Tensor& value_cache,
+    at::Tensor& query_start_loc,
+    at::Tensor& seq_lens,
+    at::Tensor& block_tables,
+    const double scale,
+    bool is_causal,
+    const c10::optional<at::Tensor>& alibi_slopes,
+    const c10::optional<at::Tensor>& k_scale,
+    const c10::optional<at::Tensor>& v_scale) {
+  auto out_ptr = out.data_ptr<scalar_t>();
+  auto query_ptr = query.data_ptr<scalar_t>();
+  auto key_cache_ptr = key_cache.data_ptr<cache_t>();
+  auto value_cache_ptr = value_cache.data_ptr<cache_t>();
+  auto k_scale_ptr = kv_cache_scale_ptr(k_scale);
+  auto v_scale_ptr = kv_cache_scale_ptr(v_scale);
+  auto k_scale_stride = kv_cache_scale_block_stride(k_scale, key_cache);
+  auto v_scale_stride = kv_cache_scale_block_stride(v_scale, value_cache);
+  auto query_start_loc_ptr = query_start_loc.data_ptr<int>();
+  auto seq_lens_ptr = seq_lens.data_ptr<int>();
+  auto block_tables_ptr = block_tables.data_ptr<int>();
+  auto alibi_slopes_ptr = alibi_slopes.has_value()
+      ? alibi_slopes.value().data_ptr<float>()
+      : nullptr;
+  auto num_seqs = seq_lens.size(0);
+  auto num_heads = query.size(1);
+  auto head_size = query.size(2);
+  auto num_kv_heads = key_cache.size(2);
+  auto block_size = key_cache.size(1);
+  auto num_queries_per_kv = num_heads / num_kv_heads;
+  auto max_num_blocks_per_seq = block_tables.size(1);
+  auto kv_block_stride = key_cache.stride(0);
+  auto kv_token_stride = key_cache.stride(1);
+  auto q_stride = query.stride(0);
+  auto q_head_stride = query.stride(1);
+  auto out_stride = out.stride(0);
+  auto out_head_stride = out.stride(1);
+
+  // Flatten the (seq, query tile) pairs so that prefill chunks and decode
+  // tokens are balanced in the same parallel loop.
+  std::vector<std::pair<int64_t, int64_t>> query_tiles;
+  for (auto seq_id = 0; seq_id < num_seqs; seq_id++) {
+    auto query_len =
+        query_start_loc_ptr[seq_id + 1] - query_start_loc_ptr[seq_id];
+    TORCH_CHECK(
+        query_len <= seq_lens_ptr[seq_id],
+        "paged_attention_varlen: query length should not exceed seq_lens");
+    for (auto qi = 0; qi < query_len; qi += VARLEN_QUERY_TILE) {
+      query_tiles.emplace_back(seq_id, qi);
+    }
+  }
+  int64_t num_tiles = query_tiles.size();
+
+  // Per thread scratch: [scores(tile * block_size), acc(tile * head_size),
+  // max(tile), sum(tile)]
+  auto thread_numbers = omp_get_max_threads();
+  auto scratch_stride = VARLEN_QUERY_TILE * (block_size + head_size + 2);
+  auto scratch = at::empty({thread_numbers, scratch_stride}, at::kFloat);
+  auto scratch_ptr = scratch.data_ptr<float>();
+
+#pragma omp parallel for collapse(2)
+  for (auto tile_id = 0; tile_id < num_tiles; tile_id++) {
+    for (auto head_id = 0; head_id < num_heads; head_id++) {
+      auto seq_id = query_tiles[tile_id].first;
+      auto q_tile_begin = query_tiles[tile_id].second;
+      auto seq_len = seq_lens_ptr[seq_id];
+      auto query_len =
+          query_start_loc_ptr[seq_id + 1] - query_start_loc_ptr[seq_id];
+      auto num_rows =
+          std::min<int64_t>(VARLEN_QUERY_TILE, query_len - q_tile_begin);
+      // The position of the first query row in the cached sequence
+      auto first_q_pos = seq_len - query_len + q_tile_begin;
+      auto thread_id = omp_get_thread_num();
+      auto scores = scratch_ptr + thread_id * scratch_stride;
+      auto acc = scores + VARLEN_QUERY_TILE * block_size;
+      auto row_max = acc + VARLEN_QUERY_TILE * head_size;
+      auto row_sum = row_max + VARLEN_QUERY_TILE;
+      auto kv_head_id = head_id / num_queries_per_kv;
+      auto kv_head_offset = kv_head_id * head_size;
+      auto alibi_slope =
+          alibi_slopes_ptr != nullptr ? alibi_slopes_ptr[head_id] : 0.f;
+      auto q_tile_start = query_ptr +
+          (query_start_loc_ptr[seq_id] + q_tile_begin) * q_stride +
+          head_id * q_head_stride;
+      torch_ipex::cpu::kernel::zero_ker(acc, num_rows * head_size);
+      for (auto row = 0; row < num_rows; row++) {
+        row_max[row] = -std::numeric_limits<float>::infinity();
+        row_sum[row] = 0.f;
+      }
+
+      auto num_keys = is_causal
+          ? std::min<int64_t>(seq_len, first_q_pos + num_rows)
+          : seq_len;
+      auto num_blocks = (num_keys + block_size - 1) / block_size;
+      for (auto block_id = 0; block_id < num_blocks; block_id++) {
+        auto physical_block_id =
+            block_tables_ptr[seq_id * max_num_blocks_per_seq + block_id];
+        auto first_token_id = block_id * block_size;
+        auto block_tokens =
+            std::min<int64_t>(block_size, num_keys - first_token_id);
+        auto k_block_start = key_cache_ptr +
+            physical_block_id * kv_block_stride + kv_head_offset;
+        auto v_block_start = value_cache_ptr +
+            physical_block_id * kv_block_stride + kv_head_offset;
+        auto k_dequant_scale = k_scale_ptr != nullptr
+            ? k_scale_ptr[physical_block_id * k_scale_stride + kv_head_id]
+            : 1.f;
+        auto v_dequant_scale = v_scale_ptr != nullptr
+            ? v_scale_ptr[physical_block_id * v_scale_stride + kv_head_id]
+            : 1.f;
+        for (auto row = 0; row < num_rows; row++) {
+          auto q_pos = first_q_pos + row;
+          // Causal mask: only the keys up to the query position are valid
+          auto num_tokens = is_causal
+              ? std::min<int64_t>(block_tokens, q_pos - first_token_id + 1)
+              : block_tokens;
+          if (num_tokens <= 0) {
+            continue;
+          }
+          auto row_scores = scores + row * block_size;
+          auto row_acc = acc + row * head_size;
+          // alibi bias: slope * (key_pos - query_pos)
+          auto block_max = compute_block_scores<scalar_t, cache_t>(
+              q_tile_start + row * q_stride,
+              k_block_start,
+              row_scores,
+              num_tokens,
+              kv_token_stride,
+              head_size,
+              scale * k_dequant_scale,
+              alibi_slope,
+              first_token_id,
+              q_pos + 1);
+          if (block_max > row_max[row]) {
+            if (row_sum[row] > 0.f) {
+              auto correction = std::exp(row_max[row] - block_max);
+              row_sum[row] *= correction;
+              for (auto hsi = 0; hsi < head_size; hsi++) {
+                row_acc[hsi] *= correction;
+              }
+            }
+            row_max[row] = block_max;
+          }
+          auto block_sum = row_max[row];
+#if defined(CPU_CAPABILITY_AVX512)
+          torch_ipex::cpu::kernel::_dil_exp_reduce_sum_fusion_kernel(
+              row_scores, num_tokens, row_scores, block_sum);
+#else
+          block_sum = 0.f;
+          for (auto ti = 0; ti < num_tokens; ti++) {
+            row_scores[ti] = std::exp(row_scores[ti] - row_max[row]);
+            block_sum += row_scores[ti];
+          }
+#endif
+          row_sum[row] += block_sum;
+          for (auto ti = 0; ti < num_tokens; ti++) {
+            mul_attenion_weights_and_value_of_head<float, cache_t>(
+                row_scores[ti] * v_dequant_scale,
+                v_block_start + ti * kv_token_stride,
+                row_acc,
+                head_size,
+                true);
+          }
+        } // for row
+      } // for block_id
+
+      for (auto row = 0; row < num_rows; row++) {
+        auto out_start = out_ptr +
+            (query_start_loc_ptr[seq_id] + q_tile_begin + row) * out_stride +
+            head_id * out_head_stride;
+#if defined(CPU_CAPABILITY_AVX512)
+        torch_ipex::cpu::kernel::_dil_normalization_kernel<scalar_t>(
+            acc + row * head_size, row_sum[row], head_size, out_start);
+#else
+        for (auto hsi = 0; hsi < head_size; hsi++) {
+          out_start[hsi] = acc[row * head_size + hsi] / row_sum[row];
+        }
+#endif
+      }
+    } // for head_id
+  } // for tile_id
+} // paged_attention_varlen_kernel
+
 /**
  * Reshapes and caches the key and value tensors based on the provided slot
  * mapping.
@@ -304,6 +687,8 @@ void single_query_cached_kv_attention_kernel(
  * sequences. For sequence i, the slot_mapping[i]//block_number can get the
  * block index, and the slot_mapping%block_size can get the offset of this
  * block.
+ * @param k_scale Optional scale to quantize the key into an int8/fp8 cache.
+ * @param v_scale Optional scale to quantize the value into an int8/fp8 cache.
  *
  * @tparam DST_T The data type of the output tensors.
  * @tparam SRC_T The data type of the input tensors.
@@ -314,7 +699,9 @@ void reshape_and_cache_kernel(
     at::Tensor& value,
     at::Tensor& key_cache,
     at::Tensor& value_cache,
-    at::Tensor& slot_mapping) {
+    at::Tensor& slot_mapping,
+    const c10::optional<at::Tensor>& k_scale,
+    const c10::optional<at::Tensor>& v_scale) {
   auto num_tokens = key.size(0);
   auto head_num = key.size(1);
   auto head_size = key.size(2);
@@ -327,6 +714,10 @@ void reshape_and_cache_kernel(
   auto slot_mapping_ptr = slot_mapping.data_ptr<int>();
   auto cache_stride = key_cache.stride(0);
   auto state_stride = key.stride(0);
+  auto k_scale_ptr = kv_cache_scale_ptr(k_scale);
+  auto v_scale_ptr = kv_cache_scale_ptr(v_scale);
+  auto k_scale_stride = kv_cache_scale_block_stride(k_scale, key_cache);
+  auto v_scale_stride = kv_cache_scale_block_stride(v_scale, value_cache);
 #pragma omp parallel for collapse(2)
   for (auto ti = 0; ti < num_tokens; ti++) {
     for (auto hi = 0; hi < head_num; hi++) {
@@ -339,14 +730,177 @@ void reshape_and_cache_kernel(
       auto key_ptr_start = key_ptr + state_offset;
       auto value_cache_start = value_cache_ptr + cache_offset;
       auto value_ptr_start = value_ptr + state_offset;
-      torch_ipex::cpu::kernel::move_ker<DST_T, SRC_T>(
-          key_cache_start, key_ptr_start, head_size);
-      torch_ipex::cpu::kernel::move_ker<DST_T, SRC_T>(
-          value_cache_start, value_ptr_start, head_size);
+      if constexpr (is_quantized_kv_cache_v<DST_T>) {
+        auto k_quant_scale = k_scale_ptr != nullptr
+            ? k_scale_ptr[block_id * k_scale_stride + hi]
+            : 1.f;
+        auto v_quant_scale = v_scale_ptr != nullptr
+            ? v_scale_ptr[block_id * v_scale_stride + hi]
+            : 1.f;
+        quantize_and_move_ker<DST_T, SRC_T>(
+            key_cache_start, key_ptr_start, k_quant_scale, head_size);
+        quantize_and_move_ker<DST_T, SRC_T>(
+            value_cache_start, value_ptr_start, v_quant_scale, head_size);
+      } else {
+        torch_ipex::cpu::kernel::move_ker<DST_T, SRC_T>(
+            key_cache_start, key_ptr_start, head_size);
+        torch_ipex::cpu::kernel::move_ker<DST_T, SRC_T>(
+            value_cache_start, value_ptr_start, head_size);
+      }
     }
   }
 }
 
+/**
+ * Copies the cache blocks of every layer according to the block mapping. It is
+ * used to fork a sequence (beam search, parallel sampling or prefix sharing)
+ * by copy-on-write of the blocks it shares with its parent.
+ *
+ * The destination blocks should be distinct and not be sources, the pairs are
+ * copied in parallel.
+ *
+ * @param key_caches The key caches of all layers. The shape of each cache
+ * should be [num_blocks, block_size, num_heads, head_size].
+ * @param value_caches The value caches of all layers, same shape as the key
+ * caches.
+ * @param block_mapping The [num_pairs, 2] mapping of (src_block, dst_block).
+ */
+void copy_blocks_kernel_impl(
+    const std::vector<at::Tensor>& key_caches,
+    const std::vector<at::Tensor>& value_caches,
+    const at::Tensor& block_mapping) {
+  int64_t num_layers = key_caches.size();
+  TORCH_CHECK(
+      key_caches.size() == value_caches.size(),
+      "copy_blocks: key_caches and value_caches should have the same length");
+  if (num_layers == 0) {
+    return;
+  }
+  TORCH_CHECK(
+      block_mapping.dim() == 2 && block_mapping.size(1) == 2,
+      "copy_blocks: block_mapping should be [num_pairs, 2]");
+  RECORD_FUNCTION(
+      "ipex::copy_blocks_kernel_impl", c10::ArrayRef<c10::IValue>({}));
+  auto mapping = block_mapping.to(at::kLong).contiguous();
+  auto mapping_ptr = mapping.data_ptr<int64_t>();
+  auto num_pairs = mapping.size(0);
+  // The caches of all layers are copied in one parallel region
+  int64_t num_caches = num_layers * 2;
+  std::vector<char*> cache_ptrs(num_caches);
+  std::vector<int64_t> block_bytes(num_caches);
+  std::vector<int64_t> num_blocks(num_caches);
+  for (auto layer = 0; layer < num_layers; layer++) {
+    for (auto kv = 0; kv < 2; kv++) {
+      auto& cache = kv == 0 ? key_caches[layer] : value_caches[layer];
+      TORCH_CHECK(
+          cache.is_contiguous(), "copy_blocks: cache should be contiguous");
+      cache_ptrs[layer * 2 + kv] = static_cast<char*>(cache.data_ptr());
+      block_bytes[layer * 2 + kv] = cache.stride(0) * cache.element_size();
+      num_blocks[layer * 2 + kv] = cache.size(0);
+    }
+  }
+  auto min_num_blocks = *std::min_element(num_blocks.begin(), num_blocks.end());
+  for (auto pi = 0; pi < num_pairs * 2; pi++) {
+    TORCH_CHECK(
+        mapping_ptr[pi] >= 0 && mapping_ptr[pi] < min_num_blocks,
+        "copy_blocks: block index out of range");
+  }
+  // The pairs are copied in parallel, so a block written by one pair should
+  // not be read or written by another one, e.g. no chained a->b, b->c
+  std::vector<bool> is_src(min_num_blocks, false);
+  std::vector<bool> is_dst(min_num_blocks, false);
+  for (auto pi = 0; pi < num_pairs; pi++) {
+    is_src[mapping_ptr[pi * 2]] = true;
+  }
+  for (auto pi = 0; pi < num_pairs; pi++) {
+    auto dst_block = mapping_ptr[pi * 2 + 1];
+    TORCH_CHECK(
+        !is_src[dst_block] && !is_dst[dst_block],
+        "copy_blocks: block ",
+        dst_block,
+        " is the destination of a pair and a source or destination of another one");
+    is_dst[dst_block] = true;
+  }
+#pragma omp parallel for collapse(2)
+  for (auto ci = 0; ci < num_caches; ci++) {
+    for (auto pi = 0; pi < num_pairs; pi++) {
+      auto src_block = mapping_ptr[pi * 2];
+      auto dst_block = mapping_ptr[pi * 2 + 1];
+      std::memcpy(
+          cache_ptrs[ci] + dst_block * block_bytes[ci],
+          cache_ptrs[ci] + src_block * block_bytes[ci],
+          block_bytes[ci]);
+    }
+  }
+}
+
+/**
+ * Swaps the cache blocks of one layer between two block pools, e.g. between
+ * a large host memory pool and the hot pool used by the attention kernels.
+ *
+ * @param src The source cache [num_src_blocks, block_size, num_heads,
+ * head_size].
+ * @param dst The destination cache [num_dst_blocks, block_size, num_heads,
+ * head_size].
+ * @param block_mapping The [num_pairs, 2] mapping of (src_block, dst_block).
+ * The destination blocks should be distinct, the pairs are copied in parallel.
+ */
+void swap_blocks_kernel_impl(
+    const at::Tensor& src,
+    at::Tensor& dst,
+    const at::Tensor& block_mapping) {
+  TORCH_CHECK(
+      src.scalar_type() == dst.scalar_type(),
+      "swap_blocks: src and dst should have the same data type");
+  TORCH_CHECK(
+      src.is_contiguous() && dst.is_contiguous(),
+      "swap_blocks: src and dst should be contiguous");
+  TORCH_CHECK(
+      src.stride(0) == dst.stride(0),
+      "swap_blocks: src and dst should have the same block shape");
+  TORCH_CHECK(
+      block_mapping.dim() == 2 && block_mapping.size(1) == 2,
+      "swap_blocks: block_mapping should be [num_pairs, 2]");
+  RECORD_FUNCTION(
+      "ipex::swap_blocks_kernel_impl", c10::ArrayRef<c10::IValue>({}));
+  auto mapping = block_mapping.to(at::kLong).contiguous();
+  auto mapping_ptr = mapping.data_ptr<int64_t>();
+  auto num_pairs = mapping.size(0);
+  auto src_ptr = static_cast<const char*>(src.data_ptr());
+  auto dst_ptr = static_cast<char*>(dst.data_ptr());
+  auto block_bytes = src.stride(0) * src.element_size();
+  auto num_src_blocks = src.size(0);
+  auto num_dst_blocks = dst.size(0);
+  for (auto pi = 0; pi < num_pairs; pi++) {
+    TORCH_CHECK(
+        mapping_ptr[pi * 2] >= 0 && mapping_ptr[pi * 2] < num_src_blocks &&
+            mapping_ptr[pi * 2 + 1] >= 0 &&
+            mapping_ptr[pi * 2 + 1] < num_dst_blocks,
+        "swap_blocks: block index out of range");
+  }
+  // The pairs are copied in parallel, so a block should not be the
+  // destination of two pairs
+  std::vector<bool> is_dst(num_dst_blocks, false);
+  for (auto pi = 0; pi < num_pairs; pi++) {
+    auto dst_block = mapping_ptr[pi * 2 + 1];
+    TORCH_CHECK(
+        !is_dst[dst_block],
+        "swap_blocks: block ",
+        dst_block,
+        " is the destination of more than one pair");
+    is_dst[dst_block] = true;
+  }
+#pragma omp parallel for
+  for (auto pi = 0; pi < num_pairs; pi++) {
+    auto src_block = mapping_ptr[pi * 2];
+    auto dst_block = mapping_ptr[pi * 2 + 1];
+    std::memcpy(
+        dst_ptr + dst_block * block_bytes,
+        src_ptr + src_block * block_bytes,
+        block_bytes);
+  }
+}
+
 void single_query_cached_kv_attention_kernel_impl(
     at::Tensor& out, // [num_seqs, num_heads, head_size]
     at::Tensor& query, // [num_seqs, num_heads, head_size]
@@ -358,50 +912,142 @@ void single_query_cached_kv_attention_kernel_impl(
     at::Tensor& context_lens, // [num_seqs]
     int64_t block_size,
     int64_t max_context_len,
-    const c10::optional<at::Tensor>& alibi_slopes) {
+    const c10::optional<at::Tensor>& alibi_slopes,
+    const c10::optional<at::Tensor>& k_scale,
+    const c10::optional<at::Tensor>& v_scale) {
   RECORD_FUNCTION(
       "ipex::single_query_cached_kv_attention_kernel_impl",
       c10::ArrayRef<c10::IValue>({}));
-  // dispatch kernel according to the data type of input tensor
+  TORCH_CHECK(
+      key_cache.scalar_type() == value_cache.scalar_type(),
+      "key_cache and value_cache should have the same data type");
+  // dispatch kernel according to the data type of input tensor and KV cache
   if (out.scalar_type() == at::ScalarType::Float) {
-    single_query_cached_kv_attention_kernel<float>(
-        out,
-        query,
-        key_cache,
-        value_cache,
-        head_mapping,
-        scale,
-        block_tables,
-        context_lens,
-        block_size,
-        max_context_len,
-        alibi_slopes);
+    dispatch_kv_cache_type<float>(key_cache.scalar_type(), [&](auto* type) {
+      using cache_t = std::remove_pointer_t<decltype(type)>;
+      single_query_cached_kv_attention_kernel<float, cache_t>(
+          out,
+          query,
+          key_cache,
+          value_cache,
+          head_mapping,
+          scale,
+          block_tables,
+          context_lens,
+          block_size,
+          max_context_len,
+          alibi_slopes,
+          k_scale,
+          v_scale);
+    });
   } else if (out.scalar_type() == at::ScalarType::BFloat16) {
-    single_query_cached_kv_attention_kernel<at::BFloat16>(
-        out,
-        query,
-        key_cache,
-        value_cache,
-        head_mapping,
-        scale,
-        block_tables,
-        context_lens,
-        block_size,
-        max_context_len,
-        alibi_slopes);
+    dispatch_kv_cache_type<at::BFloat16>(
+        key_cache.scalar_type(), [&](auto* type) {
+          using cache_t = std::remove_pointer_t<decltype(type)>;
+          single_query_cached_kv_attention_kernel<at::BFloat16, cache_t>(
+              out,
+              query,
+              key_cache,
+              value_cache,
+              head_mapping,
+              scale,
+              block_tables,
+              context_lens,
+              block_size,
+              max_context_len,
+              alibi_slopes,
+              k_scale,
+              v_scale);
+        });
   } else {
     TORCH_CHECK(
         false, "Unsupported data type for single_query_cached_kv_attention");
   }
 }
 
+void paged_attention_varlen_kernel_impl(
+    at::Tensor& out, // [num_tokens, num_heads, head_size]
+    at::Tensor& query, // [num_tokens, num_heads, head_size]
+    at::Tensor& key_cache, // [num_blocks, block_size, kv_heads, head_size]
+    at::Tensor& value_cache, // [num_blocks, block_size, kv_heads, head_size]
+    at::Tensor& query_start_loc, // [num_seqs + 1]
+    at::Tensor& seq_lens, // [num_seqs]
+    at::Tensor& block_tables, // [num_seqs, max_num_blocks_per_seq]
+    const double scale,
+    bool is_causal,
+    const c10::optional<at::Tensor>& alibi_slopes,
+    const c10::optional<at::Tensor>& k_scale,
+    const c10::optional<at::Tensor>& v_scale) {
+  TORCH_CHECK(
+      query.size(1) % key_cache.size(2) == 0,
+      "paged_attention_varlen: num_heads should be a multiple of num_kv_heads");
+  TORCH_CHECK(
+      query_start_loc.size(0) == seq_lens.size(0) + 1,
+      "paged_attention_varlen: query_start_loc should have num_seqs + 1 elements");
+  TORCH_CHECK(
+      query_start_loc.is_contiguous() && seq_lens.is_contiguous() &&
+          block_tables.is_contiguous(),
+      "paged_attention_varlen: query_start_loc, seq_lens and block_tables should be contiguous");
+  TORCH_CHECK(
+      key_cache.scalar_type() == value_cache.scalar_type(),
+      "key_cache and value_cache should have the same data type");
+  if (alibi_slopes.has_value()) {
+    TORCH_CHECK(
+        alibi_slopes.value().size(0) == query.size(1),
+        "alibi_slopes size is not equal to num_heads");
+  }
+  RECORD_FUNCTION(
+      "ipex::paged_attention_varlen_kernel_impl",
+      c10::ArrayRef<c10::IValue>({}));
+  if (out.scalar_type() == at::ScalarType::Float) {
+    dispatch_kv_cache_type<float>(key_cache.scalar_type(), [&](auto* type) {
+      using cache_t = std::remove_pointer_t<decltype(type)>;
+      paged_attention_varlen_kernel<float, cache_t>(
+          out,
+          query,
+          key_cache,
+          value_cache,
+          query_start_loc,
+          seq_lens,
+          block_tables,
+          scale,
+          is_causal,
+          alibi_slopes,
+          k_scale,
+          v_scale);
+    });
+  } else if (out.scalar_type() == at::ScalarType::BFloat16) {
+    dispatch_kv_cache_type<at::BFloat16>(
+        key_cache.scalar_type(), [&](auto* type) {
+          using cache_t = std::remove_pointer_t<decltype(type)>;
+          paged_attention_varlen_kernel<at::BFloat16, cache_t>(
+              out,
+              query,
+              key_cache,
+              value_cache,
+              query_start_loc,
+              seq_lens,
+              block_tables,
+              scale,
+              is_causal,
+              alibi_slopes,
+              k_scale,
+              v_scale);
+        });
+  } else {
+    TORCH_CHECK(false, "Unsupported data type for paged_attention_varlen");
+  }
+}
+
 // void reshape_and_cache_kernel
 void reshape_and_cache_cpu_kernel_impl(
     at::Tensor& key,
     at::Tensor& value,
     at::Tensor& key_cache,
     at::Tensor& value_cache,
-    at::Tensor& slot_mapping) {
+    at::Tensor& slot_mapping,
+    const c10::optional<at::Tensor>& k_scale,
+    const c10::optional<at::Tensor>& v_scale) {
   TORCH_CHECK(
       key.scalar_type() == value.scalar_type(),
       "key and value should have the same data type");
@@ -416,11 +1062,24 @@ void reshape_and_cache_cpu_kernel_impl(
       "ipex::reshape_and_cache_cpu_kernel_impl",
       c10::ArrayRef<c10::IValue>({}));
   if (key.scalar_type() == at::ScalarType::Float) {
-    reshape_and_cache_kernel<float, float>(
-        key, value, key_cache, value_cache, slot_mapping);
+    dispatch_kv_cache_type<float>(key_cache.scalar_type(), [&](auto* type) {
+      using cache_t = std::remove_pointer_t<decltype(type)>;
+      reshape_and_cache_kernel<cache_t, float>(
+          key, value, key_cache, value_cache, slot_mapping, k_scale, v_scale);
+    });
   } else if (key.scalar_type() == at::ScalarType::BFloat16) {
-    reshape_and_cache_kernel<at::BFloat16, at::BFloat16>(
-        key, value, key_cache, value_cache, slot_mapping);
+    dispatch_kv_cache_type<at::BFloat16>(
+        key_cache.scalar_type(), [&](auto* type) {
+          using cache_t = std::remove_pointer_t<decltype(type)>;
+          reshape_and_cache_kernel<cache_t, at::BFloat16>(
+              key,
+              value,
+              key_cache,
+              value_cache,
+              slot_mapping,
+              k_scale,
+              v_scale);
+        });
   } else {
     TORCH_CHECK(false, "Unsupported data type for ipex::reshape_and_cache");
   }
@@ -431,9 +1090,14 @@ void reshape_and_cache_cpu_kernel_impl(
 IPEX_REGISTER_DISPATCH(
     single_query_cached_kv_attention_kernel_stub,
     &single_query_cached_kv_attention_kernel_impl);
+IPEX_REGISTER_DISPATCH(
+    paged_attention_varlen_kernel_stub,
+    &paged_attention_varlen_kernel_impl);
 IPEX_REGISTER_DISPATCH(
     reshape_and_cache_kernel_stub,
     &reshape_and_cache_cpu_kernel_impl);
+IPEX_REGISTER_DISPATCH(copy_blocks_kernel_stub, &copy_blocks_kernel_impl);
+IPEX_REGISTER_DISPATCH(swap_blocks_kernel_stub, &swap_blocks_kernel_impl);
 
 } // namespace cpu
 } // namespace torch_ipex
@@ -8,6 +8,19 @@ namespace torch_ipex {
 namespace cpu {
 
 namespace {
+// Number of key/value heads of a fused qkv input [B][S][F], 0 if t_in only
+// holds query or key
+int64_t rope_kv_head_num(const at::Tensor& t_in, int64_t N, int64_t H) {
+  auto in_stride_s = t_in.stride(1);
+  if (in_stride_s <= N * H) {
+    return 0;
+  }
+  TORCH_CHECK(
+      in_stride_s == t_in.size(2),
+      "The shape of input tensor of rotary_position_embedding should be in (batch, seq_len, qkv_hidden_size) when using fused qkv)");
+  return (t_in.size(2) - N * H) / (2 * H);
+}
+
 /**
  * Applies the Rotary Position Embedding Kernel to the input tensors.
  *
@@ -22,54 +35,42 @@ namespace {
  * construced by past_kv_length + current_position
  * @param N The number of heads.
  * @param H The head size.
+ * @param N_KV The number of key/value heads of a concat_qkv input, 0 if t_in
+ * is query or key only.
  * @param offset The offset value. For GPT-J 6B/ChatGLM, cos/sin is applied to
  * the neighboring 2 elements, so the offset is 1. For lamma, cos/sin is applied
  * to the neighboring rotary_dim elements, so the offset is rotary_dim/2.
  * @param rotary_dim The rotary dimension.
- * @return A tuple containing the query, key, and value tensors.
+ * @param query The output query [B][S][N][H].
+ * @param kv_dst kv_dst(b, s, n) returns the destination of the key and value
+ * head n of the token (b, s) when concat_qkv is true.
  */
-template <typename T>
-std::tuple<at::Tensor, at::Tensor, at::Tensor> ApplyROPEKernel(
-    at::Tensor& t_in,
-    at::Tensor& t_emb_pos,
-    at::Tensor& t_pos,
+template <typename T, typename KVDst>
+void ApplyROPEKernelImpl(
+    const at::Tensor& t_in,
+    const at::Tensor& t_emb_pos,
+    const at::Tensor& t_pos,
     int64_t N, // N: number of head, H: head size
     int64_t H,
+    int64_t N_KV, // GQA/MQA, N_KV: number of head for key/value
     int64_t offset,
-    int64_t rotary_dim) {
+    int64_t rotary_dim,
+    at::Tensor& query,
+    const KVDst& kv_dst) {
   auto in_sizes = t_in.sizes(); // in[B][S][F] or [B][S][N][H]
   auto MP = t_emb_pos.size(0); // Max Pos
   auto HR = t_emb_pos.size(1); // rotary_dim
   auto B = in_sizes[0];
   auto S = in_sizes[1];
-  auto HS = in_sizes[2];
   auto in_stride_b = t_in.stride(0);
   auto in_stride_s = t_in.stride(1);
-  auto N_KV = N; // GQA/MQA, N_KV: number of head for key/value
-  auto concat_qkv = in_stride_s > N * H;
-
-  if (in_stride_s > N * H) {
-    TORCH_CHECK(
-        in_stride_s == HS,
-        "The shape of input tensor of rotary_position_embedding should be in (batch, seq_len, qkv_hidden_size) when using fused qkv)");
-    N_KV = (HS - N * H) / (2 * H);
-  }
+  auto concat_qkv = N_KV > 0;
 
   auto COFF = HR / 2;
   auto in_ptr = t_in.data_ptr<T>();
-  // initialize empty q/k/v
-  auto query = at::empty({B, S, N, H}, t_in.options());
-  auto key =
-      concat_qkv ? at::empty({B, S, N_KV, H}, t_in.options()) : at::Tensor();
-  auto value =
-      concat_qkv ? at::empty({B, S, N_KV, H}, t_in.options()) : at::Tensor();
   auto query_ptr = query.data_ptr<T>();
-  auto key_ptr = concat_qkv ? key.data_ptr<T>() : nullptr;
-  auto value_ptr = concat_qkv ? value.data_ptr<T>() : nullptr;
   auto out_stride_qb = query.stride(0);
   auto out_stride_qs = query.stride(1);
-  auto out_stride_kb = concat_qkv ? key.stride(0) : 0;
-  auto out_stride_ks = concat_qkv ? key.stride(1) : 0;
   auto emb_pos_ptr = t_emb_pos.data_ptr<float>(); // [MP][HR]
   auto pos_ptr = t_pos.data_ptr<long>(); // [MB][S]
   {
@@ -79,9 +80,12 @@ std::tuple<at::Tensor, at::Tensor, at::Tensor> ApplyROPEKernel(
         for (int n = 0; n < N; n++) {
           auto in_offset_q = b * in_stride_b + s * in_stride_s + n * H;
           auto out_offset_q = b * out_stride_qb + s * out_stride_qs + n * H;
-          auto out_offset_k =
-              concat_qkv ? b * out_stride_kb + s * out_stride_ks + n * H : 0;
           auto in_offset_k = concat_qkv ? in_offset_q + N * H : 0;
+          T* key_ptr = nullptr;
+          T* value_ptr = nullptr;
+          if (concat_qkv && n < N_KV) {
+            std::tie(key_ptr, value_ptr) = kv_dst(b, s, n);
+          }
           long p = 0;
           float* sin_start = nullptr;
           float* cos_start = nullptr;
@@ -108,10 +112,10 @@ std::tuple<at::Tensor, at::Tensor, at::Tensor> ApplyROPEKernel(
                 sin_start,
                 rotary_dim,
                 offset);
-            if (concat_qkv && n < N_KV) {
+            if (key_ptr != nullptr) {
               torch_ipex::cpu::kernel::apply_rope_along_head_kernel<T>(
                   in_ptr + in_offset_k,
-                  key_ptr + out_offset_k,
+                  key_ptr,
                   cos_start,
                   sin_start,
                   rotary_dim,
@@ -128,13 +132,13 @@ std::tuple<at::Tensor, at::Tensor, at::Tensor> ApplyROPEKernel(
               float out1 = in1 * cos + in0 * sin;
               query_ptr[out_offset_q + h] = out0;
               query_ptr[out_offset_q + h + offset] = out1;
-              if (concat_qkv && n < N_KV) {
+              if (key_ptr != nullptr) {
                 in0 = in_ptr[in_offset_k + h];
                 in1 = in_ptr[in_offset_k + h + offset];
                 out0 = in0 * cos - in1 * sin;
                 out1 = in1 * cos + in0 * sin;
-                key_ptr[out_offset_k + h] = out0;
-                key_ptr[out_offset_k + h + offset] = out1;
+                key_ptr[h] = out0;
+                key_ptr[h + offset] = out1;
               }
             }
           }
@@ -145,26 +149,151 @@ std::tuple<at::Tensor, at::Tensor, at::Tensor> ApplyROPEKernel(
                 query_ptr + out_offset_q + rotary_dim,
                 in_ptr + in_offset_q + rotary_dim,
                 H - rotary_dim);
-            if (concat_qkv && n < N_KV) {
+            if (key_ptr != nullptr) {
               torch_ipex::cpu::kernel::move_ker<T, T>(
-                  key_ptr + out_offset_k + rotary_dim,
+                  key_ptr + rotary_dim,
                   in_ptr + in_offset_k + rotary_dim,
                   H - rotary_dim);
             }
           }
           // step 3) copy value from t_in when concat_qkv is true
-          if (concat_qkv && n < N_KV) {
+          if (value_ptr != nullptr) {
             auto in_offset_v = in_offset_k + N_KV * H;
             torch_ipex::cpu::kernel::move_ker<T, T>(
-                value_ptr + out_offset_k, in_ptr + in_offset_v, H);
+                value_ptr, in_ptr + in_offset_v, H);
           }
         }
       }
     }
   }
+}
+
+/**
+ * Returns the query, key, and value tensors of ApplyROPEKernelImpl. The key and
+ * value are undefined if t_in is query or key only.
+ */
+template <typename T>
+std::tuple<at::Tensor, at::Tensor, at::Tensor> ApplyROPEKernel(
+    at::Tensor& t_in,
+    at::Tensor& t_emb_pos,
+    at::Tensor& t_pos,
+    int64_t N, // N: number of head, H: head size
+    int64_t H,
+    int64_t offset,
+    int64_t rotary_dim) {
+  auto B = t_in.size(0);
+  auto S = t_in.size(1);
+  auto N_KV = rope_kv_head_num(t_in, N, H);
+  auto concat_qkv = N_KV > 0;
+  // initialize empty q/k/v
+  auto query = at::empty({B, S, N, H}, t_in.options());
+  auto key =
+      concat_qkv ? at::empty({B, S, N_KV, H}, t_in.options()) : at::Tensor();
+  auto value =
+      concat_qkv ? at::empty({B, S, N_KV, H}, t_in.options()) : at::Tensor();
+  auto key_ptr = concat_qkv ? key.data_ptr<T>() : nullptr;
+  auto value_ptr = concat_qkv ? value.data_ptr<T>() : nullptr;
+  auto out_stride_kb = concat_qkv ? key.stride(0) : 0;
+  auto out_stride_ks = concat_qkv ? key.stride(1) : 0;
+  ApplyROPEKernelImpl<T>(
+      t_in,
+      t_emb_pos,
+      t_pos,
+      N,
+      H,
+      N_KV,
+      offset,
+      rotary_dim,
+      query,
+      [&](int64_t b, int64_t s, int64_t n) {
+        auto out_offset_k = b * out_stride_kb + s * out_stride_ks + n * H;
+        return std::make_pair(key_ptr + out_offset_k, value_ptr + out_offset_k);
+      });
   return std::make_tuple(query, key, value);
 }
 
+/**
+ * Applies ApplyROPEKernelImpl to a concat_qkv input and writes the key and
+ * value straight into the kv cache.
+ *
+ * @param key_cache The key cache. It is the indirect access kv cache
+ * [max_positions][beam_batch][N_KV][H] if slot_mapping is not given, the
+ * token (b, s) is written at [cache_offset + s][b * beam_batch / B]. Otherwise
+ * it is the paged kv cache [num_blocks][block_size][N_KV][H], the token (b, s)
+ * is written in the slot slot_mapping[b * S + s].
+ * @param value_cache The value cache, with the same layout as the key cache.
+ * @param slot_mapping Optional [B * S] slots of the tokens in the paged cache.
+ * @param cache_offset The position of the first token in the indirect access
+ * kv cache.
+ * @return The query tensor [B][S][N][H].
+ */
+template <typename T>
+at::Tensor ApplyROPEWithKVCacheKernel(
+    at::Tensor& t_in,
+    at::Tensor& t_emb_pos,
+    at::Tensor& t_pos,
+    int64_t N, // N: number of head, H: head size
+    int64_t H,
+    int64_t N_KV,
+    int64_t offset,
+    int64_t rotary_dim,
+    at::Tensor& key_cache,
+    at::Tensor& value_cache,
+    const c10::optional<at::Tensor>& slot_mapping,
+    int64_t cache_offset) {
+  auto B = t_in.size(0);
+  auto S = t_in.size(1);
+  auto query = at::empty({B, S, N, H}, t_in.options());
+  auto key_cache_ptr = key_cache.data_ptr<T>();
+  auto value_cache_ptr = value_cache.data_ptr<T>();
+  auto kc_stride_0 = key_cache.stride(0);
+  auto kc_stride_1 = key_cache.stride(1);
+  auto kc_stride_2 = key_cache.stride(2);
+  auto vc_stride_0 = value_cache.stride(0);
+  auto vc_stride_1 = value_cache.stride(1);
+  auto vc_stride_2 = value_cache.stride(2);
+  auto cache_ptrs = [&](int64_t i0, int64_t i1, int64_t n) {
+    return std::make_pair(
+        key_cache_ptr + i0 * kc_stride_0 + i1 * kc_stride_1 + n * kc_stride_2,
+        value_cache_ptr + i0 * vc_stride_0 + i1 * vc_stride_1 +
+            n * vc_stride_2);
+  };
+  if (slot_mapping.has_value()) {
+    auto slot_mapping_ptr = slot_mapping.value().data_ptr<int>();
+    auto block_size = key_cache.size(1);
+    ApplyROPEKernelImpl<T>(
+        t_in,
+        t_emb_pos,
+        t_pos,
+        N,
+        H,
+        N_KV,
+        offset,
+        rotary_dim,
+        query,
+        [&](int64_t b, int64_t s, int64_t n) {
+          auto slot = slot_mapping_ptr[b * S + s];
+          return cache_ptrs(slot / block_size, slot % block_size, n);
+        });
+  } else {
+    auto beam_size = key_cache.size(1) / B;
+    ApplyROPEKernelImpl<T>(
+        t_in,
+        t_emb_pos,
+        t_pos,
+        N,
+        H,
+        N_KV,
+        offset,
+        rotary_dim,
+        query,
+        [&](int64_t b, int64_t s, int64_t n) {
+          return cache_ptrs(cache_offset + s, b * beam_size, n);
+        });
+  }
+  return query;
+}
+
 std::tuple<at::Tensor, at::Tensor, at::Tensor>
 rotary_position_embedding_kernel_impl(
     at::Tensor& t_in,
@@ -196,11 +325,123 @@ rotary_position_embedding_kernel_impl(
   }
 }
 
+at::Tensor rotary_position_embedding_with_kv_cache_kernel_impl(
+    at::Tensor& t_in,
+    at::Tensor& t_emb_pos,
+    at::Tensor& t_pos,
+    int64_t N, // N: number of head, H: head size
+    int64_t H,
+    int64_t offset,
+    int64_t rotary_dim,
+    at::Tensor& key_cache,
+    at::Tensor& value_cache,
+    const c10::optional<at::Tensor>& slot_mapping,
+    int64_t cache_offset) {
+  t_in = t_in.contiguous();
+  t_emb_pos = t_emb_pos.contiguous();
+  t_pos = t_pos.contiguous();
+  auto N_KV = rope_kv_head_num(t_in, N, H);
+  TORCH_CHECK(
+      t_in.dim() == 3 && N_KV > 0,
+      "rotary_position_embedding_with_kv_cache: t_in should be the fused qkv (batch, seq_len, qkv_hidden_size)");
+  TORCH_CHECK(
+      key_cache.dim() == 4 && value_cache.sizes() == key_cache.sizes(),
+      "rotary_position_embedding_with_kv_cache: key_cache and value_cache should have the same 4D shape");
+  TORCH_CHECK(
+      key_cache.size(2) == N_KV && key_cache.size(3) == H,
+      "rotary_position_embedding_with_kv_cache: the cache should hold ",
+      N_KV,
+      " heads of size ",
+      H);
+  TORCH_CHECK(
+      key_cache.stride(3) == 1 && value_cache.stride(3) == 1,
+      "rotary_position_embedding_with_kv_cache: the head of the cache should be contiguous");
+  TORCH_CHECK(
+      key_cache.scalar_type() == t_in.scalar_type() &&
+          value_cache.scalar_type() == t_in.scalar_type(),
+      "rotary_position_embedding_with_kv_cache: the cache should have the data type of t_in");
+  auto B = t_in.size(0);
+  auto S = t_in.size(1);
+  if (slot_mapping.has_value()) {
+    TORCH_CHECK(
+        slot_mapping.value().scalar_type() == at::kInt &&
+            slot_mapping.value().is_contiguous() &&
+            slot_mapping.value().numel() == B * S,
+        "rotary_position_embedding_with_kv_cache: slot_mapping should be a contiguous int tensor of batch * seq_len slots");
+  } else {
+    TORCH_CHECK(
+        cache_offset >= 0 && cache_offset + S <= key_cache.size(0),
+        "rotary_position_embedding_with_kv_cache: the tokens [",
+        cache_offset,
+        ", ",
+        cache_offset + S,
+        ") are out of the kv cache of ",
+        key_cache.size(0),
+        " positions");
+    TORCH_CHECK(
+        key_cache.size(1) % B == 0,
+        "rotary_position_embedding_with_kv_cache: the beam batch of the cache should be a multiple of the batch of t_in");
+  }
+  if (t_in.scalar_type() == at::kFloat) {
+    return ApplyROPEWithKVCacheKernel<float>(
+        t_in,
+        t_emb_pos,
+        t_pos,
+        N,
+        H,
+        N_KV,
+        offset,
+        rotary_dim,
+        key_cache,
+        value_cache,
+        slot_mapping,
+        cache_offset);
+  } else if (t_in.scalar_type() == at::kBFloat16) {
+    return ApplyROPEWithKVCacheKernel<at::BFloat16>(
+        t_in,
+        t_emb_pos,
+        t_pos,
+        N,
+        H,
+        N_KV,
+        offset,
+        rotary_dim,
+        key_cache,
+        value_cache,
+        slot_mapping,
+        cache_offset);
+  } else if (t_in.scalar_type() == at::kHalf) {
+    return ApplyROPEWithKVCacheKernel<at::Half>(
+        t_in,
+        t_emb_pos,
+        t_pos,
+        N,
+        H,
+        N_KV,
+        offset,
+        rotary_dim,
+        key_cache,
+        value_cache,
+        slot_mapping,
+        cache_offset);
+  } else {
+    TORCH_CHECK(
+        false,
+        "rotary_position_embedding_with_kv_cache_kernel_impl: unsupported '",
+        t_in.scalar_type(),
+        "'");
+    return at::Tensor();
+  }
+}
+
 } // anonymous namespace
 
 IPEX_REGISTER_DISPATCH(
     rotary_position_embedding_kernel_stub,
     &rotary_position_embedding_kernel_impl);
+IPEX_REGISTER_DISPATCH(
+    rotary_position_embedding_with_kv_cache_kernel_stub,
+    &rotary_position_embedding_with_kv_cache_kernel_impl);
 
 } // namespace cpu
 } // namespace torch_ipex
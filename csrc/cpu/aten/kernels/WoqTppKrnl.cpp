@@ -5,6 +5,13 @@
 #include <ATen/cpu/vec/functional.h>
 #include <ATen/cpu/vec/vec.h>
 #include <aten/Linear.h>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <typeinfo>
+#include "csrc/cpu/aten/utils/shape_tuner.h"
 #include "csrc/cpu/tpp/woq/tla.h"
 
 #ifdef __GNUC__
@@ -135,6 +142,9 @@ float dequantize_nf4_scalar(uint8_t val) {
 
 #define SMALL_BATCH_THRESHOLD 32
 #define PARALLEL_M_THRESHOLD 128
+#define DEQUANT_ONCE_M_THRESHOLD 128
+// size of the per thread dequantized weight panel, about half of the L2
+constexpr long DEQUANT_PANEL_BYTES = 1024 * 1024;
 constexpr long PREFETCH_K_DIST = 64; // TODO(jgong5): do not hard-code
 constexpr long LOOP_K_UNROLL = 4; // TODO(jgong5): do not hard-code
 
@@ -1251,6 +1261,92 @@ struct Dequantize<int8_t, ldb, /*N_GROUP_SIZE*/ 16, /*qw_type*/ QINT4> {
   }
 };
 
+// NF4 levels scaled by 127 and rounded to int8, 1/127 is folded into the
+// weight scales when NF4 is computed in int8
+inline const std::array<int8_t, 16>& nf4_int8_lut() {
+  static const std::array<int8_t, 16> lut = []() {
+    std::array<int8_t, 16> lut;
+    for (int i = 0; i < 16; i++) {
+      lut[i] = (int8_t)std::nearbyint(dequantize_nf4_scalar(i) * 127.f);
+    }
+    return lut;
+  }();
+  return lut;
+}
+constexpr float NF4_INT8_SCALE = 1.f / 127.f;
+
+template <long ldb>
+struct Dequantize<int8_t, ldb, /*N_GROUP_SIZE*/ 16, /*qw_type*/ NF4> {
+  static inline void call(
+      uint8_t* qB,
+      long K,
+      long N,
+      int8_t* zps,
+      int8_t* B,
+      int32_t* compensation) {
+#ifdef __AVX512VNNI__
+    auto pqB = GetVLAPtr<uint8_t>(qB, {ldb, 2}); // [K/4,N,4] packed in 4-bit
+    auto pB = GetVLAPtr<int8_t>(B, {ldb, 4}); // [K/4,N,4]
+    __m256i ones = _mm256_set1_epi8(1);
+    auto lut_data = nf4_int8_lut().data();
+    __m256i lut = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(lut_data)));
+    for (int n = 0; n < N; n += 16) {
+      __m256i vcompensate[2];
+      vcompensate[0] = _mm256_setzero_si256();
+      vcompensate[1] = _mm256_setzero_si256();
+      for (int k = 0; k < K / 4; k++) {
+        auto [low, high] = load_int4_as_int8(pqB[k][n]);
+        low = _mm256_shuffle_epi8(lut, low);
+        high = _mm256_shuffle_epi8(lut, high);
+        vcompensate[0] = _mm256_dpbusd_epi32(vcompensate[0], ones, low);
+        vcompensate[1] = _mm256_dpbusd_epi32(vcompensate[1], ones, high);
+        _mm256_storeu_si256(reinterpret_cast<__m256i_u*>(pB[k][n]), low);
+        _mm256_storeu_si256(reinterpret_cast<__m256i_u*>(pB[k][n + 8]), high);
+      }
+      _mm256_storeu_si256(
+          reinterpret_cast<__m256i_u*>(&compensation[n]), vcompensate[0]);
+      _mm256_storeu_si256(
+          reinterpret_cast<__m256i_u*>(&compensation[n + 8]), vcompensate[1]);
+    }
+#else
+    TLA_ASSERT(false, "not implemented");
+#endif
+  }
+};
+
+// int8 weights are used as they are, the zero points cannot be subtracted
+// within int8 and are applied to the int32 result instead
+template <long ldb>
+struct Dequantize<int8_t, ldb, /*N_GROUP_SIZE*/ 16, /*qw_type*/ QINT8> {
+  static inline void call(
+      uint8_t* qB,
+      long K,
+      long N,
+      int8_t* zps,
+      int8_t* B,
+      int32_t* compensation) {
+#ifdef __AVX512VNNI__
+    auto pqB = GetVLAPtr<int8_t>((int8_t*)qB, {ldb, 4}); // [K/4,N,4]
+    auto pB = GetVLAPtr<int8_t>(B, {ldb, 4}); // [K/4,N,4]
+    __m256i ones = _mm256_set1_epi8(1);
+    for (int n = 0; n < N; n += 8) {
+      __m256i vcompensate = _mm256_setzero_si256();
+      for (int k = 0; k < K / 4; k++) {
+        auto vb =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pqB[k][n]));
+        vcompensate = _mm256_dpbusd_epi32(vcompensate, ones, vb);
+        _mm256_storeu_si256(reinterpret_cast<__m256i_u*>(pB[k][n]), vb);
+      }
+      _mm256_storeu_si256(
+          reinterpret_cast<__m256i_u*>(&compensation[n]), vcompensate);
+    }
+#else
+    TLA_ASSERT(false, "not implemented");
+#endif
+  }
+};
+
 // TODO(jgong5): move to tpp.h
 template <
     typename Tin,
@@ -1412,15 +1508,25 @@ class DequantGemmTPP<
             });
       }
     } else {
-      constexpr const int N_GROUP_SIZE = get_n_group_size(N);
       Tin B[K][N];
       // TODO(jgong5): add prefetch
-      Dequantize<Tin, ldb, N_GROUP_SIZE, qw_type>::call(
-          qB, K, N, scales, zps, B[0]);
-      (*pgemm)(A, B[0], C, 1, no_tile_cfg);
+      dequant(qB, scales, zps, B[0]);
+      gemm(A, B[0], C, no_tile_cfg);
     }
   }
 
+  // Dequantizes the [K, N] block qB to B, in the layout taken by gemm
+  inline void dequant(uint8_t* qB, Tin* scales, Tin* zps, Tin* B) {
+    constexpr const int N_GROUP_SIZE = get_n_group_size(N);
+    Dequantize<Tin, ldb, N_GROUP_SIZE, qw_type>::call(
+        qB, K, N, scales, zps, B);
+  }
+
+  // C += A * B with B dequantized by dequant
+  inline void gemm(Tin* A, Tin* B, Tout* C, bool no_tile_cfg = true) {
+    (*pgemm)(A, B, C, 1, no_tile_cfg);
+  }
+
   void config() {
     if (pgemm) {
       pgemm->config();
@@ -1501,7 +1607,8 @@ class DequantGemmTPP<
       int32_t k_groups = -1) {
     auto qA = GetVLAPtr<uint8_t>(A, {lda});
 #ifdef __AVX512VNNI__
-    if (M < SMALL_BATCH_THRESHOLD) {
+    // the micro kernels only handle int4 weights, the others go to brgemm
+    if (qw_type == QINT4 && M < SMALL_BATCH_THRESHOLD) {
       constexpr long PREFERRED_BLOCK_M =
           BLOCK_M * N / 16 >= 16 ? BLOCK_M / 2 : BLOCK_M;
       for (long m = 0; m < M; m += PREFERRED_BLOCK_M) {
@@ -1585,11 +1692,20 @@ class DequantGemmTPP<
       int32_t qC[M][N];
       int32_t compensation[N];
       // TODO(jgong5): add prefetch
-      Dequantize<int8_t, ldb, N_GROUP_SIZE, /*qw_type*/ QINT4>::call(
+      Dequantize<int8_t, ldb, N_GROUP_SIZE, qw_type>::call(
           qB, K, N, zps, B[0][0], compensation);
       (*pgemm)((int8_t*)qA[0], B[0][0], qC[0], 1, no_tile_cfg);
       // post-op and convert back to C
       for (long m = 0; m < M; ++m) {
+        // sum(a - zp_a)(w - zp_w) = sum(a * w) - zp_a * sum(w) -
+        //                           zp_w * (sum(a) - K * zp_a)
+        // where the int8 weights still carry their zero points
+        int32_t a_sum = 0;
+        if constexpr (qw_type == QINT8) {
+          for (long k = 0; k < K; ++k) {
+            a_sum += qA[m][k];
+          }
+        }
 #pragma omp simd
         for (long n = 0; n < N; ++n) {
           float* scale_a_m;
@@ -1603,8 +1719,14 @@ class DequantGemmTPP<
             scale_a_m = scale_a;
             zp_a_m = zp_a;
           }
-          float c = (qC[m][n] - compensation[n] * (*zp_a_m)) * (*scale_a_m) *
-              scales[n];
+          int32_t qc = qC[m][n] - compensation[n] * (*zp_a_m);
+          float scale_w = scales[n];
+          if constexpr (qw_type == QINT8) {
+            qc -= zps[n] * (a_sum - K * (*zp_a_m));
+          } else if constexpr (qw_type == NF4) {
+            scale_w *= NF4_INT8_SCALE;
+          }
+          float c = qc * (*scale_a_m) * scale_w;
           if constexpr (ACC) {
             C[m * ldc + n] += c;
           } else {
@@ -1635,6 +1757,80 @@ class DequantGemmTPP<
   long ldc;
 };
 
+// Scratch of the calling thread for the dequantized weight panels. It is kept
+// across the calls and only grows, so the large prefill GEMMs do not allocate.
+inline char* dequant_once_scratch(long size) {
+  thread_local std::unique_ptr<char, decltype(&std::free)> buf(
+      nullptr, std::free);
+  thread_local long capacity = 0;
+  if (size > capacity) {
+    // aligned_alloc requires a size that is a multiple of the alignment
+    auto aligned_size = (size + 63) / 64 * 64;
+    capacity = 0;
+    buf.reset((char*)std::aligned_alloc(64, aligned_size));
+    TORCH_CHECK(
+        buf != nullptr,
+        "Failed to allocate ",
+        aligned_size,
+        " bytes for the dequantized weight");
+    capacity = aligned_size;
+  }
+  return buf.get();
+}
+
+// Loop schedule of qlinear_woq_affine_impl
+struct WoqTppSchedule {
+  long block_m;
+  // distribute the M blocks to the threads in addition to the N blocks
+  bool parallel_m;
+  // prefetch the weight PREFETCH_K_DIST ahead along K
+  bool prefetch;
+};
+
+// The M blocks are also parallelized once the N blocks alone cannot keep all
+// the threads busy, which is the case of large prefill on narrow weights.
+inline WoqTppSchedule woq_tpp_default_schedule(long M, long Nc) {
+  long block_m = M < 32 ? M : (M < 64 ? 32 : 64);
+  bool parallel_m = M >= PARALLEL_M_THRESHOLD ||
+      (M > block_m && Nc < omp_get_max_threads());
+  return {block_m, parallel_m, true};
+}
+
+inline std::vector<WoqTppSchedule> woq_tpp_schedule_candidates(long M) {
+  std::vector<WoqTppSchedule> candidates;
+  for (long block_m : {32L, 64L, 128L}) {
+    if (block_m > M) {
+      break;
+    }
+    for (bool parallel_m : {false, true}) {
+      for (bool prefetch : {true, false}) {
+        candidates.push_back({block_m, parallel_m, prefetch});
+      }
+    }
+  }
+  return candidates;
+}
+
+inline std::ostream& operator<<(
+    std::ostream& out,
+    const WoqTppSchedule& schedule) {
+  return out << schedule.block_m << " " << schedule.parallel_m << " "
+             << schedule.prefetch;
+}
+
+inline std::istream& operator>>(std::istream& in, WoqTppSchedule& schedule) {
+  return in >> schedule.block_m >> schedule.parallel_m >> schedule.prefetch;
+}
+
+// Schedules tuned for each shape. The tuning is enabled with
+// WOQ_TPP_AUTOTUNE=1, and the table is kept in the file named by
+// WOQ_TPP_TUNE_CACHE if it is set.
+inline ShapeTuner<WoqTppSchedule>& woq_tpp_tuner() {
+  static ShapeTuner<WoqTppSchedule> tuner(
+      env2int("WOQ_TPP_AUTOTUNE", 0) != 0, getenv("WOQ_TPP_TUNE_CACHE"));
+  return tuner;
+}
+
 // If T != TComp
 //   T -> TComp -> GEMM -> TComp -> bias/PostOp -> Tout
 // If T == TComp (we can save intermediate output buffer and schedule M/N/K
@@ -1649,7 +1845,8 @@ template <
     typename TZero,
     int quant_a_mode = -1,
     int quant_w_mode = 0>
-void qlinear_woq_affine_impl(
+void qlinear_woq_affine_impl_(
+    const WoqTppSchedule& schedule,
     const at::Tensor& x,
     const at::Tensor& qw_packed,
     const at::Tensor& scales, // dtype is TComp
@@ -1685,17 +1882,7 @@ void qlinear_woq_affine_impl(
       num_concats <= 1 || Nc % num_concats == 0,
       "Nc must be a multiple of num_concats");
 
-  // select BLOCK_M according to M
-  // TODO(jgong5): improve the heuristic
-  auto BLOCK_M = [&]() -> long {
-    if (M < 32) {
-      return M;
-    } else if (M < 64) {
-      return 32;
-    } else {
-      return 64;
-    }
-  }();
+  auto BLOCK_M = schedule.block_m;
 
   auto BLOCK_M_rem = M % BLOCK_M;
 
@@ -1711,6 +1898,11 @@ void qlinear_woq_affine_impl(
   bool no_x_buf = std::is_same<T, TComp>();
   bool no_y_buf = std::is_same<T, TComp>() && std::is_same<Tout, TGemmOut>() &&
       k_splits == 1;
+  // For large M, every thread dequantizes a weight panel to bf16 once and
+  // reuses it for all its M blocks instead of dequantizing per M block
+  bool dequant_once = std::is_same<TComp, bfloat16>() &&
+      std::is_same<TScale, TComp>() && std::is_same<TZero, TComp>() &&
+      no_x_buf && k_splits == 1 && M >= DEQUANT_ONCE_M_THRESHOLD;
 
   auto lda = no_x_buf ? K : Kb;
   auto ldy = num_concats <= 1 ? N : Nc / num_concats * Nb;
@@ -1911,9 +2103,126 @@ void qlinear_woq_affine_impl(
                 LIBXSMM_MELTW_FLAG_BINARY_NONE,
                 LIBXSMM_MELTW_TYPE_BINARY_ADD);
 
-            // TODO(jgong5): parallelize over M on large BS
-            if (no_y_buf) {
-              auto loop_scheme = M >= PARALLEL_M_THRESHOLD ? "ACb" : "aCb";
+            if (dequant_once) {
+              if constexpr (
+                  std::is_same<TComp, bfloat16>() &&
+                  std::is_same<TScale, TComp>() &&
+                  std::is_same<TZero, TComp>()) {
+                auto num_threads = omp_get_max_threads();
+                long panel_kc = std::max(
+                    1L,
+                    std::min<long>(
+                        Kc, DEQUANT_PANEL_BYTES / (Kb * Nb * sizeof(TComp))));
+                long num_m_blocks = (M + BLOCK_M - 1) / BLOCK_M;
+                // M is only split when the N panels cannot occupy the threads
+                long m_splits =
+                    std::min(num_m_blocks, std::max(1L, num_threads / Nc));
+                long m_split_size =
+                    (num_m_blocks + m_splits - 1) / m_splits * BLOCK_M;
+                // sizes of the scratch are multiples of the 64-byte alignment
+                long panel_size =
+                    (panel_kc * Kb * Nb * sizeof(TComp) + 63) / 64 * 64;
+                // Without no_y_buf, the M split of the thread is accumulated in
+                // TGemmOut and converted to Tout after the last panel
+                long y_acc_size =
+                    no_y_buf ? 0 : m_split_size * Nb * sizeof(TGemmOut);
+                auto gemm_loop = ThreadedLoop<2>({{Nc}, {m_splits}}, "AB");
+                gemm_loop(
+                    [&](int* idx) {
+                      char* scratch =
+                          dequant_once_scratch(panel_size + y_acc_size);
+                      auto panel_ptr =
+                          GetVLAPtr<TComp>((TComp*)scratch, {Kb * Nb});
+                      auto y_acc_ptr = GetVLAPtr<TGemmOut>(
+                          (TGemmOut*)(scratch + panel_size), {Nb});
+                      int nc = idx[0];
+                      long m_start = idx[1] * m_split_size;
+                      long m_end = std::min<long>(M, m_start + m_split_size);
+                      for (long kc_start = 0; kc_start < Kc;
+                           kc_start += panel_kc) {
+                        long kc_end = std::min<long>(Kc, kc_start + panel_kc);
+                        for (long kc = kc_start; kc < kc_end; kc++) {
+                          int32_t quant_offset =
+                              quant_w_mode == QUANT_W_PER_CHANNEL
+                              ? 0
+                              : kc / quant_block_multiple;
+                          dequant_gemm_tpp.dequant(
+                              pw[nc][kc],
+                              pscales[nc][quant_offset],
+                              sym_quant ? nullptr : pzps[nc][quant_offset],
+                              panel_ptr[kc - kc_start]);
+                        }
+                        for (long m = m_start; m < m_end; m += BLOCK_M) {
+                          bool is_rem = (m + BLOCK_M > M);
+                          Tout* y_out_ptr = num_concats <= 1
+                              ? (Tout*)py[m][nc]
+                              : (Tout*)py_concat[nc / (Nc / num_concats)][m]
+                                                [nc % (Nc / num_concats)];
+                          TGemmOut* y_ptr = no_y_buf
+                              ? (TGemmOut*)y_out_ptr
+                              : y_acc_ptr[m - m_start];
+                          if (kc_start == 0) {
+                            auto& copy_bias_tpp = no_y_buf
+                                ? copy_bias_out_tpp
+                                : copy_bias_buf_tpp;
+                            auto& copy_bias_rem_tpp = no_y_buf
+                                ? copy_bias_out_rem_tpp
+                                : copy_bias_buf_rem_tpp;
+                            auto& zero_tpp =
+                                no_y_buf ? zero_out_tpp : zero_buf_tpp;
+                            auto& zero_rem_tpp =
+                                no_y_buf ? zero_out_rem_tpp : zero_buf_rem_tpp;
+                            if (b.defined()) {
+                              if (!is_rem) {
+                                copy_bias_tpp(pb[nc], y_ptr);
+                              } else {
+                                copy_bias_rem_tpp(pb[nc], y_ptr);
+                              }
+                            } else {
+                              if (!is_rem) {
+                                zero_tpp(y_ptr);
+                              } else {
+                                zero_rem_tpp(y_ptr);
+                              }
+                            }
+                          }
+                          for (long kc = kc_start; kc < kc_end; kc++) {
+                            TComp* x_ptr = (TComp*)px[m][kc];
+                            TComp* w_ptr = panel_ptr[kc - kc_start];
+                            if (!is_rem) {
+                              dequant_gemm_tpp.gemm(x_ptr, w_ptr, y_ptr);
+                            } else {
+                              dequant_gemm_rem_tpp.gemm(
+                                  x_ptr, w_ptr, y_ptr, false);
+                            }
+                          }
+                          if (is_rem) {
+                            dequant_gemm_tpp.config();
+                          }
+                          if (kc_end == Kc) {
+                            if (!no_y_buf) {
+                              if (!is_rem) {
+                                cvt_y_tpp(y_ptr, y_out_ptr);
+                              } else {
+                                cvt_y_rem_tpp(y_ptr, y_out_ptr);
+                              }
+                            }
+                            if (fusion_type > 0) {
+                              if (!is_rem) {
+                                post_ops_fn(m, nc);
+                              } else {
+                                post_ops_rem_fn(m, nc);
+                              }
+                            }
+                          }
+                        }
+                      }
+                    },
+                    [&]() { dequant_gemm_tpp.config(); },
+                    [&]() { dequant_gemm_tpp.release(); });
+              }
+            } else if (no_y_buf) {
+              auto loop_scheme = schedule.parallel_m ? "ACb" : "aCb";
               auto gemm_loop = ThreadedLoop<3>(
                   {{0, M, BLOCK_M, false}, {Kc}, {Nc}}, loop_scheme);
               gemm_loop(
@@ -1927,7 +2236,7 @@ void qlinear_woq_affine_impl(
                     int32_t quant_offset = kc / quant_block_multiple;
                     if constexpr (std::is_same<TComp, uint8_t>()) {
                       TLA_ASSERT(
-                          !sym_quant,
+                          !sym_quant || qw_type == NF4,
                           "Calculation of uint8 does not support symmetric quant.");
                       if constexpr (quant_a_mode == QUANT_A_PER_TENSOR) {
                         scale_a = scales_a_ptr;
@@ -1974,7 +2283,7 @@ void qlinear_woq_affine_impl(
                         }
                       }
                       TComp* x_ptr = (TComp*)px[m][kc];
-                      if (kc < Kc - 1) {
+                      if (schedule.prefetch && kc < Kc - 1) {
                         dequant_gemm_tpp(
                             x_ptr,
                             pw[nc][kc],
@@ -1996,7 +2305,7 @@ void qlinear_woq_affine_impl(
                             scale_a,
                             zp_a,
                             k_groups);
-                        if (fusion_type > 0) {
+                        if (kc == Kc - 1 && fusion_type > 0) {
                           post_ops_fn(m, nc);
                         }
                       }
@@ -2009,7 +2318,7 @@ void qlinear_woq_affine_impl(
                         }
                       }
                       TComp* x_ptr = (TComp*)px[m][kc];
-                      if (kc < Kc - 1) {
+                      if (schedule.prefetch && kc < Kc - 1) {
                         dequant_gemm_rem_tpp(
                             x_ptr,
                             pw[nc][kc],
@@ -2033,7 +2342,7 @@ void qlinear_woq_affine_impl(
                             zp_a,
                             k_groups);
                         dequant_gemm_no_prefetch_tpp.config();
-                        if (fusion_type > 0) {
+                        if (kc == Kc - 1 && fusion_type > 0) {
                           post_ops_rem_fn(m, nc);
                         }
                       }
@@ -2061,7 +2370,7 @@ void qlinear_woq_affine_impl(
               auto y_private_ptr = GetVLAPtr<TGemmOut>(y_private, {M, Nc, Nb});
               auto y_private_valid_ptr =
                   GetVLAPtr<bool>(y_private_valid, {M / BLOCK_M, Nc});
-              auto loop_scheme = M >= PARALLEL_M_THRESHOLD ? "CAB" : "ABc";
+              auto loop_scheme = schedule.parallel_m ? "CAB" : "ABc";
               auto gemm_loop = ThreadedLoop<3>(
                   {{Nc}, {0, Kc, Kc / k_splits, true}, {0, M, BLOCK_M, false}},
                   loop_scheme);
@@ -2112,7 +2421,7 @@ void qlinear_woq_affine_impl(
                       int32_t quant_offset = kc / quant_block_multiple;
                       if constexpr (std::is_same<TComp, uint8_t>()) {
                         TLA_ASSERT(
-                            !sym_quant,
+                            !sym_quant || qw_type == NF4,
                             "Calculation of uint8 does not support symmetric quant.");
                         if constexpr (quant_a_mode == QUANT_A_PER_TENSOR) {
                           scale_a = scales_a_ptr;
@@ -2151,7 +2460,7 @@ void qlinear_woq_affine_impl(
                           (*pcvt_x_tpp)(px[m][kc], x_buf[0]);
                           x_ptr = x_buf[0];
                         }
-                        if (kc < Kc - 1) {
+                        if (schedule.prefetch && kc < Kc - 1) {
                           dequant_gemm_tpp(
                               x_ptr,
                               pw[nc][kc],
@@ -2180,7 +2489,7 @@ void qlinear_woq_affine_impl(
                           (*pcvt_x_rem_tpp)(px[m][kc], x_buf[0]);
                           x_ptr = x_buf[0];
                         }
-                        if (kc < Kc - 1) {
+                        if (schedule.prefetch && kc < Kc - 1) {
                           dequant_gemm_rem_tpp(
                               x_ptr,
                               pw[nc][kc],
@@ -2257,6 +2566,94 @@ void qlinear_woq_affine_impl(
           [](auto tuple) { failing_fallback(); });
 }
 
+template <
+    typename T,
+    typename TComp,
+    typename TGemmOut,
+    typename Tout,
+    typename TScale,
+    typename TZero,
+    int quant_a_mode = -1,
+    int quant_w_mode = 0>
+void qlinear_woq_affine_impl(
+    const at::Tensor& x,
+    const at::Tensor& qw_packed,
+    const at::Tensor& scales, // dtype is TComp
+    const at::Tensor& b, // dtype is TComp
+    at::Tensor y,
+    const int qw_type,
+    int k_splits,
+    int num_concats,
+    int fusion_type,
+    const TensorList& others_list,
+    int64_t quant_block_k,
+    const std::optional<at::Tensor>& zps = std::nullopt, // dtype is TComp
+    float* scales_a_ptr = nullptr,
+    int32_t* zps_a_ptr = nullptr) {
+  auto M = x.size(0);
+  auto Nc = qw_packed.size(0);
+  auto schedule = woq_tpp_default_schedule(M, Nc);
+  auto run = [&](const WoqTppSchedule& schedule, const at::Tensor& out) {
+    qlinear_woq_affine_impl_<
+        T,
+        TComp,
+        TGemmOut,
+        Tout,
+        TScale,
+        TZero,
+        quant_a_mode,
+        quant_w_mode>(
+        schedule,
+        x,
+        qw_packed,
+        scales,
+        b,
+        out,
+        qw_type,
+        k_splits,
+        num_concats,
+        fusion_type,
+        others_list,
+        quant_block_k,
+        zps,
+        scales_a_ptr,
+        zps_a_ptr);
+  };
+  auto& tuner = woq_tpp_tuner();
+  // The decode shapes are latency bound and keep the default schedule
+  if (M < SMALL_BATCH_THRESHOLD || !tuner.active()) {
+    run(schedule, y);
+    return;
+  }
+
+  // M is bucketed to the next power of 2 so that prompts of similar length
+  // share a tuning result
+  long M_bucket = SMALL_BATCH_THRESHOLD;
+  while (M_bucket < M) {
+    M_bucket *= 2;
+  }
+  std::ostringstream key;
+  key << typeid(T).name() << "_" << typeid(TComp).name() << "_"
+      << typeid(Tout).name() << "_" << quant_a_mode << "_" << quant_w_mode
+      << "_" << qw_type << "_" << M_bucket << "_" << qw_packed.size(0) << "x"
+      << qw_packed.size(3) << "_" << qw_packed.size(1) << "x"
+      << qw_packed.size(2) << "_" << k_splits << "_" << num_concats << "_"
+      << omp_get_max_threads();
+  // The candidates write a scratch output so that y is only computed once
+  at::Tensor y_scratch;
+  schedule = tuner.get(
+      key.str(),
+      schedule,
+      [&]() { return woq_tpp_schedule_candidates(M); },
+      [&](const WoqTppSchedule& candidate) {
+        if (!y_scratch.defined()) {
+          y_scratch = at::empty_like(y);
+        }
+        run(candidate, y_scratch);
+      });
+  run(schedule, y);
+}
+
 /**
  * @brief pack the weight in quantized format.
  * @param qw quantized weight with shape [N, K]
@@ -2288,7 +2685,6 @@ at::Tensor qlinear_woq_pack(
   const int Nc = N / block_n;
   const int Kc = K / block_k;
   if (is_4bit_flag) {
-    // TODO(jgong5): support lowp_mode == LOWP_MODE_INT8
     auto result = at::empty({Nc, Kc, block_k, block_n / 2}, qw.options());
     // Pack weight in [N,K] to [N/block_n, K/block_k, block_k, block_n]
     // And then, pre-shuffle per 32 or 64 4-bit values to save shuffle at
@@ -2327,15 +2723,16 @@ at::Tensor qlinear_woq_pack(
     });
     return result;
   } else {
-    TLA_ASSERT(
-        lowp_mode != LOWP_MODE_INT8,
-        "lowp mode int8 is not supported yet with int8 weight");
     auto result = at::empty({Nc, Kc, block_k, block_n}, qw.options());
     // Pack weight in [N,K] to [N/block_n, K/block_k, block_k, block_n]
+    // With LOWP_MODE_INT8, every 4 values along K are kept together (VNNI-4),
+    // i.e., [N/block_n, K/block_k, block_k/4, block_n, 4]
     int8_t* src_data = (int8_t*)qw.data_ptr();
     int8_t* dst_data = (int8_t*)result.data_ptr();
     auto psrc = GetVLAPtr<int8_t>(src_data, {block_n, Kc, block_k});
     auto pdst = GetVLAPtr<int8_t>(dst_data, {Kc, block_k, block_n});
+    auto pdst_4vnni =
+        GetVLAPtr<int8_t>(dst_data, {Kc, block_k / 4, block_n, 4});
     auto pack_loop =
         ThreadedLoop<3>({{Nc}, {Kc}, {0, block_n, N_GROUP_SIZE, false}}, "ABc");
     pack_loop([&](int* idx) {
@@ -2344,7 +2741,12 @@ at::Tensor qlinear_woq_pack(
       int nb = idx[2];
       for (int i = 0; i < N_GROUP_SIZE; i++) {
         for (int kb = 0; kb < block_k; kb++) {
-          pdst[nc][kc][kb][nb + i] = psrc[nc][nb + i][kc][kb];
+          if (lowp_mode != LOWP_MODE_INT8) {
+            pdst[nc][kc][kb][nb + i] = psrc[nc][nb + i][kc][kb];
+          } else {
+            pdst_4vnni[nc][kc][kb / 4][nb + i][kb % 4] =
+                psrc[nc][nb + i][kc][kb];
+          }
         }
       }
     });
@@ -2368,7 +2770,6 @@ at::Tensor qlinear_woq_unpack(
     const int N_GROUP_SIZE =
         lowp_mode != LOWP_MODE_INT8 ? get_n_group_size(Nb) : 16;
     if (is_4bit_flag) {
-      // TODO: support lowp_mode == 3
       auto result = at::empty({N, K / 2}, qw_packed.options());
       uint8_t* src_data = (uint8_t*)qw_packed.data_ptr();
       uint8_t* dst_data = (uint8_t*)result.data_ptr();
@@ -2399,13 +2800,11 @@ at::Tensor qlinear_woq_unpack(
       });
       return result;
     } else {
-      TLA_ASSERT(
-          lowp_mode != LOWP_MODE_INT8,
-          "lowp mode int8 is not supported yet with int8 weight");
       auto result = at::empty({N, K}, qw_packed.options());
       int8_t* src_data = (int8_t*)qw_packed.data_ptr();
       int8_t* dst_data = (int8_t*)result.data_ptr();
       auto psrc = GetVLAPtr<int8_t>(src_data, {Kc, Kb, Nb});
+      auto psrc_4vnni = GetVLAPtr<int8_t>(src_data, {Kc, Kb / 4, Nb, 4});
       auto pdst = GetVLAPtr<int8_t>(dst_data, {Nb, Kc, Kb});
       auto unpack_loop =
           ThreadedLoop<3>({{Nc}, {Kc}, {0, Nb, N_GROUP_SIZE, false}}, "ABc");
@@ -2415,7 +2814,12 @@ at::Tensor qlinear_woq_unpack(
         int nb = idx[2];
         for (int kb = 0; kb < Kb; kb++) {
           for (int i = 0; i < N_GROUP_SIZE; i++) {
-            pdst[nc][nb + i][kc][kb] = psrc[nc][kc][kb][nb + i];
+            if (lowp_mode != LOWP_MODE_INT8) {
+              pdst[nc][nb + i][kc][kb] = psrc[nc][kc][kb][nb + i];
+            } else {
+              pdst[nc][nb + i][kc][kb] =
+                  psrc_4vnni[nc][kc][kb / 4][nb + i][kb % 4];
+            }
           }
         }
       });
@@ -3267,10 +3671,10 @@ at::Tensor qlinear_woq_affine(
                 }
               } else {
                 TLA_ASSERT(lowp_mode == LOWP_MODE_INT8, "invalid lowp_mode");
-                TLA_ASSERT(
-                    qw_type == QINT4,
-                    "LOWP_MODE_INT8 only support qw_type = QINT4");
-                TLA_ASSERT(!sym_quant, "qw_type = QINT4 is asymmetric quant");
+                // NF4 is symmetric and has no zero points
+                auto zps_int8 = sym_quant
+                    ? std::optional<at::Tensor>()
+                    : std::optional<at::Tensor>(zp_list[int8_idx]);
                 if (quant_a_mode == QUANT_A_PER_TENSOR) {
                   float scale_a;
                   int32_t zp_a;
@@ -3299,7 +3703,7 @@ at::Tensor qlinear_woq_affine(
                       fusion_type,
                       others_list,
                       quant_block_k,
-                      zp_list[int8_idx],
+                      zps_int8,
                       &scale_a,
                       &zp_a);
                 } else {
@@ -3345,7 +3749,7 @@ at::Tensor qlinear_woq_affine(
                                 fusion_type,
                                 others_list,
                                 quant_block_k,
-                                zp_list[int8_idx],
+                                zps_int8,
                                 scale_a_ptr,
                                 zp_a_ptr);
                           },
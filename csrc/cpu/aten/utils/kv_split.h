@@ -0,0 +1,55 @@
+#pragma once
+
+#include <omp.h>
+#include <algorithm>
+#include <cstdint>
+
+namespace torch_ipex {
+namespace cpu {
+
+// The minimal number of tokens handled by one KV partition when a sequence is
+// split across threads. Smaller partitions make the cross-partition reduction
+// dominate for little parallelism gain.
+constexpr int64_t PARTITION_MIN_TOKENS = 128;
+
+struct KVPartitions {
+  int64_t num_partitions;
+  // units per partition, the last partition may hold fewer
+  int64_t partition_size;
+};
+
+/*
+ *Split the KV context of every (sequence, head) work item into partitions so
+ *that (sequence, head, partition) provides enough work items for all the
+ *threads. The context is split in whole units, e.g. tokens or cache blocks,
+ *and a partition holds at least PARTITION_MIN_TOKENS tokens if it can.
+ *@param work_items: the number of (sequence, head) pairs
+ *@param num_units: the number of units of the longest context
+ *@param unit_tokens: the number of tokens of a unit
+ *An empty batch or context gets a single partition of at least one unit.
+ */
+inline KVPartitions split_kv_partitions(
+    int64_t work_items,
+    int64_t num_units,
+    int64_t unit_tokens = 1) {
+  if (work_items <= 0 || num_units <= 0) {
+    return {1, std::max<int64_t>(num_units, 1)};
+  }
+  int64_t thread_numbers = omp_get_max_threads();
+  auto min_partition_units =
+      std::max<int64_t>(1, PARTITION_MIN_TOKENS / unit_tokens);
+  int64_t num_partitions = 1;
+  if (work_items < thread_numbers) {
+    num_partitions = (thread_numbers + work_items - 1) / work_items;
+    num_partitions = std::min(
+        num_partitions,
+        (num_units + min_partition_units - 1) / min_partition_units);
+    num_partitions = std::max<int64_t>(num_partitions, 1);
+  }
+  auto partition_size = (num_units + num_partitions - 1) / num_partitions;
+  num_partitions = (num_units + partition_size - 1) / partition_size;
+  return {num_partitions, partition_size};
+}
+
+} // namespace cpu
+} // namespace torch_ipex
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace torch_ipex {
+namespace cpu {
+
+/*
+ *Table of the kernel configs tuned for each shape key. When the tuning is
+ *enabled, the config of a missing key is chosen by timing the candidates.
+ *The table is loaded from and appended to a cache file, if one is given, so
+ *that a warmup run can tune and later runs only load the table. Config is
+ *read and written with operator>> and operator<<.
+ */
+template <typename Config>
+class ShapeTuner {
+ public:
+  /*
+   *@param enabled: whether the missing keys are tuned
+   *@param cache_file: file of the table, nullptr if there is none
+   */
+  ShapeTuner(bool enabled, const char* cache_file) : enabled_(enabled) {
+    if (cache_file == nullptr) {
+      return;
+    }
+    cache_file_ = cache_file;
+    std::ifstream in(cache_file_);
+    std::string key;
+    Config config;
+    while (in >> key >> config) {
+      configs_[key] = config;
+    }
+  }
+
+  // Whether the table is used at all, i.e. tuned or loaded from a file
+  bool active() const {
+    return enabled_ || !cache_file_.empty();
+  }
+
+  /*
+   *Returns the config of key. A missing key gets default_config, or the
+   *fastest of candidates() if the tuning is enabled.
+   *@param candidates: returns the configs to time
+   *@param run: runs the kernel with a config, on scratch outputs if the
+   * result of the call must not be overwritten
+   */
+  template <typename C, typename F>
+  Config get(
+      const std::string& key,
+      const Config& default_config,
+      const C& candidates,
+      const F& run) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = configs_.find(key);
+      if (it != configs_.end()) {
+        return it->second;
+      }
+    }
+    if (!enabled_) {
+      return default_config;
+    }
+    Config best = default_config;
+    double best_time = std::numeric_limits<double>::max();
+    for (auto& candidate : candidates()) {
+      // the first run generates the kernels of the candidate
+      run(candidate);
+      auto start = std::chrono::steady_clock::now();
+      run(candidate);
+      std::chrono::duration<double> time =
+          std::chrono::steady_clock::now() - start;
+      if (time.count() < best_time) {
+        best_time = time.count();
+        best = candidate;
+      }
+    }
+    insert(key, best);
+    return best;
+  }
+
+ private:
+  void insert(const std::string& key, const Config& config) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!configs_.emplace(key, config).second || cache_file_.empty()) {
+      return;
+    }
+    std::ofstream out(cache_file_, std::ios::app);
+    out << key << " " << config << "\n";
+  }
+
+  bool enabled_;
+  std::mutex mutex_;
+  std::string cache_file_;
+  std::unordered_map<std::string, Config> configs_;
+};
+
+} // namespace cpu
+} // namespace torch_ipex
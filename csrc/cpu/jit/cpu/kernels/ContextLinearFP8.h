@@ -0,0 +1,60 @@
+#pragma once
+
+#include <ATen/Tensor.h>
+
+#include <ideep.hpp>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace torch_ipex {
+namespace cpu {
+namespace detail {
+struct ContextLinearFP8 final {
+  // Matmul primitive of an input shape, see fp8_linear::get_primitive
+  struct MatmulPrimitive {
+    dnnl::matmul::primitive_desc pd;
+    dnnl::matmul primitive;
+  };
+  // M of the input, the input has the dtype of the weight
+  using PrimitiveKey = int64_t;
+  using PrimitiveList = std::list<std::pair<PrimitiveKey, MatmulPrimitive>>;
+
+  int64_t out_features_;
+  int64_t in_features_;
+  ideep::tensor weight_packed_;
+  // at_weight will share same memory with weight_packed_, the plain weight is
+  // reordered back from it by fp8_linear::unpack
+  at::Tensor at_weight_;
+  c10::optional<at::Tensor> at_bias_;
+
+  // Primitives of the recently seen input shapes, the most recent first
+  PrimitiveList primitives_;
+  std::map<PrimitiveKey, PrimitiveList::iterator> primitive_index_;
+  std::unique_ptr<std::mutex> primitives_mutex_;
+
+  ContextLinearFP8() = delete;
+
+  ContextLinearFP8(
+      int64_t out_features,
+      int64_t in_features,
+      ideep::tensor&& weight_packed,
+      at::Tensor&& at_weight,
+      c10::optional<at::Tensor>&& bias)
+      : out_features_(out_features),
+        in_features_(in_features),
+        weight_packed_(std::move(weight_packed)),
+        at_weight_(std::move(at_weight)),
+        at_bias_(std::move(bias)),
+        primitives_mutex_(new std::mutex()) {}
+
+  ContextLinearFP8(ContextLinearFP8&&) = default;
+  ContextLinearFP8& operator=(ContextLinearFP8&&) = default;
+
+  ~ContextLinearFP8() {}
+};
+
+} // namespace detail
+} // namespace cpu
+} // namespace torch_ipex
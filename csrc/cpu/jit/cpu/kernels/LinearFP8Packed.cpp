@@ -0,0 +1,220 @@
+#include "LinearFP8Packed.h"
+#include <ideep.hpp>
+#include "aten/FP8Linear.h"
+#include "ideep/IDeepConversions.h"
+
+namespace torch_ipex {
+namespace cpu {
+namespace detail {
+namespace fp8_linear {
+
+namespace {
+// Primitives kept by a context, the ones of older input shapes are rebuilt
+constexpr size_t primitive_cache_capacity = 32;
+
+ideep::tensor::desc bias_desc_of(const ContextLinearFP8& context) {
+  if (!context.at_bias_.has_value()) {
+    return ideep::tensor::desc();
+  }
+  return ideep::tensor::desc(
+      {1, context.out_features_},
+      get_mkldnn_dtype(context.at_bias_->scalar_type()),
+      ideep::format_tag::ab);
+}
+
+// View of the scale at idx, passed to oneDNN without reading it
+ideep::tensor scale_view(const at::Tensor& scale_inv, int64_t idx) {
+  TORCH_CHECK(
+      scale_inv.scalar_type() == at::ScalarType::Float,
+      "ipex_prepack::fp8_linear_run: expects float scales");
+  return itensor_view_from_dense(scale_inv.narrow(0, idx, 1));
+}
+
+// Returns the matmul primitive of a [M, in_features] src, built with the
+// blocked layout of the packed weight. The layout was chosen for one batch
+// size, oneDNN picks the implementation of the other M that takes it.
+ContextLinearFP8::MatmulPrimitive get_primitive(
+    ContextLinearFP8& context,
+    int64_t M) {
+  std::lock_guard<std::mutex> lock(*context.primitives_mutex_);
+  auto it = context.primitive_index_.find(M);
+  if (it != context.primitive_index_.end()) {
+    context.primitives_.splice(
+        context.primitives_.begin(), context.primitives_, it->second);
+    return it->second->second;
+  }
+  auto pd = fp8_matmul_primitive_desc(
+      ideep::tensor::desc(
+          {M, context.in_features_},
+          context.weight_packed_.get_data_type(),
+          ideep::format_tag::ab),
+      context.weight_packed_.get_desc(),
+      bias_desc_of(context),
+      ideep::tensor::desc(
+          {M, context.out_features_},
+          get_mkldnn_dtype(at::ScalarType::Float),
+          ideep::format_tag::ab));
+  context.primitives_.emplace_front(
+      M, ContextLinearFP8::MatmulPrimitive{pd, dnnl::matmul(pd)});
+  context.primitive_index_[M] = context.primitives_.begin();
+  if (context.primitives_.size() > primitive_cache_capacity) {
+    context.primitive_index_.erase(context.primitives_.back().first);
+    context.primitives_.pop_back();
+  }
+  return context.primitives_.front().second;
+}
+} // namespace
+
+c10::intrusive_ptr<FP8LinearOpContext> createFP8LinearPrePackOpContext(
+    at::Tensor&& weight,
+    c10::optional<at::Tensor>&& bias,
+    c10::optional<int64_t> batch_size) {
+  RECORD_FUNCTION(
+      "ipex_prepack::createFP8LinearPrePackOpContext",
+      c10::ArrayRef<c10::IValue>({}));
+
+  return IpexFP8LinearOpContext::create_context(
+      std::move(weight), std::move(bias), batch_size);
+}
+
+at::Tensor fp8_linear_run(
+    const at::Tensor& input,
+    const at::Tensor& scale_invA,
+    int64_t idxA,
+    const at::Tensor& scale_invB,
+    int64_t idxB,
+    c10::intrusive_ptr<FP8LinearOpContext> op_context) {
+  RECORD_FUNCTION(
+      "ipex_prepack::fp8_linear_run", c10::ArrayRef<c10::IValue>({}));
+
+  return op_context->run(input, scale_invA, idxA, scale_invB, idxB);
+}
+
+ContextLinearFP8 create(
+    const at::Tensor& weight,
+    const c10::optional<at::Tensor>& bias,
+    const c10::optional<int64_t> batch_size) {
+  TORCH_CHECK(
+      weight.dim() == 2,
+      "ipex_prepack::fp8_linear_prepack: expects a 2D weight");
+  TORCH_CHECK(
+      weight.scalar_type() == at::ScalarType::Float8_e4m3fn ||
+          weight.scalar_type() == at::ScalarType::Float8_e5m2,
+      "ipex_prepack::fp8_linear_prepack: expects a Float8_e4m3fn or Float8_e5m2 weight");
+  auto out_features = weight.size(0);
+  auto in_features = weight.size(1);
+  c10::optional<at::Tensor> bias_;
+  if (bias.has_value() && bias->defined()) {
+    TORCH_CHECK(
+        bias->numel() == out_features,
+        "ipex_prepack::fp8_linear_prepack: expects a bias of ",
+        out_features,
+        " elements");
+    bias_ = bias->reshape({out_features}).contiguous();
+  }
+  auto batch = batch_size.has_value() ? batch_size.value() : 128;
+
+  // The blocked layout of the weights is chosen for the batch size and a src of
+  // the weight dtype. It hardly depends on M, the primitives of the other input
+  // shapes take it as is. A src of another dtype would need another layout, so
+  // run only accepts the weight dtype.
+  auto pd = fp8_matmul_primitive_desc(
+      ideep::tensor::desc(
+          {batch, in_features},
+          get_mkldnn_dtype(weight.scalar_type()),
+          ideep::format_tag::any),
+      ideep::tensor::desc(
+          {in_features, out_features},
+          get_mkldnn_dtype(weight.scalar_type()),
+          ideep::format_tag::any),
+      bias_.has_value() ? ideep::tensor::desc(
+                              {1, out_features},
+                              get_mkldnn_dtype(bias_->scalar_type()),
+                              ideep::format_tag::ab)
+                        : ideep::tensor::desc(),
+      ideep::tensor::desc(
+          {batch, out_features},
+          get_mkldnn_dtype(at::ScalarType::Float),
+          ideep::format_tag::any));
+  // [out_features, in_features] weight viewed as the [K, N] weights of the
+  // matmul
+  auto weight_ = weight.contiguous();
+  auto w = itensor_view_from_dense(weight_.transpose(0, 1));
+  auto at_weight =
+      empty_aten_tensor_from_desc(pd.weights_desc(), weight.options());
+  ideep::tensor weight_packed;
+  weight_packed.init(pd.weights_desc(), at_weight.data_ptr());
+  weight_packed.feed_from(w);
+
+  return ContextLinearFP8{
+      out_features,
+      in_features,
+      std::move(weight_packed),
+      std::move(at_weight),
+      std::move(bias_),
+  };
+}
+
+at::Tensor run(
+    ContextLinearFP8& context,
+    const at::Tensor& input,
+    const at::Tensor& scale_invA,
+    int64_t idxA,
+    const at::Tensor& scale_invB,
+    int64_t idxB) {
+  TORCH_CHECK(
+      input.size(-1) == context.in_features_,
+      "ipex_prepack::fp8_linear_run: expects an input with ",
+      context.in_features_,
+      " features, got ",
+      input.size(-1));
+  TORCH_CHECK(
+      input.scalar_type() == context.at_weight_.scalar_type(),
+      "ipex_prepack::fp8_linear_run: expects an input of the weight dtype ",
+      context.at_weight_.scalar_type(),
+      ", got ",
+      input.scalar_type());
+  auto input_ = input.reshape({-1, context.in_features_}).contiguous();
+  auto M = input_.size(0);
+  auto out_sizes = input.sizes().vec();
+  out_sizes.back() = context.out_features_;
+  auto out = at::empty(
+      {M, context.out_features_},
+      device(c10::kCPU).dtype(c10::ScalarType::Float));
+
+  auto matmul = get_primitive(context, M);
+  ideep::tensor scratchpad(matmul.pd.scratchpad_desc());
+  ideep::exec_args args;
+  args.insert({DNNL_ARG_SRC, itensor_view_from_dense(input_)});
+  args.insert({DNNL_ARG_WEIGHTS, context.weight_packed_});
+  args.insert({DNNL_ARG_DST, itensor_view_from_dense(out)});
+  args.insert({DNNL_ARG_SCRATCHPAD, scratchpad});
+  if (context.at_bias_.has_value()) {
+    args.insert(
+        {DNNL_ARG_BIAS,
+         itensor_view_from_dense(
+             context.at_bias_->view({1, context.out_features_}))});
+  }
+  args.insert(
+      {DNNL_ARG_ATTR_SCALES | DNNL_ARG_SRC, scale_view(scale_invA, idxA)});
+  args.insert(
+      {DNNL_ARG_ATTR_SCALES | DNNL_ARG_WEIGHTS, scale_view(scale_invB, idxB)});
+  matmul.primitive.execute(ideep::stream::default_stream(), args);
+  return out.view(out_sizes);
+}
+
+at::Tensor unpack(ContextLinearFP8& context, const at::Tensor& tensor) {
+  ideep::tensor blocked_tensor;
+  blocked_tensor.init(context.weight_packed_.get_desc(), tensor.data_ptr());
+  auto result = at::empty(
+      {context.out_features_, context.in_features_}, tensor.options());
+  // [K, N] view of the [out_features, in_features] result
+  auto pub_tensor = itensor_view_from_dense(result.transpose(0, 1));
+  pub_tensor.feed_from(blocked_tensor);
+  return result;
+}
+
+} // namespace fp8_linear
+} // namespace detail
+} // namespace cpu
+} // namespace torch_ipex
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <ATen/Tensor.h>
+#include "ContextLinearFP8.h"
+#include "OpContext.h"
+
+namespace torch_ipex {
+namespace cpu {
+namespace detail {
+namespace fp8_linear {
+
+c10::intrusive_ptr<FP8LinearOpContext> createFP8LinearPrePackOpContext(
+    at::Tensor&& weight,
+    c10::optional<at::Tensor>&& bias,
+    c10::optional<int64_t> batch_size);
+
+at::Tensor fp8_linear_run(
+    const at::Tensor& input,
+    const at::Tensor& scale_invA,
+    int64_t idxA,
+    const at::Tensor& scale_invB,
+    int64_t idxB,
+    c10::intrusive_ptr<FP8LinearOpContext> op_context);
+
+ContextLinearFP8 create(
+    const at::Tensor& weight,
+    const c10::optional<at::Tensor>& bias,
+    const c10::optional<int64_t> batch_size);
+
+// The output is float, with the leading dims of input. The input has the
+// dtype of the weight.
+at::Tensor run(
+    ContextLinearFP8& context,
+    const at::Tensor& input,
+    const at::Tensor& scale_invA,
+    int64_t idxA,
+    const at::Tensor& scale_invB,
+    int64_t idxB);
+
+// Reorders the packed weight back to the [out_features, in_features] weight
+at::Tensor unpack(ContextLinearFP8& context, const at::Tensor& tensor);
+
+} // namespace fp8_linear
+} // namespace detail
+} // namespace cpu
+} // namespace torch_ipex
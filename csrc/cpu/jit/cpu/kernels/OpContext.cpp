@@ -2,6 +2,7 @@
 #include <torch/all.h>
 #include "ConvPacked.h"
 #include "ConvTransposePacked.h"
+#include "LinearFP8Packed.h"
 #include "LinearMKLPacked.h"
 #include "LinearPacked.h"
 #include "LinearWoqPacked.h"
@@ -295,6 +296,42 @@ void IpexLinearMKLOpContext::load_from_ctx(
   load_from_ctx_template(this, other);
 }
 
+c10::intrusive_ptr<FP8LinearOpContext> IpexFP8LinearOpContext::create_context(
+    at::Tensor&& weight,
+    c10::optional<at::Tensor>&& bias,
+    c10::optional<int64_t> batch_size) {
+  auto op_context =
+      torch_ipex::cpu::detail::fp8_linear::create(weight, bias, batch_size);
+  return c10::make_intrusive<IpexFP8LinearOpContext>(
+      batch_size, std::move(op_context));
+}
+
+at::Tensor IpexFP8LinearOpContext::run(
+    const at::Tensor& input,
+    const at::Tensor& scale_invA,
+    int64_t idxA,
+    const at::Tensor& scale_invB,
+    int64_t idxB) {
+  return torch_ipex::cpu::detail::fp8_linear::run(
+      op_context_, input, scale_invA, idxA, scale_invB, idxB);
+}
+
+at::Tensor IpexFP8LinearOpContext::get_at_packed_weight() {
+  return op_context_.at_weight_;
+}
+
+c10::optional<at::Tensor> IpexFP8LinearOpContext::get_at_bias() {
+  return op_context_.at_bias_;
+}
+
+at::Tensor IpexFP8LinearOpContext::to_public(const at::Tensor& tensor) {
+  return torch_ipex::cpu::detail::fp8_linear::unpack(op_context_, tensor);
+}
+
+detail::ContextLinearFP8& IpexFP8LinearOpContext::get_context() {
+  return op_context_;
+}
+
 at::Tensor IpexConvTransposeOpContext::run(
     const at::Tensor& input,
     const ideep::attr_t& attr) {
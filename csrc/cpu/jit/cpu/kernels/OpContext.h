@@ -8,6 +8,7 @@
 #include "ContextConvTranspose.h"
 #include "ContextConvolution.h"
 #include "ContextLinear.h"
+#include "ContextLinearFP8.h"
 #include "ContextLinearMKL.h"
 #include "ContextLinearWoq.h"
 #include "assert.h"
@@ -359,6 +360,72 @@ class IpexLinearMKLOpContext final : public MKLOpContext {
   virtual void load_from_ctx(c10::intrusive_ptr<MKLOpContext> other) override;
 };
 
+// fp8 linear
+using SerializationTypeFP8LinearPrePack =
+    std::tuple<at::Tensor, c10::optional<at::Tensor>, c10::optional<int64_t>>;
+
+class FP8LinearOpContext : public torch::jit::CustomClassHolder {
+ protected:
+  c10::optional<int64_t> batch_size_;
+
+ public:
+  SerializationTypeFP8LinearPrePack unpack() {
+    auto orig_weight = this->to_public(this->get_at_packed_weight());
+    auto orig_bias = this->get_context().at_bias_;
+    return std::make_tuple(orig_weight, orig_bias, batch_size_);
+  }
+
+  // The src and weight scales are scale_invA[idxA] and scale_invB[idxB], read
+  // at execution so that they may change between runs
+  virtual at::Tensor run(
+      const at::Tensor& input,
+      const at::Tensor& scale_invA,
+      int64_t idxA,
+      const at::Tensor& scale_invB,
+      int64_t idxB) = 0;
+
+  virtual at::Tensor get_at_packed_weight() = 0;
+
+  virtual c10::optional<at::Tensor> get_at_bias() = 0;
+
+  virtual at::Tensor to_public(const at::Tensor& tensor) = 0;
+
+  virtual detail::ContextLinearFP8& get_context() = 0;
+};
+
+class IpexFP8LinearOpContext final : public FP8LinearOpContext {
+ private:
+  detail::ContextLinearFP8 op_context_;
+
+ public:
+  IpexFP8LinearOpContext(
+      c10::optional<int64_t> batch_size,
+      detail::ContextLinearFP8&& op_context)
+      : op_context_(std::move(op_context)) {
+    batch_size_ = batch_size;
+  }
+
+  virtual at::Tensor run(
+      const at::Tensor& input,
+      const at::Tensor& scale_invA,
+      int64_t idxA,
+      const at::Tensor& scale_invB,
+      int64_t idxB) override;
+
+  virtual at::Tensor get_at_packed_weight() override;
+
+  virtual c10::optional<at::Tensor> get_at_bias() override;
+
+  virtual at::Tensor to_public(const at::Tensor& tensor) override;
+
+  virtual detail::ContextLinearFP8& get_context() override;
+
+  static c10::intrusive_ptr<FP8LinearOpContext> create_context(
+      at::Tensor&& weight,
+      c10::optional<at::Tensor>&& bias,
+      c10::optional<int64_t> batch_size);
+};
+
 // Weight-only quantization
 using SerializationTypeWoqLinearPrePack = std::tuple<
     at::Tensor, // weight
@@ -3,6 +3,7 @@
 
 #include "ConvPacked.h"
 #include "ConvTransposePacked.h"
+#include "LinearFP8Packed.h"
 #include "LinearMKLPacked.h"
 #include "LinearPacked.h"
 #include "LinearWoqPacked.h"
@@ -12,6 +13,8 @@ namespace torch_ipex {
 namespace cpu {
 using detail::conv_transpose::createConvTransposePrePackOpContext;
 using detail::convolution::createConvolutionPrePackOpContext;
+using detail::fp8_linear::createFP8LinearPrePackOpContext;
+using detail::fp8_linear::fp8_linear_run;
 using detail::linear::createLinearPrePackOpContext;
 using detail::mkl_sgemm::createLinearMKLPrePackOpContext;
 #ifdef USE_LIBXSMM
@@ -121,6 +124,20 @@ TORCH_LIBRARY(ipex_prepack, m) {
       .def(
           "load_from_ctx",
           &torch_ipex::cpu::ConvTransposeOpContext::load_from_ctx);
+  m.class_<FP8LinearOpContext>("FP8LinearOpContext")
+      .def_pickle(
+          [](const c10::intrusive_ptr<FP8LinearOpContext>& op_context)
+              -> SerializationTypeFP8LinearPrePack { // __getstate__
+            return op_context->unpack();
+          },
+          [](SerializationTypeFP8LinearPrePack state)
+              -> c10::intrusive_ptr<FP8LinearOpContext> { // __setstate__
+            return createFP8LinearPrePackOpContext(
+                std::move(std::get<0>(state)),
+                std::move(std::get<1>(state)),
+                std::move(std::get<2>(state)));
+          })
+      .def("get_bias", &torch_ipex::cpu::FP8LinearOpContext::get_at_bias);
 #ifdef USE_LIBXSMM
   m.class_<WoqLinearOpContext>("WoqLinearOpContext")
       .def_pickle(
@@ -173,6 +190,14 @@ TORCH_LIBRARY(ipex_prepack, m) {
   m.def(
       "mkl_sgemm_prepack(Tensor W, Tensor? B, int? batch_size) "
       "-> __torch__.torch.classes.ipex_prepack.MKLOpContext");
+  m.def(
+      "fp8_linear_prepack(Tensor W, Tensor? B, int? batch_size=None) "
+      "-> __torch__.torch.classes.ipex_prepack.FP8LinearOpContext");
+  m.def(
+      "fp8_linear_run(Tensor input, Tensor scale_invA, int idxA, "
+      "Tensor scale_invB, int idxB, "
+      "__torch__.torch.classes.ipex_prepack.FP8LinearOpContext op_context) "
+      "-> Tensor");
   m.def(
       "conv_transpose_prepack(Tensor W, Tensor? B, int[] stride, "
       "int[] padding, int[] output_padding, int groups, int[] dilation, "
@@ -192,6 +217,8 @@ TORCH_LIBRARY_IMPL(ipex_prepack, CPU, m) {
   m.impl("convolution_prepack", TORCH_FN(createConvolutionPrePackOpContext));
   m.impl("linear_prepack", TORCH_FN(createLinearPrePackOpContext));
   m.impl("mkl_sgemm_prepack", TORCH_FN(createLinearMKLPrePackOpContext));
+  m.impl("fp8_linear_prepack", TORCH_FN(createFP8LinearPrePackOpContext));
+  m.impl("fp8_linear_run", TORCH_FN(fp8_linear_run));
   m.impl(
       "conv_transpose_prepack", TORCH_FN(createConvTransposePrePackOpContext));
 }
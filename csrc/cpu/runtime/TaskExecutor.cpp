@@ -1,8 +1,81 @@
 #include "TaskExecutor.h"
+#include <dirent.h>
+#include <algorithm>
+#include <cstdio>
+#include <string>
 
 namespace torch_ipex {
 namespace runtime {
 
+namespace {
+// Number of empty polls before an idle worker goes to sleep
+constexpr int idle_spin_count = 1024;
+
+// The running executors, stealing only happens among them
+std::mutex executors_mutex;
+std::vector<TaskExecutor*> executors;
+
+int numa_node_of_cpu_pool(const torch_ipex::runtime::CPUPool& cpu_pool) {
+  if (!cpu_pool.is_cpu_core_list_initialized() ||
+      cpu_pool.get_cpu_core_list().empty()) {
+    return -1;
+  }
+  auto cpu_dir = "/sys/devices/system/cpu/cpu" +
+      std::to_string(cpu_pool.get_cpu_core_list()[0]);
+  auto dir = opendir(cpu_dir.c_str());
+  if (dir == nullptr) {
+    return -1;
+  }
+  int node = -1;
+  while (auto entry = readdir(dir)) {
+    if (sscanf(entry->d_name, "node%d", &node) == 1) {
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+} // namespace
+
+TaskQueue::TaskQueue(size_t capacity) {
+  assert(capacity >= 2 && (capacity & (capacity - 1)) == 0);
+  this->cells = std::make_unique<Cell[]>(capacity);
+  for (size_t i = 0; i < capacity; i++) {
+    this->cells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  this->mask = capacity - 1;
+}
+
+bool TaskQueue::try_run_one() {
+  auto pos = this->dequeue_pos.load(std::memory_order_relaxed);
+  while (true) {
+    auto& cell = this->cells[pos & this->mask];
+    auto seq = cell.sequence.load(std::memory_order_acquire);
+    auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+    if (diff == 0) {
+      if (this->dequeue_pos.compare_exchange_weak(
+              pos, pos + 1, std::memory_order_relaxed)) {
+        // The slot is released after the task, the producers only need it
+        // again once the ring has wrapped around
+        cell.slot.run();
+        cell.sequence.store(pos + this->mask + 1, std::memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false; // empty
+    } else {
+      pos = this->dequeue_pos.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+bool TaskQueue::empty() const {
+  auto pos = this->dequeue_pos.load(std::memory_order_seq_cst);
+  auto seq = this->cells[pos & this->mask].sequence.load(
+      std::memory_order_seq_cst);
+  return static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1) < 0;
+}
+
 TaskExecutor::TaskExecutor(const torch_ipex::runtime::CPUPool& cpu_pool) {
   // Notice: We shouldn't load iomp symbol in sub_thread, otherwise race
   // condition happens.
@@ -12,43 +85,121 @@ TaskExecutor::TaskExecutor(const torch_ipex::runtime::CPUPool& cpu_pool) {
         "before using the runtime API.");
   }
   this->stop = false;
+  this->numa_node = numa_node_of_cpu_pool(cpu_pool);
 
   this->worker = std::make_shared<std::thread>([&, this] {
     _pin_cpu_cores(cpu_pool);
     while (true) {
-      std::function<void()> task;
-      {
-        std::unique_lock<std::mutex> lock(this->worker_mutex);
-        this->worker_condition.wait(
-            lock, [this] { return this->stop || !this->tasks.empty(); });
+      if (this->tasks.try_run_one() || this->try_steal()) {
+        continue;
+      }
+      bool has_work = false;
+      for (int i = 0; i < idle_spin_count && !has_work; i++) {
+        std::this_thread::yield();
+        has_work = !this->tasks.empty() || this->stop.load();
+      }
+      if (has_work && !this->stop.load()) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(this->worker_mutex);
+      // A submitter checks sleeping after publishing its task, so either it
+      // sees the flag or the predicate below sees the task
+      this->sleeping.store(true);
+      this->worker_condition.wait(lock, [this] {
+        return this->stop.load() || !this->tasks.empty() ||
+            this->peers_have_work();
+      });
+      this->sleeping.store(false);
 
-        if (this->stop && this->tasks.empty())
-          return;
+      if (this->stop.load() && this->tasks.empty())
+        return;
+    }
+  });
 
-        task = std::move(this->tasks.front());
-        this->tasks.pop();
+  std::lock_guard<std::mutex> lock(executors_mutex);
+  executors.push_back(this);
+}
+
+void TaskExecutor::notify_after_submit() {
+  if (this->sleeping.load()) {
+    { std::lock_guard<std::mutex> lock(this->worker_mutex); }
+    this->worker_condition.notify_one();
+    return;
+  }
+  // The owner is busy, hand the task to an idle worker of the same node
+  if (this->numa_node < 0) {
+    return;
+  }
+  // The peer is woken up after releasing executors_mutex, since a sleeping
+  // worker takes executors_mutex under its worker_mutex in peers_have_work
+  TaskExecutor* idle_peer = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(executors_mutex);
+    for (auto peer : executors) {
+      if (peer != this && peer->numa_node == this->numa_node &&
+          peer->sleeping.load()) {
+        idle_peer = peer;
+        // Keep the peer alive until it is notified, see stop_executor
+        idle_peer->active_thieves++;
+        break;
       }
-      task();
     }
-  });
+  }
+  if (idle_peer == nullptr) {
+    return;
+  }
+  { std::lock_guard<std::mutex> peer_lock(idle_peer->worker_mutex); }
+  idle_peer->worker_condition.notify_one();
+  idle_peer->active_thieves--;
+}
+
+bool TaskExecutor::try_steal() {
+  if (this->numa_node < 0) {
+    return false;
+  }
+  TaskExecutor* victim = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(executors_mutex);
+    for (auto peer : executors) {
+      if (peer != this && peer->numa_node == this->numa_node &&
+          !peer->tasks.empty()) {
+        victim = peer;
+        // Keep the victim alive until the stolen task is done, see
+        // stop_executor
+        victim->active_thieves++;
+        break;
+      }
+    }
+  }
+  if (victim == nullptr) {
+    return false;
+  }
+  bool stolen = victim->tasks.try_run_one();
+  victim->active_thieves--;
+  return stolen;
 }
 
-std::mutex& TaskExecutor::get_mutex() {
-  return this->worker_mutex;
+bool TaskExecutor::peers_have_work() {
+  if (this->numa_node < 0) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(executors_mutex);
+  return std::any_of(
+      executors.begin(), executors.end(), [this](TaskExecutor* peer) {
+        return peer != this && peer->numa_node == this->numa_node &&
+            !peer->tasks.empty();
+      });
 }
 
-std::condition_variable& TaskExecutor::get_condition() {
-  return this->worker_condition;
+void TaskExecutor::drain() {
+  while (this->tasks.try_run_one()) {
+  }
 }
 
 bool TaskExecutor::is_stop() {
   return this->stop;
 }
 
-std::queue<std::function<void()>>& TaskExecutor::get_tasks() {
-  return this->tasks;
-}
-
 void TaskExecutor::stop_executor() {
   bool should_wait_worker_join = false;
   {
@@ -61,6 +212,17 @@ void TaskExecutor::stop_executor() {
   if (should_wait_worker_join) {
     this->worker_condition.notify_all();
     this->worker->join();
+    {
+      std::lock_guard<std::mutex> lock(executors_mutex);
+      executors.erase(
+          std::remove(executors.begin(), executors.end(), this),
+          executors.end());
+    }
+    while (this->active_thieves.load() > 0) {
+      std::this_thread::yield();
+    }
+    // Tasks submitted while the worker was exiting
+    this->drain();
   }
   return;
 }
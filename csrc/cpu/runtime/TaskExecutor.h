@@ -1,16 +1,18 @@
 #pragma once
 
 #include <omp.h>
+#include <atomic>
 #include <cassert>
 #include <condition_variable>
+#include <cstring>
 #include <functional>
 #include <future>
 #include <iostream>
 #include <memory>
 #include <mutex>
-#include <queue>
 #include <stdexcept>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
 #include <ATen/core/ivalue.h>
@@ -22,22 +24,131 @@
 namespace torch_ipex {
 namespace runtime {
 
+/*TaskSlot is a preallocated cell of the task queue. Callables which fit in
+ * place are constructed in the slot, larger ones are boxed on the heap.*/
+class TaskSlot {
+ public:
+  static constexpr size_t inline_size = 64;
+
+  template <typename F>
+  void emplace(F&& f);
+  // Run the stored callable and destroy it
+  void run();
+
+ private:
+  alignas(std::max_align_t) unsigned char storage[inline_size];
+  void (*invoke)(void*) = nullptr;
+};
+
+template <typename F>
+void TaskSlot::emplace(F&& f) {
+  using Fn = std::decay_t<F>;
+  if constexpr (
+      sizeof(Fn) <= inline_size &&
+      alignof(Fn) <= alignof(std::max_align_t)) {
+    new (this->storage) Fn(std::forward<F>(f));
+    this->invoke = [](void* storage) {
+      auto fn = static_cast<Fn*>(storage);
+      struct Destroy {
+        Fn* fn;
+        ~Destroy() {
+          fn->~Fn();
+        }
+      } guard{fn};
+      (*fn)();
+    };
+  } else {
+    auto boxed = new Fn(std::forward<F>(f));
+    std::memcpy(this->storage, &boxed, sizeof(boxed));
+    this->invoke = [](void* storage) {
+      Fn* boxed;
+      std::memcpy(&boxed, storage, sizeof(boxed));
+      std::unique_ptr<Fn> guard(boxed);
+      (*boxed)();
+    };
+  }
+}
+
+inline void TaskSlot::run() {
+  this->invoke(this->storage);
+}
+
+/*TaskQueue is a bounded lock-free multi-producer multi-consumer ring of
+ * TaskSlot. Any thread may submit, the owner worker and the thieves of the
+ * same NUMA node consume.*/
+class TaskQueue {
+ public:
+  explicit TaskQueue(size_t capacity);
+  template <typename F>
+  bool try_push(F&& f);
+  // Run the oldest task in its slot. Return false if the queue is empty.
+  bool try_run_one();
+  bool empty() const;
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    TaskSlot slot;
+  };
+  std::unique_ptr<Cell[]> cells;
+  size_t mask;
+  alignas(64) std::atomic<size_t> enqueue_pos{0};
+  alignas(64) std::atomic<size_t> dequeue_pos{0};
+};
+
+template <typename F>
+bool TaskQueue::try_push(F&& f) {
+  auto pos = this->enqueue_pos.load(std::memory_order_relaxed);
+  while (true) {
+    auto& cell = this->cells[pos & this->mask];
+    auto seq = cell.sequence.load(std::memory_order_acquire);
+    auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+    if (diff == 0) {
+      if (this->enqueue_pos.compare_exchange_weak(
+              pos, pos + 1, std::memory_order_relaxed)) {
+        cell.slot.emplace(std::forward<F>(f));
+        cell.sequence.store(pos + 1, std::memory_order_seq_cst);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false; // full
+    } else {
+      pos = this->enqueue_pos.load(std::memory_order_relaxed);
+    }
+  }
+}
+
 class IPEX_API TaskExecutor {
  public:
   explicit TaskExecutor(const torch_ipex::runtime::CPUPool& cpu_pool);
-  std::mutex& get_mutex();
-  std::condition_variable& get_condition();
+  // Queue f to run on this executor, or on an idle executor of the same NUMA
+  // node. Throw if the executor is stopped.
+  template <typename F>
+  void submit(F&& f);
   bool is_stop();
-  std::queue<std::function<void()>>& get_tasks();
   void stop_executor();
   ~TaskExecutor();
 
  private:
-  std::queue<std::function<void()>> tasks;
+  void notify_after_submit();
+  bool try_steal();
+  bool peers_have_work();
+  // Run the leftover tasks of a stopped executor in the calling thread
+  void drain();
+
+  static constexpr size_t queue_capacity = 1024;
+  TaskQueue tasks{queue_capacity};
   std::shared_ptr<std::thread> worker;
+  // NUMA node of the cores of the pool, -1 if unknown. Executors only steal
+  // from the executors of the same node.
+  int numa_node;
+  // Thieves currently running a task of this executor, or peers waking up its
+  // worker
+  std::atomic<int> active_thieves{0};
 
   // Synchronization
-  bool stop;
+  std::atomic<bool> stop;
+  std::atomic<bool> sleeping{false};
   std::mutex worker_mutex;
   std::condition_variable worker_condition;
 
@@ -52,5 +163,24 @@ class IPEX_API TaskExecutor {
       delete; // Not support copy or move construtor.
 };
 
+template <typename F>
+void TaskExecutor::submit(F&& f) {
+  // submit task to a stopping the pool is not allowed
+  if (this->stop.load())
+    throw std::runtime_error("Task submit on stopped ThreadPool");
+  // The queue only fills up when the workers fall far behind, wait for them
+  while (!this->tasks.try_push(std::forward<F>(f))) {
+    if (this->stop.load())
+      throw std::runtime_error("Task submit on stopped ThreadPool");
+    // The worker would wait for itself, it runs the task in place instead
+    if (std::this_thread::get_id() == this->worker->get_id()) {
+      std::forward<F>(f)();
+      return;
+    }
+    std::this_thread::yield();
+  }
+  this->notify_after_submit();
+}
+
 } // namespace runtime
 } // namespace torch_ipex
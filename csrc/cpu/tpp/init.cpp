@@ -4,6 +4,11 @@
 
 #include <libxsmm.h>
 #include <libxsmm_intrinsics_x86.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <thread>
 //#include "init.h"
 #include "timing.h"
 #include "utils.h"
@@ -27,7 +32,116 @@ REGISTER_SCOPE(zero, "zero");
 REGISTER_SCOPE(pad_act, "pad_act");
 REGISTER_SCOPE(unpad_act, "unpad_act");
 
-int globalScope = 0;
+std::atomic<int> globalScope{0};
+thread_local uint64_t profilingScope = 0;
+
+std::atomic<bool> profiling_enabled{env2int("TPP_PROFILE") != 0};
+
+double tsc_frequency() {
+  static double frequency = [] {
+    auto time = std::chrono::steady_clock::now();
+    auto cycles = rdtsc();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    auto elapsed = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - time);
+    return (rdtsc() - cycles) / elapsed.count();
+  }();
+  return frequency;
+}
+
+void set_profiling_enabled(bool enabled) {
+  if (enabled) {
+    // Calibrate before the first scope needs it
+    tsc_frequency();
+  }
+  profiling_enabled.store(enabled);
+}
+
+namespace {
+// Leaked, the OpenMP threads may exit after the static destructors
+struct ProfilingRings {
+  std::mutex mutex;
+  std::vector<ProfilingRing*> rings;
+};
+
+ProfilingRings& get_profiling_rings() {
+  static auto rings = new ProfilingRings();
+  return *rings;
+}
+
+struct ProfilingRingOwner {
+  ProfilingRingOwner() : ring(new ProfilingRing()) {
+    auto& registry = get_profiling_rings();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.rings.push_back(ring);
+  }
+  ~ProfilingRingOwner() {
+    auto& registry = get_profiling_rings();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.rings.erase(
+        std::remove(registry.rings.begin(), registry.rings.end(), ring),
+        registry.rings.end());
+    delete ring;
+  }
+  ProfilingRing* ring;
+};
+} // namespace
+
+ProfilingRing& get_profiling_ring() {
+  static thread_local ProfilingRingOwner owner;
+  return *owner.ring;
+}
+
+#ifndef PROFILE_TPP
+void ProfilingScope::end_scope() {
+  auto end = rdtsc();
+  profilingScope = oldScope;
+  if (!record->isActive()) {
+    return;
+  }
+  long flops = 0;
+  uint64_t brgemm_cycles = 0;
+  int threads = 0;
+  {
+    auto& registry = get_profiling_rings();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (auto ring : registry.rings) {
+      auto head = ring->head.load(std::memory_order_acquire);
+      auto tail =
+          head > ProfilingRing::capacity ? head - ProfilingRing::capacity : 0;
+      bool seen = false;
+      for (auto pos = head; pos > tail; pos--) {
+        auto& event = ring->events[(pos - 1) & (ProfilingRing::capacity - 1)];
+        if (event.end < start) {
+          break;
+        }
+        if (event.scope != id || event.type != BRGEMM || event.start > end) {
+          continue;
+        }
+        flops += event.flops;
+        brgemm_cycles += event.end - event.start;
+        seen = true;
+      }
+      threads += seen;
+    }
+  }
+  if (flops == 0) {
+    return;
+  }
+  auto cycles = static_cast<double>(end - start);
+  char summary[256];
+  snprintf(
+      summary,
+      sizeof(summary),
+      "%s::BRGEMM %.3f GFLOP, %.1f GFLOP/s, %.0f%% of %d threads",
+      name,
+      flops * 1e-9,
+      flops * 1e-9 * tsc_frequency() / cycles,
+      100.0 * brgemm_cycles / (cycles * threads),
+      threads);
+  RECORD_FUNCTION(std::string(summary), std::vector<c10::IValue>());
+}
+#endif
 
 thread_local unsigned int* rng_state = NULL;
 thread_local struct drand48_data drng_state; // For non AVX512 version
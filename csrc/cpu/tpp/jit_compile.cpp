@@ -1,31 +1,185 @@
 #include "jit_compile.h"
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
 #ifndef _WIN32
 #include <dlfcn.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #else
 #include <stdexcept>
 #endif
 namespace torch_ipex {
 namespace tpp {
+#ifndef _WIN32
+static bool jit_compile(
+    const std::string& filename,
+    const std::string& flags,
+    const std::string& libname) {
+  auto cmd = std::string("g++ -shared -fPIC -x c++ ") + flags;
+  cmd = cmd + " -o " + libname + " " + filename;
+  int ret = system(cmd.c_str());
+  return ret == 0;
+}
+
+static void* jit_load_symbol(void* handle, const std::string& func_name) {
+  void* func = dlsym(handle, func_name.c_str());
+  if (func == NULL) {
+    printf("Unable to find '%s' symbol in JIT COMPILE\n", func_name.c_str());
+  }
+  // Libraries are opened with RTLD_NODELETE so func stays valid
+  dlclose(handle);
+  return func;
+}
+
+// Writes src to an anonymous temp file and sets fdname to its /proc/self/fd
+// path. The returned fd keeps the file alive, the caller closes it once the
+// file is compiled.
+static int jit_write_src(const std::string& src, std::string& fdname) {
+  char filename[] = "/tmp/ppx_XXXXXX";
+  int fd = mkstemp(filename);
+  if (fd < 0)
+    return -1;
+  unlink(filename);
+  if (write(fd, src.c_str(), src.length()) != (ssize_t)src.length()) {
+    close(fd);
+    return -1;
+  }
+  fdname = "/proc/self/fd/" + std::to_string(fd);
+  return fd;
+}
+
+// The loop nests are compiled without -march, but the cache directory may be
+// shared by hosts of different generations, so keep their entries apart.
+static std::string jit_isa_tag() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return "avx512";
+  if (__builtin_cpu_supports("avx2"))
+    return "avx2";
+  return "x86";
+#else
+  return "generic";
+#endif
+}
+
+static uint64_t fnv1a_hash(const std::string& s, uint64_t h) {
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// Directory of the persistent JIT cache. TPP_JIT_CACHE_DIR overrides the
+// default location; setting it to an empty string disables the cache.
+static std::string jit_cache_dir() {
+  const char* dir = getenv("TPP_JIT_CACHE_DIR");
+  if (dir)
+    return dir;
+  const char* xdg = getenv("XDG_CACHE_HOME");
+  if (xdg && xdg[0])
+    return std::string(xdg) + "/ipex_tpp_jit";
+  const char* home = getenv("HOME");
+  if (home && home[0])
+    return std::string(home) + "/.cache/ipex_tpp_jit";
+  return "";
+}
+
+static bool jit_make_dirs(const std::string& path) {
+  for (size_t pos = 1; pos <= path.size(); pos++) {
+    if (pos != path.size() && path[pos] != '/')
+      continue;
+    auto sub = path.substr(0, pos);
+    if (mkdir(sub.c_str(), 0755) != 0 && errno != EEXIST)
+      return false;
+  }
+  return true;
+}
+
+static std::string jit_cache_path(
+    const std::string& src,
+    const std::string& flags,
+    const std::string& func_name) {
+  static const std::string dir = jit_cache_dir();
+  static const bool dir_ok = !dir.empty() && jit_make_dirs(dir);
+  if (!dir_ok)
+    return "";
+  uint64_t h = 14695981039346656037ULL;
+  for (auto& part : {std::string("g++"), flags, jit_isa_tag(), func_name}) {
+    h = fnv1a_hash(part, h);
+    h = fnv1a_hash(std::string(1, '\0'), h);
+  }
+  h = fnv1a_hash(src, h);
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.so", (unsigned long long)h);
+  return dir + name;
+}
+
+// Looks the kernel up in the on-disk cache, compiling and publishing it on a
+// miss. Entries are written to a temp file and renamed into place so that
+// concurrent processes never observe a partially written library.
+static void* jit_from_cache(
+    const std::string& src,
+    const std::string& flags,
+    const std::string& func_name) {
+  auto libname = jit_cache_path(src, flags, func_name);
+  if (libname.empty())
+    return NULL;
+  if (access(libname.c_str(), R_OK) == 0) {
+    auto handle = dlopen(libname.c_str(), RTLD_LAZY | RTLD_NODELETE);
+    if (handle)
+      return jit_load_symbol(handle, func_name);
+    // Stale or truncated entry, rebuild it below
+    unlink(libname.c_str());
+  }
+  std::string filename;
+  int src_fd = jit_write_src(src, filename);
+  if (src_fd < 0)
+    return NULL;
+  std::string tmpname = libname + ".XXXXXX";
+  int fd = mkstemp(&tmpname[0]);
+  if (fd < 0) {
+    close(src_fd);
+    return NULL;
+  }
+  close(fd);
+  bool compiled = jit_compile(filename, flags, tmpname);
+  close(src_fd);
+  if (!compiled || rename(tmpname.c_str(), libname.c_str()) != 0) {
+    unlink(tmpname.c_str());
+    return NULL;
+  }
+  auto handle = dlopen(libname.c_str(), RTLD_LAZY | RTLD_NODELETE);
+  if (!handle) {
+    fputs(dlerror(), stderr);
+    return NULL;
+  }
+  return jit_load_symbol(handle, func_name);
+}
+#endif
+
 void* jit_compile_and_load(
     const std::string filename,
     const std::string flags) {
 #ifndef _WIN32
   char libname[] = "/tmp/ppx_XXXXXX";
   int fd = mkstemp(libname);
+  if (fd < 0)
+    return NULL;
   unlink(libname);
   char fdname[50];
   sprintf(fdname, "/proc/self/fd/%d", fd);
-  auto cmd = std::string("g++ -shared -fPIC -x c++ ") + flags;
-  cmd = cmd + " -o " + fdname + " " + filename;
-  printf("JIT COMPILE: %s\n", cmd.c_str());
-  int ret = system(cmd.c_str());
-  if (ret != 0)
+  if (!jit_compile(filename, flags, fdname)) {
+    close(fd);
     return NULL;
+  }
+  // The mapping of the library outlives the fd
   auto handle = dlopen(fdname, RTLD_LAZY | RTLD_NODELETE);
+  close(fd);
   if (!handle) {
     fputs(dlerror(), stderr);
     return NULL;
@@ -45,12 +199,7 @@ void* jit_from_file(
   void* handle = jit_compile_and_load(filename, flags);
   if (handle == NULL)
     return NULL;
-  void* func = dlsym(handle, func_name.c_str());
-  if (func == NULL) {
-    printf("Unable to find '%s' symbol in JIT COMPILE\n", func_name.c_str());
-  }
-  dlclose(handle);
-  return func;
+  return jit_load_symbol(handle, func_name);
 #else
   throw std::runtime_error("not implemented.");
   return NULL;
@@ -62,17 +211,20 @@ void* jit_from_str(
     const std::string flags,
     const std::string func_name) {
 #ifndef _WIN32
-  char filename[] = "/tmp/ppx_XXXXXX";
-  int fd = mkstemp(filename);
-  unlink(filename);
-  char fdname[50];
-  sprintf(fdname, "/proc/self/fd/%d", fd);
-  write(fd, src.c_str(), src.length());
-  return jit_from_file(fdname, flags, func_name);
+  void* func = jit_from_cache(src, flags, func_name);
+  if (func != NULL)
+    return func;
+  std::string filename;
+  int src_fd = jit_write_src(src, filename);
+  if (src_fd < 0)
+    return NULL;
+  func = jit_from_file(filename, flags, func_name);
+  close(src_fd);
+  return func;
 #else
   throw std::runtime_error("not implemented.");
   return NULL;
 #endif
 }
 } // namespace tpp
-} // namespace torch_ipex
\ No newline at end of file
+} // namespace torch_ipex
@@ -0,0 +1,229 @@
+#include <c10/util/Exception.h>
+#include <fstream>
+#include <sstream>
+#include "utils.h"
+#include "xsmm_functors.h"
+
+namespace torch_ipex {
+namespace tpp {
+
+namespace {
+constexpr size_t initial_table_capacity = 4096;
+
+template <typename Tin, typename Tout>
+void prewarm_brgemm(const std::vector<int64_t>& params) {
+  BrgemmTPP<Tin, Tout>(
+      params[2],
+      params[3],
+      params[4],
+      params[5],
+      params[6],
+      params[7],
+      params[8],
+      params[9],
+      params[10],
+      params[11],
+      params[12],
+      params[13]);
+}
+
+bool prewarm_brgemm(const std::vector<int64_t>& params) {
+  auto dt_in = params[0];
+  auto dt_out = params[1];
+  if (dt_in == LIBXSMM_DATATYPE_F32 && dt_out == LIBXSMM_DATATYPE_F32) {
+    prewarm_brgemm<float, float>(params);
+  } else if (dt_in == LIBXSMM_DATATYPE_BF16 && dt_out == LIBXSMM_DATATYPE_F32) {
+    prewarm_brgemm<bfloat16, float>(params);
+  } else if (dt_in == LIBXSMM_DATATYPE_F16 && dt_out == LIBXSMM_DATATYPE_F32) {
+    prewarm_brgemm<half, float>(params);
+  } else if (
+      dt_in == LIBXSMM_DATATYPE_BF16 && dt_out == LIBXSMM_DATATYPE_BF16) {
+    prewarm_brgemm<bfloat16, bfloat16>(params);
+  } else if (dt_in == LIBXSMM_DATATYPE_F16 && dt_out == LIBXSMM_DATATYPE_F16) {
+    prewarm_brgemm<half, half>(params);
+  } else if (dt_in == LIBXSMM_DATATYPE_I8 && dt_out == LIBXSMM_DATATYPE_I32) {
+    prewarm_brgemm<int8_t, int32_t>(params);
+  } else {
+    return false;
+  }
+  return true;
+}
+} // namespace
+
+KernelRegistry::KernelRegistry() {
+  this->tables.emplace_back(new Table(initial_table_capacity));
+  this->table.store(this->tables.back().get());
+}
+
+KernelRegistry& KernelRegistry::instance() {
+  // Leaked, kernels may still be looked up from the static destructors
+  static auto registry = new KernelRegistry();
+  return *registry;
+}
+
+void* KernelRegistry::get_or_build(
+    uint64_t hash,
+    const std::function<void*()>& build) {
+  std::unique_lock<std::mutex> lock(this->mutex);
+  while (true) {
+    auto kernel = this->find(hash);
+    if (kernel != NULL) {
+      return kernel;
+    }
+    if (this->building.count(hash) == 0) {
+      break;
+    }
+    this->built.wait(lock);
+  }
+  this->building.insert(hash);
+  lock.unlock();
+
+  // The other kernels are still found and built meanwhile
+  void* kernel = NULL;
+  try {
+    kernel = build();
+  } catch (...) {
+    lock.lock();
+    this->building.erase(hash);
+    this->built.notify_all();
+    throw;
+  }
+
+  lock.lock();
+  this->building.erase(hash);
+  if (kernel != NULL) {
+    this->insert(hash, kernel);
+  }
+  this->built.notify_all();
+  return kernel;
+}
+
+void KernelRegistry::insert(uint64_t hash, void* kernel) {
+  auto table = this->table.load(std::memory_order_relaxed);
+  if ((table->size + 1) * 2 > table->mask + 1) {
+    // Rehash into a table twice as large, then publish it
+    auto larger = new Table((table->mask + 1) * 2);
+    for (size_t i = 0; i <= table->mask; i++) {
+      auto& entry = table->entries[i];
+      auto key = entry.hash.load(std::memory_order_relaxed);
+      if (key == 0) {
+        continue;
+      }
+      auto j = key & larger->mask;
+      while (larger->entries[j].hash.load(std::memory_order_relaxed) != 0) {
+        j = (j + 1) & larger->mask;
+      }
+      larger->entries[j].kernel.store(
+          entry.kernel.load(std::memory_order_relaxed),
+          std::memory_order_relaxed);
+      larger->entries[j].hash.store(key, std::memory_order_relaxed);
+    }
+    larger->size = table->size;
+    this->tables.emplace_back(larger);
+    this->table.store(larger, std::memory_order_release);
+    table = larger;
+  }
+  auto i = hash & table->mask;
+  while (table->entries[i].hash.load(std::memory_order_relaxed) != 0) {
+    i = (i + 1) & table->mask;
+  }
+  // The kernel is visible before its key
+  table->entries[i].kernel.store(kernel, std::memory_order_relaxed);
+  table->entries[i].hash.store(hash, std::memory_order_release);
+  table->size++;
+}
+
+void KernelRegistry::set_recording(bool enabled) {
+  std::lock_guard<std::mutex> lock(this->records_mutex);
+  if (enabled) {
+    this->records.clear();
+  }
+  this->recording.store(enabled);
+}
+
+void KernelRegistry::record(uint64_t hash, std::string spec) {
+  if (spec.empty()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(this->records_mutex);
+  this->records.emplace(hash, std::move(spec));
+}
+
+int64_t KernelRegistry::save_records(const std::string& path) {
+  std::lock_guard<std::mutex> lock(this->records_mutex);
+  std::ofstream file(path);
+  TORCH_CHECK(file, "Fail to open the TPP kernel records file ", path);
+  for (auto& record : this->records) {
+    file << record.second << "\n";
+  }
+  TORCH_CHECK(file, "Fail to write the TPP kernel records file ", path);
+  return this->records.size();
+}
+
+int64_t KernelRegistry::prewarm(const std::string& path) {
+  std::ifstream file(path);
+  TORCH_CHECK(file, "Fail to open the TPP kernel records file ", path);
+  int64_t num_kernels = 0;
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream spec(line);
+    std::string kind;
+    if (!(spec >> kind)) {
+      continue;
+    }
+    std::vector<int64_t> params;
+    int64_t param;
+    while (spec >> param) {
+      params.push_back(param);
+    }
+    auto p = [&](int i) { return (int)params[i]; };
+    bool valid = true;
+    if (kind == "unary" && params.size() == 9) {
+      UnaryTPP(
+          p(0),
+          p(1),
+          p(2),
+          p(3),
+          (libxsmm_datatype)p(4),
+          (libxsmm_datatype)p(5),
+          (libxsmm_datatype)p(6),
+          (libxsmm_bitfield)p(7),
+          (libxsmm_meltw_unary_type)p(8));
+    } else if (kind == "binary" && params.size() == 11) {
+      BinaryTPP(
+          p(0),
+          p(1),
+          p(2),
+          p(3),
+          p(4),
+          (libxsmm_datatype)p(5),
+          (libxsmm_datatype)p(6),
+          (libxsmm_datatype)p(7),
+          (libxsmm_datatype)p(8),
+          (libxsmm_bitfield)p(9),
+          (libxsmm_meltw_binary_type)p(10));
+    } else if (kind == "brgemm" && params.size() == 14) {
+      valid = prewarm_brgemm(params);
+    } else {
+      valid = false;
+    }
+    TORCH_CHECK(valid, "Invalid TPP kernel record: ", line);
+    num_kernels++;
+  }
+  return num_kernels;
+}
+
+void record_tpp_kernels(bool enabled) {
+  KernelRegistry::instance().set_recording(enabled);
+}
+
+int64_t save_tpp_kernel_records(const std::string& path) {
+  return KernelRegistry::instance().save_records(path);
+}
+
+int64_t prewarm_tpp_kernels(const std::string& path) {
+  return KernelRegistry::instance().prewarm(path);
+}
+
+} // namespace tpp
+} // namespace torch_ipex
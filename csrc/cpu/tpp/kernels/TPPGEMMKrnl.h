@@ -9,7 +9,11 @@
 #ifndef NO_PARLOOPER
 #include "tpp/threaded_loops.h"
 #endif
+#include <array>
 #include <cstdint>
+#include <future>
+#include <map>
+#include <mutex>
 #include "tpp/tensor_helper.h"
 #include "tpp/xsmm_functors.h"
 
@@ -21,6 +25,9 @@ static int FT_OPT_SIZE = env2int("FT_OPT_SIZE", 256);
 static int NCB_BLOCK_SIZE = env2int("NCB_BLOCK_SIZE", 64);
 static const char* GEMM_LOOP_SCHEME =
     getenv("GEMM_LOOP_SCHEME") ? getenv("GEMM_LOOP_SCHEME") : "aCB";
+// Budget of the first token weights cache in MB, -1 for no limit and 0 to
+// disable it. The weights beyond it are relaid out on every prefill.
+static int FT_WT_CACHE_MB = env2int("FT_WT_CACHE_MB", 1024);
 
 REGISTER_LOCAL_SCOPE(
     tpp_linear_krnl,
@@ -47,12 +54,14 @@ REGISTER_LOCAL_SCOPE(
 REGISTER_LOCAL_SCOPE(
     tpp_linear_relu_krnl,
     "tpp_linear_relu_krnl"); // linear bias + relu
+REGISTER_LOCAL_SCOPE(
+    tpp_fused_moe_krnl,
+    "tpp_fused_moe_krnl"); // grouped gate_proj, up_proj and down_proj of MoE
 
 REGISTER_LOCAL_SCOPE(fftkn, "fftkn");
 
 template <typename T>
-inline at::Tensor wt_tensor_for_first_token(at::Tensor& t) {
-  RECORD_SCOPE(fftkn, {t});
+inline at::Tensor wt_relayout_for_first_token(const at::Tensor& t) {
   auto dim = t.dim();
   if (dim < 5)
     return t;
@@ -67,6 +76,7 @@ inline at::Tensor wt_tensor_for_first_token(at::Tensor& t) {
   auto C3 = sizes[4];
   if (K2 >= 32)
     return t;
+  RECORD_SCOPE(fftkn, {t});
   auto t_new = t.new_empty({K1 / RBS, C1, C2, RBS * K2, C3});
   auto in = GetVLAPtr<T>(t, {RBS, C1, C2, K2 * C3});
   auto out = GetVLAPtr<T>(t_new, {C1, C2, RBS, K2 * C3});
@@ -86,6 +96,147 @@ inline at::Tensor wt_tensor_for_first_token(at::Tensor& t) {
   return t_new;
 }
 
+// The first token weights, kept alongside the original weights so that each
+// prefill does not copy them again, up to FT_WT_CACHE_MB. An entry is keyed by
+// the storage of the weight and is dropped once the weight is freed,
+// reallocated or modified. Inference tensors have no version counter, so
+// in-place writes to them under the inference mode are not detected: set
+// FT_WT_CACHE_MB=0 if the weights are updated that way.
+class FirstTokenWeightCache {
+ public:
+  static FirstTokenWeightCache& instance() {
+    static FirstTokenWeightCache cache;
+    return cache;
+  }
+
+  // Returns the first token weight of t made by relayout(t). The first caller
+  // of a weight makes it outside of the lock, the concurrent callers of the
+  // same weight wait for it instead of making it again.
+  template <typename F>
+  at::Tensor get(const at::Tensor& t, const F& relayout) {
+    auto key = key_of(t);
+    std::promise<at::Tensor> builder;
+    std::shared_future<at::Tensor> weight;
+    uint64_t id = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = entries.find(key);
+      if (it != entries.end() && !is_stale(it->second, t)) {
+        weight = it->second.weight;
+      } else {
+        if (it != entries.end()) {
+          erase(it);
+        }
+        erase_expired();
+        weight = builder.get_future().share();
+        id = ++last_id;
+        entries.emplace(
+            key,
+            Entry{
+                c10::weak_intrusive_ptr<c10::StorageImpl>(
+                    t.storage().getIntrusivePtr()),
+                t.storage().data_ptr().get(),
+                version_of(t),
+                t.sizes().vec(),
+                weight,
+                id,
+                0});
+      }
+    }
+    if (id == 0) {
+      return weight.get();
+    }
+
+    at::Tensor t_new;
+    try {
+      t_new = relayout(t);
+    } catch (...) {
+      builder.set_exception(std::current_exception());
+      std::lock_guard<std::mutex> lock(mutex);
+      erase_if_owned(key, id);
+      throw;
+    }
+    builder.set_value(t_new);
+    std::lock_guard<std::mutex> lock(mutex);
+    // The weights that need no relayout are not kept, the entry would keep
+    // them alive
+    if (t_new.is_same(t) ||
+        (FT_WT_CACHE_MB >= 0 &&
+         nbytes + t_new.nbytes() > ((size_t)FT_WT_CACHE_MB << 20))) {
+      erase_if_owned(key, id);
+    } else {
+      auto it = entries.find(key);
+      if (it != entries.end() && it->second.id == id) {
+        it->second.nbytes = t_new.nbytes();
+        nbytes += it->second.nbytes;
+      }
+    }
+    return t_new;
+  }
+
+ private:
+  using Key = std::pair<const c10::StorageImpl*, int64_t>;
+  struct Entry {
+    c10::weak_intrusive_ptr<c10::StorageImpl> storage;
+    // Changed when the storage is reallocated, e.g. by resize_
+    const void* data;
+    int64_t version;
+    std::vector<int64_t> sizes;
+    std::shared_future<at::Tensor> weight;
+    // Tells the entry of the builder apart from a later one of the same key
+    uint64_t id;
+    // Counted in the budget once the weight is made
+    size_t nbytes;
+  };
+
+  static Key key_of(const at::Tensor& t) {
+    return {t.storage().unsafeGetStorageImpl(), t.storage_offset()};
+  }
+  // Inference tensors have no version counter, see above
+  static int64_t version_of(const at::Tensor& t) {
+    return t.is_inference() ? 0 : t._version();
+  }
+  static bool is_stale(const Entry& entry, const at::Tensor& t) {
+    return entry.storage.expired() ||
+        entry.data != t.storage().data_ptr().get() ||
+        entry.version != version_of(t) || t.sizes() != entry.sizes;
+  }
+
+  void erase(std::map<Key, Entry>::iterator it) {
+    nbytes -= it->second.nbytes;
+    entries.erase(it);
+  }
+  void erase_expired() {
+    for (auto it = entries.begin(); it != entries.end();) {
+      auto next = std::next(it);
+      if (it->second.storage.expired()) {
+        erase(it);
+      }
+      it = next;
+    }
+  }
+  void erase_if_owned(const Key& key, uint64_t id) {
+    auto it = entries.find(key);
+    if (it != entries.end() && it->second.id == id) {
+      erase(it);
+    }
+  }
+
+  std::mutex mutex;
+  std::map<Key, Entry> entries;
+  size_t nbytes = 0;
+  uint64_t last_id = 0;
+};
+
+template <typename T>
+inline at::Tensor wt_tensor_for_first_token(at::Tensor& t) {
+  if (FT_WT_CACHE_MB == 0) {
+    return wt_relayout_for_first_token<T>(t);
+  }
+  return FirstTokenWeightCache::instance().get(
+      t, [](const at::Tensor& w) { return wt_relayout_for_first_token<T>(w); });
+}
+
 template <typename T>
 inline void tpp_linear_bias(
     const at::Tensor& t_in,
@@ -947,5 +1098,140 @@ inline void tpp_linear_relu(
   }
 }
 
+// t_in holds the tokens grouped by expert, the expert e owns the rows
+// [offsets[e], offsets[e + 1]) of t_in and t_out
+// t_wt_gate/t_wt_up/t_wt_down are the prepacked weights of all the experts
+// t_out is the down_proj(silu(gate_proj(x)) * up_proj(x)) of every row
+// All the experts are computed in one parallel loop over (expert, row block,
+// output block), so that the small per expert batches of decode still keep
+// all the cores busy.
+template <typename T>
+inline void tpp_fused_moe(
+    const at::Tensor& t_in,
+    const std::vector<at::Tensor>& t_wt_gate,
+    const std::vector<at::Tensor>& t_wt_up,
+    const std::vector<at::Tensor>& t_wt_down,
+    const std::vector<int64_t>& offsets,
+    at::Tensor& t_out) {
+  int64_t num_experts = t_wt_gate.size();
+  auto total = t_in.size(0);
+  auto C = t_in.size(1);
+
+  auto wt_sizes = t_wt_gate[0].sizes();
+  auto Nc = wt_sizes[1];
+  auto Hc = C / Nc;
+  auto Nk = wt_sizes[0];
+  auto Hk = wt_sizes[3];
+  auto K = Nk * Hk;
+
+  auto down_sizes = t_wt_down[0].sizes();
+  auto Nc2 = down_sizes[1];
+  auto Hc2 = K / Nc2;
+  auto Nk2 = down_sizes[0];
+  auto Hk2 = down_sizes[3];
+  auto H = Nk2 * Hk2;
+
+  std::vector<at::Tensor> t_wt_V;
+  for (int64_t e = 0; e < num_experts; e++) {
+    auto t_wt_gate_ = t_wt_gate[e];
+    auto t_wt_up_ = t_wt_up[e];
+    auto t_wt_down_ = t_wt_down[e];
+    t_wt_V.push_back(wt_tensor_for_fwd(Nk, Hk, Nc, Hc, t_wt_gate_));
+    t_wt_V.push_back(wt_tensor_for_fwd(Nk, Hk, Nc, Hc, t_wt_up_));
+    t_wt_V.push_back(wt_tensor_for_fwd(Nk2, Hk2, Nc2, Hc2, t_wt_down_));
+  }
+
+  // (expert, first row, rows) of every row block
+  auto BSb = 64L;
+  std::vector<std::array<int64_t, 3>> row_blocks;
+  for (int64_t e = 0; e < num_experts; e++) {
+    for (auto m = offsets[e]; m < offsets[e + 1]; m += BSb) {
+      row_blocks.push_back({e, m, std::min(BSb, offsets[e + 1] - m)});
+    }
+  }
+  int64_t num_row_blocks = row_blocks.size();
+
+  // The kernels are created for every distinct row block size up front, so
+  // that no kernel is generated inside the parallel region
+  auto gate_up_brgemm = [&](long rows) {
+    return SCOPEITGEMM(
+        (BrgemmTPP<T, T>(rows, Hk, Hc, Hc, Hk * Hc, C, Hk, K, 1.0, 0, Nc)));
+  };
+  auto down_brgemm = [&](long rows) {
+    return SCOPEITGEMM((BrgemmTPP<T, T>(
+        rows, Hk2, Hc2, Hc2, Hk2 * Hc2, K, Hk2, H, 1.0, 0, Nc2)));
+  };
+  auto zero = [&](long rows, long cols, long ld) {
+    return SCOPEIT(SetZeroTPP<T>(rows, cols, ld), EW_ZERO);
+  };
+  auto silu = [&](long rows) {
+    return SCOPEIT(SiLUFwdTPP<T>(rows, Hk, K, K), ACT);
+  };
+  auto mul = [&](long rows) {
+    return SCOPEIT((MulTPP<T, T>(rows, Hk, K, K)), EW_MUL);
+  };
+  std::map<long, decltype(gate_up_brgemm(1))> gate_up_brgemm_tpps;
+  std::map<long, decltype(down_brgemm(1))> down_brgemm_tpps;
+  std::map<long, decltype(zero(1, 1, 1))> zero_tpps, zero_out_tpps;
+  std::map<long, decltype(silu(1))> silu_tpps;
+  std::map<long, decltype(mul(1))> mul_tpps;
+  for (auto& block : row_blocks) {
+    auto rows = block[2];
+    if (gate_up_brgemm_tpps.count(rows) == 0) {
+      gate_up_brgemm_tpps.emplace(rows, gate_up_brgemm(rows));
+      down_brgemm_tpps.emplace(rows, down_brgemm(rows));
+      zero_tpps.emplace(rows, zero(rows, Hk, K));
+      zero_out_tpps.emplace(rows, zero(rows, Hk2, H));
+      silu_tpps.emplace(rows, silu(rows));
+      mul_tpps.emplace(rows, mul(rows));
+    }
+  }
+
+  // This is used to store the intermediate result of the up_proj layer
+  auto t_mid = t_in.new_empty({total, K});
+  auto t_mid_tmp = t_in.new_empty({total, K});
+  auto in = GetVLAPtr<T>(t_in, {Nc, Hc});
+  auto mid = GetVLAPtr<T>(t_mid, {Nk, Hk});
+  auto mid_tmp = GetVLAPtr<T>(t_mid_tmp, {Nk, Hk});
+  auto mid_in = GetVLAPtr<T>(t_mid, {Nc2, Hc2});
+  auto out = GetVLAPtr<T>(t_out, {Nk2, Hk2});
+
+  {
+    RECORD_SCOPE(tpp_fused_moe_krnl, {t_in, t_wt_V[0]});
+    ProfilingTeamScope team_scope;
+#pragma omp parallel for collapse(2) firstprivate(team_scope)
+    for (int64_t b = 0; b < num_row_blocks; b++) {
+      for (int64_t nk = 0; nk < Nk; nk++) {
+        auto e = row_blocks[b][0];
+        auto m = row_blocks[b][1];
+        auto rows = row_blocks[b][2];
+        auto wt_gate_V = GetVLAPtr<T>(t_wt_V[e * 3], {Nc, Hc * Hk});
+        auto wt_up_V = GetVLAPtr<T>(t_wt_V[e * 3 + 1], {Nc, Hc * Hk});
+        auto& brgemm_tpp = gate_up_brgemm_tpps.at(rows);
+        auto& zero_tpp = zero_tpps.at(rows);
+        zero_tpp(mid[m][nk]);
+        zero_tpp(mid_tmp[m][nk]);
+        brgemm_tpp(in[m][0], wt_gate_V[nk][0], mid[m][nk], Nc);
+        brgemm_tpp(in[m][0], wt_up_V[nk][0], mid_tmp[m][nk], Nc);
+        silu_tpps.at(rows)(mid[m][nk], mid[m][nk]);
+        mul_tpps.at(rows)(mid[m][nk], mid_tmp[m][nk], mid[m][nk]);
+      }
+    }
+
+#pragma omp parallel for collapse(2) firstprivate(team_scope)
+    for (int64_t b = 0; b < num_row_blocks; b++) {
+      for (int64_t nk = 0; nk < Nk2; nk++) {
+        auto e = row_blocks[b][0];
+        auto m = row_blocks[b][1];
+        auto rows = row_blocks[b][2];
+        auto wt_down_V = GetVLAPtr<T>(t_wt_V[e * 3 + 2], {Nc2, Hc2 * Hk2});
+        zero_out_tpps.at(rows)(out[m][nk]);
+        down_brgemm_tpps.at(rows)(
+            mid_in[m][0], wt_down_V[nk][0], out[m][nk], Nc2);
+      }
+    }
+  }
+}
+
 } // namespace tpp
 } // namespace torch_ipex
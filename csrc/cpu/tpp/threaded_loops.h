@@ -5,13 +5,16 @@
 #include <array>
 #include <cassert>
 #include <fstream>
+#include <future>
 #include <initializer_list>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <unordered_map>
 #include "jit_compile.h"
 #include "par_loop_generator.h"
+#include "timing.h"
 
 namespace torch_ipex {
 namespace tpp {
@@ -114,6 +117,9 @@ typedef void (*par_loop_kernel)(
     std::function<void()>);
 
 extern std::unordered_map<std::string, par_loop_kernel> pre_defined_loops;
+// Loop nests listed in aot_loop_schemes.txt, generated and compiled into the
+// library at build time so they never go through the runtime JIT.
+extern std::unordered_map<std::string, par_loop_kernel> aot_compiled_loops;
 
 #if 0
 void par_nested_loops(LoopSpecs *loopSpecs, std::function<void(int*)> body_func, std::function<void()> init_func, std::function<void()> fini_func)
@@ -195,16 +201,13 @@ class LoopingScheme {
       assert(nLLBL[i] > 0);
     }
     auto search = pre_defined_loops.find(scheme);
+    auto aot_search = aot_compiled_loops.find(scheme);
     if (search != pre_defined_loops.end()) {
       test_kernel = search->second;
+    } else if (aot_search != aot_compiled_loops.end()) {
+      test_kernel = aot_search->second;
     } else {
       std::string gen_code = loop_generator(scheme.c_str());
-      std::ofstream ofs("debug.cpp", std::ofstream::out);
-      ofs << code_str + gen_code;
-      ofs.close();
-      std::cout << "Scheme: " << scheme << std::endl;
-      std::cout << "Generated code:" << std::endl << gen_code;
-
       test_kernel = (par_loop_kernel)jit_from_str(
           code_str + gen_code, " -fopenmp ", "par_nested_loops");
     }
@@ -233,18 +236,33 @@ class LoopingScheme {
   par_loop_kernel test_kernel;
 };
 
+// A scheme that is not precompiled is JIT compiled by g++, which takes
+// seconds. The first caller builds it outside of the lock, so that the
+// lookups of the other schemes are not blocked, and the concurrent callers of
+// the same scheme wait for that build instead of compiling it again.
 inline LoopingScheme* getLoopingScheme(std::string scheme) {
-  static std::unordered_map<std::string, LoopingScheme*> kernel_cache;
+  static std::unordered_map<std::string, std::shared_future<LoopingScheme*>>
+      kernel_cache;
+  static std::mutex kernel_cache_mutex;
 
-  LoopingScheme* kernel = NULL;
-  auto search = kernel_cache.find(scheme);
-  if (search != kernel_cache.end())
-    kernel = search->second;
-  if (kernel == NULL) {
-    kernel = new LoopingScheme(scheme);
-    kernel_cache[scheme] = kernel;
+  std::promise<LoopingScheme*> builder;
+  std::shared_future<LoopingScheme*> kernel;
+  bool is_builder = false;
+  {
+    std::lock_guard<std::mutex> lock(kernel_cache_mutex);
+    auto search = kernel_cache.find(scheme);
+    if (search != kernel_cache.end()) {
+      kernel = search->second;
+    } else {
+      kernel = builder.get_future().share();
+      kernel_cache.emplace(scheme, kernel);
+      is_builder = true;
+    }
+  }
+  if (is_builder) {
+    builder.set_value(new LoopingScheme(scheme));
   }
-  return kernel;
+  return kernel.get();
 }
 
 template <int N>
@@ -275,11 +293,31 @@ class ThreadedLoop {
 
   template <class T>
   void operator()(T func) {
-    loopScheme->call(bounds, func, NULL, NULL);
+    (*this)(func, init_func(), fini_func());
   }
   template <class T, class Ti, class Tf>
   void operator()(T func, Ti init, Tf fini) {
-    loopScheme->call(bounds, func, init, fini);
+    if (!is_profiling_enabled()) {
+      loopScheme->call(bounds, func, init, fini);
+      return;
+    }
+    // The threads log their TPP events under the profiling scope of the caller
+    auto scope = profilingScope;
+    init_func init_fn = init;
+    fini_func fini_fn = fini;
+    loopScheme->call(
+        bounds,
+        func,
+        [&]() {
+          ProfilingTeamScope::enter(scope);
+          if (init_fn)
+            init_fn();
+        },
+        [&]() {
+          if (fini_fn)
+            fini_fn();
+          ProfilingTeamScope::leave();
+        });
   }
 
   std::string getDefaultScheme() {
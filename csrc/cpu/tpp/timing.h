@@ -1,6 +1,8 @@
 #ifndef _BERT_TIMING_H_
 #define _BERT_TIMING_H_
 
+#include <atomic>
+#include <cstdint>
 #include "utils.h"
 namespace torch_ipex {
 namespace tpp {
@@ -51,7 +53,8 @@ inline const char* DebugTimerName(int t) {
 enum PassType { OTH, FWD, BWD, UPD };
 
 extern PassType globalPass;
-extern int globalScope;
+// Scope of the running RECORD_SCOPE of the PROFILE_TPP builds
+extern std::atomic<int> globalScope;
 constexpr int NUM_TIMERS = ((LAST_TIMER + 7) / 8) * 8;
 extern double pass_timers[MAX_THREADS][3][NUM_TIMERS];
 extern double master_pass_timers[3];
@@ -83,16 +86,117 @@ inline int register_scope(std::string name) {
   return idx;
 }
 
+// Runtime profiling of the builds without PROFILE_TPP. While it is off the
+// only cost is a flag check per BRGEMM call and per scope. While it is on,
+// every BRGEMM call logs an event in a per-thread ring buffer, and every
+// RECORD_SCOPE opens a profiler event and closes it with a child event
+// carrying the BRGEMM FLOPs and GFLOP/s of the scope. It is enabled by
+// TPP_PROFILE=1 or torch.ops.torch_ipex.tpp_set_profiling(True).
+// The end of a scope takes a process-wide lock and walks the events logged
+// since its start on the rings of all the threads, up to
+// ProfilingRing::capacity events per thread. So the scopes of the concurrent
+// streams are serialized at their ends, and the profiled timings include it.
+extern std::atomic<bool> profiling_enabled;
+
+inline bool is_profiling_enabled() {
+  return profiling_enabled.load(std::memory_order_relaxed);
+}
+
+void set_profiling_enabled(bool enabled);
+
+// Cycle counter ticks per second
+double tsc_frequency();
+
+inline int register_profiling_scope() {
+  static std::atomic<int> num_scopes{1};
+  return num_scopes++;
+}
+
+// Id of the running ProfilingScope of the calling thread, 0 if none. Every
+// ProfilingScope instance has its own id, so the events of the concurrent
+// streams running the same RECORD_SCOPE are told apart. The threads of a
+// parallel region get it from the thread starting the region, see
+// ProfilingTeamScope.
+extern thread_local uint64_t profilingScope;
+
+inline uint64_t next_profiling_scope_id() {
+  static std::atomic<uint64_t> next_id{1};
+  return next_id.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Hands the profiling scope of the thread starting a parallel region to the
+// threads of the region. Declare it before the region and copy it into every
+// thread with firstprivate. The regions that only run callbacks on each
+// thread, e.g. the init and fini functions of ThreadedLoop, use enter() and
+// leave() instead.
+class ProfilingTeamScope {
+ public:
+  ProfilingTeamScope() : scope(profilingScope), oldScope(profilingScope) {}
+  ProfilingTeamScope(const ProfilingTeamScope& other)
+      : scope(other.scope), oldScope(profilingScope) {
+    profilingScope = scope;
+  }
+  ProfilingTeamScope& operator=(const ProfilingTeamScope&) = delete;
+  ~ProfilingTeamScope() {
+    profilingScope = oldScope;
+  }
+
+  static void enter(uint64_t scope) {
+    saved_scopes().push_back(profilingScope);
+    profilingScope = scope;
+  }
+  static void leave() {
+    profilingScope = saved_scopes().back();
+    saved_scopes().pop_back();
+  }
+
+ private:
+  static std::vector<uint64_t>& saved_scopes() {
+    static thread_local std::vector<uint64_t> scopes;
+    return scopes;
+  }
+
+  uint64_t scope;
+  uint64_t oldScope;
+};
+
+struct ProfilingEvent {
+  uint64_t scope;
+  int type;
+  long flops;
+  uint64_t start;
+  uint64_t end;
+};
+
+// Events of one thread in the order they ended. The oldest ones are
+// overwritten once it wraps around.
+class ProfilingRing {
+ public:
+  static constexpr uint64_t capacity = 4096;
+  void push(const ProfilingEvent& event) {
+    auto pos = head.load(std::memory_order_relaxed);
+    events[pos & (capacity - 1)] = event;
+    head.store(pos + 1, std::memory_order_release);
+  }
+  std::atomic<uint64_t> head{0};
+  ProfilingEvent events[capacity];
+};
+
+// Ring of the calling thread, registered for the scopes to read
+ProfilingRing& get_profiling_ring();
+
 #ifdef PROFILE_TPP
 #define REGISTER_LOCAL_SCOPE(id, name) static int sc_##id = register_scope(name)
 #define REGISTER_SCOPE(id, name) int sc_##id = register_scope(name)
 #define USING_SCOPE(id) extern int sc_##id
 #else
-#define REGISTER_LOCAL_SCOPE(id, name)
-#define REGISTER_SCOPE(id, name)
-#define USING_SCOPE(id)
+#define REGISTER_LOCAL_SCOPE(id, name) \
+  static int sc_##id = register_profiling_scope()
+#define REGISTER_SCOPE(id, name) int sc_##id = register_profiling_scope()
+#define USING_SCOPE(id) extern int sc_##id
 #endif
 
+#ifdef PROFILE_TPP
 class ScopedTimer {
  public:
   ScopedTimer(DebugTimer t, long f = 0) : type(t), flops(f), start(getTime()) {}
@@ -117,6 +221,70 @@ class ScopedTimer {
   long flops;
   double start;
 };
+#else
+class ScopedTimer {
+ public:
+  ScopedTimer(DebugTimer t, long f = 0)
+      : type(t), flops(f), start(is_profiling_enabled() ? rdtsc() : 0) {}
+  ~ScopedTimer() {
+    if (start != 0) {
+      get_profiling_ring().push(
+          {profilingScope,
+           type,
+           flops,
+           start,
+           rdtsc()});
+    }
+  }
+  DebugTimer type;
+  long flops;
+  uint64_t start;
+};
+
+// Scope of RECORD_SCOPE, only recorded while the profiling is on. Its BRGEMM
+// events are the ones logged under its instance id, by the calling thread and
+// the threads of the parallel regions it starts. The ones of nested scopes are
+// left to them. The registered scope id is not used, the name is enough for
+// the profiler.
+class ProfilingScope {
+ public:
+  template <typename F>
+  ProfilingScope(int /* scope */, const char* name, const F& inputs)
+      : name(name) {
+    if (!is_profiling_enabled()) {
+      return;
+    }
+    id = next_profiling_scope_id();
+    oldScope = profilingScope;
+    profilingScope = id;
+    record.emplace(at::RecordScope::FUNCTION);
+    if (record->isActive()) {
+      if (record->needsInputs()) {
+        auto args = inputs();
+        record->before(
+            name, c10::ArrayRef<const c10::IValue>(args.data(), args.size()));
+      } else {
+        record->before(name);
+      }
+    }
+    start = rdtsc();
+  }
+  ~ProfilingScope() {
+    if (start != 0) {
+      end_scope();
+    }
+  }
+
+ private:
+  void end_scope();
+
+  const char* name;
+  uint64_t id = 0;
+  uint64_t oldScope = 0;
+  uint64_t start = 0;
+  c10::optional<at::RecordFunction> record;
+};
+#endif
 
 class GlobalScope {
  public:
@@ -205,7 +373,10 @@ class ScopedTPP {
   RECORD_FUNCTION(#scope, std::vector<c10::IValue>(__VA_ARGS__))
 #else
 #define SCOPEIT(f, ...) f
-#define RECORD_SCOPE(scope, ...)
+#define RECORD_SCOPE(scope, ...)                  \
+  ProfilingScope ps_(sc_##scope, #scope, [&]() {  \
+    return std::vector<c10::IValue>(__VA_ARGS__); \
+  })
 #endif
 
 } // namespace tpp
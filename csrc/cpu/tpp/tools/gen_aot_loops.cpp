@@ -0,0 +1,61 @@
+// Build time generator for the ahead-of-time compiled ThreadedLoop nests.
+// Usage: gen_aot_loops <manifest> <output.cpp>
+// Every non-empty, non-comment line of the manifest is a looping scheme; the
+// generated source registers one kernel per scheme in aot_compiled_loops.
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../par_loop_generator.h"
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " <manifest> <output.cpp>"
+              << std::endl;
+    return 1;
+  }
+  std::ifstream manifest(argv[1]);
+  if (!manifest) {
+    std::cerr << "Unable to open " << argv[1] << std::endl;
+    return 1;
+  }
+  std::vector<std::string> schemes;
+  std::string line;
+  while (std::getline(manifest, line)) {
+    auto begin = line.find_first_not_of(" \t\r");
+    if (begin == std::string::npos || line[begin] == '#')
+      continue;
+    auto end = line.find_last_not_of(" \t\r");
+    schemes.push_back(line.substr(begin, end - begin + 1));
+  }
+
+  const std::string signature = "extern \"C\" void par_nested_loops(";
+  std::ofstream out(argv[2]);
+  out << "// Generated by gen_aot_loops from " << argv[1] << ", do not edit.\n"
+      << "#include <omp.h>\n"
+      << "#include <functional>\n"
+      << "#include \"threaded_loops.h\"\n\n"
+      << "namespace torch_ipex {\nnamespace tpp {\n"
+      << "namespace {\nusing loop_rt_spec_t = LoopSpecs;\n\n";
+  for (size_t i = 0; i < schemes.size(); i++) {
+    auto code = torch_ipex::tpp::loop_generator(schemes[i].c_str());
+    auto pos = code.find(signature);
+    if (pos == std::string::npos) {
+      std::cerr << "Unexpected code generated for scheme '" << schemes[i]
+                << "'" << std::endl;
+      return 1;
+    }
+    // omp.h is already included at file scope
+    code.replace(0, pos + signature.size(),
+                 "void aot_loop_" + std::to_string(i) + "(");
+    out << "// Scheme: " << schemes[i] << "\n" << code << "\n";
+  }
+  out << "} // namespace\n\n"
+      << "std::unordered_map<std::string, par_loop_kernel> "
+      << "aot_compiled_loops = {\n";
+  for (size_t i = 0; i < schemes.size(); i++) {
+    out << "    {\"" << schemes[i] << "\", aot_loop_" << i << "},\n";
+  }
+  out << "};\n} // namespace tpp\n} // namespace torch_ipex\n";
+  return out ? 0 : 1;
+}
@@ -85,6 +85,11 @@ unsigned int* get_rng_state();
 void init_libxsmm();
 void xsmm_manual_seed(unsigned int seed);
 
+// defined in kernel_registry.cpp, see KernelRegistry
+void record_tpp_kernels(bool enabled);
+int64_t save_tpp_kernel_records(const std::string& path);
+int64_t prewarm_tpp_kernels(const std::string& path);
+
 #ifdef __x86_64__
 #ifdef _WIN32
 inline uint64_t rdtsc() {
@@ -7,8 +7,16 @@
 
 #include <libxsmm.h>
 #include <libxsmm_intrinsics_x86.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include "timing.h"
 
 namespace torch_ipex {
 namespace tpp {
@@ -318,36 +326,105 @@ inline uint64_t string_to_hash_int(
   return hash_value;
 }
 
+// Process-wide cache of the JITed TPP kernels, keyed by their hash. Lookups
+// are lock-free. A miss builds the kernel once, the other threads missing the
+// same hash wait for it instead of building it again.
+class KernelRegistry {
+ public:
+  static KernelRegistry& instance();
+
+  void* find(uint64_t hash) const {
+    auto table = this->table.load(std::memory_order_acquire);
+    for (auto i = hash & table->mask;; i = (i + 1) & table->mask) {
+      auto& entry = table->entries[i];
+      auto key = entry.hash.load(std::memory_order_acquire);
+      if (key == hash)
+        return entry.kernel.load(std::memory_order_relaxed);
+      if (key == 0)
+        return NULL;
+    }
+  }
+  // Return NULL if build does
+  void* get_or_build(uint64_t hash, const std::function<void*()>& build);
+
+  // While recording, the TPPs log the spec of their kernels, see
+  // save_records and prewarm
+  bool is_recording() const {
+    return recording.load(std::memory_order_relaxed);
+  }
+  void set_recording(bool enabled);
+  void record(uint64_t hash, std::string spec);
+  // Write the recorded specs to path, one per line. Return their number.
+  int64_t save_records(const std::string& path);
+  // Build the kernels of the specs saved in path. Return their number.
+  int64_t prewarm(const std::string& path);
+
+ private:
+  struct Entry {
+    std::atomic<uint64_t> hash{0};
+    std::atomic<void*> kernel{NULL};
+  };
+  struct Table {
+    explicit Table(size_t capacity)
+        : mask(capacity - 1), entries(new Entry[capacity]) {}
+    size_t mask;
+    size_t size = 0;
+    std::unique_ptr<Entry[]> entries;
+  };
+  KernelRegistry();
+  // Called with mutex held
+  void insert(uint64_t hash, void* kernel);
+
+  // Replaced tables are kept, lock-free readers may still be probing them
+  std::atomic<Table*> table;
+  std::vector<std::unique_ptr<Table>> tables;
+  std::mutex mutex;
+  std::condition_variable built;
+  std::unordered_set<uint64_t> building;
+
+  std::atomic<bool> recording{false};
+  std::mutex records_mutex;
+  std::map<uint64_t, std::string> records;
+};
+
+template <int N>
+inline std::string prewarm_spec_of(
+    const std::string& kind,
+    const std::array<int, N>& params) {
+  auto spec = kind;
+  for (int param : params) {
+    spec += " " + std::to_string(param);
+  }
+  return spec;
+}
+
 class BaseTPP {
  public:
   void* get_kernel() {
-    auto& kernel_cache = get_kernel_cache();
-    void* kernel = NULL;
+    auto& registry = KernelRegistry::instance();
     if (hash == 0)
       hash = hash_int();
-    auto search = kernel_cache.find(hash);
-    if (search != kernel_cache.end())
-      kernel = search->second;
+    void* kernel = registry.find(hash);
     if (kernel == NULL) {
-      kernel = build_kernel();
+      kernel = registry.get_or_build(hash, [this]() { return build_kernel(); });
       if (kernel == NULL) {
         print_error();
         exit(1);
       }
-      // printf("TPP: %s @ %p\n", hash.c_str(), kernel);
-      kernel_cache[hash] = kernel;
     }
+    if (registry.is_recording())
+      registry.record(hash, prewarm_spec());
     return kernel;
   }
 
  protected:
-  std::unordered_map<uint64_t, void*>& get_kernel_cache() {
-    static std::unordered_map<uint64_t, void*> kernel_cache;
-    return kernel_cache;
-  }
   virtual uint64_t hash_int() = 0;
   virtual void* build_kernel() = 0;
   virtual void print_error() = 0;
+  // Line of KernelRegistry::prewarm rebuilding the kernel, empty if it can't
+  virtual std::string prewarm_spec() {
+    return "";
+  }
   uint64_t hash = 0;
   bool initialized = false;
 };
@@ -438,6 +515,11 @@ class UnaryTPP : public BaseTPP {
     uint64_t hash_value = string_to_hash_int<9>("unary", params);
     return hash_value;
   }
+  std::string prewarm_spec() override {
+    std::array<int, 9> params = {
+        rows, cols, ldi, ldo, dt_in, dt_out, dt_compute, (int)flags, type};
+    return prewarm_spec_of<9>("unary", params);
+  }
   void* build_kernel() override {
     libxsmm_meltw_unary_shape shape = libxsmm_create_meltw_unary_shape(
         cols, rows, ldi, ldo, dt_in, dt_out, dt_compute);
@@ -550,6 +632,21 @@ class BinaryTPP : public BaseTPP {
     uint64_t hash_value = string_to_hash_int<11>("binary", params);
     return hash_value;
   }
+  std::string prewarm_spec() override {
+    std::array<int, 11> params = {
+        rows,
+        cols,
+        ldi0,
+        ldi1,
+        ldo,
+        dt_in0,
+        dt_in1,
+        dt_out,
+        dt_compute,
+        (int)flags,
+        type};
+    return prewarm_spec_of<11>("binary", params);
+  }
   void* build_kernel() override {
     libxsmm_meltw_binary_shape shape = libxsmm_create_meltw_binary_shape(
         cols, rows, ldi0, ldi1, ldo, dt_in0, dt_in1, dt_out, dt_compute);
@@ -1902,6 +1999,7 @@ class BrgemmTPP {
       Tout* C,
       uint64_t count,
       bool no_tile_cfg = false) {
+    ScopedTimer _t(BRGEMM, flops() * count);
     libxsmm_gemm_param gemm_param;
     memset(&gemm_param, 0, sizeof(libxsmm_gemm_param));
     gemm_param.op.tertiary = &count;
@@ -2015,6 +2113,27 @@ class BrgemmTPP {
       uint64_t hash_value = string_to_hash_int<14>("brgemm", params);
       return hash_value;
     }
+    std::string prewarm_spec() override {
+      // The four kernels of a BrgemmTPP come from one spec
+      if (config != 0)
+        return "";
+      std::array<int, 14> params = {
+          XsmmDtype<Tin>(),
+          XsmmDtype<Tout>(),
+          p->M,
+          p->N,
+          p->K,
+          p->str_a,
+          p->str_b,
+          p->lda,
+          p->ldb,
+          p->ldc,
+          (int)p->beta,
+          p->a_trans,
+          p->unroll_hint,
+          p->b_vnni};
+      return prewarm_spec_of<14>("brgemm", params);
+    }
     void* build_kernel() override {
       // float alpha = 1.0;
       libxsmm_gemm_shape l_shape;
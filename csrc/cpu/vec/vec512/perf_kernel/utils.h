@@ -1,5 +1,9 @@
 #pragma once
 
+#include <c10/util/Float8_e4m3fn.h>
+#include <c10/util/Float8_e5m2.h>
+#include <array>
+
 // below is for aligned data load
 inline __m512 _load_f32_data(const float* data_base) {
   return _mm512_loadu_ps(data_base);
@@ -42,6 +46,36 @@ inline __m512 _loadu(const at::Half* data_base) {
   return cvt_fp16_to_fp32(_mm256_loadu_si256((__m256i*)data_base));
 }
 
+// int8 and fp8 loads are used to dequantize the low precision KV cache
+inline __m512 _loadu(const int8_t* data_base) {
+  return _mm512_cvtepi32_ps(
+      _mm512_cvtepi8_epi32(_mm_loadu_si128((__m128i*)data_base)));
+}
+
+inline __m512 _loadu(const at::Float8_e5m2* data_base) {
+  // e5m2 shares the sign/exponent layout of fp16, it is the high byte of fp16
+  auto vec_fp16 = _mm256_slli_epi16(
+      _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i*)data_base)), 8);
+  return cvt_fp16_to_fp32(vec_fp16);
+}
+
+inline const float* _fp8_e4m3fn_to_fp32_table() {
+  static const auto table = []() {
+    std::array<float, 256> t;
+    for (int i = 0; i < 256; i++) {
+      t[i] = static_cast<float>(
+          at::Float8_e4m3fn(i, at::Float8_e4m3fn::from_bits()));
+    }
+    return t;
+  }();
+  return table.data();
+}
+
+inline __m512 _loadu(const at::Float8_e4m3fn* data_base) {
+  auto vec_idx = _mm512_cvtepu8_epi32(_mm_loadu_si128((__m128i*)data_base));
+  return _mm512_i32gather_ps(vec_idx, _fp8_e4m3fn_to_fp32_table(), 4);
+}
+
 inline __m512 _maskz_loadu(const float* data_base, __mmask16 mask) {
   return _mm512_maskz_loadu_ps(mask, data_base);
 }
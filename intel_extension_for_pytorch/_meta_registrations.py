@@ -662,6 +662,25 @@ def meta_rotary_position_embedding(
         )
 
 
+@register_meta("rotary_position_embedding_with_kv_cache")
+def meta_rotary_position_embedding_with_kv_cache(
+    t_in,
+    t_emb_pos,
+    t_pos,
+    N,
+    H,
+    offset,
+    rotary_ndims,
+    key_cache,
+    value_cache,
+    slot_mapping=None,
+    cache_offset=0,
+):
+    batch = t_in.shape[0]
+    seq_len = t_in.shape[1]
+    return torch.empty(batch, seq_len, N, H, dtype=t_in.dtype, device=t_in.device)
+
+
 @register_meta("rmsnorm")
 def meta_rmsnorm(
     input,
@@ -1,3 +1,4 @@
+from typing import List, Optional
 import torch
 import intel_extension_for_pytorch as ipex
 from .cpupool import CPUPool
@@ -34,3 +35,48 @@ class Task(object):
     def run_sync(self, *args, **kwargs):
         # sync execution
         return self._task.run_sync(*args, **kwargs)
+
+    def enable_batching(
+        self,
+        max_batch_size: int,
+        max_wait_ms: float = 1.0,
+        batch_dim: int = 0,
+        pad_inputs: bool = False,
+        padding_value: float = 0.0,
+        unpad_output_dims: Optional[List[int]] = None,
+    ):
+        r"""
+        Coalesce the following concurrent calls of this Task into one forward.
+        Only supported for torch.jit.ScriptModule.
+
+        The tensor inputs of the batched calls are concatenated along
+        ``batch_dim`` and the tensor outputs are split back along it, other
+        outputs are shared by all the calls. A tensor output which can't be
+        split along ``batch_dim`` fails the calls. Calls whose non-tensor
+        inputs differ are not batched together.
+
+        Args:
+            max_batch_size (int): Upper bound of the summed batch sizes of
+                one forward.
+            max_wait_ms (float): How long the first call of a batch waits for
+                other calls.
+            batch_dim (int): The batch dimension of the inputs and outputs.
+            pad_inputs (bool): Pad the other dimensions of the tensor inputs
+                to the largest call with ``padding_value`` instead of running
+                mismatching calls in separate batches. The tensor outputs keep
+                the padded sizes unless listed in ``unpad_output_dims``.
+            padding_value (float): The value used by ``pad_inputs``.
+            unpad_output_dims (list of int): With ``pad_inputs``, the
+                non-negative dimensions of the tensor outputs to cut back to
+                the size of the same dimension of the first tensor input of
+                each call. Such a dimension must have the padded size, outputs
+                with fewer dimensions are left as they are.
+        """
+        self._task.enable_batching(
+            max_batch_size,
+            max_wait_ms,
+            batch_dim,
+            pad_inputs,
+            padding_value,
+            unpad_output_dims if unpad_output_dims is not None else [],
+        )
@@ -3,4 +3,5 @@ import warnings
 from . import fused_bert
 from . import utils
 from . import optim
+from . import kernels
 from .utils.blocked_layout import block_model_params as block
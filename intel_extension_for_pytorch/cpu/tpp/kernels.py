@@ -0,0 +1,41 @@
+import contextlib
+import intel_extension_for_pytorch._C as torch_ipex_cpp
+
+
+@contextlib.contextmanager
+def record_kernels(path):
+    r"""
+    Record the TPP kernels used inside the context and save their specs to
+    ``path`` on exit. Loading the file with :func:`prewarm_kernels` in a new
+    process builds those kernels up front, so that the first requests do not
+    pay for their JIT compilation.
+
+    Args:
+        path (str): File the kernel specs are written to.
+
+    Examples:
+
+        >>> with ipex.cpu.tpp.kernels.record_kernels("tpp_kernels.txt"):
+        ...     model(warmup_input)
+        >>> # In the serving process
+        >>> ipex.cpu.tpp.kernels.prewarm_kernels("tpp_kernels.txt")
+    """
+    torch_ipex_cpp.tpp_record_kernels(True)
+    try:
+        yield
+    finally:
+        torch_ipex_cpp.tpp_record_kernels(False)
+    torch_ipex_cpp.tpp_save_kernel_records(path)
+
+
+def prewarm_kernels(path):
+    r"""
+    Build the TPP kernels saved by :func:`record_kernels`.
+
+    Args:
+        path (str): File written by :func:`record_kernels`.
+
+    Returns:
+        The number of kernel specs loaded.
+    """
+    return torch_ipex_cpp.tpp_prewarm_kernels(path)
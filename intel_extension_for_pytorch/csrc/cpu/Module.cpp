@@ -222,7 +222,31 @@ void InitIpexModuleBindings(py::module m) {
             // Depending on this being ScriptModule of nn.Module we will release
             // the GIL or not further down in the stack
             return self.run_async(std::move(args), std::move(kwargs));
-          });
+          })
+      .def(
+          "enable_batching",
+          [](torch_ipex::runtime::TaskModule& self,
+             int64_t max_batch_size,
+             double max_wait_ms,
+             int64_t batch_dim,
+             bool pad_inputs,
+             double padding_value,
+             std::vector<int64_t> unpad_output_dims) {
+            self.enable_batching(
+                {max_batch_size,
+                 std::chrono::microseconds(
+                     static_cast<int64_t>(max_wait_ms * 1000)),
+                 batch_dim,
+                 pad_inputs,
+                 padding_value,
+                 std::move(unpad_output_dims)});
+          },
+          py::arg("max_batch_size"),
+          py::arg("max_wait_ms") = 1.0,
+          py::arg("batch_dim") = 0,
+          py::arg("pad_inputs") = false,
+          py::arg("padding_value") = 0.0,
+          py::arg("unpad_output_dims") = std::vector<int64_t>());
 
   m.def(
       "get_process_available_cores",
@@ -258,6 +282,10 @@ void InitIpexModuleBindings(py::module m) {
   // libxsmm
   m.def("xsmm_manual_seed", &torch_ipex::tpp::xsmm_manual_seed);
   m.def("init_libxsmm", &torch_ipex::tpp::init_libxsmm);
+  m.def("tpp_record_kernels", &torch_ipex::tpp::record_tpp_kernels);
+  m.def(
+      "tpp_save_kernel_records", &torch_ipex::tpp::save_tpp_kernel_records);
+  m.def("tpp_prewarm_kernels", &torch_ipex::tpp::prewarm_tpp_kernels);
 
   // tpp-for-optimizer
   m.def("tpp_dense_sparse_add_", &torch_ipex::tpp::dense_sparse_add_);
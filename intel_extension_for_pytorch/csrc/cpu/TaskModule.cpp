@@ -1,8 +1,136 @@
 #include "TaskModule.h"
+#include <numeric>
 
 namespace torch_ipex {
 namespace runtime {
 
+namespace {
+/*Concatenate the tensor input of the requests of one batch along batch_dim.
+ * The other dimensions are padded to the largest request if pad is set.*/
+at::Tensor concat_batch_input(
+    const std::vector<at::Tensor>& tensors,
+    int64_t batch_dim,
+    bool pad,
+    double padding_value) {
+  if (tensors.size() == 1) {
+    return tensors[0];
+  }
+  auto dim = c10::maybe_wrap_dim(batch_dim, tensors[0].dim());
+  auto sizes = tensors[0].sizes().vec();
+  for (auto& tensor : tensors) {
+    for (size_t d = 0; d < sizes.size(); d++) {
+      sizes[d] = std::max(sizes[d], tensor.size(d));
+    }
+  }
+  if (!pad) {
+    return at::cat(tensors, dim);
+  }
+  std::vector<at::Tensor> padded;
+  for (auto& tensor : tensors) {
+    // constant_pad_nd takes (left, right) pairs from the last dimension
+    std::vector<int64_t> pad_widths;
+    for (int64_t d = tensor.dim() - 1; d >= 0; d--) {
+      pad_widths.push_back(0);
+      pad_widths.push_back(d == dim ? 0 : sizes[d] - tensor.size(d));
+    }
+    padded.push_back(at::constant_pad_nd(tensor, pad_widths, padding_value));
+  }
+  return at::cat(padded, dim);
+}
+
+/*How the requests of a batch are laid out in its tensor inputs*/
+struct BatchLayout {
+  int64_t batch_dim;
+  std::vector<int64_t> batch_sizes;
+  // With pad_inputs, the sizes of the first tensor input of every request
+  // and of the batch. Empty if the inputs are not padded.
+  std::vector<std::vector<int64_t>> request_sizes;
+  std::vector<int64_t> padded_sizes;
+  // The output dimensions to cut back to the sizes of each request
+  std::vector<int64_t> unpad_dims;
+};
+
+/*Split the output of a batch back to its requests. Tensors are split along
+ * batch_dim, other values are shared by all requests. With padded inputs, the
+ * unpad_dims of a tensor are cut back to the size of the same dimension of
+ * the first tensor input of each request, the other dimensions keep the
+ * padded size.*/
+std::vector<c10::IValue> split_batch_output(
+    const c10::IValue& output,
+    const BatchLayout& layout) {
+  auto& batch_sizes = layout.batch_sizes;
+  auto total = std::accumulate(
+      batch_sizes.begin(), batch_sizes.end(), static_cast<int64_t>(0));
+  std::vector<c10::IValue> outputs(batch_sizes.size(), output);
+  if (output.isTensor()) {
+    auto tensor = output.toTensor();
+    TORCH_CHECK(
+        tensor.dim() > 0,
+        "TaskModule batching: a 0-dim output can't be split back to the batched calls");
+    auto dim = c10::maybe_wrap_dim(layout.batch_dim, tensor.dim());
+    TORCH_CHECK(
+        tensor.size(dim) == total,
+        "TaskModule batching: an output has size ",
+        tensor.size(dim),
+        " along batch_dim, but the batched calls have ",
+        total,
+        " samples");
+    if (!layout.request_sizes.empty()) {
+      for (auto d : layout.unpad_dims) {
+        // An output without the dimension has nothing to cut
+        if (d >= tensor.dim()) {
+          continue;
+        }
+        TORCH_CHECK(
+            d != dim,
+            "TaskModule batching: unpad_output_dims can't contain batch_dim");
+        TORCH_CHECK(
+            d < static_cast<int64_t>(layout.padded_sizes.size()) &&
+                tensor.size(d) == layout.padded_sizes[d],
+            "TaskModule batching: dimension ",
+            d,
+            " of an output doesn't have the padded size of the first tensor input");
+      }
+    }
+    auto parts = tensor.split_with_sizes(batch_sizes, dim);
+    for (size_t i = 0; i < parts.size(); i++) {
+      auto part = parts[i];
+      if (!layout.request_sizes.empty()) {
+        for (auto d : layout.unpad_dims) {
+          if (d < part.dim()) {
+            part = part.narrow(d, 0, layout.request_sizes[i][d]);
+          }
+        }
+      }
+      outputs[i] = part;
+    }
+  } else if (output.isTuple()) {
+    std::vector<std::vector<c10::IValue>> parts(batch_sizes.size());
+    for (auto& element : output.toTuple()->elements()) {
+      auto split = split_batch_output(element, layout);
+      for (size_t i = 0; i < split.size(); i++) {
+        parts[i].push_back(std::move(split[i]));
+      }
+    }
+    for (size_t i = 0; i < parts.size(); i++) {
+      outputs[i] = c10::ivalue::Tuple::create(std::move(parts[i]));
+    }
+  } else if (output.isTensorList()) {
+    std::vector<c10::List<at::Tensor>> parts(batch_sizes.size());
+    for (auto& element : output.toTensorVector()) {
+      auto split = split_batch_output(element, layout);
+      for (size_t i = 0; i < split.size(); i++) {
+        parts[i].push_back(split[i].toTensor());
+      }
+    }
+    for (size_t i = 0; i < parts.size(); i++) {
+      outputs[i] = parts[i];
+    }
+  }
+  return outputs;
+}
+} // namespace
+
 py::object FutureTensor::get() {
   CHECK(this->script_module_initialized_ ^ this->module_initialized_);
   if (this->script_module_initialized_) {
@@ -40,9 +168,228 @@ TaskModule::TaskModule(
 
 TaskModule::~TaskModule() {
   pybind11::gil_scoped_release no_gil_guard;
+  this->stop_batching();
   this->task_executor->stop_executor();
 }
 
+void TaskModule::enable_batching(const BatchingConfig& config) {
+  TORCH_CHECK(
+      this->script_module_initialized_,
+      "TaskModule batching only supports script modules");
+  TORCH_CHECK(
+      config.max_batch_size > 0,
+      "TaskModule batching: max_batch_size should be positive");
+  TORCH_CHECK(
+      config.pad_inputs || config.unpad_output_dims.empty(),
+      "TaskModule batching: unpad_output_dims requires pad_inputs");
+  for (auto d : config.unpad_output_dims) {
+    TORCH_CHECK(
+        d >= 0,
+        "TaskModule batching: unpad_output_dims should be non-negative");
+  }
+  std::lock_guard<std::mutex> lock(this->batching_mutex);
+  TORCH_CHECK(
+      !this->batching_enabled_.load(),
+      "TaskModule batching is already enabled");
+  this->batching_config = config;
+  this->batching_thread = std::thread([this] { this->batching_loop(); });
+  // Publishes batching_config to the run_async callers
+  this->batching_enabled_.store(true, std::memory_order_release);
+}
+
+void TaskModule::stop_batching() {
+  if (!this->batching_enabled_.load()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(this->batching_mutex);
+    this->batching_stop_ = true;
+  }
+  this->batching_condition.notify_all();
+  this->batching_thread.join();
+  this->batching_enabled_.store(false);
+}
+
+std::unique_ptr<FutureTensor> TaskModule::run_async_batched(
+    std::vector<at::IValue>&& stack) {
+  auto request = std::make_unique<BatchRequest>();
+  // stack[0] is the module itself
+  request->inputs.assign(
+      std::make_move_iterator(stack.begin() + 1),
+      std::make_move_iterator(stack.end()));
+  request->batch_size = -1;
+  for (auto& input : request->inputs) {
+    if (input.isTensor() && input.toTensor().dim() > 0) {
+      auto& tensor = input.toTensor();
+      request->batch_size = tensor.size(
+          c10::maybe_wrap_dim(this->batching_config.batch_dim, tensor.dim()));
+      break;
+    }
+  }
+  TORCH_CHECK(
+      request->batch_size >= 0,
+      "TaskModule batching needs a tensor input to batch along batch_dim");
+  request->grad_mode = at::GradMode::is_enabled();
+  request->arrival = std::chrono::steady_clock::now();
+
+  std::unique_ptr<FutureTensor> future_tensor_result =
+      std::make_unique<FutureTensor>();
+  future_tensor_result->script_module_initialized_ = true;
+  future_tensor_result->future_script_tensor = request->result.get_future();
+  {
+    std::lock_guard<std::mutex> lock(this->batching_mutex);
+    TORCH_CHECK(
+        !this->batching_stop_,
+        "submit TaskModule on stopped batching queue");
+    this->batch_requests.push_back(std::move(request));
+  }
+  this->batching_condition.notify_one();
+  return future_tensor_result;
+}
+
+bool TaskModule::can_batch(
+    const BatchRequest& first,
+    const BatchRequest& request) {
+  if (first.inputs.size() != request.inputs.size() ||
+      first.grad_mode != request.grad_mode) {
+    return false;
+  }
+  for (size_t i = 0; i < first.inputs.size(); i++) {
+    auto& a = first.inputs[i];
+    auto& b = request.inputs[i];
+    if (a.isTensor() != b.isTensor()) {
+      return false;
+    }
+    if (!a.isTensor()) {
+      // non tensor inputs are passed once for the whole batch
+      if (a != b) {
+        return false;
+      }
+      continue;
+    }
+    auto& ta = a.toTensor();
+    auto& tb = b.toTensor();
+    if (ta.scalar_type() != tb.scalar_type() || ta.dim() != tb.dim() ||
+        ta.dim() == 0) {
+      return false;
+    }
+    auto dim = c10::maybe_wrap_dim(this->batching_config.batch_dim, ta.dim());
+    for (int64_t d = 0; d < ta.dim(); d++) {
+      if (d != dim && ta.size(d) != tb.size(d) &&
+          !this->batching_config.pad_inputs) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void TaskModule::batching_loop() {
+  auto& config = this->batching_config;
+  while (true) {
+    std::vector<std::unique_ptr<BatchRequest>> batch;
+    {
+      std::unique_lock<std::mutex> lock(this->batching_mutex);
+      this->batching_condition.wait(lock, [this] {
+        return this->batching_stop_ || !this->batch_requests.empty();
+      });
+      if (this->batch_requests.empty())
+        return;
+
+      // Wait for more requests until the batch is full or the first request
+      // has waited for max_wait
+      auto batch_full = [&] {
+        int64_t batch_size = 0;
+        for (auto& request : this->batch_requests) {
+          batch_size += request->batch_size;
+          if (batch_size >= config.max_batch_size)
+            return true;
+        }
+        return false;
+      };
+      this->batching_condition.wait_until(
+          lock, this->batch_requests.front()->arrival + config.max_wait, [&] {
+            return this->batching_stop_ || batch_full();
+          });
+
+      // Take the compatible requests in arrival order
+      int64_t batch_size = 0;
+      while (!this->batch_requests.empty()) {
+        auto& request = this->batch_requests.front();
+        if (!batch.empty() &&
+            (batch_size + request->batch_size > config.max_batch_size ||
+             !this->can_batch(*batch[0], *request))) {
+          break;
+        }
+        batch_size += request->batch_size;
+        batch.push_back(std::move(request));
+        this->batch_requests.pop_front();
+      }
+    }
+    this->run_batch(std::move(batch));
+  }
+}
+
+void TaskModule::run_batch(
+    std::vector<std::unique_ptr<BatchRequest>>&& batch) {
+  auto requests =
+      std::make_shared<std::vector<std::unique_ptr<BatchRequest>>>(
+          std::move(batch));
+  auto run = [this, requests]() {
+    auto& config = this->batching_config;
+    auto& first = *(*requests)[0];
+    try {
+      at::GradMode::set_enabled(first.grad_mode);
+      std::vector<at::IValue> stack;
+      stack.reserve(first.inputs.size() + 1);
+      stack.push_back(this->script_module_._ivalue());
+      BatchLayout layout;
+      layout.batch_dim = config.batch_dim;
+      layout.unpad_dims = config.unpad_output_dims;
+      for (auto& request : *requests) {
+        layout.batch_sizes.push_back(request->batch_size);
+      }
+      for (size_t i = 0; i < first.inputs.size(); i++) {
+        if (!first.inputs[i].isTensor()) {
+          stack.push_back(first.inputs[i]);
+          continue;
+        }
+        std::vector<at::Tensor> tensors;
+        for (auto& request : *requests) {
+          tensors.push_back(request->inputs[i].toTensor());
+        }
+        stack.push_back(concat_batch_input(
+            tensors,
+            config.batch_dim,
+            config.pad_inputs,
+            config.padding_value));
+        if (config.pad_inputs && layout.request_sizes.empty()) {
+          for (auto& tensor : tensors) {
+            layout.request_sizes.push_back(tensor.sizes().vec());
+          }
+          layout.padded_sizes = stack.back().toTensor().sizes().vec();
+        }
+      }
+      auto& function = this->script_module_.get_method("forward").function();
+      auto outputs = split_batch_output(function(std::move(stack)), layout);
+      for (size_t i = 0; i < requests->size(); i++) {
+        (*requests)[i]->result.set_value(std::move(outputs[i]));
+      }
+    } catch (...) {
+      for (auto& request : *requests) {
+        request->result.set_exception(std::current_exception());
+      }
+    }
+  };
+  try {
+    this->task_executor->submit(std::move(run));
+  } catch (...) {
+    for (auto& request : *requests) {
+      request->result.set_exception(std::current_exception());
+    }
+  }
+}
+
 std::unique_ptr<FutureTensor> TaskModule::run_async(
     py::args&& args,
     py::kwargs&& kwargs) {
@@ -64,11 +411,14 @@ std::unique_ptr<FutureTensor> TaskModule::run_async(
           // NOLINTNEXTLINE(performance-move-const-arg)
           std::move(kwargs),
           script_module_._ivalue());
+      if (this->batching_enabled_.load(std::memory_order_acquire)) {
+        return this->run_async_batched(std::move(stack));
+      }
 
       typedef std::function<c10::IValue(std::vector<at::IValue>)>
           SubmitFunctionType;
       typedef decltype(SubmitFunctionType()(stack)) return_type;
-      auto task = std::make_shared<std::packaged_task<return_type()>>(std::bind(
+      std::packaged_task<return_type()> task(std::bind(
           std::forward<SubmitFunctionType>(
               [&](std::vector<at::IValue> stack) -> c10::IValue {
                 return function(std::move(stack));
@@ -76,23 +426,16 @@ std::unique_ptr<FutureTensor> TaskModule::run_async(
           std::forward<std::vector<at::IValue>>(stack)));
 
       future_tensor_result->script_module_initialized_ = true;
-      future_tensor_result->future_script_tensor = task->get_future();
+      future_tensor_result->future_script_tensor = task.get_future();
 
-      {
-        std::unique_lock<std::mutex> lock(this->task_executor->get_mutex());
-        // submit task to a stopping the pool is not allowed
-        if (this->task_executor->is_stop())
-          throw std::runtime_error(
-              "submit TaskModule(py::object) on stopped ThreadPool");
-        this->task_executor->get_tasks().emplace([task, grad_mode]() {
-          // set the thread local status, such as the grad mode before
-          // execuating the status
-          at::GradMode::set_enabled(grad_mode);
-          // execuate the task
-          (*task)();
-        });
-      }
-      this->task_executor->get_condition().notify_one();
+      this->task_executor->submit(
+          [task = std::move(task), grad_mode]() mutable {
+            // set the thread local status, such as the grad mode before
+            // execuating the status
+            at::GradMode::set_enabled(grad_mode);
+            // execuate the task
+            task();
+          });
     }
   } else {
     CHECK(this->module_initialized_);
@@ -101,32 +444,23 @@ std::unique_ptr<FutureTensor> TaskModule::run_async(
 
     typedef std::function<py::object()> SubmitFunctionType;
     typedef decltype(SubmitFunctionType()()) return_type;
-    auto task = std::make_shared<std::packaged_task<return_type()>>(
-        [&, this]() -> py::object {
-          {
-            pybind11::gil_scoped_acquire gil_guard;
-            return this->module_(*(this->args), **(this->kwargs));
-          }
-        });
+    std::packaged_task<return_type()> task([&, this]() -> py::object {
+      {
+        pybind11::gil_scoped_acquire gil_guard;
+        return this->module_(*(this->args), **(this->kwargs));
+      }
+    });
 
     future_tensor_result->module_initialized_ = true;
-    future_tensor_result->future_tensor = task->get_future();
+    future_tensor_result->future_tensor = task.get_future();
 
-    {
-      std::unique_lock<std::mutex> lock(this->task_executor->get_mutex());
-      // submit task to a stopping the pool is not allowed
-      if (this->task_executor->is_stop())
-        throw std::runtime_error(
-            "submit TaskModule(py::object) on stopped ThreadPool");
-      this->task_executor->get_tasks().emplace([task, grad_mode]() {
-        // set the thread local status, such as the grad mode before execuating
-        // the status
-        at::GradMode::set_enabled(grad_mode);
-        // execuate the task
-        (*task)();
-      });
-    }
-    this->task_executor->get_condition().notify_one();
+    this->task_executor->submit([task = std::move(task), grad_mode]() mutable {
+      // set the thread local status, such as the grad mode before execuating
+      // the status
+      at::GradMode::set_enabled(grad_mode);
+      // execuate the task
+      task();
+    });
   }
   return future_tensor_result;
 }
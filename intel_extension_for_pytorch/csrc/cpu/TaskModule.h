@@ -1,11 +1,16 @@
 #pragma once
 
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <future>
 #include <iostream>
 #include <memory>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
 #include <ATen/core/ivalue.h>
@@ -28,6 +33,34 @@ struct FutureTensor {
   py::object get();
 };
 
+/*Rules to coalesce concurrent requests into one forward*/
+struct BatchingConfig {
+  // upper bound of the summed batch sizes of one forward
+  int64_t max_batch_size;
+  // how long the first request of a batch waits for others
+  std::chrono::microseconds max_wait;
+  // dimension along which the tensor inputs are concatenated and the tensor
+  // outputs are split
+  int64_t batch_dim;
+  // pad the other dimensions of the tensor inputs to the largest request
+  // instead of keeping mismatching requests in separate batches
+  bool pad_inputs;
+  double padding_value;
+  // with pad_inputs, the dimensions of the tensor outputs cut back to the
+  // size of the same dimension of the first tensor input of each request
+  std::vector<int64_t> unpad_output_dims;
+};
+
+/*A request waiting in the batching queue*/
+struct BatchRequest {
+  // inputs following the schema of forward, without self
+  std::vector<c10::IValue> inputs;
+  int64_t batch_size;
+  bool grad_mode;
+  std::chrono::steady_clock::time_point arrival;
+  std::promise<c10::IValue> result;
+};
+
 /*TaskModule is used to handle Python input of nn.module or script module*/
 class TaskModule {
  public:
@@ -47,7 +80,17 @@ class TaskModule {
   std::unique_ptr<FutureTensor> run_async(
       py::args&& args,
       py::kwargs&& kwargs); /*async execution in threadpool*/
+  /*coalesce the following run_async calls of a script module*/
+  void enable_batching(const BatchingConfig& config);
+
  private:
+  std::unique_ptr<FutureTensor> run_async_batched(
+      std::vector<at::IValue>&& stack);
+  void batching_loop();
+  bool can_batch(const BatchRequest& first, const BatchRequest& request);
+  void run_batch(std::vector<std::unique_ptr<BatchRequest>>&& batch);
+  void stop_batching();
+
   // Script module input
   torch::jit::Module script_module_;
   bool script_module_initialized_{false};
@@ -59,6 +102,16 @@ class TaskModule {
   std::shared_ptr<TaskExecutor> task_executor;
   py::args args;
   py::kwargs kwargs;
+
+  // Batching queue in front of task_executor. batching_config is only written
+  // before batching_enabled_ is set.
+  BatchingConfig batching_config;
+  std::atomic<bool> batching_enabled_{false};
+  bool batching_stop_{false};
+  std::deque<std::unique_ptr<BatchRequest>> batch_requests;
+  std::mutex batching_mutex;
+  std::condition_variable batching_condition;
+  std::thread batching_thread;
 };
 
 } // namespace runtime
@@ -91,15 +91,6 @@ class IpexWoqLinear(nn.Module):
             return mod
 
         lowp_mode = qconfig.lowp_mode
-        if qconfig.lowp_mode == 3 and qconfig.weight_dtype != torch.quint4x2:
-            # lowp_mode=3 (INT8) is enabled for INT4 weight only
-            # Fall back to lowp_mode=2 in other case
-            # TODO(Weiwen) Support lowp_mode=3
-            lowp_mode = 2
-            print(
-                "Warning: lowp_mode=3(INT8) is not supported yet in this case. "
-                "Falling back to 2(BF16)."
-            )
         act_quant_mode = qconfig.act_quant_mode
         num_concats = 1
         if hasattr(mod, "_num_concats"):
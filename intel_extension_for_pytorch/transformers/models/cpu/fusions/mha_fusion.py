@@ -79,8 +79,10 @@ class _IPEXScaleDotProductCPU(nn.Module):
                 torch.zeros([1, 1, 1, 1]).contiguous(),
                 torch.zeros(1, int(query.size(0)), dtype=torch.long).contiguous(),
             )
-        key_cache = layer_past[1].contiguous()
-        value_cache = layer_past[2].contiguous()
+        # the kernel follows the strides of the caches, which are head major
+        # when MASKED_MHA_HEAD_MAJOR_KV_CACHE=1, do not copy them here
+        key_cache = layer_past[1]
+        value_cache = layer_past[2]
         beam_idx = layer_past[3].contiguous()
         if seq_info is None:
             seq_info = torch.tensor(
@@ -10,8 +10,8 @@ from ...reference.fusions.linear_fusion import (
     _IPEXlinearMulRef,
     _IPEXlinearSiluMulRef,
 )
-from torch.nn import functional as F
 import warnings
+from itertools import accumulate
 
 
 def LlamaDecoderLayer_forward(
@@ -754,70 +754,100 @@ def MixtralDecoderLayer_forward(
     # router_logits: (batch * sequence_length, n_experts)
     router_logits = self.block_sparse_moe.gate(hidden_states)
 
-    routing_weights = F.softmax(router_logits, dim=1, dtype=torch.float)
-    routing_weights, selected_experts = torch.topk(
-        routing_weights, self.block_sparse_moe.top_k, dim=-1
+    # softmax + top-k + renormalization, with the (token, k) pairs grouped by
+    # expert so that every expert gets its top_x and idx by slicing
+    (
+        routing_weights,
+        selected_experts,
+        expert_counts,
+        sorted_token_ids,
+        sorted_topk_idx,
+    ) = torch.ops.torch_ipex.moe_router(
+        router_logits, self.block_sparse_moe.top_k, True
     )
-    routing_weights /= routing_weights.sum(dim=-1, keepdim=True)
     # we cast back to the input dtype
     routing_weights = routing_weights.to(hidden_states.dtype)
 
-    final_hidden_states = torch.zeros(
-        (batch_size * sequence_length, hidden_dim),
-        dtype=hidden_states.dtype,
-        device=hidden_states.device,
-    )
+    experts = self.block_sparse_moe.experts
+    if all(
+        expert.w1.weight.dtype not in [torch.qint8, torch.int8, torch.uint8]
+        and not (hasattr(expert.w1, "use_dnnl") and expert.w1.use_dnnl)
+        for expert in experts
+    ):
+        # all the experts take the TPP path, compute them in one grouped call
+        final_hidden_states = torch.ops.torch_ipex.fused_moe_tpp(
+            hidden_states,
+            selected_experts,
+            routing_weights,
+            [expert.w1.weight for expert in experts],
+            [expert.w3.weight for expert in experts],
+            [expert.w2.weight for expert in experts],
+            experts[0].w1.tpp_fallback
+            if hasattr(experts[0].w1, "tpp_fallback")
+            else True,
+        ).view(-1, hidden_dim)
+    else:
+        final_hidden_states = torch.zeros(
+            (batch_size * sequence_length, hidden_dim),
+            dtype=hidden_states.dtype,
+            device=hidden_states.device,
+        )
 
-    # One hot encode the selected experts to create an expert mask
-    # this will be used to easily index which expert is going to be sollicitated
-    expert_mask = torch.nn.functional.one_hot(
-        selected_experts, num_classes=self.block_sparse_moe.num_experts
-    ).permute(2, 1, 0)
-
-    # Loop over all available experts in the model and perform the computation on each expert
-    for expert_idx in range(self.block_sparse_moe.num_experts):
-        expert_layer = self.block_sparse_moe.experts[expert_idx]
-        idx, top_x = torch.where(expert_mask[expert_idx])
-        if expert_layer.w1.weight.dtype in [torch.qint8, torch.int8, torch.uint8]:
-            final_hidden_states = torch.ops.torch_ipex.mixtral_moe_woq(
-                hidden_states,
-                top_x,
-                idx,
-                expert_layer.w1._op_context.get_data_handle(),
-                expert_layer.w3._op_context.get_data_handle(),
-                expert_layer.w2._op_context.get_data_handle(),
-                routing_weights,
-                final_hidden_states,
-            )
-        elif hasattr(expert_layer.w1, "use_dnnl") and expert_layer.w1.use_dnnl:
-            final_hidden_states = torch.ops.torch_ipex.mixtral_moe(
-                hidden_states,
-                top_x,
-                idx,
-                expert_layer.w1._get_forward_weight(),
-                expert_layer.w1.ctx.get_data_handle(),
-                expert_layer.w3._get_forward_weight(),
-                expert_layer.w3.ctx.get_data_handle(),
-                expert_layer.w2._get_forward_weight(),
-                expert_layer.w2.ctx.get_data_handle(),
-                hasattr(expert_layer.w1, "use_dnnl") and expert_layer.w1.use_dnnl,
-                routing_weights,
-                final_hidden_states,
-            )
-        else:
-            final_hidden_states = torch.ops.torch_ipex.mixtral_moe_tpp(
-                hidden_states,
-                top_x,
-                idx,
-                expert_layer.w1.weight,
-                expert_layer.w3.weight,
-                expert_layer.w2.weight,
-                expert_layer.w1.tpp_fallback
-                if hasattr(expert_layer.w1, "tpp_fallback")
-                else True,
-                routing_weights,
-                final_hidden_states,
-            )
+        expert_offsets = [0] + list(accumulate(expert_counts.tolist()))
+
+        # Loop over all available experts in the model and perform the computation on each expert
+        for expert_idx in range(self.block_sparse_moe.num_experts):
+            expert_layer = self.block_sparse_moe.experts[expert_idx]
+            start, end = expert_offsets[expert_idx], expert_offsets[expert_idx + 1]
+            top_x = sorted_token_ids[start:end]
+            idx = sorted_topk_idx[start:end]
+            if expert_layer.w1.weight.dtype in [
+                torch.qint8,
+                torch.int8,
+                torch.uint8,
+            ]:
+                final_hidden_states = torch.ops.torch_ipex.mixtral_moe_woq(
+                    hidden_states,
+                    top_x,
+                    idx,
+                    expert_layer.w1._op_context.get_data_handle(),
+                    expert_layer.w3._op_context.get_data_handle(),
+                    expert_layer.w2._op_context.get_data_handle(),
+                    routing_weights,
+                    final_hidden_states,
+                )
+            elif (
+                hasattr(expert_layer.w1, "use_dnnl") and expert_layer.w1.use_dnnl
+            ):
+                final_hidden_states = torch.ops.torch_ipex.mixtral_moe(
+                    hidden_states,
+                    top_x,
+                    idx,
+                    expert_layer.w1._get_forward_weight(),
+                    expert_layer.w1.ctx.get_data_handle(),
+                    expert_layer.w3._get_forward_weight(),
+                    expert_layer.w3.ctx.get_data_handle(),
+                    expert_layer.w2._get_forward_weight(),
+                    expert_layer.w2.ctx.get_data_handle(),
+                    hasattr(expert_layer.w1, "use_dnnl")
+                    and expert_layer.w1.use_dnnl,
+                    routing_weights,
+                    final_hidden_states,
+                )
+            else:
+                final_hidden_states = torch.ops.torch_ipex.mixtral_moe_tpp(
+                    hidden_states,
+                    top_x,
+                    idx,
+                    expert_layer.w1.weight,
+                    expert_layer.w3.weight,
+                    expert_layer.w2.weight,
+                    expert_layer.w1.tpp_fallback
+                    if hasattr(expert_layer.w1, "tpp_fallback")
+                    else True,
+                    routing_weights,
+                    final_hidden_states,
+                )
     final_hidden_states = final_hidden_states.reshape(
         batch_size, sequence_length, hidden_dim
     )
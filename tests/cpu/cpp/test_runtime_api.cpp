@@ -430,3 +430,62 @@ TEST(TestRuntimeTaskAPI, TestTaskAPISameTasksMultiTensorInputs) {
   ASSERT_VARIABLE_EQ(res, res_ref);
   ASSERT_VARIABLE_EQ(res2, res_ref2);
 }
+
+TEST(TestRuntimeTaskAPI, TestTaskAPIWorkStealing) {
+  if (!torch_ipex::runtime::is_runtime_ext_enabled()) {
+    GTEST_SKIP()
+        << "Skip TestRuntimeTaskAPI::TestTaskAPIWorkStealing. Didn't preload IOMP.";
+  }
+  // Tasks are only submitted to the first executor, the second one may steal
+  // them. Every task must run exactly once either way.
+  std::vector<int32_t> cpu_core_list({0});
+  torch_ipex::runtime::CPUPool cpu_pool(cpu_core_list);
+  std::shared_ptr<torch_ipex::runtime::TaskExecutor> task_executor =
+      std::make_shared<torch_ipex::runtime::TaskExecutor>(cpu_pool);
+  std::vector<int32_t> cpu_core_list2({1});
+  torch_ipex::runtime::CPUPool cpu_pool2(cpu_core_list2);
+  std::shared_ptr<torch_ipex::runtime::TaskExecutor> task_executor2 =
+      std::make_shared<torch_ipex::runtime::TaskExecutor>(cpu_pool2);
+
+  at::Tensor input_tensor = at::rand({16, 256});
+  auto res_ref = at::softmax(input_tensor, -1);
+  torch_ipex::runtime::
+      Task<at::Tensor (*)(const at::Tensor&), const at::Tensor&>
+          task(taskfunction_const_lvalue_reference, task_executor);
+
+  // More tasks than the slots of the queue
+  std::vector<std::future<at::Tensor>> res_futures;
+  for (int i = 0; i < 2048; i++) {
+    res_futures.push_back(task(input_tensor));
+  }
+  for (auto& res_future : res_futures) {
+    ASSERT_VARIABLE_EQ(res_future.get(), res_ref);
+  }
+}
+
+TEST(TestRuntimeTaskAPI, TestTaskAPISubmitFromWorker) {
+  if (!torch_ipex::runtime::is_runtime_ext_enabled()) {
+    GTEST_SKIP()
+        << "Skip TestRuntimeTaskAPI::TestTaskAPISubmitFromWorker. Didn't preload IOMP.";
+  }
+  // A task fills the queue of its own executor, the worker can't wait for the
+  // queue to drain and has to run the overflow itself
+  std::vector<int32_t> cpu_core_list({0});
+  torch_ipex::runtime::CPUPool cpu_pool(cpu_core_list);
+  std::shared_ptr<torch_ipex::runtime::TaskExecutor> task_executor =
+      std::make_shared<torch_ipex::runtime::TaskExecutor>(cpu_pool);
+  const int num_tasks = 2048;
+  std::atomic<int> num_done{0};
+  std::promise<void> submitted;
+  task_executor->submit([&] {
+    for (int i = 0; i < num_tasks; i++) {
+      task_executor->submit([&] { num_done++; });
+    }
+    submitted.set_value();
+  });
+  submitted.get_future().wait();
+  while (num_done.load() < num_tasks) {
+    std::this_thread::yield();
+  }
+  ASSERT_EQ(num_done.load(), num_tasks);
+}
@@ -0,0 +1,89 @@
+#include <torch/torch.h>
+#include "csrc/cpu/aten/Linear.h"
+#include "gtest/gtest.h"
+
+#define ASSERT_VARIABLE_EQ(a, b) ASSERT_TRUE(torch::equal((a), (b)))
+
+using namespace torch_ipex::cpu;
+
+namespace {
+
+constexpr int64_t kLowpModeNone = 0;
+constexpr int64_t kLowpModeInt8 = 3;
+constexpr int64_t kQuantAPerTensor = 0;
+
+at::Tensor random_weight(int qw_type, int64_t N, int64_t K) {
+  if (qw_type == WOQ_DTYPE_QINT8) {
+    return at::randint(-128, 128, {N, K}, at::kChar);
+  }
+  // Two 4-bit values per byte, compressed along K
+  return at::randint(0, 256, {N, K / 2}, at::kByte);
+}
+
+} // namespace
+
+TEST(TestWoqTpp, TestPackUnpackInt8LowpMode) {
+  const int64_t N = 64, K = 128;
+  for (int qw_type : {WOQ_DTYPE_QINT8, WOQ_DTYPE_QINT4, WOQ_DTYPE_NF4}) {
+    auto qw = random_weight(qw_type, N, K);
+    auto packed = woq_tpp_gemm_packB_stub(
+        at::kCPU, qw, qw_type, /*block_n*/ 32, /*block_k*/ 64, kLowpModeInt8);
+    ASSERT_EQ(packed.dim(), 4);
+    auto unpacked =
+        woq_tpp_gemm_unpackB_stub(at::kCPU, packed, qw_type, kLowpModeInt8);
+    ASSERT_VARIABLE_EQ(unpacked, qw);
+  }
+}
+
+TEST(TestWoqTpp, TestNF4Int8LowpMode) {
+  const int64_t N = 64, K = 128;
+  auto qw = random_weight(WOQ_DTYPE_NF4, N, K);
+  auto scales = at::rand({N}) * 0.05 + 0.01;
+  std::vector<at::Tensor> scales_list = {
+      scales, scales.to(at::kHalf), scales.to(at::kBFloat16)};
+  // NF4 is symmetric and has no zero points
+  std::vector<at::Tensor> zp_list(4);
+  auto packed = woq_tpp_gemm_packB_stub(
+      at::kCPU,
+      qw,
+      WOQ_DTYPE_NF4,
+      /*block_n*/ 32,
+      /*block_k*/ 64,
+      kLowpModeInt8);
+  for (int64_t M : {1, 4, 64}) {
+    auto x = at::rand({M, K}) * 0.5;
+    // The plain 2D weight goes through the reference dequantization path
+    auto y_ref = woq_tpp_gemm_kernel_stub(
+        at::kCPU,
+        x,
+        qw,
+        scales_list,
+        zp_list,
+        {},
+        WOQ_DTYPE_NF4,
+        kLowpModeNone,
+        /*num_concats*/ 1,
+        WOQ_FUSE_NONE,
+        {},
+        kQuantAPerTensor,
+        /*quant_w_mode*/ 0,
+        /*quant_block_k*/ 0);
+    auto y = woq_tpp_gemm_kernel_stub(
+        at::kCPU,
+        x,
+        packed,
+        scales_list,
+        zp_list,
+        {},
+        WOQ_DTYPE_NF4,
+        kLowpModeInt8,
+        /*num_concats*/ 1,
+        WOQ_FUSE_NONE,
+        {},
+        kQuantAPerTensor,
+        /*quant_w_mode*/ 0,
+        /*quant_block_k*/ 0);
+    ASSERT_EQ(y.sizes(), y_ref.sizes());
+    ASSERT_TRUE(torch::allclose(y, y_ref, /*rtol*/ 5e-2, /*atol*/ 5e-2));
+  }
+}
@@ -1,5 +1,9 @@
 import unittest
 import copy
+import os
+import subprocess
+import sys
+import tempfile
 import torch
 import torch.nn as nn
 import torch.nn.functional as F
@@ -1483,6 +1487,262 @@ class CPUOPsTester(TestCase):
                         math_ref = math_ref.to(dtype)
                     torch.testing.assert_close(actual, math_ref, atol=atol, rtol=rtol)
 
+    def test_flash_attention_backward(self):
+        dtypes = [torch.float, torch.bfloat16]
+        if core.isa_has_amx_fp16_support():
+            dtypes.append(torch.float16)
+        for dtype in dtypes:
+            for causal, has_attention_mask in [
+                [False, False],
+                [True, False],
+                [False, True],
+            ]:
+                for batch_size, seq_len, n_head, head_dim in itertools.product(
+                    [2], [1, 129, 533], [3], [7, 16]
+                ):
+                    atol = 1e-4
+                    rtol = 1e-4
+                    if dtype in [torch.bfloat16, torch.float16]:
+                        atol = 5e-2
+                        rtol = 5e-2
+                    q, k, v = (
+                        torch.randn(batch_size, n_head, seq_len, head_dim).to(dtype)
+                        for _ in range(3)
+                    )
+                    grad_out = torch.randn(batch_size, n_head, seq_len, head_dim).to(
+                        dtype
+                    )
+                    mask = (
+                        torch.randn(batch_size, 1, seq_len, seq_len).to(dtype)
+                        if has_attention_mask
+                        else None
+                    )
+                    q1, k1, v1 = (x.clone().requires_grad_() for x in (q, k, v))
+                    q2, k2, v2 = (x.float().requires_grad_() for x in (q, k, v))
+                    # autograd of the aten op dispatches to the IPEX backward
+                    out = torch.ops.aten._scaled_dot_product_flash_attention_for_cpu(
+                        q1, k1, v1, 0.0, causal, attn_mask=mask
+                    )[0]
+                    out.backward(grad_out)
+                    math_ref = torch._scaled_dot_product_attention_math(
+                        q2,
+                        k2,
+                        v2,
+                        attn_mask=None if mask is None else mask.float(),
+                        dropout_p=0.0,
+                        is_causal=causal,
+                    )[0]
+                    math_ref.backward(grad_out.float())
+                    for actual, ref in [
+                        (q1.grad, q2.grad),
+                        (k1.grad, k2.grad),
+                        (v1.grad, v2.grad),
+                    ]:
+                        torch.testing.assert_close(
+                            actual, ref.to(dtype), atol=atol, rtol=rtol
+                        )
+
+    def test_flash_attention_dropout(self):
+        dropout_p = 0.3
+        for dtype in [torch.float, torch.bfloat16]:
+            # uniform attention on ones: each output element is the kept
+            # fraction of the row scaled by 1 / (1 - p)
+            q = torch.zeros(2, 4, 600, 16, dtype=dtype)
+            v = torch.ones(2, 4, 600, 16, dtype=dtype)
+            out1 = torch.ops.torch_ipex.flash_attention(
+                q, q, v, dropout_p, philox_seed=2024
+            )[0]
+            out2 = torch.ops.torch_ipex.flash_attention(
+                q, q, v, dropout_p, philox_seed=2024
+            )[0]
+            out3 = torch.ops.torch_ipex.flash_attention(
+                q, q, v, dropout_p, philox_seed=2025
+            )[0]
+            self.assertEqual(out1, out2)
+            self.assertNotEqual(out1, out3)
+            self.assertEqual(out1.float().mean().item(), 1.0, atol=2e-2, rtol=0)
+
+        # the backward regenerates the forward's mask from the seed
+        for causal in [False, True]:
+            q, k, v = (
+                torch.randn(1, 2, 9, 4, dtype=torch.double, requires_grad=True)
+                for _ in range(3)
+            )
+            self.assertTrue(
+                torch.autograd.gradcheck(
+                    lambda q, k, v: torch.ops.torch_ipex.flash_attention(
+                        q, k, v, dropout_p, causal, philox_seed=7
+                    )[0],
+                    (q, k, v),
+                )
+            )
+
+        # the aten op can not pass the seed to its backward, so it rejects
+        # dropout in the forward and the backward alike
+        q = torch.randn(1, 2, 9, 4)
+        with self.assertRaisesRegex(RuntimeError, "dropout"):
+            torch.ops.aten._scaled_dot_product_flash_attention_for_cpu(
+                q, q, q, dropout_p
+            )
+        out, lse = torch.ops.aten._scaled_dot_product_flash_attention_for_cpu(q, q, q)
+        with self.assertRaisesRegex(RuntimeError, "dropout"):
+            torch.ops.aten._scaled_dot_product_flash_attention_for_cpu_backward(
+                out, q, q, q, out, lse, dropout_p, False
+            )
+
+    def test_flash_attention_autotune(self):
+        # The tuner reads its environment once per process, so each tile
+        # table runs in its own process
+        script = """
+import sys
+import torch
+import intel_extension_for_pytorch as ipex
+
+torch.manual_seed(0)
+q, k, v = (torch.randn(1, 4, 600, 64, requires_grad=True) for _ in range(3))
+out = torch.ops.torch_ipex.flash_attention(q, k, v, is_causal=True)[0]
+out.backward(torch.ones_like(out))
+torch.save((out, q.grad, k.grad, v.grad), sys.argv[1])
+"""
+        with tempfile.TemporaryDirectory() as work_dir:
+            cache_file = os.path.join(work_dir, "flash_attention_tune_cache")
+
+            def run(name, autotune, cache=None):
+                env = dict(os.environ, FLASH_ATTENTION_AUTOTUNE=autotune)
+                env.pop("FLASH_ATTENTION_TUNE_CACHE", None)
+                if cache is not None:
+                    env["FLASH_ATTENTION_TUNE_CACHE"] = cache
+                out_file = os.path.join(work_dir, name)
+                subprocess.run(
+                    [sys.executable, "-c", script, out_file], env=env, check=True
+                )
+                return torch.load(out_file)
+
+            ref = run("ref.pt", "0")
+            tuned = run("tuned.pt", "1", cache_file)
+            for actual, expected in zip(tuned, ref):
+                torch.testing.assert_close(actual, expected, atol=1e-5, rtol=1e-5)
+            # one entry for the forward and one for the backward
+            with open(cache_file) as f:
+                self.assertEqual(len(f.readlines()), 2)
+            cached = run("cached.pt", "0", cache_file)
+            for actual, expected in zip(cached, ref):
+                torch.testing.assert_close(actual, expected, atol=1e-5, rtol=1e-5)
+
+    def test_flash_attention_window_alibi(self):
+        def dense_bias(q_len, kv_len, window, slopes):
+            q_pos = torch.arange(q_len).view(-1, 1)
+            k_pos = torch.arange(kv_len).view(1, -1)
+            bias = torch.zeros(q_len, kv_len)
+            left, right = window
+            if left >= 0:
+                bias.masked_fill_(k_pos < q_pos - left, float("-inf"))
+            if right >= 0:
+                bias.masked_fill_(k_pos > q_pos + right, float("-inf"))
+            if slopes is None:
+                return bias
+            # (B, H, q, kv) or (1, H, q, kv)
+            distance = (q_pos - k_pos).abs().float()
+            slopes = slopes.view(-1, slopes.size(-1), 1, 1)
+            return bias - slopes * distance
+
+        for dtype, window, has_alibi, seq_len in itertools.product(
+            [torch.float, torch.bfloat16],
+            [(-1, -1), (37, 0), (100, 20), (-1, 5)],
+            [False, True],
+            [1, 129, 600],
+        ):
+            atol = 2e-2 if dtype is torch.bfloat16 else 1e-4
+            batch_size, n_head, head_dim = 2, 3, 16
+            q, k, v = (
+                torch.randn(batch_size, n_head, seq_len, head_dim).to(dtype)
+                for _ in range(3)
+            )
+            slopes = torch.rand(batch_size, n_head) if has_alibi else None
+            q1, k1, v1 = (x.clone().requires_grad_() for x in (q, k, v))
+            q2, k2, v2 = (x.float().requires_grad_() for x in (q, k, v))
+            out = torch.ops.torch_ipex.flash_attention(
+                q1,
+                k1,
+                v1,
+                window_size_left=window[0],
+                window_size_right=window[1],
+                alibi_slopes=slopes,
+            )[0]
+            ref = torch._scaled_dot_product_attention_math(
+                q2,
+                k2,
+                v2,
+                attn_mask=dense_bias(seq_len, seq_len, window, slopes),
+            )[0]
+            torch.testing.assert_close(out, ref.to(dtype), atol=atol, rtol=atol)
+            grad_out = torch.randn_like(ref)
+            out.backward(grad_out.to(dtype))
+            ref.backward(grad_out)
+            grad_atol = 5e-2 if dtype is torch.bfloat16 else 1e-4
+            for actual, expected in [
+                (q1.grad, q2.grad),
+                (k1.grad, k2.grad),
+                (v1.grad, v2.grad),
+            ]:
+                torch.testing.assert_close(
+                    actual, expected.to(dtype), atol=grad_atol, rtol=grad_atol
+                )
+
+    def test_flash_attention_window_no_key(self):
+        # The window is top-left aligned, the queries past kv_len + left see
+        # no key, whole q blocks of them and the rows of a partial block
+        q_len, batch_size, n_head, head_dim = 300, 2, 3, 16
+        for dtype, kv_len, window in itertools.product(
+            [torch.float, torch.bfloat16],
+            [1, 100, 129],
+            [(0, 0), (37, 0), (10, 5)],
+        ):
+            atol = 2e-2 if dtype is torch.bfloat16 else 1e-4
+            visible = min(q_len, kv_len + window[0])
+            q = torch.randn(batch_size, n_head, q_len, head_dim).to(dtype)
+            k, v = (
+                torch.randn(batch_size, n_head, kv_len, head_dim).to(dtype)
+                for _ in range(2)
+            )
+            q1, k1, v1 = (x.clone().requires_grad_() for x in (q, k, v))
+            q2, k2, v2 = (x.float().requires_grad_() for x in (q, k, v))
+            out, lse = torch.ops.torch_ipex.flash_attention(
+                q1,
+                k1,
+                v1,
+                window_size_left=window[0],
+                window_size_right=window[1],
+            )[:2]
+            q_pos = torch.arange(visible).view(-1, 1)
+            k_pos = torch.arange(kv_len).view(1, -1)
+            bias = torch.zeros(visible, kv_len)
+            bias.masked_fill_(k_pos < q_pos - window[0], float("-inf"))
+            bias.masked_fill_(k_pos > q_pos + window[1], float("-inf"))
+            ref = torch._scaled_dot_product_attention_math(
+                q2[:, :, :visible], k2, v2, attn_mask=bias
+            )[0]
+            torch.testing.assert_close(
+                out[:, :, :visible], ref.to(dtype), atol=atol, rtol=atol
+            )
+            # The rows without a key output 0 with an infinite logsumexp
+            self.assertTrue(torch.isfinite(lse[:, :, :visible]).all())
+            self.assertTrue(torch.isposinf(lse[:, :, visible:]).all())
+            self.assertEqual(out[:, :, visible:], torch.zeros_like(out[:, :, visible:]))
+            grad_out = torch.randn(batch_size, n_head, q_len, head_dim)
+            out.backward(grad_out.to(dtype))
+            ref.backward(grad_out[:, :, :visible])
+            grad_atol = 5e-2 if dtype is torch.bfloat16 else 1e-4
+            for actual, expected in [
+                (q1.grad[:, :, :visible], q2.grad[:, :, :visible]),
+                (q1.grad[:, :, visible:], torch.zeros_like(q2.grad[:, :, visible:])),
+                (k1.grad, k2.grad),
+                (v1.grad, v2.grad),
+            ]:
+                torch.testing.assert_close(
+                    actual, expected.to(dtype), atol=grad_atol, rtol=grad_atol
+                )
+
 
 if __name__ == "__main__":
     test = unittest.main()
@@ -1,3 +1,4 @@
+import io
 import torch
 import unittest
 
@@ -207,6 +208,52 @@ class TestFP8Cases(TestCase):
             out_fp8_iter5 = fp8_linear_with_calibration(inp2[4])
         self.assertEqual(out_fp8_iter5, out_nn_iter5, atol=0.01, rtol=0.1)
 
+    @unittest.skipIf(
+        not core.onednn_has_fp8_support(),
+        "IPEX FP8 is not supported on this CPU device",
+    )
+    def test_fp8_linear_pack(self):
+        torch.manual_seed(2024)
+        weight_fp8 = torch.randn(64, 32).to(torch.float8_e4m3fn)
+        bias = torch.randn(64).to(torch.bfloat16)
+        scale_inv = torch.tensor([0.5, 2.0, 0.25])
+
+        class PackedLinear(torch.nn.Module):
+            def __init__(self):
+                super().__init__()
+                self.ctx = torch.ops.ipex_prepack.fp8_linear_prepack(weight_fp8, bias)
+
+            def forward(self, x, scale_inv, idxA: int, idxB: int):
+                return torch.ops.ipex_prepack.fp8_linear_run(
+                    x, scale_inv, idxA, scale_inv, idxB, self.ctx
+                )
+
+        model = torch.jit.script(PackedLinear())
+        # The context is rebuilt from its pickled weight and bias
+        buffer = io.BytesIO()
+        torch.jit.save(model, buffer)
+        buffer.seek(0)
+        loaded = torch.jit.load(buffer)
+        # Different input shapes, more than the cached primitives, and scales
+        # changed between runs
+        cases = [(batch, batch % 2, 2) for batch in range(1, 41)] + [(1, 0, 1)]
+        for batch, idxA, idxB in cases:
+            inp_fp8 = torch.randn(2, batch, 32).to(torch.float8_e4m3fn)
+            ref = (inp_fp8.float() * scale_inv[idxA]) @ (
+                weight_fp8.float() * scale_inv[idxB]
+            ).t() + bias.float()
+            for m in (model, loaded):
+                out = m(inp_fp8, scale_inv, idxA, idxB)
+                self.assertEqual(out.shape, (2, batch, 64))
+                self.assertEqual(out, ref, atol=1e-3, rtol=1e-3)
+        # The plain weight is reordered back from the packed one
+        state_weight = loaded.ctx.__getstate__()[0]
+        self.assertEqual(state_weight.shape, weight_fp8.shape)
+        self.assertEqual(state_weight.float(), weight_fp8.float())
+        # The packed weight layout is only valid for inputs of the weight dtype
+        with self.assertRaises(RuntimeError):
+            model(torch.randn(2, 4, 32).to(torch.float8_e5m2), scale_inv, 0, 1)
+
 
 if __name__ == "__main__":
     test = unittest.main()
@@ -0,0 +1,179 @@
+import unittest
+import itertools
+import torch
+import intel_extension_for_pytorch as ipex
+from common_utils import TestCase
+from intel_extension_for_pytorch.cpu._auto_kernel_selection import (
+    _enable_tpp,
+    _disable_tpp,
+)
+
+
+class Expert(torch.nn.Module):
+    def __init__(self, hidden_size, intermediate_size):
+        super(Expert, self).__init__()
+        self.w1 = torch.nn.Linear(hidden_size, intermediate_size, bias=False)
+        self.w2 = torch.nn.Linear(intermediate_size, hidden_size, bias=False)
+        self.w3 = torch.nn.Linear(hidden_size, intermediate_size, bias=False)
+
+
+class FusedMoETester(TestCase):
+    def ref_moe(self, hidden_states, topk_ids, topk_weights, gate, up, down):
+        output = torch.zeros(
+            hidden_states.shape[0], down[0].shape[0], dtype=torch.float
+        )
+        for t in range(hidden_states.shape[0]):
+            x = hidden_states[t : t + 1].float()
+            for k in range(topk_ids.shape[1]):
+                e = topk_ids[t, k].item()
+                y = torch.nn.functional.linear(
+                    torch.nn.functional.silu(
+                        torch.nn.functional.linear(x, gate[e].float())
+                    )
+                    * torch.nn.functional.linear(x, up[e].float()),
+                    down[e].float(),
+                )
+                output[t] += topk_weights[t, k].float() * y[0]
+        return output
+
+    def test_fused_moe_tpp_fallback(self):
+        num_experts = 8
+        hidden_size = 64
+        intermediate_size = 96
+        num_tokens = [1, 5, 33]
+        top_k = [1, 2]
+        dtypes = [torch.float, torch.bfloat16]
+        for num_token, k, dtype in itertools.product(num_tokens, top_k, dtypes):
+            hidden_states = torch.randn(num_token, hidden_size, dtype=dtype)
+            gate = [
+                torch.randn(intermediate_size, hidden_size, dtype=dtype) * 0.1
+                for _ in range(num_experts)
+            ]
+            up = [
+                torch.randn(intermediate_size, hidden_size, dtype=dtype) * 0.1
+                for _ in range(num_experts)
+            ]
+            down = [
+                torch.randn(hidden_size, intermediate_size, dtype=dtype) * 0.1
+                for _ in range(num_experts)
+            ]
+            router_logits = torch.randn(num_token, num_experts)
+            topk_weights, topk_ids = torch.topk(
+                torch.softmax(router_logits, dim=-1), k, dim=-1
+            )
+            topk_weights /= topk_weights.sum(dim=-1, keepdim=True)
+            topk_weights = topk_weights.to(dtype)
+
+            out = torch.ops.torch_ipex.fused_moe_tpp(
+                hidden_states, topk_ids, topk_weights, gate, up, down, True
+            )
+            ref_out = self.ref_moe(
+                hidden_states, topk_ids, topk_weights, gate, up, down
+            )
+            self.assertEqual(out.shape, hidden_states.shape)
+            tol = 2e-2 if dtype == torch.bfloat16 else 1e-5
+            self.assertEqual(out.float(), ref_out, atol=tol, rtol=tol)
+
+    def test_fused_moe_tpp(self):
+        num_experts = 8
+        hidden_size = 128
+        intermediate_size = 192
+        for dtype in [torch.float, torch.bfloat16]:
+            experts = torch.nn.ModuleList(
+                [Expert(hidden_size, intermediate_size) for _ in range(num_experts)]
+            ).eval()
+            if dtype is torch.bfloat16:
+                experts = experts.to(dtype)
+            _enable_tpp()
+            blocked_experts = ipex.optimize(experts, dtype=dtype)
+            _disable_tpp()
+            self.assertFalse(blocked_experts[0].w1.tpp_fallback)
+            for num_token, k in itertools.product([1, 5, 130], [1, 2]):
+                hidden_states = torch.randn(num_token, hidden_size, dtype=dtype)
+                router_logits = torch.randn(num_token, num_experts)
+                topk_weights, topk_ids = torch.topk(
+                    torch.softmax(router_logits, dim=-1), k, dim=-1
+                )
+                topk_weights /= topk_weights.sum(dim=-1, keepdim=True)
+                topk_weights = topk_weights.to(dtype)
+
+                out = torch.ops.torch_ipex.fused_moe_tpp(
+                    hidden_states,
+                    topk_ids,
+                    topk_weights,
+                    [expert.w1.weight.detach() for expert in blocked_experts],
+                    [expert.w3.weight.detach() for expert in blocked_experts],
+                    [expert.w2.weight.detach() for expert in blocked_experts],
+                    False,
+                )
+                ref_out = self.ref_moe(
+                    hidden_states,
+                    topk_ids,
+                    topk_weights,
+                    [expert.w1.weight for expert in experts],
+                    [expert.w3.weight for expert in experts],
+                    [expert.w2.weight for expert in experts],
+                )
+                self.assertEqual(out.shape, hidden_states.shape)
+                tol = 5e-2 if dtype == torch.bfloat16 else 1e-4
+                self.assertEqual(out.float(), ref_out, atol=tol, rtol=tol)
+
+    def test_fused_moe_tpp_no_token(self):
+        num_experts, hidden_size, intermediate_size = 4, 64, 96
+        weights = [
+            torch.randn(intermediate_size, hidden_size) for _ in range(num_experts)
+        ]
+        down = [torch.randn(hidden_size, intermediate_size) for _ in range(num_experts)]
+        out = torch.ops.torch_ipex.fused_moe_tpp(
+            torch.randn(0, hidden_size),
+            torch.zeros(0, 2, dtype=torch.long),
+            torch.zeros(0, 2),
+            weights,
+            weights,
+            down,
+            True,
+        )
+        self.assertEqual(out.shape, (0, hidden_size))
+
+    def test_moe_router(self):
+        num_tokens = [1, 7, 64]
+        num_experts = [8, 20]
+        top_k = [1, 2, 4]
+        renormalize = [True, False]
+        dtypes = [torch.float, torch.bfloat16]
+        for num_token, num_expert, k, renorm, dtype in itertools.product(
+            num_tokens, num_experts, top_k, renormalize, dtypes
+        ):
+            router_logits = torch.randn(num_token, num_expert).to(dtype)
+            (
+                topk_weights,
+                topk_ids,
+                expert_counts,
+                sorted_token_ids,
+                sorted_topk_idx,
+            ) = torch.ops.torch_ipex.moe_router(router_logits, k, renorm)
+
+            ref_weights, ref_ids = torch.topk(
+                torch.softmax(router_logits.float(), dim=-1), k, dim=-1
+            )
+            if renorm:
+                ref_weights /= ref_weights.sum(dim=-1, keepdim=True)
+            self.assertEqual(topk_ids, ref_ids)
+            self.assertEqual(topk_weights, ref_weights)
+
+            ref_counts = torch.bincount(ref_ids.flatten(), minlength=num_expert)
+            self.assertEqual(expert_counts, ref_counts)
+            # every expert owns a contiguous slice of the (token, k) pairs
+            expert_of_pair = topk_ids[sorted_token_ids, sorted_topk_idx]
+            self.assertEqual(
+                expert_of_pair,
+                torch.repeat_interleave(torch.arange(num_expert), ref_counts),
+            )
+            self.assertEqual(
+                sorted(zip(sorted_token_ids.tolist(), sorted_topk_idx.tolist())),
+                [(t, i) for t in range(num_token) for i in range(k)],
+            )
+
+
+if __name__ == "__main__":
+    test = unittest.main()
@@ -1,3 +1,7 @@
+import io
+import os
+import subprocess
+import sys
 import torch
 import torch.nn as nn
 from common_utils import TestCase
@@ -781,6 +785,332 @@ class MaskedMHATest(TestCase):
                             value_cache_iakv_half[offset, :, :, :],
                         )
 
+    def test_mha_kv_cache_growth(self):
+        # decode past max_seq_len so that the kv cache grows twice
+        batch_size = 2
+        head_num = 4
+        head_size = 64
+        max_seq_len = 8
+        first_seq_len = 4
+        steps = 30
+        mha = MaskedMHA(
+            hidden_size=head_num * head_size,
+            n_head=head_num,
+            n_head_kv=head_num,
+            head_dim=head_size,
+        )
+        input_t = torch.randn(batch_size, first_seq_len, head_num * head_size)
+        attention_mask = torch.full(
+            (first_seq_len, first_seq_len), -1e6, dtype=input_t.dtype
+        ).triu(1)
+        attention_mask = attention_mask.expand(batch_size, 1, -1, -1)
+        beam_idx_t = torch.arange(batch_size)
+        with torch.inference_mode(), torch.no_grad():
+            _, _, key_cache, value_cache, _ = mha(
+                input_t, None, None, max_seq_len, attention_mask, None
+            )
+            _, _, key_cache_iakv, value_cache_iakv, beam_idx = mha(
+                input_t,
+                None,
+                None,
+                max_seq_len,
+                attention_mask,
+                torch.zeros(max_seq_len, batch_size, dtype=torch.int64),
+                True,
+                torch.tensor(0),
+            )
+            beam_idx[0] = beam_idx_t
+            head_major = os.environ.get("MASKED_MHA_HEAD_MAJOR_KV_CACHE", "0") == "1"
+            key_cache_ptr = key_cache_iakv.data_ptr()
+            offset = first_seq_len
+            for _ in range(steps):
+                input_t = torch.randn(batch_size, 1, head_num * head_size)
+                attention_mask = torch.zeros(batch_size, 1, 1, offset + 1)
+                naive_output, _, key_cache, value_cache, _ = mha(
+                    input_t, key_cache, value_cache, max_seq_len, attention_mask, None
+                )
+                (
+                    indirect_access_kv_cache_output,
+                    _,
+                    key_cache_iakv,
+                    value_cache_iakv,
+                    beam_idx,
+                ) = mha(
+                    input_t,
+                    key_cache_iakv,
+                    value_cache_iakv,
+                    max_seq_len,
+                    attention_mask,
+                    beam_idx,
+                    True,
+                    torch.tensor(offset),
+                )
+                self.assertEqual(naive_output, indirect_access_kv_cache_output)
+                self.assertEqual(
+                    key_cache.transpose(0, 1), key_cache_iakv[0 : offset + 1]
+                )
+                beam_idx[offset] = beam_idx_t
+                offset += 1
+            self.assertGreaterEqual(key_cache_iakv.size(0), offset)
+            if head_major:
+                # past tokens of one head are contiguous
+                self.assertEqual(key_cache_iakv.stride(0), head_size)
+                self.assertEqual(value_cache_iakv.stride(0), head_size)
+            else:
+                # the cache grew in place, and its storage only spans the
+                # committed tokens so that it can be serialized
+                self.assertEqual(key_cache_iakv.data_ptr(), key_cache_ptr)
+                self.assertEqual(
+                    key_cache_iakv.untyped_storage().nbytes(),
+                    key_cache_iakv.numel() * key_cache_iakv.element_size(),
+                )
+            buffer = io.BytesIO()
+            torch.save(key_cache_iakv, buffer)
+            buffer.seek(0)
+            self.assertEqual(torch.load(buffer), key_cache_iakv)
+
+    def test_mha_beam_search_interleaved_streams(self):
+        # two beam searches decode in lockstep with the same latest beam rows
+        # but different histories, each must resolve its own beam origins
+        beam_size = 4
+        head_num = 4
+        head_size = 64
+        max_seq_len = 8
+        first_seq_len = 4
+        steps = 12
+        mha = MaskedMHA(
+            hidden_size=head_num * head_size,
+            n_head=head_num,
+            n_head_kv=head_num,
+            head_dim=head_size,
+        )
+        attention_mask = torch.full((first_seq_len, first_seq_len), -1e6).triu(1)
+        attention_mask = attention_mask.expand(1, 1, -1, -1)
+        streams = []
+        with torch.inference_mode(), torch.no_grad():
+            for _ in range(2):
+                input_t = torch.randn(1, first_seq_len, head_num * head_size)
+                _, _, key_cache, value_cache, _ = mha(
+                    input_t, None, None, max_seq_len, attention_mask, None
+                )
+                _, _, key_cache_iakv, value_cache_iakv, beam_idx = mha(
+                    input_t,
+                    None,
+                    None,
+                    max_seq_len,
+                    attention_mask,
+                    torch.zeros(max_seq_len, beam_size, dtype=torch.int64),
+                    True,
+                    torch.tensor(0),
+                )
+                streams.append(
+                    [
+                        key_cache.repeat_interleave(beam_size, dim=0),
+                        value_cache.repeat_interleave(beam_size, dim=0),
+                        key_cache_iakv,
+                        value_cache_iakv,
+                        beam_idx,
+                    ]
+                )
+            offset = first_seq_len
+            for step in range(steps):
+                attention_mask = torch.zeros(beam_size, 1, 1, offset + 1)
+                beam_idx_t = torch.randint(0, beam_size, (beam_size,))
+                for i, stream in enumerate(streams):
+                    (
+                        key_cache,
+                        value_cache,
+                        key_cache_iakv,
+                        value_cache_iakv,
+                        beam_idx,
+                    ) = stream
+                    input_t = torch.randn(beam_size, 1, head_num * head_size)
+                    naive_output, _, key_cache, value_cache, _ = mha(
+                        input_t,
+                        key_cache,
+                        value_cache,
+                        max_seq_len,
+                        attention_mask,
+                        None,
+                    )
+                    output, _, key_cache_iakv, value_cache_iakv, beam_idx = mha(
+                        input_t,
+                        key_cache_iakv,
+                        value_cache_iakv,
+                        max_seq_len,
+                        attention_mask,
+                        beam_idx,
+                        True,
+                        torch.tensor(offset),
+                    )
+                    self.assertEqual(naive_output, output)
+                    # only the first step picks different beams per stream
+                    beams = beam_idx_t
+                    if step == 0 and i == 1:
+                        beams = (beam_idx_t + 1) % beam_size
+                    beam_idx[offset] = beams
+                    stream[:] = [
+                        torch.index_select(key_cache, 0, beams),
+                        torch.index_select(value_cache, 0, beams),
+                        key_cache_iakv,
+                        value_cache_iakv,
+                        beam_idx,
+                    ]
+                offset += 1
+
+    def test_mha_value_cache_strides(self):
+        # the value cache is head major while the key cache is token major
+        batch_size = 2
+        head_num = 4
+        head_num_kv = 2
+        head_size = 64
+        max_seq_len = 16
+        first_seq_len = 4
+        steps = 6
+        mha = MaskedMHA(
+            hidden_size=head_num * head_size,
+            n_head=head_num,
+            n_head_kv=head_num_kv,
+            head_dim=head_size,
+        )
+        input_t = torch.randn(batch_size, first_seq_len, head_num * head_size)
+        attention_mask = torch.full((first_seq_len, first_seq_len), -1e6).triu(1)
+        attention_mask = attention_mask.expand(batch_size, 1, -1, -1)
+        beam_idx_t = torch.arange(batch_size)
+        for dtype in [torch.float32, torch.bfloat16]:
+            with torch.inference_mode(), torch.no_grad(), torch.autocast(
+                device_type="cpu",
+                enabled=dtype == torch.bfloat16,
+                dtype=torch.bfloat16,
+            ):
+                _, _, key_cache, value_cache, _ = mha(
+                    input_t, None, None, max_seq_len, attention_mask, None
+                )
+                _, _, key_cache_iakv, value_cache_iakv, beam_idx = mha(
+                    input_t,
+                    None,
+                    None,
+                    max_seq_len,
+                    attention_mask,
+                    torch.zeros(max_seq_len, batch_size, dtype=torch.int64),
+                    True,
+                    torch.tensor(0),
+                )
+                value_cache_iakv = (
+                    value_cache_iakv.permute(1, 2, 0, 3)
+                    .contiguous()
+                    .permute(2, 0, 1, 3)
+                )
+                self.assertNotEqual(key_cache_iakv.stride(), value_cache_iakv.stride())
+                beam_idx[0] = beam_idx_t
+                offset = first_seq_len
+                for _ in range(steps):
+                    input_t_step = torch.randn(batch_size, 1, head_num * head_size)
+                    step_mask = torch.zeros(batch_size, 1, 1, offset + 1)
+                    naive_output, _, key_cache, value_cache, _ = mha(
+                        input_t_step,
+                        key_cache,
+                        value_cache,
+                        max_seq_len,
+                        step_mask,
+                        None,
+                    )
+                    output, _, key_cache_iakv, value_cache_iakv, beam_idx = mha(
+                        input_t_step,
+                        key_cache_iakv,
+                        value_cache_iakv,
+                        max_seq_len,
+                        step_mask,
+                        beam_idx,
+                        True,
+                        torch.tensor(offset),
+                    )
+                    self.assertEqual(naive_output, output, prec=0.05)
+                    self.assertEqual(
+                        value_cache.transpose(0, 1), value_cache_iakv[0 : offset + 1]
+                    )
+                    beam_idx[offset] = beam_idx_t
+                    offset += 1
+
+    def test_mha_long_context_chunks(self):
+        # few (batch, head) pairs and a long context, so that the past tokens
+        # of every head are split into chunks across the threads
+        head_num = 2
+        head_size = 64
+        max_seq_len = 512
+        first_seq_len = 300
+        steps = 3
+        num_threads = torch.get_num_threads()
+        torch.set_num_threads(max(num_threads, 8))
+        mha = MaskedMHA(
+            hidden_size=head_num * head_size,
+            n_head=head_num,
+            n_head_kv=head_num,
+            head_dim=head_size,
+        )
+        attention_mask = torch.full((first_seq_len, first_seq_len), -1e6).triu(1)
+        attention_mask = attention_mask.expand(1, 1, -1, -1)
+        try:
+            for beam_size in [1, 4]:
+                input_t = torch.randn(1, first_seq_len, head_num * head_size)
+                with torch.inference_mode(), torch.no_grad():
+                    _, _, key_cache, value_cache, _ = mha(
+                        input_t, None, None, max_seq_len, attention_mask, None
+                    )
+                    _, _, key_cache_iakv, value_cache_iakv, beam_idx = mha(
+                        input_t,
+                        None,
+                        None,
+                        max_seq_len,
+                        attention_mask,
+                        torch.zeros(max_seq_len, beam_size, dtype=torch.int64),
+                        True,
+                        torch.tensor(0),
+                    )
+                    key_cache = key_cache.repeat_interleave(beam_size, dim=0)
+                    value_cache = value_cache.repeat_interleave(beam_size, dim=0)
+                    offset = first_seq_len
+                    for _ in range(steps):
+                        input_t = torch.randn(beam_size, 1, head_num * head_size)
+                        step_mask = torch.zeros(beam_size, 1, 1, offset + 1)
+                        naive_output, _, key_cache, value_cache, _ = mha(
+                            input_t,
+                            key_cache,
+                            value_cache,
+                            max_seq_len,
+                            step_mask,
+                            None,
+                        )
+                        output, _, key_cache_iakv, value_cache_iakv, beam_idx = mha(
+                            input_t,
+                            key_cache_iakv,
+                            value_cache_iakv,
+                            max_seq_len,
+                            step_mask,
+                            beam_idx,
+                            True,
+                            torch.tensor(offset),
+                        )
+                        self.assertEqual(naive_output, output)
+                        beam_idx_t = torch.randint(0, beam_size, (beam_size,))
+                        beam_idx[offset] = beam_idx_t
+                        key_cache = torch.index_select(key_cache, 0, beam_idx_t)
+                        value_cache = torch.index_select(value_cache, 0, beam_idx_t)
+                        offset += 1
+        finally:
+            torch.set_num_threads(num_threads)
+
+    def test_mha_head_major_kv_cache(self):
+        # the layout is picked once per process
+        env = os.environ.copy()
+        env["MASKED_MHA_HEAD_MAJOR_KV_CACHE"] = "1"
+        cmd = [
+            sys.executable,
+            os.path.abspath(__file__),
+            "MaskedMHATest.test_mha_kv_cache_growth",
+        ]
+        self.assertEqual(subprocess.run(cmd, env=env).returncode, 0)
+
     def test_mha(self):
         self._test_mha(torchcompile=False)
         self._test_mha_fp16(torchcompile=False)
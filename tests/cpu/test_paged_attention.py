@@ -3,7 +3,7 @@ from common_utils import TestCase
 import unittest
 import random
 from typing import List, Optional, Tuple
-from itertools import product
+from itertools import accumulate, product
 
 
 class PagedAttentionTest(TestCase):
@@ -190,7 +190,7 @@ class PagedAttentionTest(TestCase):
     def test_paged_attention(self):
         num_blocks = 128
         dtypes = [torch.bfloat16, torch.float]
-        num_gen_seqs = [7]  # Arbitrary values for testing
+        num_gen_seqs = [1, 7]  # Arbitrary values for testing
         num_heads = [(40, 40), (64, 16)]  # Arbitrary values for testing
         head_sizes = [64, 80, 128, 96, 112, 128, 256]
         block_sizes = [16, 32]
@@ -224,6 +224,405 @@ class PagedAttentionTest(TestCase):
                 seed,
             )
 
+    def test_paged_attention_empty_context(self):
+        num_blocks, block_size, head_size = 64, 16, 64
+        scale = float(1.0 / (head_size**0.5))
+        # Few (seq, head) pairs so that the long context is partitioned
+        for num_head, dtype in product([1, 4], [torch.bfloat16, torch.float]):
+            query = torch.empty(2, num_head, head_size, dtype=dtype)
+            query.uniform_(-scale, scale)
+            head_mapping = torch.arange(num_head, dtype=torch.int32)
+            context_lens = torch.tensor([0, 600], dtype=torch.int)
+            max_context_len = 600
+            max_num_blocks_per_seq = (max_context_len + block_size - 1) // block_size
+            block_tables = torch.randint(
+                0, num_blocks, (2, max_num_blocks_per_seq), dtype=torch.int
+            )
+            key_caches, value_caches = self.create_kv_caches(
+                num_blocks, block_size, 1, num_head, head_size, dtype, 0
+            )
+            output = torch.full_like(query, float("nan"))
+            torch.ops.torch_ipex.single_query_cached_kv_attention(
+                output,
+                query,
+                key_caches[0],
+                value_caches[0],
+                head_mapping,
+                scale,
+                block_tables,
+                context_lens,
+                block_size,
+                max_context_len,
+                None,
+            )
+            ref_output = torch.empty_like(query[1:])
+            self.ref_single_query_cached_kv_attention(
+                ref_output,
+                query[1:],
+                1,
+                key_caches[0],
+                value_caches[0],
+                block_tables[1:],
+                context_lens[1:],
+                scale,
+                None,
+            )
+            self.assertEqual(output[0], torch.zeros_like(output[0]))
+            assert torch.allclose(output[1:], ref_output, atol=5e-3, rtol=1e-3)
+
+    def test_paged_attention_empty_batch(self):
+        num_blocks, block_size, num_head, head_size = 64, 16, 4, 64
+        scale = float(1.0 / (head_size**0.5))
+        for num_seqs, dtype in product([0, 3], [torch.bfloat16, torch.float]):
+            query = torch.empty(num_seqs, num_head, head_size, dtype=dtype)
+            query.uniform_(-scale, scale)
+            head_mapping = torch.arange(num_head, dtype=torch.int32)
+            # An empty batch, or a batch whose sequences have no context at all
+            context_lens = torch.zeros(num_seqs, dtype=torch.int)
+            max_context_len = 0
+            block_tables = torch.empty(num_seqs, 0, dtype=torch.int)
+            key_caches, value_caches = self.create_kv_caches(
+                num_blocks, block_size, 1, num_head, head_size, dtype, 0
+            )
+            output = torch.full_like(query, float("nan"))
+            torch.ops.torch_ipex.single_query_cached_kv_attention(
+                output,
+                query,
+                key_caches[0],
+                value_caches[0],
+                head_mapping,
+                scale,
+                block_tables,
+                context_lens,
+                block_size,
+                max_context_len,
+                None,
+            )
+            self.assertEqual(output, torch.zeros_like(output))
+
+    def ref_paged_attention_varlen(
+        self,
+        output: torch.Tensor,
+        query: torch.Tensor,
+        num_queries_per_kv: int,
+        key_cache: torch.Tensor,
+        value_cache: torch.Tensor,
+        query_start_loc: torch.Tensor,
+        block_tables: torch.Tensor,
+        seq_lens: torch.Tensor,
+        scale: float,
+        is_causal: bool,
+        alibi_slopes: Optional[torch.Tensor],
+    ) -> None:
+        num_kv_head = value_cache.shape[2]
+        head_size = value_cache.shape[3]
+        block_size = value_cache.shape[1]
+        num_seqs = seq_lens.shape[0]
+
+        block_tables = block_tables.cpu().tolist()
+        seq_lens = seq_lens.cpu().tolist()
+        query_start_loc = query_start_loc.cpu().tolist()
+        for i in range(num_seqs):
+            q = query[query_start_loc[i] : query_start_loc[i + 1]]
+            query_len = q.shape[0]
+            seq_len = int(seq_lens[i])
+            block_table = block_tables[i]
+            keys = []
+            values = []
+            for j in range(seq_len):
+                block_number = int(block_table[j // block_size])
+                block_offset = j % block_size
+                keys.append(key_cache[block_number, block_offset, :, :])
+                values.append(value_cache[block_number, block_offset, :, :])
+            keys = torch.stack(keys, dim=0)
+            values = torch.stack(values, dim=0)
+            if num_queries_per_kv > 1:
+                keys = torch.repeat_interleave(keys, num_queries_per_kv, dim=1)
+                values = torch.repeat_interleave(values, num_queries_per_kv, dim=1)
+            q_pos = torch.arange(seq_len - query_len, seq_len).view(-1, 1)
+            k_pos = torch.arange(seq_len).view(1, -1)
+            attn_mask = torch.zeros(query_len, seq_len)
+            if is_causal:
+                attn_mask.masked_fill_(k_pos > q_pos, float("-inf"))
+            attn_mask = attn_mask.unsqueeze(0)
+            if alibi_slopes is not None:
+                alibi_bias = (k_pos - q_pos).float().unsqueeze(0)
+                attn_mask = attn_mask + alibi_slopes.view(-1, 1, 1) * alibi_bias
+            out = self.ref_masked_attention(q, keys, values, scale, attn_mask)
+            output[query_start_loc[i] : query_start_loc[i + 1]].copy_(out)
+
+    def _test_paged_attention_varlen_func(
+        self,
+        query_lens: List[int],
+        num_head: Tuple[int, int],
+        head_size: int,
+        is_causal: bool,
+        use_alibi: bool,
+        num_blocks: int,
+        block_size: int,
+        dtype: torch.dtype,
+        seed: int,
+    ) -> None:
+        random.seed(seed)
+        torch.random.manual_seed(seed)
+        torch.manual_seed(seed)
+        max_seq_len = 512
+        scale = float(1.0 / (head_size**0.5))
+        num_query_heads, num_kv_head = num_head
+        num_queries_per_kv = num_query_heads // num_kv_head
+        num_seqs = len(query_lens)
+        seq_lens = [random.randint(query_len, max_seq_len) for query_len in query_lens]
+        num_tokens = sum(query_lens)
+        query = torch.empty(num_tokens, num_query_heads, head_size, dtype=dtype)
+        query.uniform_(-scale, scale)
+        query_start_loc = torch.tensor(
+            [0] + list(accumulate(query_lens)), dtype=torch.int
+        )
+        alibi_slopes = None
+        if use_alibi:
+            alibi_slopes = torch.randn(num_query_heads, dtype=torch.float)
+        max_num_blocks_per_seq = (max(seq_lens) + block_size - 1) // block_size
+        block_tables = []
+        for _ in range(num_seqs):
+            block_table = [
+                random.randint(0, num_blocks - 1) for _ in range(max_num_blocks_per_seq)
+            ]
+            block_tables.append(block_table)
+        block_tables = torch.tensor(block_tables, dtype=torch.int)
+        seq_lens = torch.tensor(seq_lens, dtype=torch.int)
+        key_caches, value_caches = self.create_kv_caches(
+            num_blocks, block_size, 1, num_kv_head, head_size, dtype, seed
+        )
+        key_cache, value_cache = key_caches[0], value_caches[0]
+        output = torch.empty_like(query)
+        torch.ops.torch_ipex.paged_attention_varlen(
+            output,
+            query,
+            key_cache,
+            value_cache,
+            query_start_loc,
+            seq_lens,
+            block_tables,
+            scale,
+            is_causal,
+            alibi_slopes,
+        )
+        ref_output = torch.empty_like(query)
+        self.ref_paged_attention_varlen(
+            ref_output,
+            query,
+            num_queries_per_kv,
+            key_cache,
+            value_cache,
+            query_start_loc,
+            block_tables,
+            seq_lens,
+            scale,
+            is_causal,
+            alibi_slopes,
+        )
+        assert torch.allclose(output, ref_output, atol=5e-3, rtol=1e-3)
+
+    def test_paged_attention_varlen(self):
+        num_blocks = 128
+        # mixed batches of prefill chunks and decode tokens
+        query_lens_list = [[1, 1, 1], [37, 1, 64, 1], [100]]
+        num_heads = [(40, 40), (64, 16)]
+        head_sizes = [64, 80, 128]
+        block_sizes = [16, 32]
+        is_causals = [True, False]
+        use_alibis = [True, False]
+        dtypes = [torch.bfloat16, torch.float]
+        for (
+            query_lens,
+            num_head,
+            head_size,
+            block_size,
+            is_causal,
+            use_alibi,
+            dtype,
+        ) in product(
+            query_lens_list,
+            num_heads,
+            head_sizes,
+            block_sizes,
+            is_causals,
+            use_alibis,
+            dtypes,
+        ):
+            self._test_paged_attention_varlen_func(
+                query_lens,
+                num_head,
+                head_size,
+                is_causal,
+                use_alibi,
+                num_blocks,
+                block_size,
+                dtype,
+                0,
+            )
+
+    def _test_paged_attention_quantized_kv_cache_func(
+        self,
+        num_seqs: int,
+        num_head: Tuple[int, int],
+        head_size: int,
+        block_size: int,
+        cache_dtype: torch.dtype,
+        per_block_scale: bool,
+        dtype: torch.dtype,
+        seed: int,
+    ) -> None:
+        random.seed(seed)
+        torch.manual_seed(seed)
+        max_seq_len = 256
+        scale = float(1.0 / (head_size**0.5))
+        num_query_heads, num_kv_head = num_head
+        num_queries_per_kv = num_query_heads // num_kv_head
+        head_mapping = torch.repeat_interleave(
+            torch.arange(num_kv_head, dtype=torch.int32), num_queries_per_kv
+        )
+        context_lens = [random.randint(1, max_seq_len) for _ in range(num_seqs)]
+        max_context_len = max(context_lens)
+        max_num_blocks_per_seq = (max_context_len + block_size - 1) // block_size
+        num_blocks = num_seqs * max_num_blocks_per_seq
+        # every sequence owns its blocks so that the whole cache is written
+        block_tables = torch.arange(num_blocks, dtype=torch.int).view(
+            num_seqs, max_num_blocks_per_seq
+        )
+        slot_mapping = torch.arange(num_blocks * block_size, dtype=torch.int)
+        key = torch.randn(num_blocks * block_size, num_kv_head, head_size).to(dtype)
+        value = torch.randn(num_blocks * block_size, num_kv_head, head_size).to(dtype)
+        scale_shape = (num_blocks, num_kv_head) if per_block_scale else (num_kv_head,)
+        qmax = 127.0 if cache_dtype == torch.int8 else torch.finfo(cache_dtype).max
+        k_scale = torch.full(scale_shape, key.abs().max().float().item() / qmax)
+        v_scale = torch.full(scale_shape, value.abs().max().float().item() / qmax)
+        cache_shape = (num_blocks, block_size, num_kv_head, head_size)
+        key_cache = torch.empty(cache_shape, dtype=cache_dtype)
+        value_cache = torch.empty(cache_shape, dtype=cache_dtype)
+        torch.ops.torch_ipex.reshape_and_cache(
+            key, value, key_cache, value_cache, slot_mapping, k_scale, v_scale
+        )
+        # the dequantized cache should be close to the original key/value
+        k_dequant_scale = k_scale.view(-1, 1, num_kv_head, 1)
+        v_dequant_scale = v_scale.view(-1, 1, num_kv_head, 1)
+        ref_key_cache = (key_cache.float() * k_dequant_scale).to(dtype)
+        ref_value_cache = (value_cache.float() * v_dequant_scale).to(dtype)
+        atol = 0.1 if cache_dtype == torch.int8 else 0.5
+        assert torch.allclose(
+            ref_key_cache.view(-1, num_kv_head, head_size).float(),
+            key.float(),
+            atol=atol,
+            rtol=0.3,
+        )
+
+        query = torch.empty(num_seqs, num_query_heads, head_size, dtype=dtype)
+        query.uniform_(-scale, scale)
+        context_lens = torch.tensor(context_lens, dtype=torch.int)
+        output = torch.empty_like(query)
+        torch.ops.torch_ipex.single_query_cached_kv_attention(
+            output,
+            query,
+            key_cache,
+            value_cache,
+            head_mapping,
+            scale,
+            block_tables,
+            context_lens,
+            block_size,
+            max_context_len,
+            None,
+            k_scale,
+            v_scale,
+        )
+        ref_output = torch.empty_like(query)
+        self.ref_single_query_cached_kv_attention(
+            ref_output,
+            query,
+            num_queries_per_kv,
+            ref_key_cache,
+            ref_value_cache,
+            block_tables,
+            context_lens,
+            scale,
+            None,
+        )
+        assert torch.allclose(output, ref_output, atol=5e-3, rtol=1e-2)
+
+        # varlen: a prefill chunk for the even sequences, decode for the others
+        query_lens = [
+            min(int(context_len), 17) if i % 2 == 0 else 1
+            for i, context_len in enumerate(context_lens)
+        ]
+        query = torch.empty(sum(query_lens), num_query_heads, head_size, dtype=dtype)
+        query.uniform_(-scale, scale)
+        query_start_loc = torch.tensor(
+            [0] + list(accumulate(query_lens)), dtype=torch.int
+        )
+        output = torch.empty_like(query)
+        torch.ops.torch_ipex.paged_attention_varlen(
+            output,
+            query,
+            key_cache,
+            value_cache,
+            query_start_loc,
+            context_lens,
+            block_tables,
+            scale,
+            True,
+            None,
+            k_scale,
+            v_scale,
+        )
+        ref_output = torch.empty_like(query)
+        self.ref_paged_attention_varlen(
+            ref_output,
+            query,
+            num_queries_per_kv,
+            ref_key_cache,
+            ref_value_cache,
+            query_start_loc,
+            block_tables,
+            context_lens,
+            scale,
+            True,
+            None,
+        )
+        assert torch.allclose(output, ref_output, atol=5e-3, rtol=1e-2)
+
+    def test_paged_attention_quantized_kv_cache(self):
+        cache_dtypes = [torch.int8, torch.float8_e5m2, torch.float8_e4m3fn]
+        num_heads = [(32, 32), (32, 8)]
+        head_sizes = [64, 128]
+        block_sizes = [16]
+        per_block_scales = [True, False]
+        dtypes = [torch.bfloat16, torch.float]
+        for (
+            cache_dtype,
+            num_head,
+            head_size,
+            block_size,
+            per_block_scale,
+            dtype,
+        ) in product(
+            cache_dtypes,
+            num_heads,
+            head_sizes,
+            block_sizes,
+            per_block_scales,
+            dtypes,
+        ):
+            self._test_paged_attention_quantized_kv_cache_func(
+                5,
+                num_head,
+                head_size,
+                block_size,
+                cache_dtype,
+                per_block_scale,
+                dtype,
+                0,
+            )
+
     def _test_reshape_and_cache_func(
         self,
         num_token: int,
@@ -300,6 +699,80 @@ class PagedAttentionTest(TestCase):
                 num_token, num_kv_head, head_size, block_size, num_blocks, dtype, seed
             )
 
+    def test_copy_blocks(self):
+        num_blocks = 64
+        num_layers = 3
+        num_pairs = 10
+        for block_size, num_head, head_size, dtype in product(
+            [16, 32], [8], [64, 128], [torch.bfloat16, torch.float, torch.int8]
+        ):
+            key_caches = [
+                torch.randn(num_blocks, block_size, num_head, head_size).to(dtype)
+                for _ in range(num_layers)
+            ]
+            value_caches = [
+                torch.randn(num_blocks, block_size, num_head, head_size).to(dtype)
+                for _ in range(num_layers)
+            ]
+            blocks = random.sample(range(num_blocks), num_pairs * 2)
+            block_mapping = torch.tensor(blocks, dtype=torch.long).view(-1, 2)
+            ref_key_caches = [cache.clone() for cache in key_caches]
+            ref_value_caches = [cache.clone() for cache in value_caches]
+            for src, dst in block_mapping.tolist():
+                for ref_key_cache, ref_value_cache in zip(
+                    ref_key_caches, ref_value_caches
+                ):
+                    ref_key_cache[dst].copy_(ref_key_cache[src])
+                    ref_value_cache[dst].copy_(ref_value_cache[src])
+            torch.ops.torch_ipex.copy_blocks(key_caches, value_caches, block_mapping)
+            for key_cache, ref_key_cache in zip(key_caches, ref_key_caches):
+                self.assertEqual(key_cache, ref_key_cache)
+            for value_cache, ref_value_cache in zip(value_caches, ref_value_caches):
+                self.assertEqual(value_cache, ref_value_cache)
+        # one block forked twice
+        torch.ops.torch_ipex.copy_blocks(
+            key_caches, value_caches, torch.tensor([[0, 1], [0, 2]])
+        )
+        self.assertEqual(key_caches[0][1], key_caches[0][0])
+        self.assertEqual(value_caches[0][2], value_caches[0][0])
+        # chained pairs would race
+        with self.assertRaisesRegex(RuntimeError, "destination"):
+            torch.ops.torch_ipex.copy_blocks(
+                key_caches, value_caches, torch.tensor([[0, 1], [1, 2]])
+            )
+
+    def test_swap_blocks(self):
+        num_host_blocks = 128
+        num_blocks = 32
+        num_pairs = 16
+        for block_size, num_head, head_size, dtype in product(
+            [16, 32], [8], [64, 128], [torch.bfloat16, torch.float]
+        ):
+            host_cache = torch.randn(
+                num_host_blocks, block_size, num_head, head_size
+            ).to(dtype)
+            cache = torch.randn(num_blocks, block_size, num_head, head_size).to(dtype)
+            src_blocks = random.sample(range(num_host_blocks), num_pairs)
+            dst_blocks = random.sample(range(num_blocks), num_pairs)
+            block_mapping = torch.tensor(
+                list(zip(src_blocks, dst_blocks)), dtype=torch.long
+            )
+            # swap in: host pool -> hot pool
+            torch.ops.torch_ipex.swap_blocks(host_cache, cache, block_mapping)
+            self.assertEqual(cache[dst_blocks], host_cache[src_blocks])
+            # swap out: hot pool -> host pool
+            swapped_out = cache[dst_blocks].clone()
+            host_cache[src_blocks] = 0
+            torch.ops.torch_ipex.swap_blocks(
+                cache, host_cache, block_mapping.flip(1).contiguous()
+            )
+            self.assertEqual(host_cache[src_blocks], swapped_out)
+            # two pairs writing the same block would race
+            with self.assertRaisesRegex(RuntimeError, "destination"):
+                torch.ops.torch_ipex.swap_blocks(
+                    host_cache, cache, torch.tensor([[0, 1], [2, 1]])
+                )
+
 
 if __name__ == "__main__":
     test = unittest.main()
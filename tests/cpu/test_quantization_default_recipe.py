@@ -11,6 +11,8 @@ from torch.ao.quantization import (
 )
 import copy
 import os
+import subprocess
+import sys
 import unittest
 import transformers
 from transformers import AutoConfig
@@ -1208,6 +1210,33 @@ class WeightOnlyQuantizationTester(TestCase):
                     and woq_model.linear._lowp_mode == mode
                 ), "Weight-only quantization: low precision gemm flag is not correctly set"
 
+    def test_weight_only_quantization_int8_weight_int8_lowp_mode(self):
+        from intel_extension_for_pytorch.quantization import WoqLowpMode
+
+        class M(nn.Module):
+            def __init__(self):
+                super(M, self).__init__()
+                self.linear = torch.nn.Linear(64, 128)
+
+            def forward(self, x):
+                return self.linear(x)
+
+        m = M()
+        for batch_size, act_quant_mode in itertools.product([4, 64], range(4)):
+            data = torch.rand(batch_size, 64)
+            qconfig = ipex.quantization.get_weight_only_quant_qconfig_mapping(
+                weight_dtype=torch.qint8,
+                lowp_mode=WoqLowpMode.INT8,
+                act_quant_mode=act_quant_mode,
+            )
+            prepared_model = prepare(m, qconfig, example_inputs=data, inplace=False)
+            with torch.no_grad():
+                woq_model = convert(prepared_model)
+                assert woq_model.linear._lowp_mode == WoqLowpMode.INT8
+                y = woq_model(data)
+                y_ref = m(data)
+                torch.testing.assert_close(y, y_ref, atol=5e-2, rtol=5e-2)
+
     def test_weight_only_quantization_int8_lowp_mode_correctness(self):
         from intel_extension_for_pytorch.quantization import WoqLowpMode
 
@@ -1254,6 +1283,83 @@ class WeightOnlyQuantizationTester(TestCase):
                 y_ref = y_ref.to(act_dtype)
                 torch.testing.assert_close(y, y_ref, atol=0.005, rtol=0.01)
 
+    def test_weight_only_quantization_dequant_once(self):
+        from intel_extension_for_pytorch.quantization import WoqLowpMode
+
+        class M(nn.Module):
+            def __init__(self, has_bias):
+                super(M, self).__init__()
+                self.linear = torch.nn.Linear(256, 128, has_bias)
+
+            def forward(self, x):
+                return self.linear(x)
+
+        # A bf16 prefill with M >= 128 dequantizes each weight panel once and
+        # accumulates in fp32. It must match the small-M path, which
+        # dequantizes the weight for every M block and also computes in bf16
+        # from M = 32.
+        data = torch.rand(256, 256).bfloat16()
+        for has_bias, weight_dtype in itertools.product(
+            [False, True], [torch.qint8, torch.quint4x2]
+        ):
+            qconfig = ipex.quantization.get_weight_only_quant_qconfig_mapping(
+                weight_dtype=weight_dtype, lowp_mode=WoqLowpMode.BF16
+            )
+            prepared_model = prepare(
+                M(has_bias), qconfig, example_inputs=data.float(), inplace=False
+            )
+            with torch.no_grad():
+                woq_model = convert(prepared_model)
+                y = woq_model(data)
+                y_ref = torch.cat([woq_model(x) for x in data.split(32)])
+                self.assertEqual(y.dtype, torch.bfloat16)
+                torch.testing.assert_close(y, y_ref)
+
+    def test_weight_only_quantization_tpp_autotune(self):
+        # The tuner reads its environment once per process, so each schedule
+        # runs in its own process
+        script = """
+import sys
+import torch
+import intel_extension_for_pytorch as ipex
+from intel_extension_for_pytorch.quantization import prepare, convert, WoqLowpMode
+
+torch.manual_seed(0)
+m = torch.nn.Sequential(torch.nn.Linear(256, 128)).eval()
+data = torch.rand(256, 256)
+qconfig = ipex.quantization.get_weight_only_quant_qconfig_mapping(
+    weight_dtype=torch.quint4x2, lowp_mode=WoqLowpMode.BF16
+)
+woq_model = convert(prepare(m, qconfig, example_inputs=data))
+with torch.no_grad():
+    torch.save(woq_model(data), sys.argv[1])
+"""
+        with tempfile.TemporaryDirectory() as work_dir:
+            cache_file = os.path.join(work_dir, "woq_tpp_tune_cache")
+
+            def run(name, autotune, cache=None):
+                env = dict(os.environ, WOQ_TPP_AUTOTUNE=autotune)
+                env.pop("WOQ_TPP_TUNE_CACHE", None)
+                if cache is not None:
+                    env["WOQ_TPP_TUNE_CACHE"] = cache
+                out_file = os.path.join(work_dir, name)
+                subprocess.run(
+                    [sys.executable, "-c", script, out_file], env=env, check=True
+                )
+                return torch.load(out_file)
+
+            y_ref = run("y_ref.pt", "0")
+            # M = 256 tunes block_m and the 2D M x N distribution of the blocks
+            y_tuned = run("y_tuned.pt", "1", cache_file)
+            torch.testing.assert_close(y_tuned, y_ref)
+            with open(cache_file) as f:
+                self.assertEqual(len(f.readlines()), 1)
+            # A later run uses the cached schedule without tuning again
+            y_cached = run("y_cached.pt", "0", cache_file)
+            torch.testing.assert_close(y_cached, y_ref)
+            with open(cache_file) as f:
+                self.assertEqual(len(f.readlines()), 1)
+
     def test_weight_only_quantization_num_concats(self):
         class Mod(nn.Module):
             def __init__(self):
@@ -213,6 +213,72 @@ class FusedROPETester(TestCase):
                 ),
             )
 
+    def test_rope_with_kv_cache(self):
+        batch, seq_len, kv_head = 2, 5, self.num_heads // 2
+        position_ids = torch.arange(3, 3 + seq_len).repeat(batch, 1)
+        for (rotary_dim, offset), dtype in product(
+            [(64, 1), (self.head_size, self.head_size // 2)],
+            [torch.float32, torch.bfloat16],
+        ):
+            linear_outs = torch.rand(
+                batch,
+                seq_len,
+                self.hidden_size + kv_head * 2 * self.head_size,
+            ).to(dtype)
+            embed_positions = self.create_sinusoidal_positions(2048, rotary_dim)
+            rope_args = (
+                linear_outs,
+                embed_positions,
+                position_ids,
+                self.num_heads,
+                self.head_size,
+                offset,
+                rotary_dim,
+            )
+            query_ref, key_ref, value_ref = torch.ops.torch_ipex.rotary_position_embedding(
+                *rope_args
+            )
+
+            # indirect access kv cache [max_positions, beam_batch, N_KV, H]
+            beam_size, cache_offset = 2, 3
+            key_cache = torch.zeros(
+                16, batch * beam_size, kv_head, self.head_size, dtype=dtype
+            )
+            value_cache = torch.zeros_like(key_cache)
+            query = torch.ops.torch_ipex.rotary_position_embedding_with_kv_cache(
+                *rope_args, key_cache, value_cache, None, cache_offset
+            )
+            self.assertEqual(query, query_ref)
+            tokens = slice(cache_offset, cache_offset + seq_len)
+            self.assertEqual(key_cache[tokens, ::beam_size].transpose(0, 1), key_ref)
+            self.assertEqual(
+                value_cache[tokens, ::beam_size].transpose(0, 1), value_ref
+            )
+            self.assertEqual(key_cache[tokens, 1::beam_size].abs().sum(), 0)
+
+            # paged kv cache [num_blocks, block_size, N_KV, H]
+            num_blocks, block_size = 8, 4
+            key_cache = torch.zeros(
+                num_blocks, block_size, kv_head, self.head_size, dtype=dtype
+            )
+            value_cache = torch.zeros_like(key_cache)
+            slot_mapping = torch.randperm(num_blocks * block_size)[
+                : batch * seq_len
+            ].to(torch.int)
+            query = torch.ops.torch_ipex.rotary_position_embedding_with_kv_cache(
+                *rope_args, key_cache, value_cache, slot_mapping
+            )
+            self.assertEqual(query, query_ref)
+            slots = slot_mapping.long()
+            self.assertEqual(
+                key_cache.view(-1, kv_head, self.head_size)[slots],
+                key_ref.reshape(-1, kv_head, self.head_size),
+            )
+            self.assertEqual(
+                value_cache.view(-1, kv_head, self.head_size)[slots],
+                value_ref.reshape(-1, kv_head, self.head_size),
+            )
+
 
 if __name__ == "__main__":
     test = unittest.main()
@@ -21,6 +21,23 @@ class SimpleNet(torch.nn.Module):
         return y
 
 
+class BatchSizeNet(torch.nn.Module):
+    def forward(self, x):
+        # Every sample reports the batch size of the forward it ran in
+        return x * 2, torch.full((x.size(0),), x.size(0), dtype=torch.long)
+
+
+class LogitsNet(torch.nn.Module):
+    def forward(self, x):
+        # The logits have 5 classes whatever the size of x
+        return x * 2, torch.ones(x.size(0), 5)
+
+
+class SumNet(torch.nn.Module):
+    def forward(self, x):
+        return x.sum()
+
+
 class SimpleNet_v2(torch.nn.Module):
     def __init__(self):
         super(SimpleNet_v2, self).__init__()
@@ -247,6 +264,117 @@ class TestRuntimeAPI(TestCase):
         self.assertEqual(y, y_runtime)
         self.assertEqual(y, y_runtime2)
 
+    @unittest.skipIf(
+        not ipex.cpu.runtime.is_runtime_ext_enabled(),
+        "Skip when IPEX Runtime extension is not enabled",
+    )
+    @runtime_thread_affinity_test_env
+    def test_task_batching_jit_model(self):
+        model = SimpleNet()
+        model.eval()
+        x = torch.rand(64, 64, 3, 3)
+        traced_model = torch.jit.trace(model, x)
+        xs = [torch.rand(bs, 64, 3, 3) for bs in (1, 3, 2, 5, 4)]
+        # Calculate the reference result
+        ys = [traced_model(x) for x in xs]
+
+        # Create task
+        cpu_pool = ipex.cpu.runtime.CPUPool(node_id=0)
+        task = ipex.cpu.runtime.Task(traced_model, cpu_pool)
+        task.enable_batching(max_batch_size=8, max_wait_ms=50)
+
+        # The calls are coalesced and every one gets its own slice back
+        y_runtime_futures = [task(x) for x in xs]
+        for y, y_runtime_future in zip(ys, y_runtime_futures):
+            self.assertEqual(y, y_runtime_future.get())
+
+    @unittest.skipIf(
+        not ipex.cpu.runtime.is_runtime_ext_enabled(),
+        "Skip when IPEX Runtime extension is not enabled",
+    )
+    @runtime_thread_affinity_test_env
+    def test_task_batching_coalesces_calls(self):
+        model = torch.jit.script(BatchSizeNet())
+        xs = [torch.rand(bs, 4) for bs in (1, 3, 2)]
+
+        # Create task
+        cpu_pool = ipex.cpu.runtime.CPUPool(node_id=0)
+        task = ipex.cpu.runtime.Task(model, cpu_pool)
+        # The calls fill max_batch_size, so the first one waits for the
+        # others however long they take to be submitted and all of them run
+        # in one forward
+        task.enable_batching(max_batch_size=6, max_wait_ms=60000)
+        y_runtime_futures = [task(x) for x in xs]
+        for x, y_runtime_future in zip(xs, y_runtime_futures):
+            y, forward_batch_size = y_runtime_future.get()
+            self.assertEqual(y, x * 2)
+            self.assertEqual(forward_batch_size.tolist(), [6] * x.size(0))
+
+        # A 0-dim output can't be split back to the calls
+        task = ipex.cpu.runtime.Task(torch.jit.script(SumNet()), cpu_pool)
+        task.enable_batching(max_batch_size=6, max_wait_ms=60000)
+        y_runtime_futures = [task(x) for x in xs]
+        for y_runtime_future in y_runtime_futures:
+            with self.assertRaisesRegex(RuntimeError, "0-dim output"):
+                y_runtime_future.get()
+
+    @unittest.skipIf(
+        not ipex.cpu.runtime.is_runtime_ext_enabled(),
+        "Skip when IPEX Runtime extension is not enabled",
+    )
+    @runtime_thread_affinity_test_env
+    def test_task_batching_pad_inputs(self):
+        model = torch.jit.script(BatchSizeNet())
+        xs = [torch.rand(1, 3), torch.rand(2, 5), torch.rand(1, 4)]
+
+        # Create task
+        cpu_pool = ipex.cpu.runtime.CPUPool(node_id=0)
+        task = ipex.cpu.runtime.Task(model, cpu_pool)
+        # The calls fill max_batch_size, so they run in one forward
+        task.enable_batching(
+            max_batch_size=4,
+            max_wait_ms=60000,
+            pad_inputs=True,
+            unpad_output_dims=[1],
+        )
+
+        # The inputs are padded to [4, 5] and dimension 1 of the outputs is
+        # cut back, the 1-dim batch sizes have no dimension 1
+        y_runtime_futures = [task(x) for x in xs]
+        for x, y_runtime_future in zip(xs, y_runtime_futures):
+            y, forward_batch_size = y_runtime_future.get()
+            self.assertEqual(y, x * 2)
+            self.assertEqual(forward_batch_size.tolist(), [4] * x.size(0))
+
+        # Without unpad_output_dims the outputs keep the padded sizes, the
+        # logits are not cut though their size is the padded size of x
+        task = ipex.cpu.runtime.Task(torch.jit.script(LogitsNet()), cpu_pool)
+        task.enable_batching(max_batch_size=4, max_wait_ms=60000, pad_inputs=True)
+        y_runtime_futures = [task(x) for x in xs]
+        for x, y_runtime_future in zip(xs, y_runtime_futures):
+            y, logits = y_runtime_future.get()
+            y_ref = torch.nn.functional.pad(x * 2, (0, 5 - x.size(1)))
+            self.assertEqual(y, y_ref)
+            self.assertEqual(logits, torch.ones(x.size(0), 5))
+
+        # Unpadding an output dimension which doesn't have the padded size
+        # fails the calls
+        task = ipex.cpu.runtime.Task(torch.jit.script(LogitsNet()), cpu_pool)
+        task.enable_batching(
+            max_batch_size=4,
+            max_wait_ms=60000,
+            pad_inputs=True,
+            unpad_output_dims=[1],
+        )
+        y_runtime_futures = [task(x) for x in [torch.rand(2, 3), torch.rand(2, 4)]]
+        for y_runtime_future in y_runtime_futures:
+            with self.assertRaisesRegex(RuntimeError, "padded size"):
+                y_runtime_future.get()
+
+        task = ipex.cpu.runtime.Task(model, cpu_pool)
+        with self.assertRaisesRegex(RuntimeError, "requires pad_inputs"):
+            task.enable_batching(max_batch_size=4, unpad_output_dims=[1])
+
 
 class TestMultiStreamModule(TestCase):
     @unittest.skipIf(
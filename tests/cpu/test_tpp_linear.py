@@ -1,5 +1,10 @@
 import unittest
 import itertools
+import os
+import subprocess
+import sys
+import tempfile
+import threading
 import torch
 import intel_extension_for_pytorch as ipex
 from torch.testing._internal.common_utils import TestCase
@@ -145,6 +150,147 @@ class TestTPPlinear(TestCase):
             self.assertEqual(out_nb, ref_out_nb)
             _disable_tpp()
 
+    def test_tpp_linear_first_token(self):
+        # More rows than FT_OPT_SIZE, the VNNI weight is re-blocked for prefill
+        x = torch.rand(1, 300, 4096).to(torch.bfloat16)
+        model = Linear_with_bias().eval().to(torch.bfloat16)
+        ref_out = model(x)
+        _enable_tpp()
+        model = ipex.optimize(model, dtype=torch.bfloat16)
+        torch.ops.torch_ipex.tpp_set_profiling(True)
+        try:
+            with torch.no_grad(), torch.profiler.profile(
+                activities=[torch.profiler.ProfilerActivity.CPU]
+            ) as prof:
+                outs = [model(x) for _ in range(2)]
+        finally:
+            torch.ops.torch_ipex.tpp_set_profiling(False)
+            _disable_tpp()
+        for out in outs:
+            self.assertEqual(out, ref_out, atol=1e-2, rtol=1e-2)
+        # The second call uses the cached re-blocked weight
+        names = [e.name for e in prof.events()]
+        self.assertEqual(names.count("fftkn"), 1)
+
+    def test_tpp_linear_first_token_concurrent(self):
+        x = torch.rand(1, 300, 4096).to(torch.bfloat16)
+        model = Linear_with_bias().eval().to(torch.bfloat16)
+        ref_out = model(x)
+        _enable_tpp()
+        model = ipex.optimize(model, dtype=torch.bfloat16)
+        outs = [None] * 4
+
+        def run(i):
+            with torch.no_grad():
+                outs[i] = model(x)
+
+        torch.ops.torch_ipex.tpp_set_profiling(True)
+        try:
+            with torch.profiler.profile(
+                activities=[torch.profiler.ProfilerActivity.CPU]
+            ) as prof:
+                threads = [threading.Thread(target=run, args=(i,)) for i in range(4)]
+                for t in threads:
+                    t.start()
+                for t in threads:
+                    t.join()
+        finally:
+            torch.ops.torch_ipex.tpp_set_profiling(False)
+            _disable_tpp()
+        for out in outs:
+            self.assertEqual(out, ref_out, atol=1e-2, rtol=1e-2)
+        # The concurrent prefills share one re-blocked weight
+        names = [e.name for e in prof.events()]
+        self.assertEqual(names.count("fftkn"), 1)
+
+    def test_tpp_linear_profiling(self):
+        x = torch.rand(1, 4, 4096)
+        model = Linear_with_bias().eval()
+        ref_out = model(x)
+        _enable_tpp()
+        model = ipex.optimize(model, dtype=torch.float)
+        torch.ops.torch_ipex.tpp_set_profiling(True)
+        try:
+            with torch.no_grad(), torch.profiler.profile(
+                activities=[torch.profiler.ProfilerActivity.CPU]
+            ) as prof:
+                out = model(x)
+        finally:
+            torch.ops.torch_ipex.tpp_set_profiling(False)
+            _disable_tpp()
+        self.assertEqual(out, ref_out)
+        names = [e.name for e in prof.events()]
+        self.assertTrue("tpp_linear_krnl" in names)
+        # 2 * 4 rows * 4096 * 4096
+        summary = "tpp_linear_krnl::BRGEMM 0.134 GFLOP"
+        self.assertTrue(any(name.startswith(summary) for name in names))
+
+    def test_tpp_linear_profiling_concurrent(self):
+        x = torch.rand(1, 4, 4096)
+        model = Linear_with_bias().eval()
+        _enable_tpp()
+        model = ipex.optimize(model, dtype=torch.float)
+
+        def run():
+            with torch.no_grad():
+                for _ in range(4):
+                    model(x)
+
+        torch.ops.torch_ipex.tpp_set_profiling(True)
+        try:
+            with torch.profiler.profile(
+                activities=[torch.profiler.ProfilerActivity.CPU]
+            ) as prof:
+                threads = [threading.Thread(target=run) for _ in range(2)]
+                for t in threads:
+                    t.start()
+                for t in threads:
+                    t.join()
+        finally:
+            torch.ops.torch_ipex.tpp_set_profiling(False)
+            _disable_tpp()
+        # The concurrent scopes only count their own BRGEMM calls
+        summaries = [
+            e.name
+            for e in prof.events()
+            if e.name.startswith("tpp_linear_krnl::BRGEMM")
+        ]
+        self.assertTrue(len(summaries) > 0)
+        for summary in summaries:
+            self.assertTrue(
+                summary.startswith("tpp_linear_krnl::BRGEMM 0.134 GFLOP"), summary
+            )
+
+    def test_tpp_kernel_records(self):
+        x = torch.rand(1, 4, 4096)
+        model = Linear_with_bias().eval()
+        _enable_tpp()
+        model = ipex.optimize(model, dtype=torch.float)
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, "tpp_kernels.txt")
+            try:
+                with ipex.cpu.tpp.kernels.record_kernels(path):
+                    model(x)
+            finally:
+                _disable_tpp()
+            with open(path) as f:
+                records = f.read().splitlines()
+            self.assertTrue(any(r.startswith("brgemm ") for r in records))
+            # The kernels are already built here, prewarm them in a new process
+            script = """
+import sys
+import intel_extension_for_pytorch as ipex
+print(ipex.cpu.tpp.kernels.prewarm_kernels(sys.argv[1]))
+"""
+            result = subprocess.run(
+                [sys.executable, "-c", script, path],
+                stdout=subprocess.PIPE,
+                universal_newlines=True,
+                check=True,
+            )
+            num_kernels = int(result.stdout.strip().splitlines()[-1])
+            self.assertEqual(num_kernels, len(records))
+
     def test_tpp_linear_torchcompile(self):
         x = torch.rand(2, 2, 4096)
 